@@ -0,0 +1,141 @@
+#include "BufferPool.h"
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+const unsigned int BufferPool::class_sizes[BUFFER_CLASSES] = {
+    RESPONSE_MAX_SIZE + ENC_FIELDS,
+    MAX_RECORD_SIZE,
+    FRAME_BUFFER_SIZE
+};
+
+PoolStats BufferPool::stats[BUFFER_CLASSES];
+
+//Cache of the thread: buffers ready to be taken again, by class
+struct ThreadCache {
+    unsigned char* buffers[BUFFER_CLASSES][POOL_CACHED_BUFFERS];
+    unsigned int count[BUFFER_CLASSES];
+};
+
+static thread_local ThreadCache cache;
+
+unsigned int BufferPool::sizeClass(unsigned int size){
+    for (unsigned int i = 0; i < BUFFER_CLASSES; i++){
+        if (size <= class_sizes[i]){ return i; }
+    }
+    return BUFFER_CLASSES;
+}
+
+unsigned int BufferPool::classSize(unsigned int size_class){
+    return class_sizes[size_class];
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function takes a buffer of a class from the cache of  *|
+|* the thread, or allocates it if the cache is empty.         *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+unsigned char* BufferPool::acquire(unsigned int size_class){
+    unsigned char* buf;
+    if (cache.count[size_class] > 0){
+        buf = cache.buffers[size_class][--cache.count[size_class]];
+        stats[size_class].hits.fetch_add(1, memory_order_relaxed);
+    }
+    else {
+        buf = (unsigned char*)malloc(class_sizes[size_class]);
+        if (!buf){ return NULL; }
+        stats[size_class].misses.fetch_add(1, memory_order_relaxed);
+    }
+
+    unsigned long long in_use = stats[size_class].in_use.fetch_add(1, memory_order_relaxed) + 1;
+    unsigned long long max = stats[size_class].high_water.load(memory_order_relaxed);
+    while (in_use > max && !stats[size_class].high_water.compare_exchange_weak(max, in_use, memory_order_relaxed));
+    return buf;
+}
+
+void BufferPool::release(unsigned int size_class, unsigned char* buf){
+    stats[size_class].in_use.fetch_sub(1, memory_order_relaxed);
+    if (cache.count[size_class] < POOL_CACHED_BUFFERS){
+        cache.buffers[size_class][cache.count[size_class]++] = buf;
+        return;
+    }
+    free(buf);
+}
+
+string BufferPool::className(unsigned int size_class){
+    switch(size_class){
+        case BUFFER_SMALL: return "small";
+        case BUFFER_RECORD: return "record";
+        case BUFFER_FRAME: return "frame";
+        default: return "unknown";
+    }
+}
+
+void BufferPool::printPoolStats(){
+    cout<<"Thread "<<gettid()<<": Buffer pool statistics"<<endl;
+    for (unsigned int i = 0; i < BUFFER_CLASSES; i++){
+        cout<<"     "<<className(i)<<" ("<<class_sizes[i]<<" B): "<<stats[i].hits.load()<<" hits, "<<stats[i].misses.load()<<" misses, "<<stats[i].in_use.load()<<" in use, high-water "<<stats[i].high_water.load()<<endl;
+    }
+}
+
+PooledBuffer::PooledBuffer(){
+    this->buf = NULL;
+    this->size_class = BUFFER_CLASSES;
+    this->size = 0;
+}
+
+PooledBuffer::PooledBuffer(unsigned int size) : PooledBuffer(){
+    allocate(size);
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other){
+    this->buf = other.buf;
+    this->size_class = other.size_class;
+    this->size = other.size;
+    other.buf = NULL;
+    other.size = 0;
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other){
+    if (this != &other){
+        release();
+        this->buf = other.buf;
+        this->size_class = other.size_class;
+        this->size = other.size;
+        other.buf = NULL;
+        other.size = 0;
+    }
+    return *this;
+}
+
+/* ---------------------------------------------------------- *\
+|* Class Destructor                                           *|
+\* ---------------------------------------------------------- */
+PooledBuffer::~PooledBuffer(){
+    release();
+}
+
+bool PooledBuffer::allocate(unsigned int size){
+    release();
+    this->size_class = BufferPool::sizeClass(size);
+    if (this->size_class == BUFFER_CLASSES){
+        this->buf = (unsigned char*)malloc(size);
+        this->size = size;
+    }
+    else {
+        this->buf = BufferPool::acquire(this->size_class);
+        this->size = BufferPool::classSize(this->size_class);
+    }
+    if (!this->buf){ this->size = 0; }
+    return this->buf != NULL;
+}
+
+void PooledBuffer::release(){
+    if (!this->buf){ return; }
+    if (this->size_class == BUFFER_CLASSES){ free(this->buf); }
+    else { BufferPool::release(this->size_class, this->buf); }
+    this->buf = NULL;
+    this->size = 0;
+}
@@ -0,0 +1,95 @@
+#include <atomic>
+#include <string>
+#include <openssl/evp.h>
+#include "constants.h"
+
+#ifndef CYBERSECURITYPROJECT_BUFFERPOOL_H
+#define CYBERSECURITYPROJECT_BUFFERPOOL_H
+
+using namespace std;
+
+//Size classes of the pooled buffers
+enum BufferClass {
+    BUFFER_SMALL,   //control records: RTT, response, ACK, refresh, return to lobby
+    BUFFER_RECORD,  //any record, up to a chat message encrypted twice
+    BUFFER_FRAME,   //ring of a frame reader
+    BUFFER_CLASSES
+};
+
+//Use of a size class, over all the threads
+struct PoolStats {
+    atomic<unsigned long long> hits;        //buffers taken from the cache of a thread
+    atomic<unsigned long long> misses;      //buffers allocated because the cache was empty
+    atomic<unsigned long long> in_use;
+    atomic<unsigned long long> high_water;  //most buffers in use at the same time
+};
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Buffers of fixed sizes, cached by each thread. A buffer    *|
+|* returns to the cache of the thread that releases it, up to *|
+|* POOL_CACHED_BUFFERS per class; the others are freed. The   *|
+|* caches are plain arrays, so they need no destructor at the *|
+|* exit of a thread.                                          *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class BufferPool {
+    private:
+        static const unsigned int class_sizes[BUFFER_CLASSES];
+
+        static PoolStats stats[BUFFER_CLASSES];
+
+    public:
+        //Smallest class holding size bytes, BUFFER_CLASSES if none
+        static unsigned int sizeClass(unsigned int size);
+
+        static unsigned int classSize(unsigned int size_class);
+
+        static unsigned char* acquire(unsigned int size_class);
+
+        static void release(unsigned int size_class, unsigned char* buf);
+
+        static string className(unsigned int size_class);
+
+        static void printPoolStats();
+};
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Buffer taken from the pool, given back when the handle is  *|
+|* destroyed or released. Larger sizes than the biggest class *|
+|* are allocated on their own.                                *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class PooledBuffer {
+    private:
+        unsigned char* buf;
+        unsigned int size_class;
+        unsigned int size;
+
+    public:
+        PooledBuffer();
+
+        explicit PooledBuffer(unsigned int size);
+
+        PooledBuffer(PooledBuffer&& other);
+        PooledBuffer& operator=(PooledBuffer&& other);
+        PooledBuffer(const PooledBuffer&) = delete;
+        PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+        ~PooledBuffer();
+
+        //Take a buffer of at least size bytes, releasing the current one
+        bool allocate(unsigned int size);
+
+        void release();
+
+        unsigned char* data() const { return this->buf; }
+
+        //Usable bytes, the size of the class
+        unsigned int capacity() const { return this->size; }
+
+        bool empty() const { return this->buf == NULL; }
+};
+
+#endif
@@ -0,0 +1,344 @@
+#include "ClientDriver.h"
+#include "Utility.h"
+#include "Instrumentation.h"
+#include "Tracer.h"
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <unistd.h>
+
+string ClientDriver::eventName(ClientEvent event){
+    static const char* names[CLIENT_EVENTS] = {"connected", "s1_received", "s3_received", "r3_received", "users_received",
+        "rtt_sent", "rtt_received", "rtt_accepted", "rtt_refused", "chat_started", "message_sent", "message_received",
+        "chat_ended", "logout"};
+    return (event < CLIENT_EVENTS) ? names[event] : "unknown";
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function asks the user if he/she wants to send or     *|
+|* receive messages.                                          *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+unsigned int TerminalDriver::chooseRole(){
+    string input;
+    cout<<"LOG: Do you want to"<<endl<<"    0: Send a message"<<endl<<"    1: Receive a message"<<endl;
+    cout<<"LOG: Select a choice: ";
+    cin>>input;
+    if(!cin){exit(1);}
+    while(1){
+        if(input.compare("0")!=0 && input.compare("1")!=0){
+            cout<<"LOG: Choice not valid! Choose 0 or 1!"<<endl;
+            cin>>input;
+            if(!cin){exit(1);}
+        } else break;
+    }
+    return input.c_str()[0]-'0';
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function prints the list of online users and asks     *|
+|* the user to select one of them, to refresh or to logout.   *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+UserSelection TerminalDriver::selectUser(const vector<string> &users, string &selected){
+    if (users.size() == 0){
+        cout<<"LOG: There are no available users."<<endl;
+    } else {
+        cout<<"LOG: Online Users"<<endl;
+    }
+    for (unsigned int i = 0; i < users.size(); i++){
+        cout<<"    "<<i<<": "<<users[i]<<endl;
+    }
+    cout<<"    q: Logout"<<endl;
+    cout<<"    r: Refresh"<<endl;
+
+    string input;
+    cout<<"LOG: Select an option or the number corresponding to one of the users: ";
+    cin>>input;
+    if(!cin) {exit(1);}
+
+    while((!Utility::isNumeric(input) || (unsigned int)atoi(input.c_str()) >= users.size()) && input.compare("q") != 0 && input.compare("r")){
+        cerr<<"ERR: Selection is not valid! Select another option or number: ";
+        cin>>input;
+        if(!cin) {exit(1);}
+    }
+
+    if (input.compare("q") == 0){ return SELECT_LOGOUT; }
+    if (input.compare("r") == 0){ return SELECT_REFRESH; }
+    selected = users[atoi(input.c_str())];
+    return SELECT_USER;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function asks the user to accept or refuse an RTT.    *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+unsigned int TerminalDriver::answerRTT(string sender_username){
+    string input;
+    cout<<"LOG: "<<sender_username<<" wants to send you a message. Do you want to "<<endl<<"    0: Refuse"<<endl<<"    1: Accept"<<endl;
+    cout<<"LOG: Select a choice: ";
+    cin>>input;
+    if(!cin){exit(1);}
+    while(1){
+        if(input.compare("0")!=0 && input.compare("1")!=0){
+            cout<<"LOG: Choice not valid! Choose 0 or 1!"<<endl;
+            cin>>input;
+            if(!cin){exit(1);}
+        } else break;
+    }
+    return input.c_str()[0]-'0';
+}
+
+int TerminalDriver::inputFd(){
+    return STDIN_FILENO;
+}
+
+int TerminalDriver::inputTimeout(){
+    return -1;
+}
+
+bool TerminalDriver::readInput(char* buf, unsigned int size){
+    if (fgets(buf, size, stdin)==NULL){ cerr<<"ERR: Error while reading from stdin."<<endl; exit(1);}
+    char* p = strchr(buf, '\n');
+    if (p){*p = '\0';}
+    return true;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Headless driver: the decisions come from the scenario and  *|
+|* every step is written as a JSON line.                      *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+ScriptDriver::ScriptDriver(FILE* events){
+    this->role = 2;
+    this->refreshes = 0;
+    this->interval_ns = 0;
+    this->expect = 0;
+    this->leave = -1;
+    this->chats = 1;
+    this->attempts = 10;
+    this->retry_ms = 500;
+    this->events = events;
+    this->start_ns = Instrumentation::now();
+    this->chats_done = 0;
+    this->rtts_sent = 0;
+    this->refreshes_left = 0;
+    this->retry = false;
+    this->in_chat = false;
+    this->next_message = 0;
+    this->received = 0;
+    this->next_send_ns = 0;
+}
+
+bool ScriptDriver::set(string key, string value){
+    if (key == "message"){
+        if (value.size() == 0 || value == "q" || value.size() >= INPUT_SIZE){ return false; }
+        this->messages.push_back(value);
+        return true;
+    }
+    if (key == "role"){
+        if (value == "send"){ this->role = 0; }
+        else if (value == "receive"){ this->role = 1; }
+        else { return false; }
+        return true;
+    }
+    if (key == "peer"){
+        if (value.size() == 0){ return false; }
+        this->peer = value;
+        return true;
+    }
+    if (key == "accept"){
+        if (value.size() == 0){ return false; }
+        this->accept = value;
+        return true;
+    }
+    if (key == "leave"){
+        if (value == "yes"){ this->leave = 1; }
+        else if (value == "no"){ this->leave = 0; }
+        else { return false; }
+        return true;
+    }
+    if (key == "interval"){
+        if (!Utility::isNumeric(value)){ return false; }
+        this->interval_ns = strtoull(value.c_str(), NULL, 10)*1000000;
+        return true;
+    }
+    unsigned int* option;
+    if (key == "refresh"){ option = &this->refreshes; }
+    else if (key == "expect"){ option = &this->expect; }
+    else if (key == "chats"){ option = &this->chats; }
+    else if (key == "attempts"){ option = &this->attempts; }
+    else if (key == "retry"){ option = &this->retry_ms; }
+    else { return false; }
+    if (!Utility::isNumeric(value)){ return false; }
+    *option = strtoul(value.c_str(), NULL, 10);
+    return true;
+}
+
+bool ScriptDriver::load(string path){
+    ifstream script(path);
+    if (!script){
+        cerr<<"ERR: Cannot open the script "<<path<<"."<<endl;
+        return false;
+    }
+    string line;
+    unsigned int n = 0;
+    while (getline(script, line)){
+        n++;
+        size_t begin = line.find_first_not_of(" \t\r");
+        if (begin == string::npos || line[begin] == '#'){ continue; }
+        size_t end = line.find_first_of(" \t", begin);
+        string key = line.substr(begin, end - begin);
+        string value;
+        if (end != string::npos){
+            size_t value_begin = line.find_first_not_of(" \t", end);
+            if (value_begin != string::npos){ value = line.substr(value_begin); }
+        }
+        if (value.size() > 0 && value.back() == '\r'){ value.pop_back(); }
+        if (!set(key, value)){
+            cerr<<"ERR: "<<path<<":"<<n<<": option not valid: "<<line<<endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ScriptDriver::valid(){
+    if (this->role > 1){
+        cerr<<"ERR: The scenario needs a role: send or receive."<<endl;
+        return false;
+    }
+    if (this->role == 0 && this->peer.size() == 0){
+        cerr<<"ERR: The sender needs the peer to send the RTT to."<<endl;
+        return false;
+    }
+    if (this->leave < 0){ this->leave = (this->role == 0) ? 1 : 0; }
+    if (this->accept.size() == 0){ this->accept = "all"; }
+    this->refreshes_left = this->refreshes;
+    return true;
+}
+
+unsigned int ScriptDriver::chooseRole(){
+    return this->role;
+}
+
+UserSelection ScriptDriver::selectUser(const vector<string> &, string &selected){
+    if (this->chats_done >= this->chats || this->rtts_sent >= this->attempts){ return SELECT_LOGOUT; }
+    if (this->retry){
+        this->retry = false;
+        this_thread::sleep_for(chrono::milliseconds(retryDelay()));
+    }
+    if (this->refreshes_left > 0){
+        this->refreshes_left--;
+        return SELECT_REFRESH;
+    }
+    this->refreshes_left = this->refreshes;
+    this->rtts_sent++;
+    selected = this->peer;
+    return SELECT_USER;
+}
+
+unsigned int ScriptDriver::answerRTT(string sender_username){
+    if (this->accept == "all"){ return 1; }
+    if (this->accept == "none"){ return 0; }
+    return (sender_username == this->accept) ? 1 : 0;
+}
+
+int ScriptDriver::inputFd(){
+    return -1;
+}
+
+unsigned int ScriptDriver::messageCount(){
+    return this->messages.size();
+}
+
+void ScriptDriver::composeMessage(unsigned int index, char* buf, unsigned int size){
+    this->last_sent = this->messages[index];
+    snprintf(buf, size, "%s", this->last_sent.c_str());
+}
+
+unsigned int ScriptDriver::retryDelay(){
+    return this->retry_ms;
+}
+
+unsigned long long ScriptDriver::untilNextMessage(){
+    unsigned long long t = Instrumentation::now();
+    return (this->next_send_ns > t) ? this->next_send_ns - t : 0;
+}
+
+bool ScriptDriver::chatDone(){
+    return this->next_message >= messageCount() && this->received >= this->expect;
+}
+
+int ScriptDriver::inputTimeout(){
+    if (!this->in_chat){
+        //Only the receiver waits in the lobby: it leaves after its chats
+        return (this->chats_done >= this->chats) ? 0 : -1;
+    }
+    if (this->next_message < messageCount()){
+        return (untilNextMessage() + 999999)/1000000;
+    }
+    return (this->leave && chatDone()) ? 0 : -1;
+}
+
+bool ScriptDriver::readInput(char* buf, unsigned int size){
+    if (!this->in_chat){
+        if (this->chats_done < this->chats){ return false; }
+        strcpy(buf, "q");
+        return true;
+    }
+    if (this->next_message < messageCount() && untilNextMessage() == 0){
+        composeMessage(this->next_message++, buf, size);
+        this->next_send_ns = Instrumentation::now() + this->interval_ns;
+        return true;
+    }
+    if (this->leave && chatDone()){
+        strcpy(buf, "q");
+        return true;
+    }
+    return false;
+}
+
+void ScriptDriver::event(ClientEvent event, string peer, const char* msg, unsigned int msg_len){
+    unsigned long long t = Instrumentation::now();
+    switch (event){
+        case EVENT_RTT_REFUSED:
+            this->retry = true;
+            break;
+        case EVENT_CHAT_STARTED:
+            this->in_chat = true;
+            this->next_message = 0;
+            this->received = 0;
+            this->next_send_ns = t + this->interval_ns;
+            break;
+        case EVENT_MESSAGE_RECEIVED:
+            this->received++;
+            break;
+        case EVENT_CHAT_ENDED:
+            this->in_chat = false;
+            this->chats_done++;
+            break;
+        default:
+            break;
+    }
+    if (!this->events){ return; }
+
+    unsigned long long wall_us = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    string line = "{\"time_us\":" + to_string(wall_us) + ",\"elapsed_us\":" + to_string((t - this->start_ns)/1000)
+        + ",\"event\":\"" + eventName(event) + "\"";
+    if (peer.size() > 0){ line += ",\"peer\":\"" + Tracer::jsonEscape(peer.c_str(), peer.size()) + "\""; }
+    if (event == EVENT_MESSAGE_SENT){
+        line += ",\"len\":" + to_string(msg_len) + ",\"text\":\"" + Tracer::jsonEscape(this->last_sent.c_str(), this->last_sent.size()) + "\"";
+    } else if (event == EVENT_MESSAGE_RECEIVED){
+        line += ",\"len\":" + to_string(msg_len) + ",\"text\":\"" + Tracer::jsonEscape(msg, msg_len) + "\"";
+    }
+    line += "}\n";
+    fputs(line.c_str(), this->events);
+    fflush(this->events);
+}
@@ -0,0 +1,192 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#ifndef CYBERSECURITYPROJECT_CLIENTDRIVER_H
+#define CYBERSECURITYPROJECT_CLIENTDRIVER_H
+
+using namespace std;
+
+//Steps of a client session, reported to its driver when they are done
+enum ClientEvent {
+    EVENT_CONNECTED,            //TCP connection to the server open
+    EVENT_S1_RECEIVED,          //certificate of the server received
+    EVENT_S3_RECEIVED,          //full login done, K derived
+    EVENT_R3_RECEIVED,          //session resumed with the ticket, K derived
+    EVENT_USERS_RECEIVED,       //list of the online users received
+    EVENT_RTT_SENT,             //RTT sent to the peer
+    EVENT_RTT_RECEIVED,         //RTT received from the peer
+    EVENT_RTT_ACCEPTED,         //RTT accepted, by the peer or by this user
+    EVENT_RTT_REFUSED,          //RTT refused or the peer not available
+    EVENT_CHAT_STARTED,         //M3 sent or received, chat key set
+    EVENT_MESSAGE_SENT,         //chat message sent to the peer
+    EVENT_MESSAGE_RECEIVED,     //chat message of the peer received
+    EVENT_CHAT_ENDED,           //back to the lobby
+    EVENT_LOGOUT,               //session closed
+    CLIENT_EVENTS
+};
+
+//Answer of a driver to the list of the online users
+enum UserSelection {
+    SELECT_USER,        //send an RTT to the selected user
+    SELECT_REFRESH,     //ask the list again
+    SELECT_LOGOUT
+};
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Source of the decisions of a client: the role, the user to *|
+|* talk to, the answer to an RTT and the lines typed while    *|
+|* waiting for an RTT or chatting. The client polls the       *|
+|* server socket together with the descriptor of the driver,  *|
+|* if any, and asks for a line when the descriptor is ready   *|
+|* or the timeout of the driver expires. The steps of the     *|
+|* session are reported back to the driver as events.         *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class ClientDriver {
+    public:
+        virtual ~ClientDriver(){}
+
+        //Role of the session: 0 to send messages, 1 to receive them
+        virtual unsigned int chooseRole() = 0;
+
+        //What to do with the list of the online users; selected is the user to send the RTT to
+        virtual UserSelection selectUser(const vector<string> &users, string &selected) = 0;
+
+        //Answer to the RTT of a user: 1 to accept, 0 to refuse
+        virtual unsigned int answerRTT(string sender_username) = 0;
+
+        //Descriptor polled with the socket while waiting for an RTT or chatting, -1 if none
+        virtual int inputFd() = 0;
+
+        //Milliseconds to wait for the socket before asking for a line anyway, -1 to wait forever
+        virtual int inputTimeout() = 0;
+
+        //Next line typed, without the newline: "q" leaves the lobby or the chat. False if there is none yet
+        virtual bool readInput(char* buf, unsigned int size) = 0;
+
+        //A step of the session is done; a message received comes with its text, a message sent only with its length
+        virtual void event(ClientEvent, string, const char*, unsigned int){}
+
+        static string eventName(ClientEvent event);
+};
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Driver of the interactive client: the user at the terminal *|
+|* answers the prompts and types the messages on stdin.       *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class TerminalDriver : public ClientDriver {
+    public:
+        unsigned int chooseRole();
+
+        UserSelection selectUser(const vector<string> &users, string &selected);
+
+        unsigned int answerRTT(string sender_username);
+
+        int inputFd();
+
+        int inputTimeout();
+
+        bool readInput(char* buf, unsigned int size);
+};
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Driver of a headless client, that follows a scenario given *|
+|* as options ("--key value") or as a script ("key value" per *|
+|* line, # for comments):                                     *|
+|*   role send|receive    role of the session                 *|
+|*   peer USER            user the sender sends the RTT to    *|
+|*   accept all|none|USER RTTs accepted by the receiver       *|
+|*   refresh N            lobby refreshes before each RTT     *|
+|*   message TEXT         message sent in each chat, in order *|
+|*   interval MS          pause before each message           *|
+|*   expect N             messages of the peer to receive     *|
+|*                        before leaving the chat             *|
+|*   leave yes|no         leave the chat, or wait for the     *|
+|*                        peer to (default: yes for senders)  *|
+|*   chats N              chats before the logout             *|
+|*   attempts N           RTTs sent before giving up          *|
+|*   retry MS             pause before a new RTT after a      *|
+|*                        refusal                             *|
+|* Every step is written as a JSON line with its wall clock   *|
+|* time and the time since the start of the client.           *|
+|* A subclass can generate the messages and the pauses before *|
+|* a new RTT, like the users of loadgen.                      *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class ScriptDriver : public ClientDriver {
+    protected:
+        unsigned int role;
+        string peer;
+        string accept;
+        unsigned int refreshes;
+        vector<string> messages;
+        unsigned long long interval_ns;
+        unsigned int expect;
+        int leave;
+        unsigned int chats;
+        unsigned int attempts;
+        unsigned int retry_ms;
+
+        //Where the events are written, NULL for nowhere
+        FILE* events;
+        unsigned long long start_ns;
+
+        unsigned int chats_done;
+        unsigned int rtts_sent;
+        unsigned int refreshes_left;
+        bool retry;
+        bool in_chat;
+        unsigned int next_message;
+        unsigned int received;
+        unsigned long long next_send_ns;
+        string last_sent;
+
+        //Messages sent in each chat
+        virtual unsigned int messageCount();
+
+        //Write the message of a chat with the given index in buf
+        virtual void composeMessage(unsigned int index, char* buf, unsigned int size);
+
+        //Milliseconds to wait before a new RTT after a refusal
+        virtual unsigned int retryDelay();
+
+        //Time before the next message, 0 if it is due
+        unsigned long long untilNextMessage();
+
+        //The chat is over for this side: all the messages sent and the expected ones received
+        bool chatDone();
+
+    public:
+        //Scenario with the defaults: no role yet, events written to the given file
+        ScriptDriver(FILE* events);
+
+        //Set an option of the scenario, false if it is not valid
+        bool set(string key, string value);
+
+        //Read the options of a script file, false at the first one not valid
+        bool load(string path);
+
+        //Check that the scenario is complete, printing what is missing
+        bool valid();
+
+        unsigned int chooseRole();
+
+        UserSelection selectUser(const vector<string> &users, string &selected);
+
+        unsigned int answerRTT(string sender_username);
+
+        int inputFd();
+
+        int inputTimeout();
+
+        bool readInput(char* buf, unsigned int size);
+
+        void event(ClientEvent event, string peer, const char* msg, unsigned int msg_len);
+};
+
+#endif
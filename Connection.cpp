@@ -0,0 +1,252 @@
+#include "Connection.h"
+#include "Reactor.h"
+#include "Logger.h"
+#include <iostream>
+#include <unistd.h>
+#include <errno.h>
+#include <utility>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <cstring>
+
+//Number of the next connection accepted
+static atomic<unsigned long long> next_id(1);
+
+Connection::Connection(int socket, sockaddr_in address){
+    this->socket = socket;
+    this->address = address;
+    this->reactor = NULL;
+    this->id = next_id.fetch_add(1, memory_order_relaxed);
+    this->phase = PHASE_S2;
+    this->phase_since = 0;
+    this->role = 0;
+    this->resume_tried = false;
+    this->out_offset = 0;
+    this->closed = false;
+    this->ring_slot = -1;
+    this->ring_ops = 0;
+    this->send_pending = false;
+    this->send_buffer = 0;
+    this->events_overflow = false;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function queues a message on the connection, as a     *|
+|* frame.                                                     *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool Connection::write(const unsigned char* buf, unsigned int len){
+    lock_guard<mutex> lck(this->out_mutex);
+    return writeLocked(buf, len);
+}
+
+bool Connection::writev(const struct iovec* parts, unsigned int count){
+    lock_guard<mutex> lck(this->out_mutex);
+    return writeLocked(parts, count);
+}
+
+bool Connection::writeLocked(const unsigned char* buf, unsigned int len){
+    struct iovec part;
+    part.iov_base = (void*)buf;
+    part.iov_len = len;
+    return writeLocked(&part, 1);
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function queues a message made of several parts, as a *|
+|* frame: the parts are gathered by the kernel, or copied in  *|
+|* order at the end of the queue.                             *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool Connection::writeLocked(const struct iovec* parts, unsigned int count){
+    if (this->closed){ return false; }
+    if (count == 0 || count > MAX_WRITE_PARTS){ return false; }
+    size_t len = 0;
+    for (unsigned int i = 0; i < count; i++){ len += parts[i].iov_len; }
+    if (len == 0 || len > MAX_FRAME_SIZE){ return false; }
+
+    unsigned char header[FRAME_HEADER_SIZE];
+    Framing::writeHeader(header, len);
+    unsigned int total = FRAME_HEADER_SIZE + len;
+
+    struct iovec iov[1 + MAX_WRITE_PARTS];
+    iov[0].iov_base = header;
+    iov[0].iov_len = FRAME_HEADER_SIZE;
+    memcpy(iov + 1, parts, count*sizeof(struct iovec));
+    unsigned int iovcnt = 1 + count;
+
+    /* ---------------------------------------------------------- *\
+    |* With io_uring the reactor sends the queue in its next      *|
+    |* batch                                                      *|
+    \* ---------------------------------------------------------- */
+    Reactor* owner = this->reactor.load();
+    bool ring = owner != NULL && owner->usesRing();
+
+    /* ---------------------------------------------------------- *\
+    |* Send header and payload directly if nothing is waiting     *|
+    |* before this message                                        *|
+    \* ---------------------------------------------------------- */
+    unsigned int sent = 0;
+    unsigned int first = 0;
+    if (!ring && this->out_offset == this->out_buf.size()){
+        while (sent < total){
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov + first;
+            msg.msg_iovlen = iovcnt - first;
+            ssize_t ret = ::sendmsg(this->socket, &msg, MSG_NOSIGNAL);
+            if (ret < 0 && errno == EINTR){ continue; }
+            if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){ break; }
+            if (ret < 0){ return false; }
+            sent += ret;
+
+            //Skip the parts sent, and the sent bytes of the first one left
+            size_t skip = ret;
+            while (first < iovcnt && skip >= iov[first].iov_len){
+                skip -= iov[first].iov_len;
+                first++;
+            }
+            if (skip > 0){
+                iov[first].iov_base = (unsigned char*)iov[first].iov_base + skip;
+                iov[first].iov_len -= skip;
+            }
+        }
+    }
+
+    /* ---------------------------------------------------------- *\
+    |* Keep the rest until the reactor can send it                *|
+    \* ---------------------------------------------------------- */
+    if (sent < total){
+        if (this->out_offset == this->out_buf.size()){
+            this->out_buf.clear();
+            this->out_offset = 0;
+        }
+        for (unsigned int i = first; i < iovcnt; i++){
+            unsigned char* part = (unsigned char*)iov[i].iov_base;
+            this->out_buf.insert(this->out_buf.end(), part, part + iov[i].iov_len);
+        }
+    }
+    if (ring && !this->send_pending){
+        this->send_pending = true;
+        owner->requestSend(shared_from_this());
+    }
+    return true;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function sends the queued bytes of the connection.    *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool Connection::flush(){
+    lock_guard<mutex> lck(this->out_mutex);
+    if (this->closed){ return false; }
+    while (this->out_offset < this->out_buf.size()){
+        ssize_t ret = ::send(this->socket, this->out_buf.data() + this->out_offset, this->out_buf.size() - this->out_offset, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR){ continue; }
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){ return true; }
+        if (ret < 0){ return false; }
+        this->out_offset += ret;
+    }
+    this->out_buf.clear();
+    this->out_offset = 0;
+    return true;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function closes the socket of the connection. It is   *|
+|* done under out_mutex so that no other thread can write on  *|
+|* a socket number already reused by the kernel.              *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void Connection::close(){
+    lock_guard<mutex> lck(this->out_mutex);
+    if (this->closed){ return; }
+    this->closed = true;
+    ProtocolStateMachine::finish(this);
+    ::close(this->socket);
+}
+
+string Connection::getPeer(){
+    lock_guard<mutex> lck(this->out_mutex);
+    return this->peer;
+}
+
+void Connection::setPeer(const string &peer){
+    lock_guard<mutex> lck(this->out_mutex);
+    this->peer = peer;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function queues an event for the session of the       *|
+|* connection, resuming it if it is suspended. It must be     *|
+|* called by the thread of the reactor owning the connection. *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void Connection::pushEvent(ConnectionEvent event){
+    coroutine_handle<> handle;
+    {
+        lock_guard<mutex> lck(this->events_mutex);
+        if (this->events_overflow){ return; }
+        if (this->events.size() >= MAX_CONNECTION_EVENTS){
+            //The client sends faster than its session handles the records: close it rather than queue without limit
+            Logger::warn("Session ", this->id, " is ", this->events.size(), " events behind, closing the connection");
+            this->events_overflow = true;
+            event = ConnectionEvent{};
+            event.type = EVENT_CLOSED;
+        }
+        this->events.push_back(move(event));
+        handle = exchange(this->waiter, nullptr);
+    }
+    if (handle){ handle.resume(); }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function queues an event from another thread. If the  *|
+|* connection moves to another shard in the meantime the      *|
+|* event follows it; it is dropped if the connection is       *|
+|* closed. These events carry no record.                      *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void Connection::postEvent(ConnectionEvent event){
+    shared_ptr<Connection> self = shared_from_this();
+    Reactor* target = this->reactor.load();
+    int type = event.type;
+    unsigned int message_type = event.message_type;
+    unsigned int value = event.value;
+    target->post([self, type, message_type, value, target](Reactor*){
+        ConnectionEvent event;
+        event.type = type;
+        event.message_type = message_type;
+        event.value = value;
+        if (self->closed){ return; }
+        if (self->reactor.load() != target){
+            self->postEvent(move(event));
+            return;
+        }
+        self->pushEvent(move(event));
+    });
+}
+
+Connection::EventAwaiter Connection::nextEvent(){
+    return EventAwaiter{this};
+}
+
+bool Connection::EventAwaiter::await_suspend(coroutine_handle<> handle){
+    lock_guard<mutex> lck(this->conn->events_mutex);
+    if (!this->conn->events.empty()){ return false; }
+    this->conn->waiter = handle;
+    return true;
+}
+
+ConnectionEvent Connection::EventAwaiter::await_resume(){
+    lock_guard<mutex> lck(this->conn->events_mutex);
+    ConnectionEvent event = move(this->conn->events.front());
+    this->conn->events.pop_front();
+    return event;
+}
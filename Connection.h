@@ -0,0 +1,148 @@
+#include <netinet/in.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <coroutine>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Utility.h"
+#include "ProtocolStateMachine.h"
+#include "Framing.h"
+#include "ServerIdentity.h"
+
+#ifndef CYBERSECURITYPROJECT_CONNECTION_H
+#define CYBERSECURITYPROJECT_CONNECTION_H
+
+using namespace std;
+
+class Reactor;
+
+//What wakes up the session of a connection
+enum ConnectionEventType {
+    EVENT_RECORD,   //a record received from the client
+    EVENT_PEER,     //a notification of the other user of a RTT
+    EVENT_CLOSED    //end of file or error on the socket
+};
+
+struct ConnectionEvent {
+    int type;
+    unsigned int message_type;
+    unsigned int value;
+
+    //Received record, in a buffer of the pool of the reactor
+    PooledBuffer record;
+    unsigned int record_len = 0;
+};
+
+struct Connection : public enable_shared_from_this<Connection> {
+    //Socket of the connection
+    int socket;
+
+    //Address of the client
+    sockaddr_in address;
+
+    //Reactor that owns the connection, changed by a migration while other threads may post to it
+    atomic<Reactor*> reactor;
+
+    //Number of the connection in the process, the session ID of the trace
+    unsigned long long id;
+
+    //Current phase of the protocol, changed through ProtocolStateMachine
+    atomic<int> phase;
+
+    //Time when the current phase started (ns of the steady clock)
+    atomic<unsigned long long> phase_since;
+
+    //Role chosen in S2
+    //0: sender
+    //1: receiver
+    unsigned int role;
+
+    //Username of the authenticated user
+    string username;
+
+    //User on the other side of a RTT or a chat. The sender sets it on the connection of the receiver too,
+    //from another reactor, so it is only accessed through getPeer and setPeer, under out_mutex
+    string peer;
+
+    //Set when the connection sent R2: after a rejected ticket only S2 is accepted
+    bool resume_tried;
+
+    //Nonce sent in S1
+    unsigned char R_server[R_SIZE];
+
+    //Certificate sent in S1, whose private key signs S3
+    shared_ptr<const ServerIdentity> identity;
+
+    //Bytes accepted by write() but not yet taken by the kernel. The mutex also serializes the messages
+    //encrypted for this connection, so that counters and socket order always match
+    mutex out_mutex;
+    vector<unsigned char> out_buf;
+    size_t out_offset;
+
+    //Set once by close(), under out_mutex; read without it by the reactors and by the tasks posted to them
+    atomic<bool> closed;
+
+    //io_uring backend: slot in the fixed files of the ring (-1 if none), requests in the ring,
+    //send submitted or queued, registered buffer of the send in the ring
+    int ring_slot;
+    unsigned int ring_ops;
+    bool send_pending;
+    unsigned int send_buffer;
+
+    //Frames received but not yet given to the session, used only by the reactor owning the connection
+    FrameReader reader;
+
+    //Events not yet taken by the session, and the session suspended waiting for them.
+    //The session is resumed only by the thread of the reactor owning the connection
+    mutex events_mutex;
+    deque<ConnectionEvent> events;
+    coroutine_handle<> waiter;
+
+    //Set when the session fell MAX_CONNECTION_EVENTS events behind: the next events are dropped
+    bool events_overflow;
+
+    //Awaitable returned by nextEvent()
+    struct EventAwaiter {
+        Connection* conn;
+        bool await_ready(){ return false; }
+        bool await_suspend(coroutine_handle<> handle);
+        ConnectionEvent await_resume();
+    };
+
+    Connection(int socket, sockaddr_in address);
+
+    //Queue a message in a frame, sending as much as possible immediately
+    bool write(const unsigned char* buf, unsigned int len);
+
+    //Same as write, for a message made of up to MAX_WRITE_PARTS parts
+    bool writev(const struct iovec* parts, unsigned int count);
+
+    //Same as write, with out_mutex already held by the caller
+    bool writeLocked(const unsigned char* buf, unsigned int len);
+
+    //Same as writev, with out_mutex already held by the caller
+    bool writeLocked(const struct iovec* parts, unsigned int count);
+
+    //Send the queued bytes when the socket becomes writable
+    bool flush();
+
+    void close();
+
+    string getPeer();
+
+    void setPeer(const string &peer);
+
+    //Queue an event and resume the session if it is waiting for one. A session too far behind gets EVENT_CLOSED instead
+    void pushEvent(ConnectionEvent event);
+
+    //Queue an event from any thread: it is pushed by the thread of the reactor owning the connection
+    void postEvent(ConnectionEvent event);
+
+    //Suspend the session until the next event
+    EventAwaiter nextEvent();
+};
+
+#endif
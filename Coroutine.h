@@ -0,0 +1,74 @@
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+#ifndef CYBERSECURITYPROJECT_COROUTINE_H
+#define CYBERSECURITYPROJECT_COROUTINE_H
+
+using namespace std;
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Coroutine returning a value of type T. It starts only when *|
+|* it is awaited by another coroutine, that is resumed when   *|
+|* it ends, or when it is detached: a detached coroutine      *|
+|* frees its own frame at the end.                            *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+template<typename T>
+class Task {
+    public:
+        struct promise_type {
+            T value;
+            coroutine_handle<> continuation;
+            bool detached = false;
+
+            //At the end resume the awaiting coroutine, if any, without growing the stack
+            struct FinalAwaiter {
+                bool await_ready() noexcept { return false; }
+                coroutine_handle<> await_suspend(coroutine_handle<promise_type> handle) noexcept {
+                    promise_type& promise = handle.promise();
+                    if (promise.detached){
+                        handle.destroy();
+                        return noop_coroutine();
+                    }
+                    if (promise.continuation){ return promise.continuation; }
+                    return noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+
+            Task get_return_object(){ return Task(coroutine_handle<promise_type>::from_promise(*this)); }
+            suspend_always initial_suspend() noexcept { return {}; }
+            FinalAwaiter final_suspend() noexcept { return {}; }
+            void return_value(T v){ this->value = v; }
+            void unhandled_exception(){ terminate(); }
+        };
+
+        Task(Task&& other) : handle(exchange(other.handle, nullptr)) {}
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+        ~Task(){ if (this->handle){ this->handle.destroy(); } }
+
+        //Awaiting a task runs it and suspends the caller until it ends
+        bool await_ready(){ return false; }
+        coroutine_handle<> await_suspend(coroutine_handle<> caller){
+            this->handle.promise().continuation = caller;
+            return this->handle;
+        }
+        T await_resume(){ return this->handle.promise().value; }
+
+        //Run the task on its own, up to its first suspension
+        void detach(){
+            coroutine_handle<promise_type> h = exchange(this->handle, nullptr);
+            h.promise().detached = true;
+            h.resume();
+        }
+
+    private:
+        coroutine_handle<promise_type> handle;
+
+        explicit Task(coroutine_handle<promise_type> h) : handle(h) {}
+};
+
+#endif
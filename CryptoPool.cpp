@@ -0,0 +1,149 @@
+#include "CryptoPool.h"
+#include "Reactor.h"
+#include "Instrumentation.h"
+#include <iostream>
+#include <thread>
+#include <unistd.h>
+
+unsigned int CryptoPool::workers = 0;
+
+mutex CryptoPool::jobs_mutex;
+condition_variable CryptoPool::idle;
+deque<CryptoJob> CryptoPool::jobs[CRYPTO_QUEUES];
+unsigned int CryptoPool::running_handshakes = 0;
+
+CryptoQueueStats CryptoPool::stats[CRYPTO_QUEUES];
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function starts the workers. It is called once,       *|
+|* before the reactors start.                                 *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void CryptoPool::start(unsigned int threads){
+    if (workers){ return; }
+    if (threads == 0){ threads = thread::hardware_concurrency(); }
+    if (threads == 0){ threads = 1; }
+    workers = threads;
+    for (unsigned int i = 0; i < threads; i++){
+        thread(&CryptoPool::work).detach();
+    }
+    cout<<"Thread "<<gettid()<<": "<<threads<<" crypto workers started."<<endl;
+}
+
+bool CryptoPool::started(){
+    return workers > 0;
+}
+
+void CryptoPool::submit(CryptoQueue queue, function<void()> work){
+    {
+        lock_guard<mutex> lock(jobs_mutex);
+        jobs[queue].push_back(CryptoJob{move(work), Instrumentation::now()});
+    }
+    idle.notify_one();
+}
+
+unsigned int CryptoPool::handshakeLimit(){
+    return (workers > 1) ? workers - 1 : 1;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function is the body of a worker: it sleeps until     *|
+|* there is a job it can take, records first. A handshake is  *|
+|* not taken if it would leave no worker for the records.     *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void CryptoPool::work(){
+    while (true){
+        int queue;
+        CryptoJob job;
+        {
+            unique_lock<mutex> lock(jobs_mutex);
+            idle.wait(lock, [](){ return !jobs[CRYPTO_AEAD].empty() || (!jobs[CRYPTO_HANDSHAKE].empty() && running_handshakes < handshakeLimit()); });
+            queue = !jobs[CRYPTO_AEAD].empty() ? CRYPTO_AEAD : CRYPTO_HANDSHAKE;
+            job = move(jobs[queue].front());
+            jobs[queue].pop_front();
+            if (queue == CRYPTO_HANDSHAKE){ running_handshakes++; }
+        }
+
+        unsigned long long start = Instrumentation::now();
+        unsigned long long wait = start - job.queued_ns;
+        job.work();
+        stats[queue].run_ns += Instrumentation::now() - start;
+        stats[queue].count++;
+        stats[queue].wait_ns += wait;
+        unsigned long long max = stats[queue].max_wait_ns.load();
+        while (wait > max && !stats[queue].max_wait_ns.compare_exchange_weak(max, wait));
+
+        //A handshake slot is free again
+        if (queue == CRYPTO_HANDSHAKE){
+            {
+                lock_guard<mutex> lock(jobs_mutex);
+                running_handshakes--;
+            }
+            idle.notify_one();
+        }
+    }
+}
+
+CryptoAwaiter CryptoPool::run(const atomic<Reactor*>* owner, CryptoQueue queue, function<int()> work){
+    return CryptoAwaiter{owner, queue, move(work), 0};
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function resumes a coroutine in the thread of the     *|
+|* reactor owning its connection. If the connection moves to  *|
+|* another shard before the task runs, the task follows it.   *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+static void resumeOn(const atomic<Reactor*>* owner, coroutine_handle<> handle){
+    Reactor* target = owner->load();
+    target->post([owner, handle, target](Reactor*){
+        if (owner->load() != target){
+            resumeOn(owner, handle);
+            return;
+        }
+        handle.resume();
+    });
+}
+
+//Without workers the job runs in the calling thread
+bool CryptoAwaiter::await_ready(){
+    if (CryptoPool::started()){ return false; }
+    this->result = this->work();
+    return true;
+}
+
+void CryptoAwaiter::await_suspend(coroutine_handle<> handle){
+    CryptoPool::submit(this->queue, [this, handle](){
+        this->result = this->work();
+        resumeOn(this->owner, handle);
+    });
+}
+
+string CryptoPool::queueName(int queue){
+    switch(queue){
+        case CRYPTO_AEAD: return "aead";
+        case CRYPTO_HANDSHAKE: return "handshake";
+        default: return "unknown";
+    }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function prints how long the jobs of each queue       *|
+|* waited for a worker, and how long they ran.                *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void CryptoPool::printPoolStats(){
+    if (!workers){ return; }
+    cout<<"Thread "<<gettid()<<": Crypto pool statistics ("<<workers<<" workers)"<<endl;
+    for (int i = 0; i < CRYPTO_QUEUES; i++){
+        unsigned long long count = stats[i].count.load();
+        if (count == 0){ continue; }
+        cout<<"     "<<queueName(i)<<": "<<count<<" jobs, queue wait mean "<<stats[i].wait_ns.load()/count/1000<<" us, max "<<stats[i].max_wait_ns.load()/1000
+            <<" us, run mean "<<stats[i].run_ns.load()/count/1000<<" us"<<endl;
+    }
+}
@@ -0,0 +1,95 @@
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#ifndef CYBERSECURITYPROJECT_CRYPTOPOOL_H
+#define CYBERSECURITYPROJECT_CRYPTOPOOL_H
+
+using namespace std;
+
+class Reactor;
+
+//Classes of crypto jobs, in the order the workers take them
+enum CryptoQueue {
+    CRYPTO_AEAD,        //decryption and encryption of a relayed record, short and latency sensitive
+    CRYPTO_HANDSHAKE,   //S2/S3 and R2/R3: signatures, key exchange and envelopes
+    CRYPTO_QUEUES
+};
+
+struct CryptoJob {
+    function<void()> work;
+    unsigned long long queued_ns;   //steady clock when submitted
+};
+
+//Wait and run time of the jobs of a queue
+struct CryptoQueueStats {
+    atomic<unsigned long long> count;
+    atomic<unsigned long long> wait_ns;
+    atomic<unsigned long long> max_wait_ns;
+    atomic<unsigned long long> run_ns;
+};
+
+//Awaitable returned by CryptoPool::run: the coroutine is resumed by the reactor owning its connection with the result of the job
+struct CryptoAwaiter {
+    const atomic<Reactor*>* owner;
+    CryptoQueue queue;
+    function<int()> work;
+    int result;
+
+    bool await_ready();
+    void await_suspend(coroutine_handle<> handle);
+    int await_resume(){ return this->result; }
+};
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Threads running the expensive cryptography of the server   *|
+|* out of the reactors, one per core, taking the jobs of one  *|
+|* queue per class in order of submission. A job costs far    *|
+|* more than the lock, so the workers share the queues.       *|
+|* Record jobs are taken before handshake jobs, and at most   *|
+|* all the workers but one run a handshake, so that a burst   *|
+|* of logins does not stall the relayed messages. The session *|
+|* that submitted a job is resumed by its own reactor.        *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class CryptoPool {
+    private:
+        static unsigned int workers;
+
+        //Jobs of each queue not yet taken, handshakes running, and the idle workers waiting for a job they can take
+        static mutex jobs_mutex;
+        static condition_variable idle;
+        static deque<CryptoJob> jobs[CRYPTO_QUEUES];
+        static unsigned int running_handshakes;
+
+        static CryptoQueueStats stats[CRYPTO_QUEUES];
+
+        //Handshakes that can run at the same time
+        static unsigned int handshakeLimit();
+
+        //Body of a worker thread
+        static void work();
+
+    public:
+        //Start the workers, one per core if threads is 0
+        static void start(unsigned int threads);
+
+        static bool started();
+
+        //Run a job on a worker
+        static void submit(CryptoQueue queue, function<void()> work);
+
+        //Run a job on a worker and resume the awaiting coroutine in the thread of the reactor that owns its connection at the end
+        static CryptoAwaiter run(const atomic<Reactor*>* owner, CryptoQueue queue, function<int()> work);
+
+        static string queueName(int queue);
+
+        static void printPoolStats();
+};
+
+#endif
@@ -0,0 +1,172 @@
+#include "Framing.h"
+#include <cstring>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+void Framing::writeHeader(unsigned char* header, unsigned int len){
+    header[0] = (len >> 24) & 0xff;
+    header[1] = (len >> 16) & 0xff;
+    header[2] = (len >> 8) & 0xff;
+    header[3] = len & 0xff;
+}
+
+unsigned int Framing::readHeader(const unsigned char* header){
+    return ((unsigned int)header[0] << 24) | ((unsigned int)header[1] << 16) | ((unsigned int)header[2] << 8) | (unsigned int)header[3];
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function sends the header and the payload of a frame  *|
+|* with a single system call when the socket accepts them.    *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+int Framing::sendFrame(int socket, const unsigned char* buf, unsigned int len){
+    if (len == 0 || len > MAX_FRAME_SIZE){ return -1; }
+    unsigned char header[FRAME_HEADER_SIZE];
+    writeHeader(header, len);
+
+    size_t total = FRAME_HEADER_SIZE + len;
+    size_t sent = 0;
+    while (sent < total){
+        struct iovec iov[2];
+        int iovcnt = 0;
+        if (sent < FRAME_HEADER_SIZE){
+            iov[iovcnt].iov_base = header + sent;
+            iov[iovcnt].iov_len = FRAME_HEADER_SIZE - sent;
+            iovcnt++;
+        }
+        size_t payload_sent = (sent > FRAME_HEADER_SIZE) ? sent - FRAME_HEADER_SIZE : 0;
+        iov[iovcnt].iov_base = (void*)(buf + payload_sent);
+        iov[iovcnt].iov_len = len - payload_sent;
+        iovcnt++;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t ret = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR){ continue; }
+        if (ret < 0){ return -1; }
+        sent += ret;
+    }
+    return len;
+}
+
+FrameReader::FrameReader(){
+    this->head = 0;
+    this->size = 0;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function reads from the socket into the free space of *|
+|* the ring, that can be split in two by its end.             *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+ssize_t FrameReader::fill(int socket){
+    if (this->ring.empty() && !this->ring.allocate(FRAME_BUFFER_SIZE)){
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t capacity = this->ring.capacity();
+    size_t tail = (this->head + this->size) % capacity;
+    size_t free_space = capacity - this->size;
+
+    struct iovec iov[2];
+    int iovcnt = 1;
+    iov[0].iov_base = this->ring.data() + tail;
+    iov[0].iov_len = (tail + free_space <= capacity) ? free_space : capacity - tail;
+    if (iov[0].iov_len < free_space){
+        iov[1].iov_base = this->ring.data();
+        iov[1].iov_len = free_space - iov[0].iov_len;
+        iovcnt = 2;
+    }
+
+    ssize_t ret = readv(socket, iov, iovcnt);
+    if (ret > 0){ this->size += ret; }
+    return ret;
+}
+
+bool FrameReader::append(const unsigned char* buf, unsigned int len){
+    if (this->ring.empty() && !this->ring.allocate(FRAME_BUFFER_SIZE)){ return false; }
+    size_t capacity = this->ring.capacity();
+    if (len > capacity - this->size){ return false; }
+
+    size_t tail = (this->head + this->size) % capacity;
+    size_t first = (len < capacity - tail) ? len : capacity - tail;
+    memcpy(this->ring.data() + tail, buf, first);
+    memcpy(this->ring.data(), buf + first, len - first);
+    this->size += len;
+    return true;
+}
+
+void FrameReader::copyOut(size_t offset, unsigned char* buf, size_t len){
+    size_t capacity = this->ring.capacity();
+    size_t start = (this->head + offset) % capacity;
+    size_t first = (len < capacity - start) ? len : capacity - start;
+    memcpy(buf, this->ring.data() + start, first);
+    memcpy(buf + first, this->ring.data(), len - first);
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function extracts the next frame, if it has been      *|
+|* received completely.                                       *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+int FrameReader::next(unsigned char* buf, unsigned int buf_size, unsigned int &len){
+    if (this->size < FRAME_HEADER_SIZE){ return FRAME_PARTIAL; }
+
+    unsigned char header[FRAME_HEADER_SIZE];
+    copyOut(0, header, FRAME_HEADER_SIZE);
+    unsigned int frame_len = Framing::readHeader(header);
+    if (frame_len == 0 || frame_len > MAX_FRAME_SIZE || frame_len > buf_size){ return FRAME_INVALID; }
+    if (this->size < FRAME_HEADER_SIZE + frame_len){ return FRAME_PARTIAL; }
+
+    copyOut(FRAME_HEADER_SIZE, buf, frame_len);
+    this->head = (this->head + FRAME_HEADER_SIZE + frame_len) % this->ring.capacity();
+    this->size -= FRAME_HEADER_SIZE + frame_len;
+    if (this->size == 0){ this->head = 0; }
+    len = frame_len;
+    return FRAME_READY;
+}
+
+bool FrameReader::hasFrame(){
+    if (this->size < FRAME_HEADER_SIZE){ return false; }
+    unsigned char header[FRAME_HEADER_SIZE];
+    copyOut(0, header, FRAME_HEADER_SIZE);
+    unsigned int frame_len = Framing::readHeader(header);
+
+    //An invalid frame is reported by next() without waiting for more bytes
+    if (frame_len == 0 || frame_len > MAX_FRAME_SIZE){ return true; }
+    return this->size >= FRAME_HEADER_SIZE + frame_len;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function waits for the next frame on a blocking       *|
+|* socket.                                                    *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+int FrameReader::readFrame(int socket, unsigned char* buf, unsigned int buf_size){
+    while(1){
+        unsigned int len;
+        int status = next(buf, buf_size, len);
+        if (status == FRAME_READY){ return len; }
+        if (status == FRAME_INVALID){ return -1; }
+
+        ssize_t ret = fill(socket);
+        if (ret < 0 && errno == EINTR){ continue; }
+        if (ret < 0){ return -1; }
+        if (ret == 0){ return 0; }
+    }
+}
+
+void FrameReader::release(){
+    if (this->size == 0){
+        this->ring.release();
+        this->head = 0;
+    }
+}
@@ -0,0 +1,73 @@
+#include <sys/types.h>
+#include <vector>
+#include "Utility.h"
+#include "BufferPool.h"
+
+#ifndef CYBERSECURITYPROJECT_FRAMING_H
+#define CYBERSECURITYPROJECT_FRAMING_H
+
+using namespace std;
+
+//Result of FrameReader::next
+enum FrameStatus {
+    FRAME_READY,    //a frame has been extracted
+    FRAME_PARTIAL,  //more bytes are needed
+    FRAME_INVALID   //empty frame or frame over the size limit, the stream cannot be trusted anymore
+};
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Every message on the socket is a frame: a header with the  *|
+|* length of the payload followed by the payload.             *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class Framing {
+    public:
+        static void writeHeader(unsigned char* header, unsigned int len);
+
+        static unsigned int readHeader(const unsigned char* header);
+
+        //Send a whole frame on a blocking socket. Returns the length of the payload, -1 on error
+        static int sendFrame(int socket, const unsigned char* buf, unsigned int len);
+};
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Ring buffer that rebuilds the frames of a stream: one read *|
+|* can bring many frames, or only a part of one. The buffer   *|
+|* is taken from the pool at the first byte and can be given  *|
+|* back when it is empty, so idle connections do not keep it. *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class FrameReader {
+    private:
+        PooledBuffer ring;
+        size_t head;
+        size_t size;
+
+        //Copy bytes starting at offset from the head, across the end of the ring
+        void copyOut(size_t offset, unsigned char* buf, size_t len);
+
+    public:
+        FrameReader();
+
+        //Read once from the socket into all the free space. Returns the result of the read
+        ssize_t fill(int socket);
+
+        //Add bytes received in another way, false if they do not fit
+        bool append(const unsigned char* buf, unsigned int len);
+
+        //Extract the next frame, copying its payload in buf
+        int next(unsigned char* buf, unsigned int buf_size, unsigned int &len);
+
+        //Check if a whole frame is already buffered
+        bool hasFrame();
+
+        //Block until the next frame. Returns the length of the payload, 0 if the peer closed, -1 on error
+        int readFrame(int socket, unsigned char* buf, unsigned int buf_size);
+
+        //Give the memory back if nothing is buffered
+        void release();
+};
+
+#endif
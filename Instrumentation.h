@@ -0,0 +1,49 @@
+#include <atomic>
+#include <chrono>
+
+#ifndef CYBERSECURITYPROJECT_INSTRUMENTATION_H
+#define CYBERSECURITYPROJECT_INSTRUMENTATION_H
+
+using namespace std;
+
+//Clock of the logs, the traces and the statistics
+class Instrumentation {
+    public:
+        //Nanoseconds of the steady clock
+        static unsigned long long now(){
+            return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+        }
+};
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* List of objects of type T, one for each thread that uses   *|
+|* it. A thread allocates its object at its first use and     *|
+|* pushes it on the list without a lock; any thread can then  *|
+|* walk the list through the next field of T. The objects are *|
+|* never freed, so those of a thread that exits can still be  *|
+|* read.                                                      *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+template<typename T>
+class PerThread {
+    private:
+        static inline atomic<T*> head{NULL};
+        static inline thread_local T* local = NULL;
+
+    public:
+        //Object of the calling thread
+        static T* get(){
+            if (local){ return local; }
+            T* object = new T();
+            object->next = head.load();
+            while (!head.compare_exchange_weak(object->next, object));
+            local = object;
+            return object;
+        }
+
+        //Most recent object of the list, NULL if no thread used it yet
+        static T* first(){ return head.load(); }
+};
+
+#endif
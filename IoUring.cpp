@@ -0,0 +1,145 @@
+#include "IoUring.h"
+#include <cstring>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+IoUring::IoUring(){
+    this->ring_fd = -1;
+    this->sq_ring = MAP_FAILED;
+    this->cq_ring = MAP_FAILED;
+    this->sqes = (struct io_uring_sqe*)MAP_FAILED;
+    this->to_submit = 0;
+}
+
+/* ---------------------------------------------------------- *\
+|* Class Destructor                                           *|
+\* ---------------------------------------------------------- */
+IoUring::~IoUring(){
+    if (this->sqes != MAP_FAILED){ munmap(this->sqes, this->sqes_size); }
+    if (this->cq_ring != MAP_FAILED && this->cq_ring != this->sq_ring){ munmap(this->cq_ring, this->cq_ring_size); }
+    if (this->sq_ring != MAP_FAILED){ munmap(this->sq_ring, this->sq_ring_size); }
+    if (this->ring_fd >= 0){ close(this->ring_fd); }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function creates the ring and maps its queues.        *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool IoUring::setup(unsigned int entries, unsigned int cq_entries){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+
+    this->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (this->ring_fd < 0){ return false; }
+
+    this->sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+    this->cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP){
+        if (this->cq_ring_size > this->sq_ring_size){ this->sq_ring_size = this->cq_ring_size; }
+        this->cq_ring_size = this->sq_ring_size;
+    }
+
+    this->sq_ring = mmap(NULL, this->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ring_fd, IORING_OFF_SQ_RING);
+    if (this->sq_ring == MAP_FAILED){ return false; }
+    if (params.features & IORING_FEAT_SINGLE_MMAP){
+        this->cq_ring = this->sq_ring;
+    }
+    else {
+        this->cq_ring = mmap(NULL, this->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ring_fd, IORING_OFF_CQ_RING);
+        if (this->cq_ring == MAP_FAILED){ return false; }
+    }
+
+    this->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+    this->sqes = (struct io_uring_sqe*)mmap(NULL, this->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ring_fd, IORING_OFF_SQES);
+    if (this->sqes == MAP_FAILED){ return false; }
+
+    unsigned char* sq = (unsigned char*)this->sq_ring;
+    this->sq_head = (unsigned int*)(sq + params.sq_off.head);
+    this->sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+    this->sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+    this->sq_array = (unsigned int*)(sq + params.sq_off.array);
+    this->sq_entries = params.sq_entries;
+
+    unsigned char* cq = (unsigned char*)this->cq_ring;
+    this->cq_head = (unsigned int*)(cq + params.cq_off.head);
+    this->cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+    this->cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+    this->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function returns the next submission entry.           *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+struct io_uring_sqe* IoUring::getSqe(){
+    unsigned int tail = *this->sq_tail;
+    unsigned int head = __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= this->sq_entries){
+        submitAndWait(0);
+        tail = *this->sq_tail;
+        head = __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= this->sq_entries){ return NULL; }
+    }
+
+    unsigned int index = tail & *this->sq_mask;
+    struct io_uring_sqe* sqe = &this->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    this->sq_array[index] = index;
+    __atomic_store_n(this->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    this->to_submit++;
+    return sqe;
+}
+
+int IoUring::submitAndWait(unsigned int wait_nr){
+    unsigned int flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+    while(1){
+        int ret = syscall(__NR_io_uring_enter, this->ring_fd, this->to_submit, wait_nr, flags, NULL, 0);
+        if (ret < 0 && errno == EINTR){ continue; }
+        if (ret >= 0){ this->to_submit -= ((unsigned int)ret < this->to_submit) ? ret : this->to_submit; }
+        return ret;
+    }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* These functions read the completion queue.                 *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+struct io_uring_cqe* IoUring::peekCqe(){
+    unsigned int head = *this->cq_head;
+    if (head == __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE)){ return NULL; }
+    return &this->cqes[head & *this->cq_mask];
+}
+
+void IoUring::cqeSeen(){
+    __atomic_store_n(this->cq_head, *this->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* These functions register files and buffers in the ring, so *|
+|* that the kernel does not look them up at every request.    *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool IoUring::registerFiles(const int* fds, unsigned int count){
+    return syscall(__NR_io_uring_register, this->ring_fd, IORING_REGISTER_FILES, fds, count) == 0;
+}
+
+bool IoUring::updateFile(unsigned int slot, int fd){
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.fds = (unsigned long)&fd;
+    return syscall(__NR_io_uring_register, this->ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+}
+
+bool IoUring::registerBuffers(const struct iovec* iovecs, unsigned int count){
+    return syscall(__NR_io_uring_register, this->ring_fd, IORING_REGISTER_BUFFERS, iovecs, count) == 0;
+}
@@ -0,0 +1,76 @@
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+//linux/fs.h, included by linux/io_uring.h, defines BLOCK_SIZE as 1024, that would hide the one in constants.h
+#undef BLOCK_SIZE
+
+#ifndef CYBERSECURITYPROJECT_IOURING_H
+#define CYBERSECURITYPROJECT_IOURING_H
+
+using namespace std;
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Minimal io_uring instance, driven with the raw system      *|
+|* calls. It is used by a single thread: the submission       *|
+|* entries are filled by that thread and given to the kernel  *|
+|* in one io_uring_enter, which also waits for completions.   *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class IoUring {
+    private:
+        int ring_fd;
+
+        //Submission queue
+        void* sq_ring;
+        size_t sq_ring_size;
+        unsigned int* sq_head;
+        unsigned int* sq_tail;
+        unsigned int* sq_mask;
+        unsigned int* sq_array;
+        struct io_uring_sqe* sqes;
+        size_t sqes_size;
+        unsigned int sq_entries;
+
+        //Entries filled but not yet given to the kernel
+        unsigned int to_submit;
+
+        //Completion queue
+        void* cq_ring;
+        size_t cq_ring_size;
+        unsigned int* cq_head;
+        unsigned int* cq_tail;
+        unsigned int* cq_mask;
+        struct io_uring_cqe* cqes;
+
+    public:
+        IoUring();
+
+        ~IoUring();
+
+        //Create the ring, returns false if io_uring is not available
+        bool setup(unsigned int entries, unsigned int cq_entries);
+
+        //Next free submission entry, already zeroed. The pending ones are submitted if the queue is full
+        struct io_uring_sqe* getSqe();
+
+        //Submit the pending entries and wait for at least wait_nr completions
+        int submitAndWait(unsigned int wait_nr);
+
+        //Oldest completion not yet seen, NULL if none
+        struct io_uring_cqe* peekCqe();
+
+        //Release the completion returned by peekCqe
+        void cqeSeen();
+
+        //Register a table of files, -1 for the free slots
+        bool registerFiles(const int* fds, unsigned int count);
+
+        //Change the file in a slot of the table (-1 to free it)
+        bool updateFile(unsigned int slot, int fd);
+
+        //Register buffers used by the fixed reads and writes
+        bool registerBuffers(const struct iovec* iovecs, unsigned int count);
+};
+
+#endif
@@ -0,0 +1,105 @@
+#include "KeyPool.h"
+#include "Utility.h"
+#include "Tracer.h"
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <unistd.h>
+
+KeySuitePool* KeyPool::pools[KEY_SUITES] = { NULL, NULL };
+
+KeyPoolStats KeyPool::stats[KEY_SUITES];
+
+EVP_PKEY* KeyPool::generate(unsigned char suite){
+    TraceSpan keygen_span((suite == SUITE_X25519) ? "keygen x25519" : "keygen rsa", 0, "", "");
+    return (suite == SUITE_X25519) ? Utility::generateTshareK() : Utility::generateTprivK();
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function starts the background thread of a suite.     *|
+|* It is called once per suite, before the first pop.         *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void KeyPool::start(unsigned char suite, unsigned int capacity){
+    if (suite >= KEY_SUITES || pools[suite] || capacity == 0){ return; }
+    pools[suite] = new KeySuitePool();
+    pools[suite]->capacity = capacity;
+    thread(&KeyPool::refill, suite).detach();
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function is the background thread of a suite: it      *|
+|* generates key pairs while the pool is not full, then waits *|
+|* for a pop. The key pair is generated without the lock.     *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void KeyPool::refill(unsigned char suite){
+    KeySuitePool* pool = pools[suite];
+    while (true){
+        {
+            unique_lock<mutex> lock(pool->keys_mutex);
+            pool->refill.wait(lock, [pool](){ return pool->keys.size() < pool->capacity; });
+        }
+
+        auto start = chrono::steady_clock::now();
+        EVP_PKEY* key = generate(suite);
+        stats[suite].generate_ns += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        stats[suite].generated++;
+
+        lock_guard<mutex> lock(pool->keys_mutex);
+        pool->keys.push_back(key);
+        stats[suite].depth = pool->keys.size();
+    }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function takes the oldest ready key pair of a suite   *|
+|* and wakes up the background thread to replace it.          *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+EVP_PKEY* KeyPool::pop(unsigned char suite){
+    if (suite >= KEY_SUITES){ return NULL; }
+    KeySuitePool* pool = pools[suite];
+    if (pool){
+        EVP_PKEY* key = NULL;
+        {
+            lock_guard<mutex> lock(pool->keys_mutex);
+            if (!pool->keys.empty()){
+                key = pool->keys.front();
+                pool->keys.pop_front();
+                stats[suite].depth = pool->keys.size();
+            }
+        }
+        pool->refill.notify_one();
+        if (key){
+            stats[suite].hits++;
+            return key;
+        }
+    }
+    stats[suite].cold_misses++;
+    return generate(suite);
+}
+
+string KeyPool::suiteName(unsigned char suite){
+    switch(suite){
+        case SUITE_RSA: return "rsa";
+        case SUITE_X25519: return "x25519";
+        default: return "unknown";
+    }
+}
+
+void KeyPool::printPoolStats(){
+    cout<<"Thread "<<gettid()<<": Key pool statistics"<<endl;
+    for (unsigned int i = 0; i < KEY_SUITES; i++){
+        if (!pools[i]){ continue; }
+        unsigned long long generated = stats[i].generated.load();
+        unsigned long long generate_ns = stats[i].generate_ns.load();
+        double rate = (generate_ns > 0) ? generated*1e9/generate_ns : 0;
+        cout<<"     "<<suiteName(i)<<": depth "<<stats[i].depth.load()<<"/"<<pools[i]->capacity<<", "<<stats[i].hits.load()<<" hits, "<<stats[i].cold_misses.load()<<" cold misses, "
+            <<generated<<" generated, refill rate "<<fixed<<setprecision(1)<<rate<<" key pairs/s"<<endl;
+    }
+}
@@ -0,0 +1,67 @@
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <openssl/evp.h>
+#include "constants.h"
+
+#ifndef CYBERSECURITYPROJECT_KEYPOOL_H
+#define CYBERSECURITYPROJECT_KEYPOOL_H
+
+using namespace std;
+
+//Use of the pool of a suite
+struct KeyPoolStats {
+    atomic<unsigned long long> hits;            //key pairs taken ready from the pool
+    atomic<unsigned long long> cold_misses;     //key pairs generated by the caller because the pool was empty
+    atomic<unsigned long long> generated;       //key pairs generated by the background thread
+    atomic<unsigned long long> generate_ns;     //time spent by the background thread generating them
+    atomic<unsigned int> depth;                 //key pairs ready now
+};
+
+//Ready key pairs of a suite and their generator
+struct KeySuitePool {
+    unsigned int capacity;
+    deque<EVP_PKEY*> keys;
+    mutex keys_mutex;
+    condition_variable refill;
+};
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Ephemeral key pairs generated in advance by a background   *|
+|* thread, one pool per key exchange suite. Each key pair is  *|
+|* given out once: login and chat setup take one without      *|
+|* waiting and the thread generates its replacement. If the   *|
+|* pool is empty, or not started, the caller generates the    *|
+|* key pair itself (cold miss).                               *|
+|* The pools are never freed, so that a thread still working  *|
+|* at the exit of the process does not use freed memory.      *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class KeyPool {
+    private:
+        static KeySuitePool* pools[KEY_SUITES];
+
+        static KeyPoolStats stats[KEY_SUITES];
+
+        //Generate a key pair of a suite on the calling thread
+        static EVP_PKEY* generate(unsigned char suite);
+
+        //Body of the background thread of a suite
+        static void refill(unsigned char suite);
+
+    public:
+        //Start the background thread of a suite, keeping up to capacity key pairs ready
+        static void start(unsigned char suite, unsigned int capacity);
+
+        //Take a fresh key pair of a suite, owned by the caller; NULL for an unknown suite
+        static EVP_PKEY* pop(unsigned char suite);
+
+        static string suiteName(unsigned char suite);
+
+        static void printPoolStats();
+};
+
+#endif
@@ -0,0 +1,131 @@
+#include "LatencyStats.h"
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <signal.h>
+#include <thread>
+#include <unistd.h>
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function maps a latency to its bucket: the values     *|
+|* below LATENCY_SUB_BUCKETS have their own bucket, the       *|
+|* others are split by their highest bit and the next         *|
+|* LATENCY_SUB_BITS bits.                                     *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+unsigned int LatencyStats::bucket(unsigned long long ns){
+    if (ns < LATENCY_SUB_BUCKETS){ return ns; }
+    unsigned int exponent = 63 - __builtin_clzll(ns);
+    unsigned int sub = (ns >> (exponent - LATENCY_SUB_BITS)) - LATENCY_SUB_BUCKETS;
+    return (exponent - LATENCY_SUB_BITS + 1)*LATENCY_SUB_BUCKETS + sub;
+}
+
+unsigned long long LatencyStats::bucketLimit(unsigned int bucket){
+    if (bucket < LATENCY_SUB_BUCKETS){ return bucket; }
+    unsigned int shift = bucket/LATENCY_SUB_BUCKETS - 1;
+    unsigned long long sub = bucket%LATENCY_SUB_BUCKETS;
+    return ((LATENCY_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function records a latency in the histogram of the    *|
+|* thread. The thread is the only writer: a load and a store  *|
+|* are enough, without a locked instruction.                  *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void LatencyStats::record(int phase, unsigned long long since){
+    unsigned long long elapsed = Instrumentation::now() - since;
+    LatencyHistogram &histogram = PerThread<ThreadHistograms>::get()->phases[phase];
+    atomic<unsigned long long> &count = histogram.counts[bucket(elapsed)];
+    count.store(count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    histogram.total_ns.store(histogram.total_ns.load(memory_order_relaxed) + elapsed, memory_order_relaxed);
+    if (elapsed > histogram.max_ns.load(memory_order_relaxed)){ histogram.max_ns.store(elapsed, memory_order_relaxed); }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function merges the histograms of a phase of all the  *|
+|* threads. The records done meanwhile may be counted or not. *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void LatencyStats::snapshot(int phase, LatencySnapshot &merged){
+    memset(&merged, 0, sizeof(merged));
+    for (ThreadHistograms* histograms = PerThread<ThreadHistograms>::first(); histograms != NULL; histograms = histograms->next){
+        LatencyHistogram &histogram = histograms->phases[phase];
+        for (unsigned int i = 0; i < LATENCY_BUCKETS; i++){
+            unsigned long long count = histogram.counts[i].load(memory_order_relaxed);
+            merged.counts[i] += count;
+            merged.count += count;
+        }
+        merged.total_ns += histogram.total_ns.load(memory_order_relaxed);
+        merged.max_ns = max(merged.max_ns, histogram.max_ns.load(memory_order_relaxed));
+    }
+}
+
+unsigned long long LatencyStats::quantile(const LatencySnapshot &merged, double fraction){
+    if (merged.count == 0){ return 0; }
+    unsigned long long rank = (unsigned long long)(fraction*merged.count);
+    if (rank >= merged.count){ rank = merged.count - 1; }
+    unsigned long long seen = 0;
+    for (unsigned int i = 0; i < LATENCY_BUCKETS; i++){
+        seen += merged.counts[i];
+        if (seen > rank){ return min(bucketLimit(i), merged.max_ns); }
+    }
+    return merged.max_ns;
+}
+
+string LatencyStats::phaseName(int phase){
+    switch(phase){
+        case LATENCY_S1: return "S1";
+        case LATENCY_S2_VERIFY: return "S2_VERIFY";
+        case LATENCY_S3: return "S3";
+        case LATENCY_USER_LIST: return "USER_LIST";
+        case LATENCY_RTT_FORWARD: return "RTT_FORWARD";
+        case LATENCY_RESPONSE_WAIT: return "RESPONSE_WAIT";
+        case LATENCY_M1_RELAY: return "M1_RELAY";
+        case LATENCY_M2_RELAY: return "M2_RELAY";
+        case LATENCY_M3_RELAY: return "M3_RELAY";
+        case LATENCY_MESSAGE_RELAY: return "MESSAGE_RELAY";
+        default: return "UNKNOWN";
+    }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function prints the count, the mean, the quantiles    *|
+|* and the maximum of each phase, in microseconds.            *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void LatencyStats::printLatencyStats(){
+    const double fractions[] = { 0.5, 0.9, 0.99, 0.999 };
+    const char* labels[] = { "p50", "p90", "p99", "p99.9" };
+    LatencySnapshot* merged = new LatencySnapshot;
+    cout<<"Thread "<<gettid()<<": Latency statistics"<<endl;
+    for (int i = 0; i < LATENCY_PHASES; i++){
+        snapshot(i, *merged);
+        if (merged->count == 0){ continue; }
+        cout<<"     "<<phaseName(i)<<": "<<merged->count<<" times, mean "<<fixed<<setprecision(1)<<merged->total_ns/1000.0/merged->count<<" us";
+        for (unsigned int j = 0; j < 4; j++){
+            cout<<", "<<labels[j]<<" "<<quantile(*merged, fractions[j])/1000.0<<" us";
+        }
+        cout<<", max "<<merged->max_ns/1000.0<<" us"<<endl;
+    }
+    delete merged;
+}
+
+void LatencyStats::dumpLoop(int signum){
+    sigset_t dump_set;
+    sigemptyset(&dump_set);
+    sigaddset(&dump_set, signum);
+    while (true){
+        int received;
+        if (sigwait(&dump_set, &received) != 0){ continue; }
+        printLatencyStats();
+    }
+}
+
+void LatencyStats::start(int signum){
+    thread(&LatencyStats::dumpLoop, signum).detach();
+}
@@ -0,0 +1,85 @@
+#include <atomic>
+#include <string>
+#include <openssl/evp.h>
+#include "constants.h"
+#include "Instrumentation.h"
+
+#ifndef CYBERSECURITYPROJECT_LATENCYSTATS_H
+#define CYBERSECURITYPROJECT_LATENCYSTATS_H
+
+using namespace std;
+
+//Steps of the protocol whose latency is recorded by the server
+enum LatencyPhase {
+    LATENCY_S1,             //certificate sent to a new connection
+    LATENCY_S2_VERIFY,      //S2 parsed and its signature verified
+    LATENCY_S3,             //K sealed (RSA) or derived (X25519), S3 signed and sent
+    LATENCY_USER_LIST,      //list of the available users built and sent
+    LATENCY_RTT_FORWARD,    //RTT decrypted, receiver reserved and RTT forwarded
+    LATENCY_RESPONSE_WAIT,  //sender suspended until the response of the receiver
+    LATENCY_M1_RELAY,       //M1, M2 and M3 decrypted and forwarded to the peer
+    LATENCY_M2_RELAY,
+    LATENCY_M3_RELAY,
+    LATENCY_MESSAGE_RELAY,  //chat message decrypted and forwarded to the peer
+    LATENCY_PHASES
+};
+
+//Histogram of a phase recorded by one thread. Only that thread writes it, the others read it
+struct LatencyHistogram {
+    atomic<unsigned long long> counts[LATENCY_BUCKETS];
+    atomic<unsigned long long> total_ns;
+    atomic<unsigned long long> max_ns;
+};
+
+//Histogram of a phase merged over all the threads
+struct LatencySnapshot {
+    unsigned long long counts[LATENCY_BUCKETS];
+    unsigned long long count;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+};
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Latency of the steps of the protocol, in log-linear        *|
+|* buckets as in HDR histograms. Every thread records in its  *|
+|* own histograms: a record is a plain store of the owner,    *|
+|* and the histograms of all the threads are merged only when *|
+|* they are read.                                             *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class LatencyStats {
+    private:
+        //Histograms of a thread, one for each phase
+        struct ThreadHistograms {
+            LatencyHistogram phases[LATENCY_PHASES];
+            ThreadHistograms* next;
+        };
+
+        //Print the histograms every time the signal is received
+        static void dumpLoop(int signum);
+
+    public:
+        //Record the time elapsed since a value of Instrumentation::now()
+        static void record(int phase, unsigned long long since);
+
+        static unsigned int bucket(unsigned long long ns);
+
+        //Highest value counted in a bucket
+        static unsigned long long bucketLimit(unsigned int bucket);
+
+        //Merge the histograms of a phase of all the threads
+        static void snapshot(int phase, LatencySnapshot &merged);
+
+        //Value under which there is the given fraction of the records, within the width of its bucket
+        static unsigned long long quantile(const LatencySnapshot &merged, double fraction);
+
+        static string phaseName(int phase);
+
+        static void printLatencyStats();
+
+        //Start the thread printing the histograms on a signal, that must be blocked in all the threads
+        static void start(int signum);
+};
+
+#endif
@@ -0,0 +1,142 @@
+#include "Logger.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+mutex Logger::drain_mutex;
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function copies an entry after the tail of the ring   *|
+|* of the thread, wrapping around its end, and publishes it   *|
+|* by moving the tail.                                        *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool Logger::push(const unsigned char* entry, unsigned int size){
+    Ring* ring = PerThread<Ring>::get();
+    unsigned long long tail = ring->tail.load(memory_order_relaxed);
+    if (tail + size - ring->head.load(memory_order_acquire) > LOG_RING_SIZE){
+        ring->dropped.store(ring->dropped.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        return false;
+    }
+    unsigned int offset = tail & (LOG_RING_SIZE - 1);
+    unsigned int first = min(size, LOG_RING_SIZE - offset);
+    memcpy(ring->data + offset, entry, first);
+    memcpy(ring->data, entry + first, size - first);
+    ring->tail.store(tail + size, memory_order_release);
+    return true;
+}
+
+//Copy out of a ring the bytes at a position, wrapping around its end
+static void copyOut(const Logger::Ring* ring, unsigned long long position, unsigned char* buf, unsigned int size){
+    unsigned int offset = position & (LOG_RING_SIZE - 1);
+    unsigned int first = min(size, LOG_RING_SIZE - offset);
+    memcpy(buf, ring->data + offset, first);
+    memcpy(buf + first, ring->data, size - first);
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function formats the entries published in the rings,  *|
+|* taking each time the oldest one among the heads, and       *|
+|* writes them with one system call for each run of entries   *|
+|* going to the same stream. Called with drain_mutex held.    *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool Logger::drain(){
+    vector<Ring*> all;
+    vector<unsigned long long> tails;
+    for (Ring* ring = PerThread<Ring>::first(); ring != NULL; ring = ring->next){
+        all.push_back(ring);
+        tails.push_back(ring->tail.load(memory_order_acquire));
+    }
+
+    unsigned char entry[LOG_ENTRY_MAX_SIZE];
+    ostringstream out;
+    int out_fd = STDOUT_FILENO;
+    bool drained = false;
+    while (true){
+        int oldest = -1;
+        LogEntryHeader oldest_header{};
+        for (unsigned int i = 0; i < all.size(); i++){
+            unsigned long long head = all[i]->head.load(memory_order_relaxed);
+            if (head == tails[i]){ continue; }
+            LogEntryHeader header;
+            copyOut(all[i], head, (unsigned char*)&header, sizeof(LogEntryHeader));
+            if (oldest < 0 || header.time_ns < oldest_header.time_ns){
+                oldest = i;
+                oldest_header = header;
+            }
+        }
+        if (oldest < 0){ break; }
+        drained = true;
+
+        /* ---------------------------------------------------------- *\
+        |* Write what is pending before changing stream               *|
+        \* ---------------------------------------------------------- */
+        int fd = (oldest_header.level >= LOG_LEVEL_WARN) ? STDERR_FILENO : STDOUT_FILENO;
+        if (fd != out_fd){
+            string pending = out.str();
+            if (!pending.empty() && ::write(out_fd, pending.data(), pending.size()) < 0){}
+            out.str("");
+            out_fd = fd;
+        }
+
+        Ring* ring = all[oldest];
+        unsigned long long head = ring->head.load(memory_order_relaxed);
+        copyOut(ring, head, entry, oldest_header.size);
+        out<<"Thread "<<oldest_header.tid<<": ";
+        oldest_header.format(entry + sizeof(LogEntryHeader), out);
+        out<<"\n";
+        ring->head.store(head + oldest_header.size, memory_order_release);
+    }
+    string pending = out.str();
+    if (!pending.empty() && ::write(out_fd, pending.data(), pending.size()) < 0){}
+    return drained;
+}
+
+void Logger::writeLoop(){
+    while (true){
+        bool drained;
+        {
+            lock_guard<mutex> lck(drain_mutex);
+            drained = drain();
+        }
+        if (!drained){ this_thread::sleep_for(chrono::milliseconds(1)); }
+    }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function starts the writer thread. The entries left   *|
+|* in the rings are written at the exit of the process too.   *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void Logger::start(){
+    atexit(&Logger::flush);
+    thread(&Logger::writeLoop).detach();
+}
+
+//Write the entries in the rings at once, after the batch of the writer if it is draining
+void Logger::flush(){
+    lock_guard<mutex> lck(drain_mutex);
+    drain();
+}
+
+unsigned long long Logger::dropped(){
+    unsigned long long total = 0;
+    for (Ring* ring = PerThread<Ring>::first(); ring != NULL; ring = ring->next){
+        total += ring->dropped.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+void Logger::printLoggerStats(){
+    unsigned int count = 0;
+    for (Ring* ring = PerThread<Ring>::first(); ring != NULL; ring = ring->next){ count++; }
+    cout<<"Thread "<<gettid()<<": Logger statistics"<<endl;
+    cout<<"     "<<count<<" rings, "<<dropped()<<" entries dropped"<<endl;
+}
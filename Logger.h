@@ -0,0 +1,174 @@
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include "constants.h"
+#include "Instrumentation.h"
+
+#ifndef CYBERSECURITYPROJECT_LOGGER_H
+#define CYBERSECURITYPROJECT_LOGGER_H
+
+using namespace std;
+
+//Levels of the log; an entry below LOGGER_LEVEL is not compiled at all
+enum LogLevel {
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO = 1,     //steps of the protocol, on stdout
+    LOG_LEVEL_WARN = 2,     //from here on stderr
+    LOG_LEVEL_ERROR = 3
+};
+
+//Lowest level compiled, e.g. -DLOGGER_LEVEL=2 keeps only the warnings and the errors
+#ifndef LOGGER_LEVEL
+#define LOGGER_LEVEL 1
+#endif
+
+//Arguments copied in an entry as they are and printed by the writer
+template<typename T>
+struct LogCodec {
+    static_assert(is_arithmetic<T>::value || is_enum<T>::value, "Argument of the log not supported");
+
+    static unsigned int size(const T &){ return sizeof(T); }
+
+    static void encode(unsigned char* &p, const T &value){ memcpy(p, &value, sizeof(T)); p += sizeof(T); }
+
+    static void decode(const unsigned char* &p, ostream &out){ T value; memcpy(&value, p, sizeof(T)); p += sizeof(T); out<<value; }
+};
+
+//Strings copied with their length
+struct LogStringCodec {
+    static unsigned int size(const char*, unsigned int len){ return sizeof(unsigned int) + len; }
+
+    static void encode(unsigned char* &p, const char* value, unsigned int len){ memcpy(p, &len, sizeof(unsigned int)); memcpy(p + sizeof(unsigned int), value, len); p += sizeof(unsigned int) + len; }
+
+    static void decode(const unsigned char* &p, ostream &out){ unsigned int len; memcpy(&len, p, sizeof(unsigned int)); out.write((const char*)p + sizeof(unsigned int), len); p += sizeof(unsigned int) + len; }
+};
+
+template<>
+struct LogCodec<string> {
+    static unsigned int size(const string &value){ return LogStringCodec::size(value.data(), value.size()); }
+
+    static void encode(unsigned char* &p, const string &value){ LogStringCodec::encode(p, value.data(), value.size()); }
+
+    static void decode(const unsigned char* &p, ostream &out){ LogStringCodec::decode(p, out); }
+};
+
+template<>
+struct LogCodec<const char*> {
+    static unsigned int size(const char* value){ return LogStringCodec::size(value, value ? strlen(value) : 0); }
+
+    static void encode(unsigned char* &p, const char* value){ LogStringCodec::encode(p, value, value ? strlen(value) : 0); }
+
+    static void decode(const unsigned char* &p, ostream &out){ LogStringCodec::decode(p, out); }
+};
+
+template<>
+struct LogCodec<char*> : LogCodec<const char*> {};
+
+//Header of an entry in a ring, followed by the arguments
+struct LogEntryHeader {
+    unsigned int size;      //header and arguments
+    unsigned int level;
+    pid_t tid;
+    unsigned long long time_ns;
+    void (*format)(const unsigned char* args, ostream &out);
+};
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Asynchronous log of the server. A thread copies the        *|
+|* arguments of an entry, without formatting them, in a ring  *|
+|* of its own: it is the only producer of the ring and the    *|
+|* writer thread the only consumer, so neither takes a lock.  *|
+|* The writer formats the entries in order of time and writes *|
+|* them in batches, each line as "Thread <tid>: <arguments>". *|
+|* If the ring of a thread is full the entry is dropped and   *|
+|* counted.                                                   *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class Logger {
+    public:
+        //Ring of a thread; head is moved by the writer, tail and dropped by the thread
+        struct Ring {
+            unsigned char data[LOG_RING_SIZE];
+            atomic<unsigned long long> head;
+            atomic<unsigned long long> tail;
+            atomic<unsigned long long> dropped;
+            Ring* next;
+        };
+
+    private:
+        //Held by whoever drains the rings: the writer thread or a flush
+        static mutex drain_mutex;
+
+        //Copy an entry in the ring of the thread, false if it does not fit
+        static bool push(const unsigned char* entry, unsigned int size);
+
+        //Format and write the entries in the rings, false if there were none
+        static bool drain();
+
+        static void writeLoop();
+
+        template<typename... Args>
+        static void format(const unsigned char* args, ostream &out){
+            (LogCodec<decay_t<Args>>::decode(args, out), ...);
+        }
+
+        template<typename... Args>
+        static void write(unsigned int level, const Args&... args){
+            unsigned int size = sizeof(LogEntryHeader) + (0 + ... + LogCodec<decay_t<Args>>::size(args));
+            if (size > LOG_ENTRY_MAX_SIZE){
+                PerThread<Ring>::get()->dropped.fetch_add(1, memory_order_relaxed);
+                return;
+            }
+            unsigned char entry[LOG_ENTRY_MAX_SIZE];
+            LogEntryHeader header;
+            header.size = size;
+            header.level = level;
+            header.tid = gettid();
+            header.time_ns = Instrumentation::now();
+            header.format = &format<Args...>;
+            memcpy(entry, &header, sizeof(LogEntryHeader));
+            unsigned char* p = entry + sizeof(LogEntryHeader);
+            (LogCodec<decay_t<Args>>::encode(p, args), ...);
+            push(entry, size);
+        }
+
+    public:
+        //Start the writer thread; the entries logged before are kept in the rings
+        static void start();
+
+        //Write the entries still in the rings, e.g. before an exit
+        static void flush();
+
+        //Entries dropped because a ring was full
+        static unsigned long long dropped();
+
+        static void printLoggerStats();
+
+        template<typename... Args>
+        static void debug(const Args&... args){
+            if constexpr (LOG_LEVEL_DEBUG >= LOGGER_LEVEL){ write(LOG_LEVEL_DEBUG, args...); }
+        }
+
+        template<typename... Args>
+        static void info(const Args&... args){
+            if constexpr (LOG_LEVEL_INFO >= LOGGER_LEVEL){ write(LOG_LEVEL_INFO, args...); }
+        }
+
+        template<typename... Args>
+        static void warn(const Args&... args){
+            if constexpr (LOG_LEVEL_WARN >= LOGGER_LEVEL){ write(LOG_LEVEL_WARN, args...); }
+        }
+
+        template<typename... Args>
+        static void error(const Args&... args){
+            if constexpr (LOG_LEVEL_ERROR >= LOGGER_LEVEL){ write(LOG_LEVEL_ERROR, args...); }
+        }
+};
+
+#endif
@@ -0,0 +1,178 @@
+#include "ProtocolStateMachine.h"
+#include "Connection.h"
+#include "Logger.h"
+#include "Instrumentation.h"
+#include <iostream>
+#include <unistd.h>
+
+/* ---------------------------------------------------------- *\
+|* Transitions of the protocol. The messages received from    *|
+|* the client are accepted only if they have a row here.      *|
+\* ---------------------------------------------------------- */
+const ProtocolTransition ProtocolStateMachine::transitions[] = {
+    //Authentication
+    {PHASE_S2,           MSG_AUTH_SENDER,       FROM_CLIENT, PHASE_LOBBY},
+    {PHASE_S2,           MSG_AUTH_RECEIVER,     FROM_CLIENT, PHASE_IDLE},
+    {PHASE_S2,           MSG_RESUME,            FROM_CLIENT, PHASE_LOBBY},
+    {PHASE_S2,           MSG_RESUME,            FROM_CLIENT, PHASE_IDLE},
+
+    //Sender in the lobby
+    {PHASE_LOBBY,        MSG_REFRESH,           FROM_CLIENT, PHASE_LOBBY},
+    {PHASE_LOBBY,        MSG_LOGOUT,            FROM_CLIENT, PHASE_CLOSED},
+    {PHASE_LOBBY,        MSG_RTT,               FROM_CLIENT, PHASE_RTT_PENDING},
+    {PHASE_LOBBY,        MSG_RTT,               FROM_CLIENT, PHASE_ACK},
+    {PHASE_ACK,          MSG_ACK,               FROM_CLIENT, PHASE_LOBBY},
+    {PHASE_ACK,          MSG_LOGOUT,            FROM_CLIENT, PHASE_CLOSED},
+    {PHASE_RTT_PENDING,  MSG_RESPONSE,          FROM_PEER,   PHASE_M1},
+    {PHASE_RTT_PENDING,  MSG_RESPONSE,          FROM_PEER,   PHASE_LOBBY},
+
+    //Receiver
+    {PHASE_IDLE,         MSG_LOGOUT,            FROM_CLIENT, PHASE_CLOSED},
+    {PHASE_IDLE,         MSG_RTT,               FROM_PEER,   PHASE_RTT_RECEIVED},
+    {PHASE_RTT_RECEIVED, MSG_RESPONSE,          FROM_CLIENT, PHASE_PEER_WAIT},
+    {PHASE_RTT_RECEIVED, MSG_RESPONSE,          FROM_CLIENT, PHASE_IDLE},
+    {PHASE_RTT_RECEIVED, MSG_LOGOUT,            FROM_CLIENT, PHASE_CLOSED},
+
+    //Key establishment between the two users
+    {PHASE_M1,           MSG_KEY_ESTABLISHMENT, FROM_CLIENT, PHASE_PEER_WAIT},
+    {PHASE_M2,           MSG_KEY_ESTABLISHMENT, FROM_CLIENT, PHASE_PEER_WAIT},
+    {PHASE_M3,           MSG_KEY_ESTABLISHMENT, FROM_CLIENT, PHASE_CHAT},
+    {PHASE_PEER_WAIT,    MSG_KEY_ESTABLISHMENT, FROM_PEER,   PHASE_M2},
+    {PHASE_PEER_WAIT,    MSG_KEY_ESTABLISHMENT, FROM_PEER,   PHASE_M3},
+    {PHASE_PEER_WAIT,    MSG_KEY_ESTABLISHMENT, FROM_PEER,   PHASE_CHAT},
+
+    //Chat
+    {PHASE_CHAT,         MSG_RELAYED,           FROM_CLIENT, PHASE_CHAT},
+    {PHASE_CHAT,         MSG_RETURN_TO_LOBBY,   FROM_CLIENT, PHASE_LOBBY},
+    {PHASE_CHAT,         MSG_RETURN_TO_LOBBY,   FROM_CLIENT, PHASE_IDLE},
+
+    //The peer returned to the lobby or left
+    {PHASE_CHAT,         MSG_RETURN_TO_LOBBY,   FROM_PEER,   PHASE_LOBBY},
+    {PHASE_CHAT,         MSG_RETURN_TO_LOBBY,   FROM_PEER,   PHASE_IDLE},
+    {PHASE_M1,           MSG_RETURN_TO_LOBBY,   FROM_PEER,   PHASE_LOBBY},
+    {PHASE_M2,           MSG_RETURN_TO_LOBBY,   FROM_PEER,   PHASE_IDLE},
+    {PHASE_M3,           MSG_RETURN_TO_LOBBY,   FROM_PEER,   PHASE_LOBBY},
+    {PHASE_PEER_WAIT,    MSG_RETURN_TO_LOBBY,   FROM_PEER,   PHASE_LOBBY},
+    {PHASE_PEER_WAIT,    MSG_RETURN_TO_LOBBY,   FROM_PEER,   PHASE_IDLE},
+};
+
+const unsigned int ProtocolStateMachine::transitions_size = sizeof(ProtocolStateMachine::transitions)/sizeof(ProtocolTransition);
+
+PhaseStats ProtocolStateMachine::stats[PHASE_COUNT];
+atomic<long long> ProtocolStateMachine::current[PHASE_COUNT];
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function returns the type of a decrypted message. In  *|
+|* the chat the payload is encrypted with the key of the two  *|
+|* users, so only the return to lobby can be recognized.      *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+unsigned int ProtocolStateMachine::messageType(int phase, const unsigned char* buf, unsigned int len){
+    if (len == 0){ return MSG_RELAYED; }
+    if (phase == PHASE_CHAT){
+        if (len == 1 && buf[0] == MSG_RETURN_TO_LOBBY){ return MSG_RETURN_TO_LOBBY; }
+        return MSG_RELAYED;
+    }
+    return buf[0];
+}
+
+bool ProtocolStateMachine::accepts(int phase, unsigned int message_type){
+    for (unsigned int i = 0; i < transitions_size; i++){
+        if (transitions[i].from == phase && transitions[i].message_type == message_type && transitions[i].source == FROM_CLIENT){
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ProtocolStateMachine::allowed(int from, int to){
+    if (from == PHASE_CLOSED){ return false; }
+    if (to == PHASE_CLOSED){ return true; }
+    for (unsigned int i = 0; i < transitions_size; i++){
+        if (transitions[i].from == from && transitions[i].to == to){
+            return true;
+        }
+    }
+    return false;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function moves a connection to a new phase. The       *|
+|* phase of a connection can be changed by the reactor of the *|
+|* peer too, so the change is a compare and swap.             *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool ProtocolStateMachine::transition(Connection* conn, ConnectionPhase to){
+    int from = conn->phase.load();
+    do {
+        if (!allowed(from, to)){
+            Logger::error("Transition from ", phaseName(from), " to ", phaseName(to), " not allowed for ", conn->username);
+            return false;
+        }
+    } while (!conn->phase.compare_exchange_weak(from, to));
+
+    unsigned long long t = Instrumentation::now();
+    recordPhase(from, conn->phase_since.exchange(t));
+    current[from].fetch_sub(1, memory_order_relaxed);
+    if (to != PHASE_CLOSED){ current[to].fetch_add(1, memory_order_relaxed); }
+    return true;
+}
+
+void ProtocolStateMachine::start(Connection* conn){
+    conn->phase_since = Instrumentation::now();
+    current[conn->phase.load()].fetch_add(1, memory_order_relaxed);
+}
+
+void ProtocolStateMachine::finish(Connection* conn){
+    int from = conn->phase.exchange(PHASE_CLOSED);
+    if (from == PHASE_CLOSED){ return; }
+    recordPhase(from, conn->phase_since.exchange(Instrumentation::now()));
+    current[from].fetch_sub(1, memory_order_relaxed);
+}
+
+long long ProtocolStateMachine::connections(int phase){
+    return current[phase].load(memory_order_relaxed);
+}
+
+void ProtocolStateMachine::recordPhase(int phase, unsigned long long since){
+    unsigned long long elapsed = Instrumentation::now() - since;
+    stats[phase].count++;
+    stats[phase].total_ns += elapsed;
+    unsigned long long max = stats[phase].max_ns.load();
+    while (elapsed > max && !stats[phase].max_ns.compare_exchange_weak(max, elapsed));
+}
+
+string ProtocolStateMachine::phaseName(int phase){
+    switch(phase){
+        case PHASE_S2: return "S2";
+        case PHASE_LOBBY: return "LOBBY";
+        case PHASE_ACK: return "ACK";
+        case PHASE_RTT_PENDING: return "RTT_PENDING";
+        case PHASE_IDLE: return "IDLE";
+        case PHASE_RTT_RECEIVED: return "RTT_RECEIVED";
+        case PHASE_M1: return "M1";
+        case PHASE_M2: return "M2";
+        case PHASE_M3: return "M3";
+        case PHASE_PEER_WAIT: return "PEER_WAIT";
+        case PHASE_CHAT: return "CHAT";
+        case PHASE_CLOSED: return "CLOSED";
+        default: return "UNKNOWN";
+    }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function prints how long the connections stayed in    *|
+|* each phase.                                                *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void ProtocolStateMachine::printPhaseStats(){
+    cout<<"Thread "<<gettid()<<": Phase statistics"<<endl;
+    for (int i = 0; i < PHASE_CLOSED; i++){
+        unsigned long long count = stats[i].count.load();
+        if (count == 0){ continue; }
+        cout<<"     "<<phaseName(i)<<": "<<count<<" times, mean "<<stats[i].total_ns.load()/count/1000<<" us, max "<<stats[i].max_ns.load()/1000<<" us"<<endl;
+    }
+}
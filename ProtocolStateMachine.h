@@ -0,0 +1,109 @@
+#include <atomic>
+#include <string>
+
+#ifndef CYBERSECURITYPROJECT_PROTOCOLSTATEMACHINE_H
+#define CYBERSECURITYPROJECT_PROTOCOLSTATEMACHINE_H
+
+using namespace std;
+
+struct Connection;
+
+//Phases of the protocol in which a connection can be
+enum ConnectionPhase {
+    PHASE_S2,           //waiting for the authentication message S2
+    PHASE_LOBBY,        //sender waiting for a RTT, a refresh or a logout
+    PHASE_ACK,          //sender waiting for the ACK of a bad response
+    PHASE_RTT_PENDING,  //sender waiting for the response of the selected receiver
+    PHASE_IDLE,         //receiver waiting for a RTT or for a logout
+    PHASE_RTT_RECEIVED, //receiver that has to answer to a forwarded RTT
+    PHASE_M1,           //sender that has to send M1
+    PHASE_M2,           //receiver that has to send M2
+    PHASE_M3,           //sender that has to send M3
+    PHASE_PEER_WAIT,    //waiting for a key establishment message of the peer
+    PHASE_CHAT,         //chat messages are relayed to the peer
+    PHASE_CLOSED,
+    PHASE_COUNT
+};
+
+//Types of the messages, i.e. their first byte once decrypted by the server
+enum MessageType {
+    MSG_AUTH_SENDER = 0,        //S2 of a user that wants to send
+    MSG_AUTH_RECEIVER = 1,      //S2 of a user that wants to receive, S3
+    MSG_USER_LIST = 2,
+    MSG_RTT = 3,
+    MSG_RESPONSE = 4,
+    MSG_PUBKEY = 5,
+    MSG_KEY_ESTABLISHMENT = 6,  //M1, M2 and M3
+    MSG_BAD_RESPONSE = 7,
+    MSG_LOGOUT = 8,
+    MSG_CHAT = 9,
+    MSG_REFRESH = 10,
+    MSG_ACK = 11,
+    MSG_RETURN_TO_LOBBY = 12,
+    MSG_TICKET = 13,            //session ticket sent after S3 or R3
+    MSG_RESUME = 14,            //resumption request R2 of a user with a ticket, R3
+    MSG_RESUME_REJECTED = 15,   //ticket not accepted: the user has to send S2
+    MSG_REKEY = 16,             //the sender ratchets the key of its direction after this record, accepted in every phase with a key
+    MSG_RELAYED = 255           //chat payload encrypted with the key of the peers, opaque to the server
+};
+
+//Who causes a transition
+enum TransitionSource {
+    FROM_CLIENT,    //a message received on the connection itself
+    FROM_PEER       //a message received from the other user of a RTT or of a chat
+};
+
+struct ProtocolTransition {
+    ConnectionPhase from;
+    unsigned int message_type;
+    TransitionSource source;
+    ConnectionPhase to;
+};
+
+//Time spent by the connections in each phase
+struct PhaseStats {
+    atomic<unsigned long long> count;
+    atomic<unsigned long long> total_ns;
+    atomic<unsigned long long> max_ns;
+};
+
+class ProtocolStateMachine {
+    private:
+        static const ProtocolTransition transitions[];
+        static const unsigned int transitions_size;
+
+        static PhaseStats stats[PHASE_COUNT];
+
+        //Connections currently in each phase, the closed ones excluded
+        static atomic<long long> current[PHASE_COUNT];
+
+        static void recordPhase(int phase, unsigned long long since);
+
+    public:
+        //Type of a message received in a phase, as used in the transition table
+        static unsigned int messageType(int phase, const unsigned char* buf, unsigned int len);
+
+        //Check if a message of the given type can be received from the client in a phase
+        static bool accepts(int phase, unsigned int message_type);
+
+        //Check if a transition is in the table
+        static bool allowed(int from, int to);
+
+        //Move a connection to a new phase, if the table allows it
+        static bool transition(Connection* conn, ConnectionPhase to);
+
+        //Reset the clock of the current phase of a new connection
+        static void start(Connection* conn);
+
+        //Move a connection to PHASE_CLOSED from any phase, when its socket is closed
+        static void finish(Connection* conn);
+
+        //Connections currently in a phase
+        static long long connections(int phase);
+
+        static string phaseName(int phase);
+
+        static void printPhaseStats();
+};
+
+#endif
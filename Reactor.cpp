@@ -0,0 +1,596 @@
+#include "Reactor.h"
+#include "Logger.h"
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+//Requests of the io_uring backend. The operation on a connection is kept in the low bits of the
+//pointer, the other requests use values that cannot be a pointer
+const unsigned long long RING_IGNORED = 0;
+const unsigned long long RING_LISTENER = 1;
+const unsigned long long RING_EVENTFD = 2;
+const unsigned int RING_OP_RECV = 1;
+const unsigned int RING_OP_SEND = 2;
+const unsigned int RING_OP_MASK = 7;
+const unsigned int RING_RECV_GROUP = 0;
+
+Reactor::Reactor(unsigned int index, IoBackend backend, function<void(Connection*)> on_readable, function<void(Connection*, unsigned char*, int)> on_data, function<void(Reactor*)> on_acceptable){
+    this->index = index;
+    this->listening_socket = -1;
+    this->loop_tid = 0;
+    this->on_readable = on_readable;
+    this->on_data = on_data;
+    this->on_acceptable = on_acceptable;
+    this->ring = NULL;
+    this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (this->epoll_fd < 0){
+        Logger::error("Error in the creation of the epoll instance");
+        exit(1);
+    }
+
+    this->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &this->event_fd;
+    if (this->event_fd < 0 || epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->event_fd, &ev) < 0){
+        Logger::error("Error in the creation of the eventfd of the reactor");
+        exit(1);
+    }
+
+    if (backend == IO_URING && !setupRing()){
+        Logger::warn("io_uring is not available, reactor ", index, " uses epoll");
+        delete this->ring;
+        this->ring = NULL;
+    }
+}
+
+/* ---------------------------------------------------------- *\
+|* Class Destructor                                           *|
+\* ---------------------------------------------------------- */
+Reactor::~Reactor(){
+    if (this->listening_socket >= 0){ close(this->listening_socket); }
+    close(this->event_fd);
+    close(this->epoll_fd);
+    delete this->ring;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function starts the thread of the event loop.         *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void Reactor::start(){
+    this->loop_thread = thread(&Reactor::run, this);
+}
+
+void Reactor::join(){
+    if (this->loop_thread.joinable()){ this->loop_thread.join(); }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function adds the listening socket of the shard to    *|
+|* the reactor.                                               *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool Reactor::setListener(int socket){
+    this->listening_socket = socket;
+    if (this->ring){ return true; }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &this->listening_socket;
+    if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, socket, &ev) < 0){
+        Logger::error("Error in adding the listening socket to the epoll instance");
+        return false;
+    }
+    return true;
+}
+
+int Reactor::getListener(){
+    return this->listening_socket;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function pins the reactor thread to one CPU, so that  *|
+|* the connections of a shard stay in the same caches.        *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void Reactor::setAffinity(){
+    unsigned int cpus = thread::hardware_concurrency();
+    if (cpus == 0){ return; }
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(this->index % cpus, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0){
+        Logger::warn("Unable to pin the reactor to CPU ", this->index % cpus);
+    }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function adds a connection to the reactor.            *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool Reactor::registerConnection(shared_ptr<Connection> conn){
+    conn->reactor = this;
+    {
+        lock_guard<mutex> lck(this->connections_mutex);
+        this->connections[conn->socket] = conn;
+    }
+
+    /* ---------------------------------------------------------- *\
+    |* io_uring: the socket goes in the fixed files, if there is   *|
+    |* a free slot, and a receive is submitted. The socket is     *|
+    |* made blocking so that the ring waits for it by itself      *|
+    \* ---------------------------------------------------------- */
+    if (this->ring){
+        fcntl(conn->socket, F_SETFL, fcntl(conn->socket, F_GETFL) & ~O_NONBLOCK);
+        if (!this->free_file_slots.empty() && this->ring->updateFile(this->free_file_slots.back(), conn->socket)){
+            conn->ring_slot = this->free_file_slots.back();
+            this->free_file_slots.pop_back();
+        }
+        submitRecv(conn);
+
+        //Bytes queued before the registration
+        lock_guard<mutex> lck(conn->out_mutex);
+        if (conn->out_offset < conn->out_buf.size() && !conn->send_pending){
+            conn->send_pending = true;
+            this->send_queue.push_back(conn);
+        }
+        return true;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn.get();
+    if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, conn->socket, &ev) < 0){
+        Logger::error("Error in adding a socket to the epoll instance");
+        lock_guard<mutex> lck(this->connections_mutex);
+        this->connections.erase(conn->socket);
+        return false;
+    }
+    return true;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function removes a connection from the reactor and    *|
+|* closes it. The object is kept alive until the end of the   *|
+|* current batch, other events may still point to it.         *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void Reactor::unregisterConnection(Connection* conn){
+    if (conn->closed){ return; }
+    if (this->ring){
+        //Cancel the pending receive and free the slot: the ring keeps its own reference to the socket
+        struct io_uring_sqe* sqe = this->ring->getSqe();
+        if (sqe){
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (unsigned long long)conn | RING_OP_RECV;
+            sqe->user_data = RING_IGNORED;
+        }
+        if (conn->ring_slot >= 0){
+            this->ring->updateFile(conn->ring_slot, -1);
+            this->free_file_slots.push_back(conn->ring_slot);
+            conn->ring_slot = -1;
+        }
+    }
+    else {
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+    }
+
+    lock_guard<mutex> lck(this->connections_mutex);
+    map<int, shared_ptr<Connection>>::iterator it = this->connections.find(conn->socket);
+    if (it != this->connections.end()){
+        this->closed_connections.push_back(it->second);
+        this->connections.erase(it);
+    }
+    conn->close();
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function hands a connection off to another shard. It  *|
+|* stops being watched here at once, and it is registered in  *|
+|* the target when the current event has been handled, so     *|
+|* that two threads never read from it at the same time.      *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool Reactor::migrateConnection(Connection* conn, Reactor* target){
+    //The requests of a connection cannot leave the ring they were submitted to
+    if (conn->closed || target == this || this->ring || target->ring){ return false; }
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+
+    lock_guard<mutex> lck(this->connections_mutex);
+    map<int, shared_ptr<Connection>>::iterator it = this->connections.find(conn->socket);
+    if (it == this->connections.end()){ return false; }
+    this->migrated_connections.push_back(it->second);
+    this->connections.erase(it);
+    conn->reactor = target;
+    return true;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function contains the event loop of the reactor.      *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void Reactor::run(){
+    this->loop_tid = gettid();
+    setAffinity();
+    if (this->ring){
+        runRing();
+        return;
+    }
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while(1){
+        int n = epoll_wait(this->epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (n < 0){
+            if (errno == EINTR){ continue; }
+            Logger::error("Error in the epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < n; i++){
+            /* ---------------------------------------------------------- *\
+            |* New connections on the listening socket of the shard       *|
+            \* ---------------------------------------------------------- */
+            if (events[i].data.ptr == &this->listening_socket){
+                this->on_acceptable(this);
+                continue;
+            }
+
+            /* ---------------------------------------------------------- *\
+            |* Tasks posted by other threads                              *|
+            \* ---------------------------------------------------------- */
+            if (events[i].data.ptr == &this->event_fd){
+                runTasks();
+                handOff();
+                continue;
+            }
+
+            Connection* conn = (Connection*)events[i].data.ptr;
+            if (conn->closed){ continue; }
+
+            /* ---------------------------------------------------------- *\
+            |* Socket writable again: send what was left in the queue     *|
+            \* ---------------------------------------------------------- */
+            if ((events[i].events & EPOLLOUT) && !conn->flush()){
+                //Let the handler see the end of the connection and release the user
+                shutdown(conn->socket, SHUT_RDWR);
+                this->on_readable(conn);
+            }
+
+            /* ---------------------------------------------------------- *\
+            |* Data to read, end of file or error. A migrated connection  *|
+            |* can also bring frames already read by its previous shard   *|
+            \* ---------------------------------------------------------- */
+            else if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) || conn->reader.hasFrame()){
+                this->on_readable(conn);
+            }
+            handOff();
+        }
+
+        lock_guard<mutex> lck(this->connections_mutex);
+        this->closed_connections.clear();
+    }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function registers the connections moved to other     *|
+|* shards during the last event.                              *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void Reactor::handOff(){
+    vector<shared_ptr<Connection>> migrated;
+    {
+        lock_guard<mutex> lck(this->connections_mutex);
+        migrated.swap(this->migrated_connections);
+    }
+    for (unsigned int j = 0; j < migrated.size(); j++){
+        if (!migrated[j]->reactor.load()->registerConnection(migrated[j])){
+            migrated[j]->close();
+        }
+    }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function queues a task for the thread of the reactor  *|
+|* and wakes it up.                                           *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void Reactor::post(function<void(Reactor*)> task){
+    {
+        lock_guard<mutex> lck(this->tasks_mutex);
+        this->tasks.push_back(task);
+    }
+    uint64_t one = 1;
+    if (write(this->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN){
+        Logger::error("Error in waking up a reactor");
+    }
+}
+
+void Reactor::runTasks(){
+    uint64_t count;
+    while (read(this->event_fd, &count, sizeof(count)) > 0);
+
+    deque<function<void(Reactor*)>> pending;
+    {
+        lock_guard<mutex> lck(this->tasks_mutex);
+        pending.swap(this->tasks);
+    }
+    for (unsigned int i = 0; i < pending.size(); i++){
+        pending[i](this);
+    }
+}
+
+bool Reactor::usesRing(){
+    return this->ring != NULL;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function creates the io_uring of the reactor, with an *|
+|* empty table of fixed files and the registered buffers of   *|
+|* the sends.                                                 *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool Reactor::setupRing(){
+    this->ring = new IoUring();
+    if (!this->ring->setup(RING_ENTRIES, 4*RING_ENTRIES)){ return false; }
+
+    vector<int> files(RING_FILES, -1);
+    if (!this->ring->registerFiles(files.data(), RING_FILES)){ return false; }
+    for (unsigned int i = RING_FILES; i > 0; i--){
+        this->free_file_slots.push_back(i - 1);
+    }
+
+    this->send_buffers.resize(RING_SEND_BUFFERS*MAX_RECORD_SIZE);
+    struct iovec iov;
+    iov.iov_base = this->send_buffers.data();
+    iov.iov_len = this->send_buffers.size();
+    if (!this->ring->registerBuffers(&iov, 1)){ return false; }
+    for (unsigned int i = 0; i < RING_SEND_BUFFERS; i++){
+        this->free_send_buffers.push_back(i);
+    }
+
+    this->recv_buffers.resize(RING_RECV_BUFFERS*MAX_RECORD_SIZE);
+    return true;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function contains the event loop of the io_uring      *|
+|* backend. The requests filled while handling a batch of     *|
+|* completions are submitted together with the wait for the   *|
+|* next batch, in a single system call.                       *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void Reactor::runRing(){
+    struct io_uring_sqe* sqe = this->ring->getSqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = RING_RECV_BUFFERS;
+    sqe->addr = (unsigned long long)this->recv_buffers.data();
+    sqe->len = MAX_RECORD_SIZE;
+    sqe->off = 0;
+    sqe->buf_group = RING_RECV_GROUP;
+    sqe->user_data = RING_IGNORED;
+    submitPoll(this->listening_socket, RING_LISTENER);
+    submitPoll(this->event_fd, RING_EVENTFD);
+
+    while(1){
+        /* ---------------------------------------------------------- *\
+        |* Requests that did not fit in the last batch, the buffers   *|
+        |* first so that the receives find them                       *|
+        \* ---------------------------------------------------------- */
+        vector<unsigned int> buffers;
+        buffers.swap(this->buffer_queue);
+        for (unsigned int i = 0; i < buffers.size(); i++){
+            provideBuffer(buffers[i]);
+        }
+        vector<shared_ptr<Connection>> receivers;
+        receivers.swap(this->recv_queue);
+        for (unsigned int i = 0; i < receivers.size(); i++){
+            submitRecv(receivers[i]);
+        }
+        while (!this->send_queue.empty() && !this->free_send_buffers.empty()){
+            shared_ptr<Connection> conn = this->send_queue.front();
+            this->send_queue.pop_front();
+            if (!submitSend(conn)){
+                this->send_queue.push_front(conn);
+                break;
+            }
+        }
+
+        if (this->ring->submitAndWait(1) < 0 && errno != EBUSY){
+            Logger::error("Error in the io_uring_enter");
+            exit(1);
+        }
+
+        /* ---------------------------------------------------------- *\
+        |* Reap the whole batch of completions                        *|
+        \* ---------------------------------------------------------- */
+        struct io_uring_cqe* cqe;
+        while ((cqe = this->ring->peekCqe()) != NULL){
+            unsigned long long user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned int flags = cqe->flags;
+            this->ring->cqeSeen();
+            handleCompletion(user_data, res, flags);
+        }
+
+        lock_guard<mutex> lck(this->connections_mutex);
+        this->closed_connections.clear();
+    }
+}
+
+void Reactor::handleCompletion(unsigned long long user_data, int res, unsigned int flags){
+    if (user_data == RING_IGNORED){ return; }
+
+    /* ---------------------------------------------------------- *\
+    |* New connections on the listening socket of the shard       *|
+    \* ---------------------------------------------------------- */
+    if (user_data == RING_LISTENER){
+        this->on_acceptable(this);
+        submitPoll(this->listening_socket, RING_LISTENER);
+        return;
+    }
+
+    /* ---------------------------------------------------------- *\
+    |* Tasks posted by other threads                              *|
+    \* ---------------------------------------------------------- */
+    if (user_data == RING_EVENTFD){
+        runTasks();
+        submitPoll(this->event_fd, RING_EVENTFD);
+        return;
+    }
+
+    Connection* ptr = (Connection*)(user_data & ~(unsigned long long)RING_OP_MASK);
+    unsigned int op = user_data & RING_OP_MASK;
+    shared_ptr<Connection> conn = this->in_flight[ptr];
+    if (--conn->ring_ops == 0){ this->in_flight.erase(ptr); }
+
+    /* ---------------------------------------------------------- *\
+    |* Bytes received: the kernel chose one of the buffers        *|
+    \* ---------------------------------------------------------- */
+    if (op == RING_OP_RECV){
+        bool has_buffer = flags & IORING_CQE_F_BUFFER;
+        unsigned int id = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res == -ENOBUFS || res == -EINTR || res == -EAGAIN){
+            this->recv_queue.push_back(conn);
+        }
+        else if (!conn->closed && res > 0){
+            this->on_data(conn.get(), this->recv_buffers.data() + id*MAX_RECORD_SIZE, res);
+            if (!conn->closed){ submitRecv(conn); }
+        }
+        else if (!conn->closed){
+            this->on_data(conn.get(), NULL, res);
+        }
+        if (has_buffer){ provideBuffer(id); }
+        return;
+    }
+
+    /* ---------------------------------------------------------- *\
+    |* Send completed: submit the rest of the queue, if any       *|
+    \* ---------------------------------------------------------- */
+    this->free_send_buffers.push_back(conn->send_buffer);
+    lock_guard<mutex> lck(conn->out_mutex);
+    if (res < 0 && res != -EINTR && res != -EAGAIN){
+        //The receive sees the end of the connection and the session releases the user
+        conn->send_pending = false;
+        if (!conn->closed){ shutdown(conn->socket, SHUT_RDWR); }
+        return;
+    }
+    if (res > 0){ conn->out_offset += res; }
+    if (conn->out_offset == conn->out_buf.size()){
+        conn->out_buf.clear();
+        conn->out_offset = 0;
+        conn->send_pending = false;
+        return;
+    }
+    this->send_queue.push_back(conn);
+}
+
+void Reactor::prepareRequest(struct io_uring_sqe* sqe, shared_ptr<Connection> conn, unsigned int op){
+    if (conn->ring_slot >= 0){
+        sqe->fd = conn->ring_slot;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    else {
+        sqe->fd = conn->socket;
+    }
+    sqe->user_data = (unsigned long long)conn.get() | op;
+    if (conn->ring_ops++ == 0){ this->in_flight[conn.get()] = conn; }
+}
+
+void Reactor::submitPoll(int fd, unsigned long long user_data){
+    struct io_uring_sqe* sqe = this->ring->getSqe();
+    if (!sqe){
+        Logger::error("Submission queue of the io_uring full");
+        exit(1);
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data;
+}
+
+void Reactor::submitRecv(shared_ptr<Connection> conn){
+    if (conn->closed){ return; }
+    struct io_uring_sqe* sqe = this->ring->getSqe();
+    if (!sqe){
+        this->recv_queue.push_back(conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->len = MAX_RECORD_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RING_RECV_GROUP;
+    prepareRequest(sqe, conn, RING_OP_RECV);
+}
+
+bool Reactor::submitSend(shared_ptr<Connection> conn){
+    lock_guard<mutex> lck(conn->out_mutex);
+    if (conn->closed || conn->out_offset == conn->out_buf.size()){
+        conn->send_pending = false;
+        return true;
+    }
+    struct io_uring_sqe* sqe = this->ring->getSqe();
+    if (!sqe){ return false; }
+
+    conn->send_buffer = this->free_send_buffers.back();
+    this->free_send_buffers.pop_back();
+    unsigned char* buf = this->send_buffers.data() + conn->send_buffer*MAX_RECORD_SIZE;
+    size_t len = conn->out_buf.size() - conn->out_offset;
+    if (len > MAX_RECORD_SIZE){ len = MAX_RECORD_SIZE; }
+    memcpy(buf, conn->out_buf.data() + conn->out_offset, len);
+
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->addr = (unsigned long long)buf;
+    sqe->len = len;
+    sqe->buf_index = 0;
+    prepareRequest(sqe, conn, RING_OP_SEND);
+    return true;
+}
+
+void Reactor::provideBuffer(unsigned int id){
+    struct io_uring_sqe* sqe = this->ring->getSqe();
+    if (!sqe){
+        this->buffer_queue.push_back(id);
+        return;
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = (unsigned long long)(this->recv_buffers.data() + id*MAX_RECORD_SIZE);
+    sqe->len = MAX_RECORD_SIZE;
+    sqe->off = id;
+    sqe->buf_group = RING_RECV_GROUP;
+    sqe->user_data = RING_IGNORED;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function queues a connection for a send of the ring.  *|
+|* Other threads hand it to the reactor with a task.          *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void Reactor::requestSend(shared_ptr<Connection> conn){
+    if (gettid() == this->loop_tid){
+        this->send_queue.push_back(conn);
+        return;
+    }
+    post([conn](Reactor* reactor){ reactor->send_queue.push_back(conn); });
+}
@@ -0,0 +1,150 @@
+#include <sys/epoll.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Connection.h"
+#include "IoUring.h"
+
+#ifndef CYBERSECURITYPROJECT_REACTOR_H
+#define CYBERSECURITYPROJECT_REACTOR_H
+
+using namespace std;
+
+//How the reactors do the I/O of their connections
+enum IoBackend {
+    IO_EPOLL,   //readiness from epoll, one recv/send system call per message
+    IO_URING    //receives and sends submitted and reaped in batches through io_uring
+};
+
+class Reactor {
+    private:
+        //Position of the shard, used to choose the CPU it runs on
+        unsigned int index;
+
+        //Edge-triggered epoll instance watching the listener and the connections of this reactor
+        int epoll_fd;
+
+        //Listening socket of the shard, bound with SO_REUSEPORT on the server address
+        int listening_socket;
+
+        //Tasks posted by other threads, run by the event loop. The eventfd wakes it up
+        int event_fd;
+        mutex tasks_mutex;
+        deque<function<void(Reactor*)>> tasks;
+
+        //Thread running the event loop, and its id once started
+        thread loop_thread;
+        atomic<pid_t> loop_tid;
+
+        //Called when a connection has data to read or has been closed by the peer (epoll)
+        function<void(Connection*)> on_readable;
+
+        //Called with the bytes received on a connection, or with len <= 0 when it has been closed (io_uring)
+        function<void(Connection*, unsigned char*, int)> on_data;
+
+        //Called when the listening socket has connections waiting to be accepted
+        function<void(Reactor*)> on_acceptable;
+
+        //Connections owned by the reactor, indexed by socket
+        mutex connections_mutex;
+        map<int, shared_ptr<Connection>> connections;
+
+        //Connections closed during the current batch of events, released after it
+        vector<shared_ptr<Connection>> closed_connections;
+
+        //Connections handed off to another shard, registered there once the current event is over
+        vector<shared_ptr<Connection>> migrated_connections;
+
+        //io_uring backend, NULL with epoll. The sockets get a slot in the table of fixed files, the
+        //receives take one of the buffers provided to the kernel only when data arrives, and the
+        //sends are copied in the registered buffers
+        IoUring* ring;
+        vector<unsigned int> free_file_slots;
+        vector<unsigned char> recv_buffers;
+        vector<unsigned char> send_buffers;
+        vector<unsigned int> free_send_buffers;
+
+        //Connections with requests in the ring, kept alive until their completions
+        map<Connection*, shared_ptr<Connection>> in_flight;
+
+        //Connections waiting for a receive or a send to be submitted in the next batch
+        vector<shared_ptr<Connection>> recv_queue;
+        deque<shared_ptr<Connection>> send_queue;
+
+        //Receive buffers to give back to the kernel in the next batch
+        vector<unsigned int> buffer_queue;
+
+        //Pin the thread of the event loop to the CPU of the shard
+        void setAffinity();
+
+        //Run the tasks posted to the reactor
+        void runTasks();
+
+        //Register the migrated connections in their new shard
+        void handOff();
+
+        //Event loop
+        void run();
+
+        //Event loop of the io_uring backend
+        void runRing();
+
+        //Create the ring and register its files and buffers
+        bool setupRing();
+
+        //Fill the fields of a request on a connection and keep the connection alive until it completes
+        void prepareRequest(struct io_uring_sqe* sqe, shared_ptr<Connection> conn, unsigned int op);
+
+        void submitPoll(int fd, unsigned long long user_data);
+
+        void submitRecv(shared_ptr<Connection> conn);
+
+        //Submit the next part of the queue of a connection, false if the ring is full
+        bool submitSend(shared_ptr<Connection> conn);
+
+        //Give a receive buffer back to the kernel
+        void provideBuffer(unsigned int id);
+
+        void handleCompletion(unsigned long long user_data, int res, unsigned int flags);
+
+    public:
+        Reactor(unsigned int index, IoBackend backend, function<void(Connection*)> on_readable, function<void(Connection*, unsigned char*, int)> on_data, function<void(Reactor*)> on_acceptable);
+
+        ~Reactor();
+
+        //Start the thread of the event loop
+        void start();
+
+        //Wait for the end of the event loop
+        void join();
+
+        //Watch the listening socket of the shard
+        bool setListener(int socket);
+
+        int getListener();
+
+        //Add a connection to the reactor. Can be called by any thread with epoll, only by the thread of the reactor with io_uring
+        bool registerConnection(shared_ptr<Connection> conn);
+
+        //Remove and close a connection. Must be called by the thread of the reactor
+        void unregisterConnection(Connection* conn);
+
+        //Move a connection to another shard. Must be called by the thread of the reactor.
+        //With io_uring the connections stay where they are accepted and false is returned
+        bool migrateConnection(Connection* conn, Reactor* target);
+
+        //Run a task in the thread of the reactor. Can be called by any thread
+        void post(function<void(Reactor*)> task);
+
+        bool usesRing();
+
+        //Let the ring send the queue of a connection in the next batch. Called with out_mutex held
+        void requestSend(shared_ptr<Connection> conn);
+};
+
+#endif
@@ -6,26 +6,28 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <chrono>
+#include <fstream>
 
-string SecureChatClient::username;
-unsigned int SecureChatClient::choice;
-EVP_PKEY* SecureChatClient::client_prvkey = NULL;
-X509* SecureChatClient::ca_certificate = NULL;
-X509_CRL* SecureChatClient::ca_crl = NULL;
-
-SecureChatClient::SecureChatClient(string client_username, const char *server_addr, unsigned short int server_port) {
+SecureChatClient::SecureChatClient(string client_username, const char *server_addr, unsigned short int server_port, unsigned char key_exchange_suite, unsigned char aead_suite, ClientDriver* client_driver, const char* key_password) {
     if (client_username.length() > USERNAME_MAX_SIZE){ cerr<<"ERR: Username too long."<<endl; exit(1); }
     if (strlen(server_addr) > MAX_ADDRESS_SIZE){ cerr<<"ERR: Server address out of bound."<<endl; }
 
     /* ---------------------------------------------------------- *\
-    |* Set client username                                        *|
+    |* Set client username, key exchange suite and AEAD suite     *|
     \* ---------------------------------------------------------- */
     username = client_username;
+    suite = key_exchange_suite;
+    aead = aead_suite;
+    driver = client_driver;
+    logged_out = false;
 
     /* ---------------------------------------------------------- *\
     |* Get client private key                                     *|
     \* ---------------------------------------------------------- */
-    client_prvkey = getPrvKey();
+    client_prvkey = getPrvKey(key_password);
 
     /* ---------------------------------------------------------- *\
     |* Read the CA certificate                                    *|
@@ -37,6 +39,12 @@ SecureChatClient::SecureChatClient(string client_username, const char *server_ad
     \* ---------------------------------------------------------- */
     ca_crl = getCRL();
 
+    /* ---------------------------------------------------------- *\
+    |* Start generating the ephemeral key pairs of the login and  *|
+    |* of the first chat while the client connects                *|
+    \* ---------------------------------------------------------- */
+    KeyPool::start(suite, CLIENT_KEY_POOL_SIZE);
+
     
     /* ---------------------------------------------------------- *\
     |* Set the server address and the server port in the          *|
@@ -50,80 +58,94 @@ SecureChatClient::SecureChatClient(string client_username, const char *server_ad
     |* Setup the server socket                                    *|
     \* ---------------------------------------------------------- */
     setupServerSocket(server_port, server_addr);
+    driver->event(EVENT_CONNECTED, "", NULL, 0);
 
     /* ---------------------------------------------------------- *\
     |* Receive server certificate (S1)                            *|
     \* ---------------------------------------------------------- */
     cout<<"LOG: Starting Key Establishment with the server"<<endl;
+    unsigned long long login_start = Instrumentation::now();
     unsigned char* R_server = receiveCertificate();
     cout<<"LOG: Message S1 received"<<endl;
+    driver->event(EVENT_S1_RECEIVED, "", NULL, 0);
 
-    /* ---------------------------------------------------------- *\
-    |* Verify server certificate                                  *|
-    \* ---------------------------------------------------------- */
-    verifyCertificate();
-
-    string input;
-
-    cout<<"LOG: Do you want to"<<endl<<"    0: Send a message"<<endl<<"    1: Receive a message"<<endl;
-    cout<<"LOG: Select a choice: ";
-    cin>>input;
-    if(!cin){exit(1);}
-    while(1){
-        if(input.compare("0")!=0 && input.compare("1")!=0){
-            cout<<"LOG: Choice not valid! Choose 0 or 1!"<<endl;
-            cin>>input;
-            if(!cin){exit(1);}
-        } else break;
-    }
-    choice = input.c_str()[0]-'0';
-
-    /* ---------------------------------------------------------- *\
-    |* Generating TpubK e TprvK                                   *|
-    \* ---------------------------------------------------------- */
-    EVP_PKEY* tprivk = Utility::generateTprivK(this->username);
-    EVP_PKEY* tpubk = Utility::generateTpubK(this->username);
-    Utility::removeTprivK(this->username);
-    Utility::removeTpubK(this->username);
+    choice = driver->chooseRole();
 
-    /* ---------------------------------------------------------- *\
-    |* Send a message to authenticate to the server (S2)          *|
-    \* ---------------------------------------------------------- */
     unsigned char* R_user;
     R_user = (unsigned char*)malloc(R_SIZE);
     if (!R_user){cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1);}
-    authenticateUser(choice, R_server, tpubk, R_user);
-    cout<<"LOG: Message S2 sent"<<endl;
 
+    /* ---------------------------------------------------------- *\
+    |* Resume the last session with its ticket (R2), if any       *|
+    \* ---------------------------------------------------------- */
     unsigned char* iv;
-    unsigned char* K = receiveS3Message(iv, tprivk, R_user);
-    cout<<"LOG: Message S3 received"<<endl;
+    unsigned char* K = resumeSession(choice, R_server, R_user, iv);
+    bool resumed = K != NULL;
+
+    if (!K){
+        /* ---------------------------------------------------------- *\
+        |* Verify server certificate                                  *|
+        \* ---------------------------------------------------------- */
+        verifyCertificate();
+
+        /* ---------------------------------------------------------- *\
+        |* Generating TpubK e TprvK: with SUITE_X25519 both are the   *|
+        |* same X25519 key pair, whose public share is sent           *|
+        \* ---------------------------------------------------------- */
+        unsigned long long key_start = Instrumentation::now();
+        EVP_PKEY* tprivk = KeyPool::pop(suite);
+        EVP_PKEY* tpubk = (suite == SUITE_X25519) ? tprivk : Utility::generateTpubK(tprivk);
+        Tracer::record("ephemeral key", key_start, 0, username, "", false);
+
+        /* ---------------------------------------------------------- *\
+        |* Send a message to authenticate to the server (S2)          *|
+        \* ---------------------------------------------------------- */
+        authenticateUser(choice, R_server, tpubk, R_user);
+        cout<<"LOG: Message S2 sent"<<endl;
+
+        K = receiveS3Message(iv, tprivk, R_user, R_server);
+        cout<<"LOG: Message S3 received"<<endl;
+        if (tpubk != tprivk){ EVP_PKEY_free(tpubk); }
+        EVP_PKEY_free(tprivk);
+    }
 
     setCounters(iv);
     storeK(K);
+    Tracer::record(resumed ? "login R1-R3" : "login S1-S3", login_start, 0, username, "", false);
+    driver->event(resumed ? EVENT_R3_RECEIVED : EVENT_S3_RECEIVED, "", NULL, 0);
+
+    /* ---------------------------------------------------------- *\
+    |* Keep the ticket for the next login                         *|
+    \* ---------------------------------------------------------- */
+    receiveTicket(R_server, R_user);
 
     unsigned int response;
     EVP_PKEY* peer_key;
 
-    while(1){
+    while(!logged_out){
         /* ---------------------------------------------------------- *\
         |* client wants to send a message                             *|
         \* ---------------------------------------------------------- */
         if(choice == 0){ 
-            while(1){
+            while(!logged_out){
                 /* ---------------------------------------------------------- *\
                 |* Print the user list and select a user to communicate with  *|
                 \* ---------------------------------------------------------- */
                 string selected_user = receiveAvailableUsers();
+                if (logged_out){ break; }
                 /* ---------------------------------------------------------- *\
                 |* Send request to talk to the selected user                  *|
                 \* ---------------------------------------------------------- */
                 sendRTT(selected_user);
+                driver->event(EVENT_RTT_SENT, selected_user, NULL, 0);
 
                 /* ---------------------------------------------------------- *\
                 |* Wait for the answer to the previous RTT                    *|
                 \* ---------------------------------------------------------- */
+                unsigned long long wait_start = Instrumentation::now();
                 response = waitForResponse();
+                Tracer::record("RTT wait", wait_start, 0, username, selected_user, false);
+                driver->event((response == 1) ? EVENT_RTT_ACCEPTED : EVENT_RTT_REFUSED, selected_user, NULL, 0);
                 if (response==0){
                     cout<<"LOG: response equal to 0"<<endl;
                     continue;
@@ -146,26 +168,16 @@ SecureChatClient::SecureChatClient(string client_username, const char *server_ad
         |* client wants to receive a message                          *|
         \* ---------------------------------------------------------- */ 
         else if(choice == 1){ 
-            while(1){
+            while(!logged_out){
                 cout<<"LOG: Waiting for RTT (press 'q' to logout)..."<<endl;
                 string sender_username = waitForRTT();
-                string input;
-
-                cout<<"LOG: "<<sender_username<<" wants to send you a message. Do you want to "<<endl<<"    0: Refuse"<<endl<<"    1: Accept"<<endl;
-                cout<<"LOG: Select a choice: ";
-                cin>>input;
-                if(!cin){exit(1);}
-                while(1){
-                    if(input.compare("0")!=0 && input.compare("1")!=0){
-                        cout<<"LOG: Choice not valid! Choose 0 or 1!"<<endl;
-                        cin>>input;
-                        if(!cin){exit(1);}
-                    } else break;
-                }
+                if (logged_out){ break; }
+                driver->event(EVENT_RTT_RECEIVED, sender_username, NULL, 0);
 
-                response = input.c_str()[0]-'0';
+                response = driver->answerRTT(sender_username);
 
                 sendResponse(sender_username, response);
+                driver->event((response == 1) ? EVENT_RTT_ACCEPTED : EVENT_RTT_REFUSED, sender_username, NULL, 0);
 
                 if (response==0){
                     continue;
@@ -189,12 +201,16 @@ SecureChatClient::SecureChatClient(string client_username, const char *server_ad
 
 /* ---------------------------------------------------------- *\
 |*                                                            *|
-|* This functions gets user's private key.                    *|
+|* This functions gets user's private key. Without a password *|
+|* the one in KEY_PASSWORD_ENV is used, so that a headless    *|
+|* client or loadgen runs unattended; without both OpenSSL    *|
+|* asks for it on the terminal.                               *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-EVP_PKEY* SecureChatClient::getPrvKey() {
+EVP_PKEY* SecureChatClient::getPrvKey(const char* password) {
     string path = "./client/" + username + "/" + username + "_key_password.pem";
-    client_prvkey = Utility::readPrvKey(path.c_str(), NULL);
+    if (!password){ password = getenv(KEY_PASSWORD_ENV); }
+    client_prvkey = Utility::readPrvKey(path.c_str(), (void*)password);
     return client_prvkey;
 }
 
@@ -230,7 +246,7 @@ X509_CRL* SecureChatClient::getCRL(){
 void SecureChatClient::setupServerAddress(unsigned short int port, const char *addr){
     memset(&(this->server_addr), 0, sizeof(this->server_addr));
 	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = htons(server_port);
+	server_addr.sin_port = htons(port);
 	inet_pton(AF_INET, addr, &(this->server_addr.sin_addr));
 }
 
@@ -260,8 +276,8 @@ unsigned char* SecureChatClient::receiveCertificate(){
     }
     
     cout<<"LOG: Waiting for certificate"<<endl;
-    unsigned int len = recv(this->server_socket, (void*)buf, S1_SIZE, 0);
-    if (len < 0){ cerr<<"ERR: Error in receiving the certificate"<<endl; exit(1); }
+    int len = this->reader.readFrame(this->server_socket, (unsigned char*)buf, S1_SIZE);
+    if (len <= 0){ cerr<<"ERR: Error in receiving the certificate"<<endl; exit(1); }
     cout<<"LOG: Certificate received"<<endl;
 
     unsigned char* R_server = (unsigned char*)malloc(R_SIZE);
@@ -273,7 +289,7 @@ unsigned char* SecureChatClient::receiveCertificate(){
     Utility::secure_memcpy(R_server, 0, R_SIZE, buf, 0, S1_SIZE, R_SIZE);
 
     if (R_SIZE + (unsigned long)buf < R_SIZE) { cerr<<"Thread "<<gettid()<<": Wrap around"<<endl; exit(1); }
-    if (len > S1_SIZE) { cerr<<"ERR: Access out-of-bound"<<endl; exit(1); }
+    if ((unsigned int)len > S1_SIZE) { cerr<<"ERR: Access out-of-bound"<<endl; exit(1); }
     BIO* mbio = BIO_new(BIO_s_mem());
     BIO_write(mbio, buf+R_SIZE, CERTIFICATE_MAX_SIZE);
     this->server_certificate = PEM_read_bio_X509(mbio, NULL, NULL, NULL);
@@ -317,15 +333,15 @@ void SecureChatClient::verifyCertificate(){
 EVP_PKEY* SecureChatClient::receiveUserPubKey(string username){
     char* enc_buf = (char*)malloc(PUBKEY_MSG_SIZE+ENC_FIELDS);
     if (!enc_buf){ cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }
-    unsigned int len = recv(this->server_socket, (void*)enc_buf, PUBKEY_MSG_SIZE+ENC_FIELDS, 0);
-    if (len < 0){ cerr<<"ERR: Error in receiving the RTT message"<<endl; exit(1); }
+    int len = readServerFrame((unsigned char*)enc_buf, PUBKEY_MSG_SIZE+ENC_FIELDS);
+    if (len <= 0){ cerr<<"ERR: Error in receiving the RTT message"<<endl; exit(1); }
 
     unsigned char* pubkey_buf = (unsigned char*)malloc(PUBKEY_MSG_SIZE);
     if (!pubkey_buf){ cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }
     unsigned int buf_len;
     incrementCounter(0);
     checkCounter(0, (unsigned char*)enc_buf);
-    if (Utility::decryptSessionMessage(pubkey_buf, (unsigned char*)enc_buf, len, this->K, buf_len, 1) == false){
+    if (Utility::decryptSessionMessage(pubkey_buf, (unsigned char*)enc_buf, len, this->server_cipher, buf_len) == false){
         cerr<<"ERR: Error while decrypting"<<endl;
         exit(1);
     };
@@ -364,19 +380,12 @@ void SecureChatClient::authenticateUser(unsigned int choice, unsigned char* R_se
     |* to send message or 1 to receive message                    *|
     \* ---------------------------------------------------------- */
     msg[0] = choice; 
-    unsigned int len = 1;
+    msg[1] = suite | (aead << 4);
+    unsigned int len = 2;
     Utility::secure_memcpy((unsigned char*)msg, len, S2_SIZE, R_server, 0, R_SIZE, R_SIZE);
     len += R_SIZE;
 
-    BIO* mbio = BIO_new(BIO_s_mem());
-    PEM_write_bio_PUBKEY(mbio, tpubk);
-    char* pubkey_buf = NULL;
-    long pubkey_size = BIO_get_mem_data(mbio, &pubkey_buf);
-    Utility::secure_memcpy((unsigned char*)msg, len, S2_SIZE, (unsigned char*)&pubkey_size, 0, sizeof(long), sizeof(long));
-    len += sizeof(long);
-    Utility::secure_memcpy((unsigned char*)msg, len, S2_SIZE, (unsigned char*)pubkey_buf, 0, pubkey_size, pubkey_size);
-    BIO_free(mbio);
-    len += pubkey_size;
+    len += writeTpubK((unsigned char*)msg + len, S2_SIZE - len, tpubk);
 
     unsigned int to_sign_len = len;
     Utility::secure_memcpy((unsigned char*)msg, len, S2_SIZE, R_user, 0, R_SIZE, R_SIZE);
@@ -395,9 +404,10 @@ void SecureChatClient::authenticateUser(unsigned int choice, unsigned char* R_se
 
     Utility::signMessage(client_prvkey, msg, to_sign_len, &signature, &signature_len);
     Utility::secure_memcpy((unsigned char*)msg, len, S2_SIZE, (unsigned char*)signature, 0, SIGNATURE_SIZE, signature_len);
+    free(signature);
     len += signature_len;
     
-    if (send(this->server_socket, msg, len, 0) < 0){
+    if (Framing::sendFrame(this->server_socket, (unsigned char*)msg, len) < 0){
 		cerr<<"ERR: Error in the sendto of the authentication message."<<endl;
 		exit(1);
 	}
@@ -409,14 +419,14 @@ void SecureChatClient::authenticateUser(unsigned int choice, unsigned char* R_se
 |* Returns K, namely the session key betweem client and server*|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-unsigned char* SecureChatClient::receiveS3Message(unsigned char* &iv, EVP_PKEY* tprivk, unsigned char* R_user){
+unsigned char* SecureChatClient::receiveS3Message(unsigned char* &iv, EVP_PKEY* tprivk, unsigned char* R_user, unsigned char* R_server){
     /* ---------------------------------------------------------- *\
     |* Receive the message                                        *|
     \* ---------------------------------------------------------- */
     char* buf = (char*)malloc(S3_SIZE);
     if (!buf){ cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }
-    unsigned int len = recv(this->server_socket, (void*)buf, S3_SIZE, 0);
-    if (len < 1){ cerr<<"ERR: Error in receiving the S3 message"<<endl; exit(1); }
+    int len = this->reader.readFrame(this->server_socket, (unsigned char*)buf, S3_SIZE);
+    if (len <= 0){ cerr<<"ERR: Error in receiving the S3 message"<<endl; exit(1); }
 
     if (buf[0] != 1){
         cerr<<"ERR: Message type is not corresponding to S3"<<endl;
@@ -425,10 +435,11 @@ unsigned char* SecureChatClient::receiveS3Message(unsigned char* &iv, EVP_PKEY*
     /* ---------------------------------------------------------- *\
     |* Verify the authenticity of the message                     *|
     \* ---------------------------------------------------------- */
+    unsigned int signature_len = EVP_PKEY_get_size(this->server_pubkey);
     if ((unsigned long)buf + R_SIZE < R_SIZE){ cerr<<"Wrap around"<<endl; exit(1); }
-    if (len < SIGNATURE_SIZE){ cerr<<"Access out-of-bound"<<endl; exit(1); }
-    if ((unsigned long)buf + len < len){ cerr<<"Wrap around"<<endl; exit(1); }
-    if(Utility::verifyMessage(this->server_pubkey, buf, len-SIGNATURE_SIZE, (unsigned char*)((unsigned long)buf+len-SIGNATURE_SIZE), SIGNATURE_SIZE) != 1) { 
+    if ((unsigned int)len < 1 + R_SIZE + signature_len){ cerr<<"Access out-of-bound"<<endl; exit(1); }
+    if ((unsigned long)buf + len < (unsigned long)len){ cerr<<"Wrap around"<<endl; exit(1); }
+    if(Utility::verifyMessage(this->server_pubkey, buf, len-signature_len, (unsigned char*)((unsigned long)buf+len-signature_len), signature_len) != 1) { 
         cerr<<"ERR: Authentication error while receiving the S3 message"<<endl;
         exit(1);
     }
@@ -440,10 +451,22 @@ unsigned char* SecureChatClient::receiveS3Message(unsigned char* &iv, EVP_PKEY*
         exit(1);
     }
 
+    if (suite == SUITE_X25519){
+        /* ---------------------------------------------------------- *\
+        |* Derive K from the server share                             *|
+        \* ---------------------------------------------------------- */
+        unsigned char salt[2*R_SIZE];
+        memcpy(salt, R_server, R_SIZE);
+        memcpy(salt+R_SIZE, R_user, R_SIZE);
+        unsigned char* derived_K = deriveSharedK(tprivk, (unsigned char*)buf+1+R_SIZE, len-1-R_SIZE-signature_len, salt, "login", iv);
+        free(buf);
+        return derived_K;
+    }
+
     /* ---------------------------------------------------------- *\
     |* Initialize variables for decrypting                        *|
     \* ---------------------------------------------------------- */
-    const EVP_CIPHER* cipher = EVP_aes_256_cbc();
+    const EVP_CIPHER* cipher = Utility::AES_256_CBC;
     unsigned int iv_len = EVP_CIPHER_iv_length(cipher);
     unsigned int encrypted_key_len = EVP_PKEY_size(tprivk);
     unsigned int cphr_size = 2*BLOCK_SIZE;
@@ -472,6 +495,226 @@ unsigned char* SecureChatClient::receiveS3Message(unsigned char* &iv, EVP_PKEY*
     return plaintext;
 }
 
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function returns the path of the ticket of the user.  *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+string SecureChatClient::getTicketPath(){
+    return "./client/" + username + "/session_ticket";
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function reads the ticket of the last session: its    *|
+|* expiry, the resumption secret and the ticket to send.      *|
+|* Returns false if there is none or it is expired            *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool SecureChatClient::loadTicket(unsigned char* secret, unsigned char* ticket){
+    string path = getTicketPath();
+    char* canon_path = realpath(path.c_str(), NULL);
+    if (!canon_path){ return false; }
+    bool allowed = strncmp(canon_path, Utility::HOME_DIR, strlen(Utility::HOME_DIR)) == 0;
+    free(canon_path);
+    if (!allowed){ return false; }
+
+    ifstream f(path, ios::in | ios::binary);
+    if (!f){ return false; }
+    unsigned long long expiry;
+    f.read((char*)&expiry, sizeof(expiry));
+    f.read((char*)secret, RESUMPTION_SECRET_SIZE);
+    f.read((char*)ticket, TICKET_SIZE);
+    if (!f || f.peek() != EOF){ cerr<<"ERR: The ticket file is not valid"<<endl; OPENSSL_cleanse(secret, RESUMPTION_SECRET_SIZE); return false; }
+
+    unsigned long long now = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+    if (expiry <= now){ cout<<"LOG: The ticket is expired"<<endl; OPENSSL_cleanse(secret, RESUMPTION_SECRET_SIZE); return false; }
+    return true;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function resumes the last session: it sends R2 with   *|
+|* the ticket and derives K from the resumption secret once   *|
+|* R3 proves that the server opened it.                       *|
+|* Returns K, or NULL if there is no ticket or the server     *|
+|* rejected it: the login goes on with S2 on the connection   *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+unsigned char* SecureChatClient::resumeSession(unsigned int choice, unsigned char* R_server, unsigned char* R_user, unsigned char* &iv){
+    unsigned char msg[R2_SIZE];
+    unsigned char secret[RESUMPTION_SECRET_SIZE];
+    unsigned int ticket_index = 3 + 2*R_SIZE;
+    if (!loadTicket(secret, msg+ticket_index)){ return NULL; }
+
+    /* ---------------------------------------------------------- *\
+    |* Type = 14, choice, suite, R_server, R_user, ticket and     *|
+    |* their MAC                                                  *|
+    \* ---------------------------------------------------------- */
+    RAND_poll();
+    RAND_bytes(R_user, R_SIZE);
+    msg[0] = 14;
+    msg[1] = choice;
+    msg[2] = suite | (aead << 4);
+    memcpy(msg+3, R_server, R_SIZE);
+    memcpy(msg+3+R_SIZE, R_user, R_SIZE);
+    unsigned int mac_index = ticket_index + TICKET_SIZE;
+    if (!Utility::computeMAC(secret, RESUMPTION_SECRET_SIZE, msg, mac_index, msg+mac_index)){ cerr<<"ERR: Error while computing the MAC"<<endl; exit(1); }
+    if (Framing::sendFrame(this->server_socket, msg, R2_SIZE) < 0){
+        cerr<<"ERR: Error in the sendto of the resumption message."<<endl;
+        exit(1);
+    }
+    cout<<"LOG: Message R2 sent"<<endl;
+
+    unsigned char buf[R3_SIZE];
+    int len = this->reader.readFrame(this->server_socket, buf, R3_SIZE);
+    if (len <= 0){ cerr<<"ERR: Error in receiving the R3 message"<<endl; exit(1); }
+
+    /* ---------------------------------------------------------- *\
+    |* Ticket rejected (type = 15): back to the full login        *|
+    \* ---------------------------------------------------------- */
+    if (len == 1 && buf[0] == 15){
+        cout<<"LOG: Ticket rejected by the server"<<endl;
+        OPENSSL_cleanse(secret, RESUMPTION_SECRET_SIZE);
+        unlink(getTicketPath().c_str());
+        return NULL;
+    }
+    if (len != R3_SIZE || buf[0] != 14){ cerr<<"ERR: Message type is not corresponding to R3"<<endl; exit(1); }
+    if (Utility::compareR(buf+1, R_user) == false){ cerr<<"ERR: R_user not corrisponding"<<endl; exit(1); }
+
+    /* ---------------------------------------------------------- *\
+    |* Verify that the server knows the secret                    *|
+    \* ---------------------------------------------------------- */
+    unsigned char mac_input[1 + 2*R_SIZE];
+    memcpy(mac_input, buf, 1+R_SIZE);
+    memcpy(mac_input+1+R_SIZE, R_server, R_SIZE);
+    unsigned char mac[MAC_SIZE];
+    if (!Utility::computeMAC(secret, RESUMPTION_SECRET_SIZE, mac_input, 1+2*R_SIZE, mac) || CRYPTO_memcmp(mac, buf+1+R_SIZE, MAC_SIZE) != 0){
+        cerr<<"ERR: Authentication error while receiving the R3 message"<<endl;
+        exit(1);
+    }
+
+    /* ---------------------------------------------------------- *\
+    |* Derive K and the counter, salted with R_server and R_user  *|
+    \* ---------------------------------------------------------- */
+    unsigned char salt[2*R_SIZE];
+    memcpy(salt, R_server, R_SIZE);
+    memcpy(salt+R_SIZE, R_user, R_SIZE);
+    unsigned char key_material[DERIVED_KEY_SIZE];
+    if (!Utility::expandKey(secret, RESUMPTION_SECRET_SIZE, salt, 2*R_SIZE, "resume", key_material, DERIVED_KEY_SIZE)){ cerr<<"ERR: Error while deriving K"<<endl; exit(1); }
+    OPENSSL_cleanse(secret, RESUMPTION_SECRET_SIZE);
+    unsigned char* K = (unsigned char*)malloc(K_SIZE);
+    iv = (unsigned char*)malloc(BLOCK_SIZE);
+    if (!K || !iv){ cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }
+    memcpy(K, key_material, K_SIZE);
+    memcpy(iv, key_material+K_SIZE, BLOCK_SIZE);
+    OPENSSL_cleanse(key_material, DERIVED_KEY_SIZE);
+    cout<<"LOG: Message R3 received, session resumed"<<endl;
+    return K;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function receives the ticket sent after S3 or R3 and  *|
+|* stores it, with the resumption secret derived from K, in a *|
+|* file readable only by the user.                            *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void SecureChatClient::receiveTicket(unsigned char* R_server, unsigned char* R_user){
+    unsigned char enc_buf[TICKET_MSG_SIZE+ENC_FIELDS];
+    int len = readServerFrame(enc_buf, TICKET_MSG_SIZE+ENC_FIELDS);
+    if (len <= 0){ cerr<<"ERR: Error in receiving the ticket"<<endl; exit(1); }
+
+    unsigned char buf[TICKET_MSG_SIZE+ENC_FIELDS];
+    unsigned char* plaintext = buf;
+    unsigned int buf_len;
+    incrementCounter(0);
+    checkCounter(0, enc_buf);
+    if (Utility::decryptSessionMessage(plaintext, enc_buf, len, this->server_cipher, buf_len) == false){
+        cerr<<"ERR: Error while decrypting"<<endl;
+        exit(1);
+    }
+    if (buf_len != TICKET_MSG_SIZE || buf[0] != 13){ cerr<<"ERR: Message type is not corresponding to 'ticket type'."<<endl; exit(1); }
+
+    unsigned int lifetime;
+    memcpy(&lifetime, buf+1, sizeof(unsigned int));
+    unsigned long long expiry = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count() + lifetime;
+
+    /* ---------------------------------------------------------- *\
+    |* Resumption secret of the ticket                            *|
+    \* ---------------------------------------------------------- */
+    unsigned char salt[2*R_SIZE];
+    memcpy(salt, R_server, R_SIZE);
+    memcpy(salt+R_SIZE, R_user, R_SIZE);
+    unsigned char secret[RESUMPTION_SECRET_SIZE];
+    if (!Utility::expandKey(this->K, K_SIZE, salt, 2*R_SIZE, "resumption", secret, RESUMPTION_SECRET_SIZE)){ cerr<<"ERR: Error while deriving the resumption secret"<<endl; exit(1); }
+
+    /* ---------------------------------------------------------- *\
+    |* Write a new file and rename it, so that a ticket is never  *|
+    |* read half written                                          *|
+    \* ---------------------------------------------------------- */
+    string path = getTicketPath();
+    string tmp_path = path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool ok = fd >= 0;
+    ok = ok && write(fd, &expiry, sizeof(expiry)) == sizeof(expiry);
+    ok = ok && write(fd, secret, RESUMPTION_SECRET_SIZE) == RESUMPTION_SECRET_SIZE;
+    ok = ok && write(fd, buf+1+sizeof(unsigned int), TICKET_SIZE) == TICKET_SIZE;
+    if (fd >= 0){ close(fd); }
+    ok = ok && rename(tmp_path.c_str(), path.c_str()) == 0;
+    OPENSSL_cleanse(secret, RESUMPTION_SECRET_SIZE);
+    OPENSSL_cleanse(buf, TICKET_MSG_SIZE);
+    if (!ok){ cerr<<"ERR: Error while storing the ticket, the next login will not be resumed"<<endl; unlink(tmp_path.c_str()); return; }
+    cout<<"LOG: Ticket received, valid for "<<lifetime<<" s"<<endl;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function writes an ephemeral public key into S2 or    *|
+|* M2 as its length followed by its bytes: the PEM of the RSA *|
+|* key, or the raw share of the X25519 key.                   *|
+|* Returns the number of bytes written                        *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+unsigned int SecureChatClient::writeTpubK(unsigned char* buf, unsigned int size, EVP_PKEY* tpubk){
+    long pubkey_size;
+    if (EVP_PKEY_is_a(tpubk, "X25519")){
+        unsigned char share[X25519_SHARE_SIZE];
+        if (!Utility::writeShare(tpubk, share)){ cerr<<"ERR: Error while writing the TpubK"<<endl; exit(1); }
+        pubkey_size = X25519_SHARE_SIZE;
+        Utility::secure_memcpy(buf, 0, size, (unsigned char*)&pubkey_size, 0, sizeof(long), sizeof(long));
+        Utility::secure_memcpy(buf, sizeof(long), size, share, 0, X25519_SHARE_SIZE, X25519_SHARE_SIZE);
+        return sizeof(long) + pubkey_size;
+    }
+    BIO* mbio = BIO_new(BIO_s_mem());
+    PEM_write_bio_PUBKEY(mbio, tpubk);
+    char* pubkey_buf = NULL;
+    pubkey_size = BIO_get_mem_data(mbio, &pubkey_buf);
+    Utility::secure_memcpy(buf, 0, size, (unsigned char*)&pubkey_size, 0, sizeof(long), sizeof(long));
+    Utility::secure_memcpy(buf, sizeof(long), size, (unsigned char*)pubkey_buf, 0, pubkey_size, pubkey_size);
+    BIO_free(mbio);
+    return sizeof(long) + pubkey_size;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function derives K and the IV of the counters from    *|
+|* the X25519 share of the other party, with the nonces of    *|
+|* the handshake (2*R_SIZE bytes) as salt.                    *|
+|* Returns K                                                  *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+unsigned char* SecureChatClient::deriveSharedK(EVP_PKEY* tsharek, unsigned char* share, unsigned int share_len, unsigned char* salt, const char* label, unsigned char* &iv){
+    EVP_PKEY* peer_share = Utility::readShare(share, share_len);
+    if (!peer_share){ cerr<<"ERR: Error while reading the TpubK"<<endl; exit(1); }
+    unsigned char* K = (unsigned char*)malloc(K_SIZE);
+    iv = (unsigned char*)malloc(BLOCK_SIZE);
+    if (!K || !iv){ cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }
+    if (!Utility::deriveK(tsharek, peer_share, salt, 2*R_SIZE, label, K, iv)){ cerr<<"ERR: Error while deriving K"<<endl; exit(1); }
+    EVP_PKEY_free(peer_share);
+    return K;
+}
+
 
 /* ---------------------------------------------------------- *\
 |*                                                            *|
@@ -479,13 +722,12 @@ unsigned char* SecureChatClient::receiveS3Message(unsigned char* &iv, EVP_PKEY*
 |*                                                            *|
 \* ---------------------------------------------------------- */
 string SecureChatClient::receiveAvailableUsers(){
-    map<unsigned int, string> users_online;
     string selected;
     while(1){
         char* enc_buf = (char*)malloc(AVAILABLE_USER_MAX_SIZE+ENC_FIELDS);
         if (!enc_buf){ cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }
-        unsigned int len = recv(this->server_socket, (void*)enc_buf, AVAILABLE_USER_MAX_SIZE+ENC_FIELDS, 0);
-        if (len < 0){ cerr<<"ERR: Error in receiving the message containing the list of users"<<endl; exit(1); }
+        int len = readServerFrame((unsigned char*)enc_buf, AVAILABLE_USER_MAX_SIZE+ENC_FIELDS);
+        if (len <= 0){ cerr<<"ERR: Error in receiving the message containing the list of users"<<endl; exit(1); }
 
         cout<<"LOG: Message containing the list of users received"<<endl;
 
@@ -494,10 +736,11 @@ string SecureChatClient::receiveAvailableUsers(){
         unsigned int buf_len;
         incrementCounter(0);
         checkCounter(0, (unsigned char*)enc_buf);
-        if (Utility::decryptSessionMessage(buf, (unsigned char*)enc_buf, len, this->K, buf_len, 1) == false){
+        if (Utility::decryptSessionMessage(buf, (unsigned char*)enc_buf, len, this->server_cipher, buf_len) == false){
             cerr<<"ERR: Error while decrypting"<<endl;
             exit(1);
         };
+        free(enc_buf);
         
         unsigned int message_type = buf[0];
         if (message_type != 2){ cerr<<"ERR: The message type is not corresponding to 'user list'"<<endl; exit(1); }
@@ -506,13 +749,8 @@ string SecureChatClient::receiveAvailableUsers(){
         unsigned int current_len = 2;
         unsigned int username_len;
         char current_username[USERNAME_MAX_SIZE];
+        vector<string> users_online;
 
-        if (user_number < 0){ cerr<<"ERR: The number of available users is negative."<<endl; exit(1); }
-        if (user_number == 0){ 
-            cout<<"LOG: There are no available users."<<endl; 
-        } else {
-            cout<<"LOG: Online Users"<<endl;
-        }
         for (unsigned int i = 0; i < user_number; i++){
             if (current_len >= AVAILABLE_USER_MAX_SIZE){ cerr<<"ERR: Access out-of-bound"<<endl; exit(1); }
             username_len = buf[current_len];
@@ -521,36 +759,30 @@ string SecureChatClient::receiveAvailableUsers(){
             current_len++;
             Utility::secure_memcpy((unsigned char*)current_username, 0, USERNAME_MAX_SIZE, buf, current_len, AVAILABLE_USER_MAX_SIZE, username_len);
             current_username[username_len] = '\0';
-            cout<<"    "<<i<<": "<<current_username<<endl;
             if (username_len + current_len < username_len){ cerr<<"ERR: Wrap around"<<endl; exit(1); }
             current_len += username_len;
-            users_online.insert(pair<unsigned int, string>(i, (string)current_username));
+            users_online.push_back((string)current_username);
         }
-        cout<<"    q: Logout"<<endl;
-        cout<<"    r: Refresh"<<endl;
-
-        cout<<"LOG: Select an option or the number corresponding to one of the users: ";
-        cin>>selected;
-        if(!cin) {exit(1);}
+        free(buf);
+        driver->event(EVENT_USERS_RECEIVED, "", NULL, 0);
 
-        while((!Utility::isNumeric(selected) || atoi(selected.c_str()) >= user_number) && selected.compare("q") != 0 && selected.compare("r")){
-            cerr<<"ERR: Selection is not valid! Select another option or number: ";
-            cin>>selected;
-            if(!cin) {exit(1);}
-        }
+        /* ---------------------------------------------------------- *\
+        |* The driver selects a user, or asks to refresh or logout    *|
+        \* ---------------------------------------------------------- */
+        UserSelection selection = driver->selectUser(users_online, selected);
 
-        if (selected.compare("q") == 0){
+        if (selection == SELECT_LOGOUT){
             logout();
-            exit(0);
+            return "";
         }
 
-        if (selected.compare("r") == 0){
+        if (selection == SELECT_REFRESH){
             refresh();
             continue;
         }
         break;
     }
-    return users_online.at(atoi(selected.c_str()));
+    return selected;
 }
 
 /* ---------------------------------------------------------- *\
@@ -576,12 +808,12 @@ void SecureChatClient::sendRTT(string selected_user){
     unsigned int enc_buf_max_len = 2 + receiver_username_len + ENC_FIELDS;
     unsigned int enc_buf_len;
     enc_buf = (unsigned char*)malloc(enc_buf_max_len);
-    if (Utility::encryptSessionMessage(len, this->K, (unsigned char*)msg, ciphertext, outlen, cipherlen, this->user_counter, tag, enc_buf, enc_buf_max_len, 0, enc_buf_len) == false){
+    if (Utility::encryptSessionMessage(len, this->server_cipher, (unsigned char*)msg, ciphertext, outlen, cipherlen, this->user_counter, tag, enc_buf, enc_buf_max_len, enc_buf_len) == false){
         cerr<<"Thread "<<gettid()<<"Error in the encryption"<<endl;
         pthread_exit(NULL);
     };
     
-    if (send(this->server_socket, enc_buf, enc_buf_len, 0) < 0){ cerr<<"ERR: Error in the sendto of the authentication message."<<endl; exit(1); }
+    if (Framing::sendFrame(this->server_socket, (unsigned char*)enc_buf, enc_buf_len) < 0){ cerr<<"ERR: Error in the sendto of the authentication message."<<endl; exit(1); }
 };
 
 /* ---------------------------------------------------------- *\
@@ -590,31 +822,22 @@ void SecureChatClient::sendRTT(string selected_user){
 |*                                                            *|
 \* ---------------------------------------------------------- */
 string SecureChatClient::waitForRTT(){
-    fd_set master, copy;
-    FD_ZERO(&master);
-
-    FD_SET(this->server_socket, &master);
-    FD_SET(STDIN_FILENO, &master);
-    unsigned int my_nonce = 0;
-    unsigned int other_nonce = 0;
-
     while(true){
-        copy = master;
-
-        int count = select(FD_SETSIZE, &copy, NULL, NULL, NULL);
+        bool socket_ready, input_ready;
+        if (!pollInput(socket_ready, input_ready)){ continue; }
 
-        if (FD_ISSET(this->server_socket, &copy)){
+        if (socket_ready){
                 char* enc_buf = (char*)malloc(RTT_MAX_SIZE+ENC_FIELDS);
                 if (!enc_buf){ cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }
-                unsigned int len = recv(this->server_socket, (void*)enc_buf, RTT_MAX_SIZE+ENC_FIELDS, 0);
-                if (len < 0){ cerr<<"ERR: Error in receiving the RTT message"<<endl; exit(1); }
+                int len = readServerFrame((unsigned char*)enc_buf, RTT_MAX_SIZE+ENC_FIELDS);
+                if (len <= 0){ cerr<<"ERR: Error in receiving the RTT message"<<endl; exit(1); }
 
                 unsigned char* buf = (unsigned char*)malloc(RTT_MAX_SIZE);
                 if (!buf){ cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }
                 unsigned int buf_len;
                 incrementCounter(0);
                 checkCounter(0, (unsigned char*)enc_buf);
-                if (Utility::decryptSessionMessage(buf, (unsigned char*)enc_buf, len, this->K, buf_len, 1) == false){
+                if (Utility::decryptSessionMessage(buf, (unsigned char*)enc_buf, len, this->server_cipher, buf_len) == false){
                     cerr<<"ERR: Error while decrypting"<<endl;
                     exit(1);
                 };
@@ -626,26 +849,53 @@ string SecureChatClient::waitForRTT(){
                 string sender_username;
                 if ((unsigned long)buf + 2 < 2){ cerr<<"ERR: Wrap around"<<endl; exit(1); }
                 sender_username.append((char*)buf+2, sender_username_len);
+                free(enc_buf);
+                free(buf);
 
                 return sender_username;
         }
 
-        if (FD_ISSET(STDIN_FILENO, &copy)){
-            char* input = (char*)malloc(INPUT_SIZE);
-
-            if (fgets(input, INPUT_SIZE, stdin)==NULL){ cerr<<"ERR: Error while reading from stdin."<<endl; exit(1);}
-            char* p = strchr(input, '\n');
-            if (p){*p = '\0';}
+        if (input_ready){
+            char input[INPUT_SIZE];
+            if (!driver->readInput(input, INPUT_SIZE)){ continue; }
             if (strcmp(input, "q")==0){
                 logout();
                 cout<<"LOG: Logout..."<<endl;
-                exit(0);
+                return "";
             }
         }
     }
+};
 
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function waits for a frame of the server or for the   *|
+|* input of the driver: its descriptor, or the expiry of its  *|
+|* timeout. poll is used instead of select, whose sets do not *|
+|* hold the descriptors over FD_SETSIZE of a process running  *|
+|* many clients.                                              *|
+|* Returns false if neither is ready                          *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool SecureChatClient::pollInput(bool &socket_ready, bool &input_ready){
+    //A frame already buffered by the reader would not wake up the poll
+    if (this->reader.hasFrame()){
+        socket_ready = true;
+        input_ready = false;
+        return true;
+    }
 
-};
+    struct pollfd fds[2];
+    fds[0].fd = this->server_socket;
+    fds[0].events = POLLIN;
+    fds[1].fd = driver->inputFd();
+    fds[1].events = POLLIN;
+    int ready = poll(fds, 2, driver->inputTimeout());
+    if (ready < 0){ return false; }
+    socket_ready = (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+    input_ready = (fds[1].revents & (POLLIN | POLLHUP)) != 0 || ready == 0;
+    return socket_ready || input_ready;
+}
 
 /* ---------------------------------------------------------- *\
 |*                                                            *|
@@ -674,12 +924,12 @@ void SecureChatClient::sendResponse(string sender_username, unsigned int respons
     unsigned int enc_buf_max_len = 2 + username_len + ENC_FIELDS;
     unsigned int enc_buf_len;
     enc_buf = (unsigned char*)malloc(enc_buf_max_len);
-    if (Utility::encryptSessionMessage(len, this->K, (unsigned char*)msg, ciphertext, outlen, cipherlen, this->user_counter, tag, enc_buf, enc_buf_max_len, 0, enc_buf_len) == false){
+    if (Utility::encryptSessionMessage(len, this->server_cipher, (unsigned char*)msg, ciphertext, outlen, cipherlen, this->user_counter, tag, enc_buf, enc_buf_max_len, enc_buf_len) == false){
         cerr<<"Thread "<<gettid()<<"Error in the encryption"<<endl;
         pthread_exit(NULL);
     };
     
-    if (send(this->server_socket, enc_buf, enc_buf_len, 0) < 0){ cerr<<"ERR: Error in the sendto of the authentication message."<<endl; exit(1); }
+    if (Framing::sendFrame(this->server_socket, (unsigned char*)enc_buf, enc_buf_len) < 0){ cerr<<"ERR: Error in the sendto of the authentication message."<<endl; exit(1); }
 
     cout<<"LOG: Sending Response to RTT equal to "<<response<<endl;
 };
@@ -692,8 +942,8 @@ void SecureChatClient::sendResponse(string sender_username, unsigned int respons
 unsigned int SecureChatClient::waitForResponse(){
     char* enc_buf = (char*)malloc(RESPONSE_MAX_SIZE+ENC_FIELDS);
     if (!enc_buf){ cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }
-    unsigned int len = recv(this->server_socket, (void*)enc_buf, RESPONSE_MAX_SIZE+ENC_FIELDS, 0);
-    if (len < 0){ cerr<<"ERR: Error in receiving the RTT message"<<endl; exit(1); }
+    int len = readServerFrame((unsigned char*)enc_buf, RESPONSE_MAX_SIZE+ENC_FIELDS);
+    if (len <= 0){ cerr<<"ERR: Error in receiving the RTT message"<<endl; exit(1); }
     cout<<"Response message len: "<<len<<endl;
 
     unsigned char* buf = (unsigned char*)malloc(RESPONSE_MAX_SIZE);
@@ -702,7 +952,7 @@ unsigned int SecureChatClient::waitForResponse(){
     incrementCounter(0);
     checkCounter(0, (unsigned char*)enc_buf);
 
-    if (Utility::decryptSessionMessage(buf, (unsigned char*)enc_buf, len, this->K, buf_len, 1) == false){
+    if (Utility::decryptSessionMessage(buf, (unsigned char*)enc_buf, len, this->server_cipher, buf_len) == false){
         cerr<<"ERR: Error while decrypting"<<endl;
         exit(1);
     };
@@ -745,11 +995,11 @@ void SecureChatClient::refresh(){
     unsigned int enc_buf_max_len = LOGOUT_MAX_SIZE + ENC_FIELDS;
     unsigned int enc_buf_len;
     enc_buf = (unsigned char*)malloc(enc_buf_max_len);
-    if (Utility::encryptSessionMessage(LOGOUT_MAX_SIZE, this->K, (unsigned char*)msg, ciphertext, outlen, cipherlen, this->user_counter, tag, enc_buf, enc_buf_max_len, 1, enc_buf_len) == false){
+    if (Utility::encryptSessionMessage(LOGOUT_MAX_SIZE, this->server_cipher, (unsigned char*)msg, ciphertext, outlen, cipherlen, this->user_counter, tag, enc_buf, enc_buf_max_len, enc_buf_len) == false){
         cerr<<"ERR: Error in the encryption"<<endl;
         exit(1);
     };    
-    if (send(this->server_socket, enc_buf, enc_buf_len, 0) < 0){ cerr<<"ERR: Error in the sendto of the refresh message."<<endl; exit(1); }
+    if (Framing::sendFrame(this->server_socket, (unsigned char*)enc_buf, enc_buf_len) < 0){ cerr<<"ERR: Error in the sendto of the refresh message."<<endl; exit(1); }
 }
 
 /* ---------------------------------------------------------- *\
@@ -770,11 +1020,11 @@ void SecureChatClient::sendAck(){
     unsigned int enc_buf_max_len = LOGOUT_MAX_SIZE + ENC_FIELDS;
     unsigned int enc_buf_len;
     enc_buf = (unsigned char*)malloc(enc_buf_max_len);
-    if (Utility::encryptSessionMessage(LOGOUT_MAX_SIZE, this->K, (unsigned char*)msg, ciphertext, outlen, cipherlen, this->user_counter, tag, enc_buf, enc_buf_max_len, 1, enc_buf_len) == false){
+    if (Utility::encryptSessionMessage(LOGOUT_MAX_SIZE, this->server_cipher, (unsigned char*)msg, ciphertext, outlen, cipherlen, this->user_counter, tag, enc_buf, enc_buf_max_len, enc_buf_len) == false){
         cerr<<"ERR: Error in the encryption"<<endl;
         exit(1);
     };    
-    if (send(this->server_socket, enc_buf, enc_buf_len, 0) < 0){ cerr<<"ERR: Error in the sendto of the ACK message."<<endl; exit(1); }
+    if (Framing::sendFrame(this->server_socket, (unsigned char*)enc_buf, enc_buf_len) < 0){ cerr<<"ERR: Error in the sendto of the ACK message."<<endl; exit(1); }
 }
 
 /* ---------------------------------------------------------- *\
@@ -806,13 +1056,16 @@ void SecureChatClient::logout(){
     unsigned int enc_buf_max_len = LOGOUT_MAX_SIZE + ENC_FIELDS;
     unsigned int enc_buf_len;
     enc_buf = (unsigned char*)malloc(enc_buf_max_len);
-    if (Utility::encryptSessionMessage(LOGOUT_MAX_SIZE, this->K, (unsigned char*)msg, ciphertext, outlen, cipherlen, this->user_counter, tag, enc_buf, enc_buf_max_len, 1, enc_buf_len) == false){
+    if (Utility::encryptSessionMessage(LOGOUT_MAX_SIZE, this->server_cipher, (unsigned char*)msg, ciphertext, outlen, cipherlen, this->user_counter, tag, enc_buf, enc_buf_max_len, enc_buf_len) == false){
         cerr<<"ERR: Error in the encryption"<<endl;
         exit(1);
     };    
-    if (send(this->server_socket, enc_buf, enc_buf_len, 0) < 0){ cerr<<"ERR: Error in the sendto of the logout message."<<endl; exit(1); }
+    if (Framing::sendFrame(this->server_socket, (unsigned char*)enc_buf, enc_buf_len) < 0){ cerr<<"ERR: Error in the sendto of the logout message."<<endl; exit(1); }
     
     close(this->server_socket);
+    KeyPool::printPoolStats();
+    logged_out = true;
+    driver->event(EVENT_LOGOUT, "", NULL, 0);
 }
 
 /* ---------------------------------------------------------- *\
@@ -835,6 +1088,7 @@ bool SecureChatClient::checkLobby(char* msg, unsigned int buffer_len){
 |*                                                            *|
 \* ---------------------------------------------------------- */
 void SecureChatClient::senderKeyEstablishment(string receiver_username, EVP_PKEY* peer_key){
+    unsigned long long establishment_start = Instrumentation::now();
 
     /* ---------------------------------------------------------- *\    
     |* *************************   M1   ************************* *|
@@ -853,6 +1107,7 @@ void SecureChatClient::senderKeyEstablishment(string receiver_username, EVP_PKEY
     char m1[M1_SIZE];
     m1[0] = 6;
     Utility::secure_memcpy((unsigned char*)m1, 1, M1_SIZE, R, 0, R_SIZE, R_SIZE);
+    m1[1+R_SIZE] = suite | (aead << 4);
 
     /* ---------------------------------------------------------- *\
     |* Encrypt and send the message.                              *|
@@ -864,32 +1119,32 @@ void SecureChatClient::senderKeyEstablishment(string receiver_username, EVP_PKEY
     unsigned int enc_buf_max_len = M1_SIZE + ENC_FIELDS;
     unsigned int enc_buf_len;
     enc_buf = (unsigned char*)malloc(enc_buf_max_len);
-    if (Utility::encryptSessionMessage(M1_SIZE, this->K, (unsigned char*)m1, ciphertext, outlen, cipherlen, this->user_counter, tag, enc_buf, enc_buf_max_len, 1, enc_buf_len) == false){
+    if (Utility::encryptSessionMessage(M1_SIZE, this->server_cipher, (unsigned char*)m1, ciphertext, outlen, cipherlen, this->user_counter, tag, enc_buf, enc_buf_max_len, enc_buf_len) == false){
         cerr<<"ERR: Error in the encryption"<<endl;
         exit(1);
     };
     
-    if (send(this->server_socket, enc_buf, enc_buf_len, 0) < 0){ cerr<<"ERR: Error in the sendto of the M1 message."<<endl; exit(1); }
+    if (Framing::sendFrame(this->server_socket, (unsigned char*)enc_buf, enc_buf_len) < 0){ cerr<<"ERR: Error in the sendto of the M1 message."<<endl; exit(1); }
     cout<<"LOG: M1 sent"<<endl;
 
     /* ---------------------------------------------------------- *\
     |* *************************   M2   ************************* *|
-    \* ---------------------------------------------------------- *
+    \* ---------------------------------------------------------- */
 
     /* ---------------------------------------------------------- *\
     |* Receiving M2 message from the receiver                     *|
     \* ---------------------------------------------------------- */
     char* m2_enc_buf = (char*)malloc(M2_SIZE+ENC_FIELDS);
     if (!m2_enc_buf){ cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }
-    unsigned int len = recv(this->server_socket, (void*)m2_enc_buf, M2_SIZE+ENC_FIELDS, 0);
-    if (len < 0){ cerr<<"ERR: Error in receiving the RTT message"<<endl; exit(1); }
+    int len = readServerFrame((unsigned char*)m2_enc_buf, M2_SIZE+ENC_FIELDS);
+    if (len <= 0){ cerr<<"ERR: Error in receiving the RTT message"<<endl; exit(1); }
 
     unsigned char* m2 = (unsigned char*)malloc(M2_SIZE);
     if (!m2){ cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }
     unsigned int m2_len;
     incrementCounter(0);
     checkCounter(0, (unsigned char*)m2_enc_buf);
-    if (Utility::decryptSessionMessage(m2, (unsigned char*)m2_enc_buf, len, this->K, m2_len, 1) == false){
+    if (Utility::decryptSessionMessage(m2, (unsigned char*)m2_enc_buf, len, this->server_cipher, m2_len) == false){
         cerr<<"ERR: Error while decrypting"<<endl;
         exit(1);
     };
@@ -898,11 +1153,19 @@ void SecureChatClient::senderKeyEstablishment(string receiver_username, EVP_PKEY
     /* ---------------------------------------------------------- *\
     |* Verify message authenticity                                *|
     \* ---------------------------------------------------------- */
-    if(m2_len < (SIGNATURE_SIZE+R_SIZE)) { cerr<<"ERR: Wrap around"<<endl; exit(1); }
-    unsigned int clear_message_len = m2_len - SIGNATURE_SIZE - R_SIZE;
+    unsigned int peer_signature_len = EVP_PKEY_get_size(peer_key);
+    if(m2_len < (1+sizeof(long)+peer_signature_len+2*R_SIZE)) { cerr<<"ERR: Wrap around"<<endl; exit(1); }
+    if(m2_len > ((suite == SUITE_X25519) ? M2_X25519_SIZE : M2_SIZE)) { cerr<<"ERR: Wrong length of the message M2"<<endl; exit(1); }
+    unsigned int clear_message_len = m2_len - peer_signature_len - R_SIZE;
     if ((unsigned long)m2 + clear_message_len < (unsigned long)m2) { cerr<<"ERR: Wrap around"<<endl; exit(1); }
 
-    if(Utility::verifyMessage(peer_key, (char*)m2, clear_message_len, (unsigned char*)((unsigned long)m2+clear_message_len+R_SIZE), SIGNATURE_SIZE) != 1) { 
+    /* ---------------------------------------------------------- *    |* The receiver also signs the suite byte of the M1 it got:   *|
+    |* the check fails if the server changed the offered suite    *|
+    \* ---------------------------------------------------------- */
+    unsigned char signed_m2[M2_SIZE + 1];
+    memcpy(signed_m2, m2, clear_message_len);
+    signed_m2[clear_message_len] = m1[1+R_SIZE];
+    if(Utility::verifyMessage(peer_key, (char*)signed_m2, clear_message_len + 1, (unsigned char*)((unsigned long)m2+clear_message_len+R_SIZE), peer_signature_len) != 1) { 
         cerr<<"ERR: Authentication error while receiving message m2"<<endl; exit(1);
     }
     cout<<"LOG: M2 received"<<endl;
@@ -914,13 +1177,6 @@ void SecureChatClient::senderKeyEstablishment(string receiver_username, EVP_PKEY
     Utility::secure_memcpy(R_received, 0, R_SIZE, (unsigned char*)m2, 1, M2_SIZE, R_SIZE);
     if (!Utility::compareR(R, R_received)){ exit(1); }
 
-    /* ---------------------------------------------------------- *\
-    |* Key session generation                                     *|
-    \* ---------------------------------------------------------- */
-    RAND_poll();
-    unsigned char K[K_SIZE];
-    RAND_bytes(K, K_SIZE);
-
     /* ---------------------------------------------------------- *\
     |* Insert TpubK in a buffer for the BIO_write                 *|
     \* ---------------------------------------------------------- */
@@ -928,52 +1184,82 @@ void SecureChatClient::senderKeyEstablishment(string receiver_username, EVP_PKEY
     unsigned int message_len = 1  + R_SIZE;
     long pubkey_len;
     Utility::secure_memcpy((unsigned char*)&pubkey_len, 0, sizeof(long), m2, message_len, M2_SIZE, sizeof(long));
+    if (pubkey_len <= 0 || (unsigned long)pubkey_len > clear_message_len - message_len - sizeof(long)){ cerr<<"ERR: TpubK length is over the upper bound."<<endl; exit(1); }
     message_len += sizeof(long);
     unsigned char* tpubk_received = (unsigned char*)malloc(pubkey_len);
     if (!tpubk_received) { cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }
     Utility::secure_memcpy(tpubk_received, 0, pubkey_len, m2, message_len, M2_SIZE, pubkey_len);
     message_len += pubkey_len;
 
-    /* ---------------------------------------------------------- *\
-    |* Read the TpubK                                             *|
-    \* ---------------------------------------------------------- */
-    BIO* mbio = BIO_new(BIO_s_mem());
-    BIO_write(mbio, tpubk_received, PUBKEY_MSG_SIZE);
-    EVP_PKEY* tpubk = PEM_read_bio_PUBKEY(mbio, NULL, NULL, NULL);
-    BIO_free(mbio);
-
     unsigned char r2[R_SIZE];
     Utility::secure_memcpy(r2, 0, R_SIZE, m2, message_len, M2_SIZE, R_SIZE);
 
     /* ------------------------------------------------------------------------------------ *\
     |* **********************************   M3   ****************************************** *|
     \* ------------------------------------------------------------------------------------ */
-
-    /* ---------------------------------------------------------- *\
-    |* Encrypt K using TpubK                                      *|
-    \* ---------------------------------------------------------- */
     char* buf = (char*)malloc(M3_SIZE);
     buf[0] = 6;
-    Utility::secure_thread_memcpy((unsigned char*)buf, 1, M3_SIZE, r2, 0, R_SIZE, R_SIZE);
-
-    /* ---------------------------------------------------------- *\
-    |* Encrypt K using TpubK                                      *|
-    \* ---------------------------------------------------------- */
+    Utility::secure_memcpy((unsigned char*)buf, 1, M3_SIZE, r2, 0, R_SIZE, R_SIZE);
     len = 1+R_SIZE;
-    unsigned char plaintext[K_SIZE];
-    unsigned char* encrypted_key, *m3_ciphertext;
-    unsigned int m3_cipherlen;
-    int m3_outlen, encrypted_key_len;
-    Utility::secure_thread_memcpy(plaintext, 0, K_SIZE, K, 0, K_SIZE, K_SIZE);
 
+    unsigned char K[K_SIZE];
     unsigned char* iv;
-    if (!Utility::encryptMessage(K_SIZE, tpubk, plaintext, m3_ciphertext, encrypted_key, iv, encrypted_key_len, m3_outlen, m3_cipherlen)){ cerr<<"ERR: Error while encrypting"<<endl; pthread_exit(NULL); }
-    Utility::secure_thread_memcpy((unsigned char*)buf, len, M3_SIZE, m3_ciphertext, 0, K_SIZE+16, m3_cipherlen);
-    len += m3_cipherlen;
-    Utility::secure_thread_memcpy((unsigned char*)buf, len, M3_SIZE, iv, 0, BLOCK_SIZE, BLOCK_SIZE);
-    len += BLOCK_SIZE;
-    Utility::secure_thread_memcpy((unsigned char*)buf, len, M3_SIZE, encrypted_key, 0, EVP_PKEY_size(tpubk), encrypted_key_len);
-    len += encrypted_key_len;
+    if (suite == SUITE_X25519){
+        /* ---------------------------------------------------------- *\
+        |* Send our share and derive K from the one of the receiver   *|
+        \* ---------------------------------------------------------- */
+        unsigned long long key_start = Instrumentation::now();
+        EVP_PKEY* tsharek = KeyPool::pop(SUITE_X25519);
+        Tracer::record("ephemeral key", key_start, 0, username, receiver_username, false);
+        if (!Utility::writeShare(tsharek, (unsigned char*)buf+len)){ cerr<<"ERR: Error while writing the TpubK"<<endl; exit(1); }
+        len += X25519_SHARE_SIZE;
+        unsigned char salt[2*R_SIZE];
+        memcpy(salt, R, R_SIZE);
+        memcpy(salt+R_SIZE, r2, R_SIZE);
+        unsigned char* derived_K = deriveSharedK(tsharek, tpubk_received, pubkey_len, salt, "chat", iv);
+        memcpy(K, derived_K, K_SIZE);
+        OPENSSL_cleanse(derived_K, K_SIZE);
+        free(derived_K);
+        EVP_PKEY_free(tsharek);
+    } else {
+        /* ---------------------------------------------------------- *\
+        |* Key session generation                                     *|
+        \* ---------------------------------------------------------- */
+        RAND_poll();
+        RAND_bytes(K, K_SIZE);
+
+        /* ---------------------------------------------------------- *\
+        |* Read the TpubK                                             *|
+        \* ---------------------------------------------------------- */
+        BIO* mbio = BIO_new(BIO_s_mem());
+        BIO_write(mbio, tpubk_received, pubkey_len);
+        EVP_PKEY* tpubk = PEM_read_bio_PUBKEY(mbio, NULL, NULL, NULL);
+        BIO_free(mbio);
+        if (!tpubk){ cerr<<"ERR: Error while reading the TpubK"<<endl; exit(1); }
+
+        /* ---------------------------------------------------------- *\
+        |* Encrypt K using TpubK                                      *|
+        \* ---------------------------------------------------------- */
+        unsigned char plaintext[K_SIZE];
+        unsigned char* encrypted_key, *m3_ciphertext;
+        unsigned int m3_cipherlen;
+        int m3_outlen, encrypted_key_len;
+        Utility::secure_memcpy(plaintext, 0, K_SIZE, K, 0, K_SIZE, K_SIZE);
+
+        if (!Utility::encryptMessage(K_SIZE, tpubk, plaintext, m3_ciphertext, encrypted_key, iv, encrypted_key_len, m3_outlen, m3_cipherlen)){ cerr<<"ERR: Error while encrypting"<<endl; pthread_exit(NULL); }
+        Utility::secure_memcpy((unsigned char*)buf, len, M3_SIZE, m3_ciphertext, 0, K_SIZE+16, m3_cipherlen);
+        len += m3_cipherlen;
+        Utility::secure_memcpy((unsigned char*)buf, len, M3_SIZE, iv, 0, BLOCK_SIZE, BLOCK_SIZE);
+        len += BLOCK_SIZE;
+        Utility::secure_memcpy((unsigned char*)buf, len, M3_SIZE, encrypted_key, 0, EVP_PKEY_size(tpubk), encrypted_key_len);
+        len += encrypted_key_len;
+
+        /* ---------------------------------------------------------- *\
+        |* Delete TpubK                                               *|
+        \* ---------------------------------------------------------- */
+        EVP_PKEY_free(tpubk);
+    }
+    free(tpubk_received);
 
     /* ---------------------------------------------------------- *\
     |* Sign the R2                                                *|
@@ -981,8 +1267,9 @@ void SecureChatClient::senderKeyEstablishment(string receiver_username, EVP_PKEY
     unsigned char* signature;
     unsigned int signature_len;
     Utility::signMessage(this->client_prvkey, (char*)buf, len, &signature, &signature_len);
-    Utility::secure_thread_memcpy((unsigned char*)buf, len, S3_SIZE, signature, 0, SIGNATURE_SIZE, signature_len);
-    len += SIGNATURE_SIZE;
+    Utility::secure_memcpy((unsigned char*)buf, len, M3_SIZE, signature, 0, SIGNATURE_SIZE, signature_len);
+    free(signature);
+    len += signature_len;
 
     /* ---------------------------------------------------------- *\
     |* Encrypt and send the message.                              *|
@@ -994,20 +1281,17 @@ void SecureChatClient::senderKeyEstablishment(string receiver_username, EVP_PKEY
     unsigned int server_enc_buf_max_len = M3_SIZE + ENC_FIELDS;
     unsigned int server_enc_buf_len;
     server_enc_buf = (unsigned char*)malloc(server_enc_buf_max_len);
-    if (Utility::encryptSessionMessage(len, this->K, (unsigned char*)buf, server_ciphertext, server_outlen, server_cipherlen, this->user_counter, server_tag, server_enc_buf, server_enc_buf_max_len, 1, server_enc_buf_len) == false){
+    if (Utility::encryptSessionMessage(len, this->server_cipher, (unsigned char*)buf, server_ciphertext, server_outlen, server_cipherlen, this->user_counter, server_tag, server_enc_buf, server_enc_buf_max_len, server_enc_buf_len) == false){
         cerr<<"ERR: Error in the encryption"<<endl;
         exit(1);
     };
     
-    if (send(this->server_socket, server_enc_buf, server_enc_buf_len, 0) < 0){ cerr<<"ERR: Error in the sendto of the M3 message."<<endl; exit(1); }
+    if (Framing::sendFrame(this->server_socket, (unsigned char*)server_enc_buf, server_enc_buf_len) < 0){ cerr<<"ERR: Error in the sendto of the M3 message."<<endl; exit(1); }
     cout<<"LOG: M3 sent"<<endl;
-    /* ---------------------------------------------------------- *\
-    |* Delete TpubK                                               *|
-    \* ---------------------------------------------------------- */
-    EVP_PKEY_free(tpubk);
 
-    storeChatK(K);
+    storeChatK(K, aead, true);
     setChatCounters(iv);
+    Tracer::record("key establishment M1-M3", establishment_start, 0, username, receiver_username, false);
 
     chat(receiver_username, K, peer_key);
 
@@ -1020,6 +1304,7 @@ void SecureChatClient::senderKeyEstablishment(string receiver_username, EVP_PKEY
 |*                                                            *|
 \* ---------------------------------------------------------- */
 void SecureChatClient::receiverKeyEstablishment(string sender_username, EVP_PKEY* peer_key){
+    unsigned long long establishment_start = Instrumentation::now();
 
     /* ---------------------------------------------------------- *\
     |* *************************   M1   ************************* *|
@@ -1032,8 +1317,8 @@ void SecureChatClient::receiverKeyEstablishment(string sender_username, EVP_PKEY
     \* ---------------------------------------------------------- */
     char* enc_buf = (char*)malloc(M1_SIZE+ENC_FIELDS);
     if (!enc_buf){ cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }
-    unsigned int len = recv(this->server_socket, (void*)enc_buf, M1_SIZE+ENC_FIELDS, 0);
-    if (len < 0){ cerr<<"ERR: Error in receiving the RTT message"<<endl; exit(1); }
+    int len = readServerFrame((unsigned char*)enc_buf, M1_SIZE+ENC_FIELDS);
+    if (len <= 0){ cerr<<"ERR: Error in receiving the RTT message"<<endl; exit(1); }
 
     cout<<"LOG: M1 received"<<endl;
 
@@ -1042,7 +1327,7 @@ void SecureChatClient::receiverKeyEstablishment(string sender_username, EVP_PKEY
     unsigned int buf_len;
     incrementCounter(0);
     checkCounter(0, (unsigned char*)enc_buf);
-    if (Utility::decryptSessionMessage(m1, (unsigned char*)enc_buf, len, this->K, buf_len, 1) == false){
+    if (Utility::decryptSessionMessage(m1, (unsigned char*)enc_buf, len, this->server_cipher, buf_len) == false){
         cerr<<"ERR: Error while decrypting"<<endl;
         exit(1);
     };
@@ -1053,16 +1338,26 @@ void SecureChatClient::receiverKeyEstablishment(string sender_username, EVP_PKEY
     |* creating a buffer containing random nonce R received       *|
     |* from sender_username                                       *|
     \* ---------------------------------------------------------- */
+    if (buf_len != M1_SIZE){ cerr<<"ERR: Wrong length of the message M1"<<endl; exit(1); }
     unsigned char r[R_SIZE];
     memcpy(r, m1+1, R_SIZE);
 
+    /* ---------------------------------------------------------- *\
+    |* The receiver follows the suite offered by the sender       *|
+    \* ---------------------------------------------------------- */
+    unsigned char offered_suite = m1[1+R_SIZE];
+    unsigned char chat_suite = offered_suite & 0x0F;
+    unsigned char chat_aead = offered_suite >> 4;
+    if (chat_suite != SUITE_RSA && chat_suite != SUITE_X25519){ cerr<<"ERR: Key exchange suite not supported"<<endl; exit(1); }
+    if (!SessionCipher::cipher(chat_aead)){ cerr<<"ERR: AEAD suite not supported"<<endl; exit(1); }
+
     /* ---------------------------------------------------------- *\
     |* Generating TpubK e TprvK                                   *|
     \* ---------------------------------------------------------- */
-    EVP_PKEY* tprivk = Utility::generateTprivK(this->username);
-    EVP_PKEY* tpubk = Utility::generateTpubK(this->username);
-    Utility::removeTprivK(this->username);
-    Utility::removeTpubK(this->username);
+    unsigned long long key_start = Instrumentation::now();
+    EVP_PKEY* tprivk = KeyPool::pop(chat_suite);
+    EVP_PKEY* tpubk = (chat_suite == SUITE_X25519) ? tprivk : Utility::generateTpubK(tprivk);
+    Tracer::record("ephemeral key", key_start, 0, username, sender_username, false);
 
 
     /* ---------------------------------------------------------- *\
@@ -1086,25 +1381,25 @@ void SecureChatClient::receiverKeyEstablishment(string sender_username, EVP_PKEY
     Utility::secure_memcpy((unsigned char*)msg, len, M2_SIZE, r, 0, R_SIZE, R_SIZE);
     len += R_SIZE;
 
-    BIO* mbio = BIO_new(BIO_s_mem());
-    PEM_write_bio_PUBKEY(mbio, tpubk);
-    char* pubkey_buf = NULL;
-    long pubkey_size = BIO_get_mem_data(mbio, &pubkey_buf);
-    Utility::secure_memcpy((unsigned char*)msg, len, M2_SIZE, (unsigned char*)&pubkey_size, 0, sizeof(long), sizeof(long));
-    len += sizeof(long);
-    Utility::secure_memcpy((unsigned char*)msg, len, M2_SIZE, (unsigned char*)pubkey_buf, 0, pubkey_size, pubkey_size);
-    BIO_free(mbio);
-    len += pubkey_size;
+    len += writeTpubK((unsigned char*)msg + len, M2_SIZE - len, tpubk);
 
     unsigned int to_sign_len = len;
     Utility::secure_memcpy((unsigned char*)msg, len, M2_SIZE, r2, 0, R_SIZE, R_SIZE);
     len += R_SIZE;
 
+    /* ---------------------------------------------------------- *\
+    |* Sign the suite byte of M1 too, so that the sender can tell *|
+    |* whether the offer reached us unchanged. It is not sent     *|
+    \* ---------------------------------------------------------- */
     unsigned char* signature;
     unsigned int signature_len;
+    char signed_msg[M2_SIZE + 1];
+    memcpy(signed_msg, msg, to_sign_len);
+    signed_msg[to_sign_len] = offered_suite;
 
-    Utility::signMessage(client_prvkey, msg, to_sign_len, &signature, &signature_len);
+    Utility::signMessage(client_prvkey, signed_msg, to_sign_len + 1, &signature, &signature_len);
     Utility::secure_memcpy((unsigned char*)msg, len, M2_SIZE, (unsigned char*)signature, 0, SIGNATURE_SIZE, signature_len);
+    free(signature);
     len += signature_len;
 
     /* ---------------------------------------------------------- *\
@@ -1117,12 +1412,12 @@ void SecureChatClient::receiverKeyEstablishment(string sender_username, EVP_PKEY
     unsigned int m2_enc_buf_max_len = len + ENC_FIELDS;
     unsigned int m2_enc_buf_len;
     m2_enc_buf = (unsigned char*)malloc(m2_enc_buf_max_len);
-    if (Utility::encryptSessionMessage(len, this->K, (unsigned char*)msg, m2_ciphertext, m2_outlen, m2_cipherlen, this->user_counter, m2_tag, m2_enc_buf, m2_enc_buf_max_len, 0, m2_enc_buf_len) == false){
+    if (Utility::encryptSessionMessage(len, this->server_cipher, (unsigned char*)msg, m2_ciphertext, m2_outlen, m2_cipherlen, this->user_counter, m2_tag, m2_enc_buf, m2_enc_buf_max_len, m2_enc_buf_len) == false){
         cerr<<"Thread "<<gettid()<<"Error in the encryption"<<endl;
         pthread_exit(NULL);
     };
     
-    if (send(this->server_socket, m2_enc_buf, m2_enc_buf_len, 0) < 0){ cerr<<"ERR: Error in the send to of the M2 message."<<endl; exit(1); }
+    if (Framing::sendFrame(this->server_socket, (unsigned char*)m2_enc_buf, m2_enc_buf_len) < 0){ cerr<<"ERR: Error in the send to of the M2 message."<<endl; exit(1); }
     cout<<"LOG: M2 sent"<<endl;
 
     /* ---------------------------------------------------------- *\
@@ -1130,8 +1425,8 @@ void SecureChatClient::receiverKeyEstablishment(string sender_username, EVP_PKEY
     \* ---------------------------------------------------------- */
     char* m3_enc_buf = (char*)malloc(M3_SIZE+ENC_FIELDS);
     if (!m3_enc_buf){ cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }
-    len = recv(this->server_socket, (void*)m3_enc_buf, M3_SIZE+ENC_FIELDS, 0);
-    if (len < 0){ cerr<<"ERR: Error in receiving the RTT message"<<endl; exit(1); }
+    len = readServerFrame((unsigned char*)m3_enc_buf, M3_SIZE+ENC_FIELDS);
+    if (len <= 0){ cerr<<"ERR: Error in receiving the RTT message"<<endl; exit(1); }
 
     cout<<"LOG: M3 received"<<endl;
 
@@ -1140,11 +1435,12 @@ void SecureChatClient::receiverKeyEstablishment(string sender_username, EVP_PKEY
     unsigned int m3_buf_len;
     incrementCounter(0);
     checkCounter(0, (unsigned char*)m3_enc_buf);
-    if (Utility::decryptSessionMessage(buf, (unsigned char*)m3_enc_buf, len, this->K, m3_buf_len, 1) == false){
+    if (Utility::decryptSessionMessage(buf, (unsigned char*)m3_enc_buf, len, this->server_cipher, m3_buf_len) == false){
         cerr<<"ERR: Error while decrypting"<<endl;
         exit(1);
     };
     len = m3_buf_len;
+    if ((unsigned int)len > ((chat_suite == SUITE_X25519) ? M3_X25519_SIZE : M3_SIZE)){ cerr<<"ERR: Wrong length of the message M3"<<endl; exit(1); }
 
     if (buf[0] != 6){
         cerr<<"ERR: Message type is not corresponding to M3"<<endl;
@@ -1153,10 +1449,11 @@ void SecureChatClient::receiverKeyEstablishment(string sender_username, EVP_PKEY
     /* ---------------------------------------------------------- *\
     |* Verify the authenticity of the message                     *|
     \* ---------------------------------------------------------- */
+    unsigned int peer_signature_len = EVP_PKEY_get_size(peer_key);
     if ((unsigned long)buf + R_SIZE < R_SIZE){ cerr<<"Wrap around"<<endl; exit(1); }
-    if (len < SIGNATURE_SIZE){ cerr<<"Access out-of-bound"<<endl; exit(1); }
-    if ((unsigned long)buf + len < len){ cerr<<"Wrap around"<<endl; exit(1); }
-    if(Utility::verifyMessage(peer_key, (char*)buf, len - SIGNATURE_SIZE, (unsigned char*)((unsigned long)buf+len-SIGNATURE_SIZE), SIGNATURE_SIZE) != 1) { 
+    if ((unsigned int)len < 1 + R_SIZE + peer_signature_len){ cerr<<"Access out-of-bound"<<endl; exit(1); }
+    if ((unsigned long)buf + len < (unsigned long)len){ cerr<<"Wrap around"<<endl; exit(1); }
+    if(Utility::verifyMessage(peer_key, (char*)buf, len - peer_signature_len, (unsigned char*)((unsigned long)buf+len-peer_signature_len), peer_signature_len) != 1) { 
         cerr<<"ERR: Authentication error while receiving the M3 message"<<endl;
         exit(1);
     }
@@ -1168,49 +1465,64 @@ void SecureChatClient::receiverKeyEstablishment(string sender_username, EVP_PKEY
         exit(1);
     }
 
-    /* ---------------------------------------------------------- *\
-    |* Initialize variables for decrypting                        *|
-    \* ---------------------------------------------------------- */
-    const EVP_CIPHER* cipher = EVP_aes_256_cbc();
-    unsigned int iv_len = EVP_CIPHER_iv_length(cipher);
-    unsigned int encrypted_key_len = EVP_PKEY_size(tprivk);
-    unsigned int cphr_size = 2*BLOCK_SIZE;
-    unsigned int plaintext_len;
-    unsigned char* encrypted_key = (unsigned char*)malloc(encrypted_key_len);
-    unsigned char* m3_iv = (unsigned char*)malloc(iv_len);
-    unsigned char* ciphertext = (unsigned char*)malloc(cphr_size);
-    unsigned char* plaintext = (unsigned char*)malloc(cphr_size);
-    if(!encrypted_key || !m3_iv || !ciphertext || !plaintext) { cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }    
+    unsigned char K[K_SIZE];
+    unsigned char* m3_iv;
+    if (chat_suite == SUITE_X25519){
+        /* ---------------------------------------------------------- *\
+        |* Derive K from the share of the sender                      *|
+        \* ---------------------------------------------------------- */
+        unsigned char salt[2*R_SIZE];
+        memcpy(salt, r, R_SIZE);
+        memcpy(salt+R_SIZE, r2, R_SIZE);
+        unsigned char* derived_K = deriveSharedK(tprivk, buf+1+R_SIZE, len-1-R_SIZE-peer_signature_len, salt, "chat", m3_iv);
+        memcpy(K, derived_K, K_SIZE);
+        OPENSSL_cleanse(derived_K, K_SIZE);
+        free(derived_K);
+    } else {
+        /* ---------------------------------------------------------- *\
+        |* Initialize variables for decrypting                        *|
+        \* ---------------------------------------------------------- */
+        const EVP_CIPHER* cipher = Utility::AES_256_CBC;
+        unsigned int iv_len = EVP_CIPHER_iv_length(cipher);
+        unsigned int encrypted_key_len = EVP_PKEY_size(tprivk);
+        unsigned int cphr_size = 2*BLOCK_SIZE;
+        unsigned int plaintext_len;
+        unsigned char* encrypted_key = (unsigned char*)malloc(encrypted_key_len);
+        m3_iv = (unsigned char*)malloc(iv_len);
+        unsigned char* ciphertext = (unsigned char*)malloc(cphr_size);
+        unsigned char* plaintext = (unsigned char*)malloc(cphr_size);
+        if(!encrypted_key || !m3_iv || !ciphertext || !plaintext) { cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }    
 
-    /* ---------------------------------------------------------- *\
-    |* Insert the fields from S3 into the respective variables    *|
-    \* ---------------------------------------------------------- */
-    unsigned int index = 1+R_SIZE;
-    Utility::secure_memcpy(ciphertext, 0, cphr_size, (unsigned char*)buf, index, M3_SIZE, cphr_size);
-    index += cphr_size;
-    Utility::secure_memcpy(m3_iv, 0, iv_len, (unsigned char*)buf, index, M3_SIZE, iv_len);
-    index += iv_len;
-    Utility::secure_memcpy(encrypted_key, 0, encrypted_key_len, (unsigned char*)buf, index, M3_SIZE, encrypted_key_len);
+        /* ---------------------------------------------------------- *\
+        |* Insert the fields from S3 into the respective variables    *|
+        \* ---------------------------------------------------------- */
+        unsigned int index = 1+R_SIZE;
+        Utility::secure_memcpy(ciphertext, 0, cphr_size, (unsigned char*)buf, index, M3_SIZE, cphr_size);
+        index += cphr_size;
+        Utility::secure_memcpy(m3_iv, 0, iv_len, (unsigned char*)buf, index, M3_SIZE, iv_len);
+        index += iv_len;
+        Utility::secure_memcpy(encrypted_key, 0, encrypted_key_len, (unsigned char*)buf, index, M3_SIZE, encrypted_key_len);
 
-    /* ---------------------------------------------------------- *\
-    |* Decrypt the message                                        *|
-    \* ---------------------------------------------------------- */
-    if (!Utility::decryptMessage(plaintext, ciphertext, cphr_size, m3_iv, encrypted_key, encrypted_key_len, tprivk, plaintext_len)) { cerr<<"ERR: Error while decrypting"<<endl; exit(1); }
+        /* ---------------------------------------------------------- *\
+        |* Decrypt the message                                        *|
+        \* ---------------------------------------------------------- */
+        if (!Utility::decryptMessage(plaintext, ciphertext, cphr_size, m3_iv, encrypted_key, encrypted_key_len, tprivk, plaintext_len)) { cerr<<"ERR: Error while decrypting"<<endl; exit(1); }
 
-    /* ---------------------------------------------------------- *\
-    |* Analyze the content of the plaintext                       *|
-    \* ---------------------------------------------------------- */
-    unsigned char K[K_SIZE];
-    memcpy(K, plaintext, K_SIZE);
+        /* ---------------------------------------------------------- *\
+        |* Analyze the content of the plaintext                       *|
+        \* ---------------------------------------------------------- */
+        memcpy(K, plaintext, K_SIZE);
+    }
 
     /* ---------------------------------------------------------- *\
     |* Delete TpubK e TprivK                                      *|
     \* ---------------------------------------------------------- */
+    if (tpubk != tprivk){ EVP_PKEY_free(tpubk); }
     EVP_PKEY_free(tprivk);
-    EVP_PKEY_free(tpubk);
 
-    storeChatK(K);
+    storeChatK(K, chat_aead, false);
     setChatCounters(m3_iv);
+    Tracer::record("key establishment M1-M3", establishment_start, 0, username, sender_username, false);
 
     chat(sender_username, K, peer_key);
 }
@@ -1220,105 +1532,106 @@ void SecureChatClient::receiverKeyEstablishment(string sender_username, EVP_PKEY
 |* This function handles the chat between two users.          *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatClient::chat(string other_username, unsigned char* K, EVP_PKEY* peer_key){
+void SecureChatClient::chat(string other_username, unsigned char*, EVP_PKEY*){
     cout<<"LOG: Starting chat with "<<other_username<<"(press 'q' to logout)"<<endl;
-
-    /* ---------------------------------------------------------- *\
-    |* Create a fd_set structure to manage the server socket      *|
-    |* and the stdin.                                             *|
-    \* ---------------------------------------------------------- */
-    fd_set master, copy;
-    FD_ZERO(&master);
-
-    FD_SET(this->server_socket, &master);
-    FD_SET(STDIN_FILENO, &master);
-    unsigned int my_nonce = 0;
-    unsigned int other_nonce = 0;
+    driver->event(EVENT_CHAT_STARTED, other_username, NULL, 0);
 
     while(true){
-        copy = master;
+        /* ---------------------------------------------------------- *\
+        |* Wait for the server socket and the input of the driver     *|
+        \* ---------------------------------------------------------- */
+        bool socket_ready, input_ready;
+        if (!pollInput(socket_ready, input_ready)){ continue; }
 
-        int count = select(FD_SETSIZE, &copy, NULL, NULL, NULL);
         /* ---------------------------------------------------------- *\
         |* The client receive a message from the server on the socket *|
         \* ---------------------------------------------------------- */   
-        if (FD_ISSET(this->server_socket, &copy)){
-            char* server_enc_buf = (char*)malloc(GENERAL_MSG_SIZE+2*ENC_FIELDS);
-            if (!server_enc_buf){ cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }
-            unsigned int len = recv(this->server_socket, (void*)server_enc_buf, GENERAL_MSG_SIZE+2*ENC_FIELDS, 0);
+        if (socket_ready){
+            /* ---------------------------------------------------------- *\
+            |* The two records are decrypted in place: the one of the     *|
+            |* server contains the one of the other user                  *|
+            \* ---------------------------------------------------------- */
+            unsigned char record[MAX_FRAME_SIZE];
+            int len = readServerFrame(record, MAX_FRAME_SIZE);
             if (len < 0){ cerr<<"ERR: Error in receiving the RTT message"<<endl; exit(1); }
             if (len == 0){
                 cout<<"LOG: "<<other_username<<" has logged out"<<endl;
                 close(this->server_socket);
                 cout<<"LOG: Logout..."<<endl;
-                exit(0);
+                logged_out = true;
+                driver->event(EVENT_CHAT_ENDED, other_username, NULL, 0);
+                driver->event(EVENT_LOGOUT, "", NULL, 0);
+                return;
             }
 
-            unsigned char* client_enc_buf = (unsigned char*)malloc(GENERAL_MSG_SIZE+ENC_FIELDS);
-            if (!client_enc_buf){ cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }
             unsigned int server_buf_len;
             incrementCounter(0);
-            checkCounter(0, (unsigned char*)server_enc_buf);
-            if (Utility::decryptSessionMessage(client_enc_buf, (unsigned char*)server_enc_buf, len, this->K, server_buf_len, 1) == false){
+            checkCounter(0, record);
+            if (this->server_cipher.open(record, len, server_buf_len) == false){
                 cerr<<"ERR: Error while decrypting"<<endl;
                 exit(1);
             };
-            len = server_buf_len;
+            unsigned char* client_record = record + GCM_IV_SIZE;
             
-            if(checkLobby((char*)client_enc_buf, len) == true) {
+            if(checkLobby((char*)client_record, server_buf_len) == true) {
                 cout<<"LOG: Returning to the lobby..."<<endl;
+                driver->event(EVENT_CHAT_ENDED, other_username, NULL, 0);
                 return;
             };
 
-            unsigned char* buf = (unsigned char*)malloc(GENERAL_MSG_SIZE);
-            if (!buf){ cerr<<"ERR: There is not more space in memory to allocate a new buffer"<<endl; exit(1); }
             unsigned int buf_len;
             incrementChatCounter(0);
-            checkChatCounter(0, (unsigned char*)client_enc_buf);
-            if (Utility::decryptSessionMessage(buf, (unsigned char*)client_enc_buf, len, this->chat_K, buf_len, 1) == false){
+            checkChatCounter(0, client_record);
+            if (this->chat_cipher.open(client_record, server_buf_len, buf_len) == false){
                 cerr<<"ERR: Error while decrypting"<<endl;
                 exit(1);
             };
-            len = buf_len;
+            unsigned char* buf = client_record + GCM_IV_SIZE;
+
+            //The other user sends the next messages with the next key
+            if (buf_len == REKEY_SIZE && buf[0] == 16){
+                if (!this->chat_cipher.rekeyDecrypt()){ cerr<<"ERR: Error in the rekey of the chat"<<endl; exit(1); }
+                cout<<"LOG: Chat key of "<<other_username<<" ratcheted"<<endl;
+                continue;
+            }
 
-            if (buf[0] != 9) { cerr<<"ERR: Message type is not corresponding to chat message."<<endl; exit(1); }
+            //The tags after the plaintext leave room for the terminator
+            if (buf_len < 1 || buf[0] != 9) { cerr<<"ERR: Message type is not corresponding to chat message."<<endl; exit(1); }
             buf[buf_len] = '\0';
             if ((unsigned long)buf + 1 < 1){ cerr<<"ERR: Wrap around"; exit(1);}
-            Utility::printChatMessage(other_username, (char*)buf+1, buf_len);
+            Utility::printChatMessage(other_username, (char*)buf+1, buf_len - 1);
+            driver->event(EVENT_MESSAGE_RECEIVED, other_username, (char*)buf+1, buf_len - 1);
         }
         /* ---------------------------------------------------------- *\
         |* The client input a message in the stdin                    *|
         \* ---------------------------------------------------------- */    
-        if (FD_ISSET(STDIN_FILENO, &copy)){
-            char* input = (char*)malloc(INPUT_SIZE);
-            unsigned char msg[GENERAL_MSG_SIZE];
+        if (input_ready){
+            /* ---------------------------------------------------------- *\
+            |* The message is read directly where the two records will    *|
+            |* be sealed in place: IV | IV | msg | tag | tag               *|
+            \* ---------------------------------------------------------- */
+            unsigned char record[MAX_FRAME_SIZE];
+            unsigned char* msg = record + 2*GCM_IV_SIZE;
+            char* input = (char*)msg + 1;
             msg[0] = 9;
-            if (fgets(input, INPUT_SIZE, stdin)==NULL){ cerr<<"ERR: Error while reading from stdin."<<endl; exit(1);}
-            char* p = strchr(input, '\n');
-            if (p){*p = '\0';}
+            if (!driver->readInput(input, INPUT_SIZE)){ continue; }
             if (strcmp(input, "")==0){continue;}
             if (strcmp(input, "q")==0){
                 sendLobby();
                 cout<<"LOG: Returning to the lobby..."<<endl;
+                driver->event(EVENT_CHAT_ENDED, other_username, NULL, 0);
                 return;
             }
-            /* ---------------------------------------------------------- *\
-            |* Encrypt msg using K                                        *|
-            \* ---------------------------------------------------------- */
             unsigned int msg_len = 1 + strlen(input);
-            Utility::secure_memcpy(msg, 1, GENERAL_MSG_SIZE, (unsigned char*)input, 0, INPUT_SIZE, strlen(input));
 
             /* ---------------------------------------------------------- *\
-            |* Encrypt the message with user session key K                *|
+            |* Encrypt the message with the chat session key, the next    *|
+            |* one if the current one is worn out                         *|
             \* ---------------------------------------------------------- */
+            if (this->chat_cipher.encryptExpired()){ sendChatRekey(); }
             incrementChatCounter(1);
-            unsigned char* client_ciphertext, *client_tag, *client_enc_buf;
-            int client_outlen;
-            unsigned int client_cipherlen;
-            unsigned int client_enc_buf_max_len = msg_len + ENC_FIELDS;
             unsigned int client_enc_buf_len;
-            client_enc_buf = (unsigned char*)malloc(client_enc_buf_max_len);
-            if (Utility::encryptSessionMessage(msg_len, this->chat_K, (unsigned char*)msg, client_ciphertext, client_outlen, client_cipherlen, this->chat_my_counter, client_tag, client_enc_buf, client_enc_buf_max_len, 0, client_enc_buf_len) == false){
+            if (this->chat_cipher.seal(this->chat_my_counter, record + GCM_IV_SIZE, msg_len, MAX_FRAME_SIZE - GCM_IV_SIZE, client_enc_buf_len) == false){
                 cerr<<"Thread "<<gettid()<<"Error in the encryption"<<endl;
                 pthread_exit(NULL);
             };
@@ -1327,18 +1640,15 @@ void SecureChatClient::chat(string other_username, unsigned char* K, EVP_PKEY* p
             |* Encrypt usign server session key and send the message      *|
             \* ---------------------------------------------------------- */
             incrementCounter(1);
-            unsigned char* server_ciphertext, *server_tag, *server_enc_buf;
-            int server_outlen;
-            unsigned int server_cipherlen;
-            unsigned int server_enc_buf_max_len = client_enc_buf_len + ENC_FIELDS;
             unsigned int server_enc_buf_len;
-            server_enc_buf = (unsigned char*)malloc(server_enc_buf_max_len);
-            if (Utility::encryptSessionMessage(client_enc_buf_len, this->K, (unsigned char*)client_enc_buf, server_ciphertext, server_outlen, server_cipherlen, this->user_counter, server_tag, server_enc_buf, server_enc_buf_max_len, 0, server_enc_buf_len) == false){
+            if (this->server_cipher.seal(this->user_counter, record, client_enc_buf_len, MAX_FRAME_SIZE, server_enc_buf_len) == false){
                 cerr<<"Thread "<<gettid()<<"Error in the encryption"<<endl;
                 pthread_exit(NULL);
             };
             
-            if (send(this->server_socket, server_enc_buf, server_enc_buf_len, 0) < 0){ cerr<<"ERR: Error in the sendto a chat message."<<endl; exit(1); }
+            if (Framing::sendFrame(this->server_socket, record, server_enc_buf_len) < 0){ cerr<<"ERR: Error in the sendto a chat message."<<endl; exit(1); }
+            //The text has been sealed in place, the driver already knows it
+            driver->event(EVENT_MESSAGE_SENT, other_username, NULL, msg_len - 1);
         }
     }
 }
@@ -1349,9 +1659,9 @@ void SecureChatClient::chat(string other_username, unsigned char* K, EVP_PKEY* p
 |* for the communication with the server.                     *|
 \* ---------------------------------------------------------- */
 void SecureChatClient::setCounters(unsigned char* iv){
-    Utility::secure_memcpy((unsigned char*)&this->server_counter, 0, sizeof(__uint128_t), iv, 0, EVP_CIPHER_iv_length(EVP_aes_256_cbc()), sizeof(__uint128_t));
-    Utility::secure_memcpy((unsigned char*)&this->user_counter, 0, sizeof(__uint128_t), iv, 0, EVP_CIPHER_iv_length(EVP_aes_256_cbc()), sizeof(__uint128_t));
-    Utility::secure_memcpy((unsigned char*)&this->base_counter, 0, sizeof(__uint128_t), iv, 0, EVP_CIPHER_iv_length(EVP_aes_256_cbc()), sizeof(__uint128_t));
+    Utility::secure_memcpy((unsigned char*)&this->server_counter, 0, sizeof(__uint128_t), iv, 0, EVP_CIPHER_iv_length(Utility::AES_256_CBC), sizeof(__uint128_t));
+    Utility::secure_memcpy((unsigned char*)&this->user_counter, 0, sizeof(__uint128_t), iv, 0, EVP_CIPHER_iv_length(Utility::AES_256_CBC), sizeof(__uint128_t));
+    Utility::secure_memcpy((unsigned char*)&this->base_counter, 0, sizeof(__uint128_t), iv, 0, EVP_CIPHER_iv_length(Utility::AES_256_CBC), sizeof(__uint128_t));
     memset((unsigned char*)(&this->server_counter)+12, 0, 4);
     memset((unsigned char*)(&this->user_counter)+12, 0, 4);
     memset((unsigned char*)(&this->base_counter)+12, 0, 4);
@@ -1370,6 +1680,8 @@ void SecureChatClient::incrementCounter(int counter){
         return;
     }
     if (counter == 1){
+        //The record about to be sealed would go over the limit of the key: a rekey goes before it
+        if (this->server_cipher.isKeyed() && this->server_cipher.encryptExpired()){ sendRekey(); }
         this->user_counter++;
         memset((unsigned char*)(&this->user_counter)+12, 0, 4);
         return;
@@ -1404,12 +1716,76 @@ void SecureChatClient::checkCounter(int counter, unsigned char* received_counter
     exit(1);
 }
 
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function reads a record of the server. The rekey      *|
+|* messages are taken here: the server sends one just before  *|
+|* a record, so the read goes on with that record. A record   *|
+|* that is not a rekey is left to the caller, which decrypts  *|
+|* it again with its counter.                                 *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+int SecureChatClient::readServerFrame(unsigned char* buf, unsigned int size){
+    while (true){
+        int len = this->reader.readFrame(this->server_socket, buf, size);
+        if (len != GCM_IV_SIZE + REKEY_SIZE + TAG_SIZE){ return len; }
+
+        unsigned char record[GCM_IV_SIZE + REKEY_SIZE + TAG_SIZE];
+        unsigned int record_len;
+        memcpy(record, buf, len);
+        if (!this->server_cipher.open(record, len, record_len) || record[GCM_IV_SIZE] != 16){ return len; }
+        incrementCounter(0);
+        checkCounter(0, buf);
+        if (!this->server_cipher.rekeyDecrypt()){ cerr<<"ERR: Error in the rekey of the server records"<<endl; exit(1); }
+        cout<<"LOG: Key of the server ratcheted"<<endl;
+    }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function sends a rekey message to the server, sealed  *|
+|* with the old key, and moves to the next key.               *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void SecureChatClient::sendRekey(){
+    unsigned char record[GCM_IV_SIZE + REKEY_SIZE + TAG_SIZE];
+    unsigned int record_len;
+    record[GCM_IV_SIZE] = 16;
+    this->user_counter++;
+    memset((unsigned char*)(&this->user_counter)+12, 0, 4);
+    if (!this->server_cipher.seal(this->user_counter, record, REKEY_SIZE, sizeof(record), record_len)){ cerr<<"ERR: Error in the encryption"<<endl; exit(1); }
+    if (Framing::sendFrame(this->server_socket, record, record_len) < 0){ cerr<<"ERR: Error in the sendto of the rekey message."<<endl; exit(1); }
+    if (!this->server_cipher.rekeyEncrypt()){ cerr<<"ERR: Error in the rekey of the records to the server"<<endl; exit(1); }
+    cout<<"LOG: Key of the records to the server ratcheted"<<endl;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function sends a rekey message to the other user,     *|
+|* inside a record of the server like a chat message, and     *|
+|* moves the chat to the next key.                            *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void SecureChatClient::sendChatRekey(){
+    unsigned char record[2*GCM_IV_SIZE + REKEY_SIZE + 2*TAG_SIZE];
+    unsigned int client_record_len, record_len;
+    record[2*GCM_IV_SIZE] = 16;
+    incrementChatCounter(1);
+    if (!this->chat_cipher.seal(this->chat_my_counter, record + GCM_IV_SIZE, REKEY_SIZE, sizeof(record) - GCM_IV_SIZE, client_record_len)){ cerr<<"ERR: Error in the encryption"<<endl; exit(1); }
+    incrementCounter(1);
+    if (!this->server_cipher.seal(this->user_counter, record, client_record_len, sizeof(record), record_len)){ cerr<<"ERR: Error in the encryption"<<endl; exit(1); }
+    if (Framing::sendFrame(this->server_socket, record, record_len) < 0){ cerr<<"ERR: Error in the sendto of the rekey message."<<endl; exit(1); }
+    if (!this->chat_cipher.rekeyEncrypt()){ cerr<<"ERR: Error in the rekey of the chat"<<endl; exit(1); }
+    cout<<"LOG: Chat key ratcheted"<<endl;
+}
+
 /* ------------------------------------------------------------- *\
 |* to save the session key K used to communicate with the server.*|
 \* ------------------------------------------------------------- */
 void SecureChatClient::storeK(unsigned char* K){
     this->K = (unsigned char*)malloc(K_SIZE);
     Utility::secure_memcpy(this->K, 0, K_SIZE, K, 0, K_SIZE, K_SIZE);
+    if (!this->server_cipher.setKey(aead, this->K, KEY_LABEL_USER, KEY_LABEL_SERVER)){ cerr<<"ERR: Error in setting the session key"<<endl; exit(1); }
 }
 
 /* ---------------------------------------------------------- *\
@@ -1418,9 +1794,9 @@ void SecureChatClient::storeK(unsigned char* K){
 |* for the communication with the other peer.                 *|
 \* ---------------------------------------------------------- */
 void SecureChatClient::setChatCounters(unsigned char* iv){
-    Utility::secure_memcpy((unsigned char*)&this->chat_peer_counter, 0, sizeof(__uint128_t), iv, 0, EVP_CIPHER_iv_length(EVP_aes_256_cbc()), sizeof(__uint128_t));
-    Utility::secure_memcpy((unsigned char*)&this->chat_my_counter, 0, sizeof(__uint128_t), iv, 0, EVP_CIPHER_iv_length(EVP_aes_256_cbc()), sizeof(__uint128_t));
-    Utility::secure_memcpy((unsigned char*)&this->chat_base_counter, 0, sizeof(__uint128_t), iv, 0, EVP_CIPHER_iv_length(EVP_aes_256_cbc()), sizeof(__uint128_t));
+    Utility::secure_memcpy((unsigned char*)&this->chat_peer_counter, 0, sizeof(__uint128_t), iv, 0, EVP_CIPHER_iv_length(Utility::AES_256_CBC), sizeof(__uint128_t));
+    Utility::secure_memcpy((unsigned char*)&this->chat_my_counter, 0, sizeof(__uint128_t), iv, 0, EVP_CIPHER_iv_length(Utility::AES_256_CBC), sizeof(__uint128_t));
+    Utility::secure_memcpy((unsigned char*)&this->chat_base_counter, 0, sizeof(__uint128_t), iv, 0, EVP_CIPHER_iv_length(Utility::AES_256_CBC), sizeof(__uint128_t));
     memset((unsigned char*)(&this->chat_peer_counter)+12, 0, 4);
     memset((unsigned char*)(&this->chat_my_counter)+12, 0, 4);
     memset((unsigned char*)(&this->chat_base_counter)+12, 0, 4);
@@ -1477,9 +1853,10 @@ void SecureChatClient::checkChatCounter(int counter, unsigned char* received_cou
 /* ------------------------------------------------------------- *\
 |* to save the session key K used to communicate with the peer.  *|
 \* ------------------------------------------------------------- */
-void SecureChatClient::storeChatK(unsigned char* K){
+void SecureChatClient::storeChatK(unsigned char* K, unsigned char chat_aead, bool sender){
     this->chat_K = (unsigned char*)malloc(K_SIZE);
     Utility::secure_memcpy(this->chat_K, 0, K_SIZE, K, 0, K_SIZE, K_SIZE);
+    if (!this->chat_cipher.setKey(chat_aead, this->chat_K, sender ? KEY_LABEL_SENDER : KEY_LABEL_RECEIVER, sender ? KEY_LABEL_RECEIVER : KEY_LABEL_SENDER)){ cerr<<"ERR: Error in setting the chat key"<<endl; exit(1); }
 }
 
 /* ---------------------------------------------------------- *\
@@ -1500,9 +1877,9 @@ void SecureChatClient::sendLobby(){
     unsigned int enc_buf_max_len = RETURN_TO_LOBBY_SIZE + ENC_FIELDS;
     unsigned int enc_buf_len;
     enc_buf = (unsigned char*)malloc(enc_buf_max_len);
-    if (Utility::encryptSessionMessage(RETURN_TO_LOBBY_SIZE, this->K, (unsigned char*)msg, ciphertext, outlen, cipherlen, this->user_counter, tag, enc_buf, enc_buf_max_len, 1, enc_buf_len) == false){
+    if (Utility::encryptSessionMessage(RETURN_TO_LOBBY_SIZE, this->server_cipher, (unsigned char*)msg, ciphertext, outlen, cipherlen, this->user_counter, tag, enc_buf, enc_buf_max_len, enc_buf_len) == false){
         cerr<<"ERR: Error in the encryption"<<endl;
         exit(1);
     };    
-    if (send(this->server_socket, enc_buf, enc_buf_len, 0) < 0){ cerr<<"ERR: Error in the sendto of the return to lobby message."<<endl; exit(1); }
+    if (Framing::sendFrame(this->server_socket, (unsigned char*)enc_buf, enc_buf_len) < 0){ cerr<<"ERR: Error in the sendto of the return to lobby message."<<endl; exit(1); }
 }
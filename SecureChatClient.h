@@ -4,6 +4,11 @@
 #include <arpa/inet.h>
 #include <cstring>
 #include "Utility.h"
+#include "Framing.h"
+#include "KeyPool.h"
+#include "SessionCipher.h"
+#include "ClientDriver.h"
+#include "Tracer.h"
 
 class SecureChatClient{
     private:
@@ -19,20 +24,36 @@ class SecureChatClient{
         unsigned char* K;
         unsigned char* chat_K;
 
+        //Contexts keyed once with K and chat_K
+        SessionCipher server_cipher;
+        SessionCipher chat_cipher;
+
         //Client username
-        static string username;
+        string username;
 
         //Client choice
-        static unsigned int choice;
+        unsigned int choice;
+
+        //Key exchange suite offered in S2 and M1 (SUITE_RSA or SUITE_X25519)
+        unsigned char suite;
+
+        //AEAD suite offered in S2, R2 and M1 for the records
+        unsigned char aead;
 
         //Client private key
-        static EVP_PKEY* client_prvkey;
+        EVP_PKEY* client_prvkey;
 
         //CA certificate
-        static X509* ca_certificate;
+        X509* ca_certificate;
 
         //CRL
-        static X509_CRL* ca_crl;
+        X509_CRL* ca_crl;
+
+        //Source of the choices and of the messages, told about every step of the session
+        ClientDriver* driver;
+
+        //Set by the logout, the session unwinds back to the constructor
+        bool logged_out;
 
         //Port and IP address of the server
         struct sockaddr_in server_addr;
@@ -40,20 +61,23 @@ class SecureChatClient{
         unsigned short int server_port;
         int server_socket;
 
+        //Frames received from the server and not yet read
+        FrameReader reader;
+
         //Server certificate
         X509* server_certificate;
 
         //Server Public key
         EVP_PKEY* server_pubkey;
 
-        //Get the server private key
-        static EVP_PKEY* getPrvKey();
+        //Get the private key of the user, decrypted with password (NULL: the environment, else a prompt on the terminal)
+        EVP_PKEY* getPrvKey(const char* password);
 
         //Get the server certificate
-        static X509* getCertificate();
+        X509* getCertificate();
 
         //Get the server CRL
-        static X509_CRL* getCRL();
+        X509_CRL* getCRL();
 
         //Setup the server address into the sockaddr_in structure
         void setupServerAddress(unsigned short int server_port, const char *server_addr);
@@ -76,13 +100,16 @@ class SecureChatClient{
         //Authenticate user
         void authenticateUser(unsigned int choice, unsigned char* R_server, EVP_PKEY* tpubk, unsigned char* &R_user);
 
-        //Receive the list of available users
+        //Receive the list of available users, until the driver selects one. Empty after a logout
         string receiveAvailableUsers();
 
+        //Wait for the socket or for the input of the driver. False if neither is ready
+        bool pollInput(bool &socket_ready, bool &input_ready);
+
         //Send request to talk to the selected user
         void sendRTT(string selected_user);
 
-        //Wait for a message from another user
+        //Wait for a message from another user. Empty after a logout
         string waitForRTT();
 
         //Send response to RTT
@@ -109,7 +136,25 @@ class SecureChatClient{
 
         void chat(string other_username, unsigned char* K, EVP_PKEY* peer_key);
 
-        unsigned char* receiveS3Message(unsigned char* &iv, EVP_PKEY* tprivk, unsigned char* R_user);
+        unsigned char* receiveS3Message(unsigned char* &iv, EVP_PKEY* tprivk, unsigned char* R_user, unsigned char* R_server);
+
+        //Path of the file keeping the ticket of the last session
+        string getTicketPath();
+
+        //Read the stored ticket and its resumption secret, false if there is none or it is expired
+        bool loadTicket(unsigned char* secret, unsigned char* ticket);
+
+        //Resume the last session with its ticket (R2/R3), NULL if the full login is needed
+        unsigned char* resumeSession(unsigned int choice, unsigned char* R_server, unsigned char* R_user, unsigned char* &iv);
+
+        //Receive the ticket of the session and store it for the next login
+        void receiveTicket(unsigned char* R_server, unsigned char* R_user);
+
+        //Write the length and the bytes of an ephemeral public key (PEM for RSA, raw share for X25519)
+        unsigned int writeTpubK(unsigned char* buf, unsigned int size, EVP_PKEY* tpubk);
+
+        //Derive K and the IV of the counters from the X25519 share of the other party
+        unsigned char* deriveSharedK(EVP_PKEY* tsharek, unsigned char* share, unsigned int share_len, unsigned char* salt, const char* label, unsigned char* &iv);
 
         void setCounters(unsigned char* iv);
 
@@ -125,7 +170,17 @@ class SecureChatClient{
 
         void storeK(unsigned char* K);
 
-        void storeChatK(unsigned char* K);
+        //Read a frame of the server, after the rekey messages in front of it
+        int readServerFrame(unsigned char* buf, unsigned int size);
+
+        //Send a rekey message to the server and move to the next key
+        void sendRekey();
+
+        //Send a rekey message to the other user of the chat and move to the next chat key
+        void sendChatRekey();
+
+        //Key the chat cipher; the sender of the RTT and the receiver take opposite directions
+        void storeChatK(unsigned char* K, unsigned char chat_aead, bool sender);
 
         void sendAck();
 
@@ -134,6 +189,7 @@ class SecureChatClient{
         bool checkLobby(char* msg, unsigned int buffer_len);
 
     public:
-        //Constructor that gets the username, the server address and the server port
-        SecureChatClient(string username, const char *server_addr, unsigned short int server_port);
+        //Constructor that gets the username, the server address, the server port, the suites, the driver of the session
+        //and the password of the private key of the user; returns at the logout
+        SecureChatClient(string username, const char *server_addr, unsigned short int server_port, unsigned char key_exchange_suite, unsigned char aead_suite, ClientDriver* driver, const char* key_password = NULL);
 };
\ No newline at end of file
@@ -2,17 +2,39 @@
 #include <cstring>
 #include <iostream>
 #include <openssl/x509.h>
-#include <sys/select.h>
 #include <signal.h>
+#include <errno.h>
+#include <thread>
+#include <chrono>
 
-EVP_PKEY* SecureChatServer::server_prvkey = NULL;
-X509* SecureChatServer::server_certificate = NULL;
+atomic<shared_ptr<const ServerIdentity>> SecureChatServer::identity;
 map<string, User>* SecureChatServer::users = NULL;
 
 /* ---------------------------------------------------------- *\
-|* Close each client socket when the server shutdown          *|
+|*                                                            *|
+|* This function is the shutdown thread: on SIGINT it prints  *|
+|* the statistics, closes each client socket and exits. It    *|
+|* takes the signal with sigwait instead of a handler, so the *|
+|* printers can allocate and lock the streams like any other  *|
+|* thread.                                                    *|
+|*                                                            *|
 \* ---------------------------------------------------------- */
-void sig_handler(int signum){
+void SecureChatServer::shutdownOnSignal(){
+    sigset_t shutdown_set;
+    sigemptyset(&shutdown_set);
+    sigaddset(&shutdown_set, SIGINT);
+    int signum;
+    while (sigwait(&shutdown_set, &signum) != 0);
+
+    Logger::flush();
+    ProtocolStateMachine::printPhaseStats();
+    BufferPool::printPoolStats();
+    KeyPool::printPoolStats();
+    UserKeyCache::printCacheStats();
+    SessionTickets::printTicketStats();
+    CryptoPool::printPoolStats();
+    LatencyStats::printLatencyStats();
+    Logger::printLoggerStats();
     for (map<string,User>::iterator it=(*SecureChatServer::users).begin(); it!=(*SecureChatServer::users).end(); ++it){
         close(it->second.socket);
     }
@@ -23,7 +45,9 @@ void sig_handler(int signum){
 |* Class Destructor                                           *|
 \* ---------------------------------------------------------- */
 SecureChatServer::~SecureChatServer(){
-    close(this->listening_socket);
+    for (unsigned int i = 0; i < this->reactors.size(); i++){
+        delete this->reactors[i];
+    }
 }
 
 /* ---------------------------------------------------------- *\
@@ -31,19 +55,56 @@ SecureChatServer::~SecureChatServer(){
 |* This function setups the server.                           *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-SecureChatServer::SecureChatServer(const char *addr, unsigned short int port, const char *user_filename) {
+SecureChatServer::SecureChatServer(const char *addr, unsigned short int port, const char *user_filename, unsigned int reactor_threads, IoBackend backend, const char* metrics_endpoint, const char* trace_path) {
+
+    //The writes of io_uring on a closed socket would raise SIGPIPE, the error is handled by the reactor
+    signal(SIGPIPE, SIG_IGN);
+
+    /* ---------------------------------------------------------- *\
+    |* SIGINT is only taken by the shutdown thread, SIGHUP by the *|
+    |* reload one, SIGUSR1 by the one printing the latencies and  *|
+    |* SIGUSR2 by the one writing the trace: block them before    *|
+    |* any other thread starts, so that they all inherit the mask *|
+    \* ---------------------------------------------------------- */
+    sigset_t reload_set;
+    sigemptyset(&reload_set);
+    sigaddset(&reload_set, SIGINT);
+    sigaddset(&reload_set, SIGHUP);
+    sigaddset(&reload_set, SIGUSR1);
+    if (trace_path){ sigaddset(&reload_set, SIGUSR2); }
+    pthread_sigmask(SIG_BLOCK, &reload_set, NULL);
+
+    //The protocol steps are logged by the writer thread of the logger
+    Logger::start();
+    thread(&SecureChatServer::shutdownOnSignal).detach();
+    LatencyStats::start(SIGUSR1);
+    if (trace_path){
+        Tracer::start(trace_path, "server", SIGUSR2);
+        Logger::info("Trace written to ", trace_path, " on SIGUSR2 and at the exit");
+    }
 
-    signal(2,sig_handler);
+    /* ---------------------------------------------------------- *\
+    |* Read the server private key and certificate               *|
+    \* ---------------------------------------------------------- */
+    shared_ptr<const ServerIdentity> server_identity = getIdentity();
+    if (!server_identity){ cerr<<"ERR: Error in reading the server identity"<<endl; exit(1); }
+    identity.store(server_identity);
+    thread(&SecureChatServer::reloadIdentity).detach();
+
+    /* ---------------------------------------------------------- *\
+    |* Keep X25519 key pairs ready for the S3 of the logins       *|
+    \* ---------------------------------------------------------- */
+    KeyPool::start(SUITE_X25519, SERVER_KEY_POOL_SIZE);
 
     /* ---------------------------------------------------------- *\
-    |* Read the server private key                                *|
+    |* Key of the resumption tickets of this run                  *|
     \* ---------------------------------------------------------- */
-    server_prvkey = getPrvKey();
+    SessionTickets::start();
 
     /* ---------------------------------------------------------- *\
-    |* Read the server certificate                                *|
+    |* Workers for the handshakes and the large records           *|
     \* ---------------------------------------------------------- */
-    server_certificate = getCertificate();
+    CryptoPool::start(0);
 
     /* ---------------------------------------------------------- *\
     |* Set the server address and the server port in the          *|
@@ -59,350 +120,964 @@ SecureChatServer::SecureChatServer(const char *addr, unsigned short int port, co
     this->users = loadUsers(user_filename);
 
     /* ---------------------------------------------------------- *\
-    |* Setup the server socket                                    *|
+    |* Keep the parsed user keys in memory and watch their files  *|
+    \* ---------------------------------------------------------- */
+    if (this->users){ UserKeyCache::start("./server/", this->users); }
+
+    /* ---------------------------------------------------------- *\
+    |* Serve the metrics on the local endpoint, if any            *|
     \* ---------------------------------------------------------- */
-    setupSocket();
+    if (metrics_endpoint && !ServerMetrics::start(metrics_endpoint)){ exit(1); }
 
     /* ---------------------------------------------------------- *\
-    |* Let the server listen to client requests                   *|
+    |* Start the shards, each one with its own listening socket   *|
+    \* ---------------------------------------------------------- */
+    setupReactors(reactor_threads, backend);
+
+    /* ---------------------------------------------------------- *\
+    |* Let the shards serve the client requests                   *|
     \* ---------------------------------------------------------- */
     listenRequests();
 }
 
 /* ---------------------------------------------------------- *\
 |*                                                            *|
-|* This function gets the server private key.                 *|
+|* This function reads the server private key and the server  *|
+|* certificate, serializing the certificate once for all the  *|
+|* S1 messages.                                               *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-EVP_PKEY* SecureChatServer::getPrvKey() {
-    server_prvkey = Utility::readPrvKey("./server/server_key.pem", NULL);
-    return server_prvkey;
+shared_ptr<const ServerIdentity> SecureChatServer::getIdentity() {
+    return ServerIdentity::load("./server/server_key.pem", "./server/server_cert.pem");
 }
 
 /* ---------------------------------------------------------- *\
 |*                                                            *|
-|* This function gets the server private key.                 *|
+|* This function is the reload thread: on SIGHUP it reads the *|
+|* key and certificate again and swaps them atomically. The   *|
+|* connections past S1 keep signing with the key of the       *|
+|* certificate they received; a file that is not valid keeps  *|
+|* the current identity.                                      *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-EVP_PKEY* SecureChatServer::getUserKey(string username) {
-    string path = "./server/" + username + "_pubkey.pem";
-    EVP_PKEY* username_pubkey = Utility::readPubKey(path.c_str(), NULL);
-    return username_pubkey;
+void SecureChatServer::reloadIdentity() {
+    sigset_t reload_set;
+    sigemptyset(&reload_set);
+    sigaddset(&reload_set, SIGHUP);
+    while (true){
+        int signum;
+        if (sigwait(&reload_set, &signum) != 0){ continue; }
+        shared_ptr<const ServerIdentity> server_identity = getIdentity();
+        if (!server_identity){ Logger::error("Server certificate not reloaded, the current one is kept"); continue; }
+        identity.store(server_identity);
+        Logger::info("Server certificate reloaded");
+    }
 }
 
 /* ---------------------------------------------------------- *\
 |*                                                            *|
-|* This function gets the server certificate.                 *|
+|* This function gets the public key of a user from the key   *|
+|* cache, filled at startup and kept up to date by inotify.   *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-X509* SecureChatServer::getCertificate(){
-    server_certificate = Utility::readCertificate("./server/server_cert.pem");
-    return server_certificate;
+shared_ptr<UserKey> SecureChatServer::getUserKey(string username) {
+    shared_ptr<UserKey> user_key = UserKeyCache::get(username);
+    if (!user_key){ Logger::error("Public key of ", username, " not found"); }
+    return user_key;
 }
 
 /* ---------------------------------------------------------- *\
 |*                                                            *|
-|* This function setups the server socket.                    *|
+|* This function setups a listening socket of the server.     *|
+|* Every shard has its own one, bound to the same address     *|
+|* with SO_REUSEPORT: the kernel spreads the incoming         *|
+|* connections among them.                                    *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatServer::setupSocket(){
-    this->listening_socket = socket(AF_INET, SOCK_STREAM, 0);
+int SecureChatServer::setupSocket(){
+    int listening_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listening_socket < 0){
+        Logger::error("Error in the creation of the socket");
+        exit(1);
+    }
 	memset(&this->server_addr, 0, sizeof(this->server_addr));
 	this->server_addr.sin_family = AF_INET;
 	this->server_addr.sin_port = htons(this->port);
     inet_pton(AF_INET, this->address, &this->server_addr.sin_addr);
-	cout<<"Thread "<<gettid()<<": Socket created to receive client requests."<<endl;
+	Logger::info("Socket created to receive client requests.");
 
-	if (bind(this->listening_socket, (struct sockaddr*)&this->server_addr, sizeof(this->server_addr)) < 0){
-		cerr<<"Thread "<<gettid()<<": Error in the bind"<<endl;
+    int enable = 1;
+    if (setsockopt(listening_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0 ||
+        setsockopt(listening_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0){
+        Logger::error("Error in the setsockopt");
+        exit(1);
+    }
+
+	if (bind(listening_socket, (struct sockaddr*)&this->server_addr, sizeof(this->server_addr)) < 0){
+		Logger::error("Error in the bind");
 		exit(1);
 	}
 
-    if (listen(this->listening_socket, 10)){
-        cerr<<"Thread "<<gettid()<<": Error in the listen"<<endl;
+    if (listen(listening_socket, SOMAXCONN)){
+        Logger::error("Error in the listen");
         exit(1);
     }
 
-	cout<<"Thread "<<gettid()<<": Socket associated through bind."<<endl;
+	Logger::info("Socket associated through bind.");
+    return listening_socket;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function starts the shards. Each one has a reactor    *|
+|* thread pinned to a CPU and its own listening socket, and   *|
+|* owns the connections it accepts.                           *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void SecureChatServer::setupReactors(unsigned int reactor_threads, IoBackend backend){
+    if (reactor_threads == 0){ reactor_threads = 1; }
+    for (unsigned int i = 0; i < reactor_threads; i++){
+        Reactor* reactor = new Reactor(i, backend,
+                                       [this](Connection* conn){ handleConnection(conn); },
+                                       [this](Connection* conn, unsigned char* buf, int len){ handleData(conn, buf, len); },
+                                       [this](Reactor* r){ acceptConnections(r); });
+        if (!reactor->setListener(setupSocket())){ exit(1); }
+        this->reactors.push_back(reactor);
+    }
+    for (unsigned int i = 0; i < reactor_threads; i++){
+        this->reactors[i]->start();
+    }
+    Logger::info(reactor_threads, " reactor threads started (", (this->reactors[0]->usesRing() ? "io_uring" : "epoll"), ").");
 }
 
 /* ---------------------------------------------------------- *\
 |*                                                            *|
-|* This function contains the role of the main thread that    *|
-|* listens to requests and starts new threads to handle them. *|
+|* This function contains the role of the main thread, that   *|
+|* waits for the shards.                                      *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
 void SecureChatServer::listenRequests(){
-    pid_t pid;
+    for (unsigned int i = 0; i < this->reactors.size(); i++){
+        this->reactors[i]->join();
+    }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function accepts the requests waiting on the          *|
+|* listening socket of a shard. It is called by its reactor.  *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void SecureChatServer::acceptConnections(Reactor* reactor){
     int new_socket;
     struct sockaddr_in client_addr;
     memset(&client_addr, 0, sizeof(client_addr));
     socklen_t addrlen = sizeof(struct sockaddr_in);
-    addrlen = sizeof(client_addr);
 
     while(1){
         /* ---------------------------------------------------------- *\
-        |* Waiting for a client request                               *|
+        |* Take the next client request, if any                       *|
         \* ---------------------------------------------------------- */
-        new_socket = accept(this->listening_socket, (struct sockaddr*)&client_addr, &addrlen);
+        addrlen = sizeof(client_addr);
+        new_socket = accept4(reactor->getListener(), (struct sockaddr*)&client_addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (new_socket < 0){
-            cerr<<"Thread "<<gettid()<<"Error in the accept"<<endl;
-            exit(1);
+            if (errno == EINTR || errno == ECONNABORTED){ continue; }
+            if (errno != EAGAIN && errno != EWOULDBLOCK){ Logger::error("Error in the accept"); }
+            return;
         }
-        cout<<"Thread "<<gettid()<<": Request received by a client with address "<<inet_ntoa(client_addr.sin_addr)<<" and port "<<ntohs(client_addr.sin_port)<<endl;
+        Logger::info("Request received by a client with address ", inet_ntoa(client_addr.sin_addr), " and port ", ntohs(client_addr.sin_port));
+
+        shared_ptr<Connection> conn = make_shared<Connection>(new_socket, client_addr);
+        ProtocolStateMachine::start(conn.get());
+
+        /* ---------------------------------------------------------- *\
+        |* Create R_server                                            *|
+        \* ---------------------------------------------------------- */
+        RAND_poll();
+        RAND_bytes(conn->R_server, R_SIZE);
 
         /* ---------------------------------------------------------- *\
-        |* Create a new thread to handle the new connection           *|
+        |* Send certificate to the new user (S1)                      *|
         \* ---------------------------------------------------------- */
-        thread handler (&SecureChatServer::handleConnection, this, new_socket, client_addr);
-        handler.detach();
+        Logger::info("Starting Key Establishment with the new client");
+        unsigned long long s1_start = Instrumentation::now();
+        if (!sendCertificate(conn.get())){
+            conn->close();
+            continue;
+        }
+        LatencyStats::record(LATENCY_S1, s1_start);
+        Tracer::record("S1", s1_start, conn->id, "", "", false);
+        Logger::info("Message S1 sent");
+
+        /* ---------------------------------------------------------- *\
+        |* The shard will handle the rest of the protocol             *|
+        \* ---------------------------------------------------------- */
+        if (!reactor->registerConnection(conn)){
+            conn->close();
+            continue;
+        }
+        session(conn).detach();
     }
 }
 
 /* ---------------------------------------------------------- *\
 |*                                                            *|
-|* This function handles a single client until he/she is      *|
-|* linked to another client.                                  *|
+|* This function reads all the bytes available on a           *|
+|* connection and resumes its session with each frame. It is  *|
+|* called by the reactor owning the connection.               *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatServer::handleConnection(int data_socket, sockaddr_in client_address){
-    /* ---------------------------------------------------------- *\
-    |* Create R_server                                            *|
-    \* ---------------------------------------------------------- */
-    RAND_poll();
-    unsigned char R_server[R_SIZE];
-    RAND_bytes(R_server, R_SIZE);
+void SecureChatServer::handleConnection(Connection* conn){
+    Reactor* owner = conn->reactor.load();
+
+    //Stop as soon as the connection is handed off to another shard
+    while(!conn->closed && conn->reactor == owner){
+        if (!deliverFrames(conn)){ return; }
+
+        ssize_t len = conn->reader.fill(conn->socket);
+        if (len < 0 && errno == EINTR){ continue; }
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            conn->reader.release();
+            return;
+        }
+        if (len <= 0){
+            handleRecord(conn, NULL, len);
+            return;
+        }
+    }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function takes the bytes received by the ring on a    *|
+|* connection, or its end if len <= 0.                        *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void SecureChatServer::handleData(Connection* conn, unsigned char* buf, int len){
+    if (len <= 0){
+        handleRecord(conn, NULL, len);
+        return;
+    }
+    if (!conn->reader.append(buf, len)){
+        Logger::error("Frame over the size limit");
+        handleRecord(conn, NULL, -1);
+        return;
+    }
+    if (deliverFrames(conn)){ conn->reader.release(); }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function gives the frames already received to the     *|
+|* session. It stops if the connection is closed or handed    *|
+|* off, and returns false in that case.                       *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool SecureChatServer::deliverFrames(Connection* conn){
+    unsigned char buf[MAX_FRAME_SIZE];
+    Reactor* owner = conn->reactor.load();
+
+    while(!conn->closed && conn->reactor == owner){
+        unsigned int len;
+        int status = conn->reader.next(buf, MAX_FRAME_SIZE, len);
+        if (status == FRAME_PARTIAL){ return true; }
+        if (status == FRAME_INVALID){
+            Logger::error("Frame over the size limit");
+            handleRecord(conn, NULL, -1);
+            return false;
+        }
+        handleRecord(conn, buf, len);
+    }
+    return false;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function resumes the session of a connection with a   *|
+|* received record, or with its end if len <= 0.              *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void SecureChatServer::handleRecord(Connection* conn, unsigned char* buf, int len){
+    ConnectionEvent event;
+    if (len <= 0){
+        if (len < 0){ Logger::error("Error in receiving a message"); }
+        event.type = EVENT_CLOSED;
+        conn->pushEvent(move(event));
+        return;
+    }
+
+    event.type = EVENT_RECORD;
+    if (!event.record.allocate(len)){
+        Logger::error("Error in allocating a buffer");
+        event.type = EVENT_CLOSED;
+        conn->pushEvent(move(event));
+        return;
+    }
+    memcpy(event.record.data(), buf, len);
+    event.record_len = len;
+    conn->pushEvent(move(event));
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This coroutine runs the protocol on a connection. It is    *|
+|* suspended between two messages instead of blocking a       *|
+|* thread, so an idle user costs only its frame and its       *|
+|* Connection. The large buffers stay on the stack of the     *|
+|* handlers, outside the frame.                               *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+Task<bool> SecureChatServer::session(shared_ptr<Connection> conn){
+    while(1){
+        ConnectionEvent event = co_await conn->nextEvent();
+        if (event.type == EVENT_CLOSED){ break; }
+        if (event.type == EVENT_PEER){ continue; }
+
+        /* ---------------------------------------------------------- *\
+        |* The handshake and the large records are processed by a    *|
+        |* crypto worker: the reactor serves the other connections    *|
+        |* meanwhile and resumes this session with the result         *|
+        \* ---------------------------------------------------------- */
+        HandlerResult result;
+        int phase = conn->phase.load();
+        if (phase == PHASE_S2){
+            LoginResult login;
+            result = (HandlerResult)co_await CryptoPool::run(&conn->reactor, CRYPTO_HANDSHAKE, [&](){ return (int)handleAuthentication(conn.get(), event.record.data(), event.record_len, login); });
+
+            //No user in login: the ticket was rejected and the client starts again with S2
+            if (result == RESULT_CONTINUE && !login.username.empty() && !startSession(conn.get(), login)){ result = RESULT_CLOSE; }
+        } else if (phase == PHASE_CHAT && event.record_len >= CRYPTO_OFFLOAD_SIZE){
+            result = (HandlerResult)co_await CryptoPool::run(&conn->reactor, CRYPTO_AEAD, [&](){ return (int)handleMessage(conn.get(), event.record.data(), event.record_len); });
+        } else {
+            result = handleMessage(conn.get(), event.record.data(), event.record_len);
+        }
+        if (result == RESULT_CLOSE){ break; }
+
+        /* ---------------------------------------------------------- *\
+        |* RTT forwarded: wait for the response of the receiver       *|
+        \* ---------------------------------------------------------- */
+        if (result == RESULT_WAIT_PEER && !(co_await waitResponse(conn))){ break; }
+    }
+    closeConnection(conn.get());
+    co_return true;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This coroutine waits for the response to the RTT of a      *|
+|* sender. The session of the receiver notifies it.           *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+Task<bool> SecureChatServer::waitResponse(shared_ptr<Connection> conn){
+    unsigned long long wait_start = Instrumentation::now();
+    ConnectionEvent event = co_await conn->nextEvent();
+    Tracer::record("RTT wait", wait_start, conn->id, conn->username, conn->getPeer(), true);
+    if (event.type == EVENT_RECORD){
+        Logger::error("Unexpected message from ", conn->username, " while waiting for the response to the RTT");
+    }
+    if (event.type != EVENT_PEER || event.message_type != MSG_RESPONSE){ co_return false; }
+    LatencyStats::record(LATENCY_RESPONSE_WAIT, wait_start);
+    co_return handleResponse(conn.get(), event.value);
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function drives the state machine of a connection     *|
+|* with a received message: the message is decrypted, its     *|
+|* type is checked against the current phase and it is given  *|
+|* to the handler of the phase.                               *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+HandlerResult SecureChatServer::handleMessage(Connection* conn, unsigned char* msg, unsigned int len){
+    int phase = conn->phase.load();
+    unsigned long long relay_start = Instrumentation::now();
+
+    unsigned char* buf;
+    unsigned int buf_len;
+    if (!receive(conn->username, msg, len, buf, buf_len)){ return RESULT_CLOSE; }
 
     /* ---------------------------------------------------------- *\
-    |* Send certificate to the new user (S1)                      *|
+    |* A rekey belongs to the records, not to the phase: the user *|
+    |* sends the next records with the next key                   *|
     \* ---------------------------------------------------------- */
-    cout<<"Thread "<<gettid()<<": Starting Key Establishment with the new client"<<endl;
-    sendCertificate(data_socket, R_server);
-    cout<<"Thread "<<gettid()<<": Message S1 sent"<<endl;
+    if (buf_len == REKEY_SIZE && buf[0] == MSG_REKEY){
+        if (!getCipher(conn->username)->rekeyDecrypt()){ Logger::error("Error in the rekey of ", conn->username); return RESULT_CLOSE; }
+        Logger::info("Key of the records of ", conn->username, " ratcheted");
+        return RESULT_CONTINUE;
+    }
+
+    unsigned int message_type = ProtocolStateMachine::messageType(phase, buf, buf_len);
+    if (!ProtocolStateMachine::accepts(phase, message_type)){
+        Logger::error("Unexpected message of type ", message_type, " from ", conn->username, " in phase ", ProtocolStateMachine::phaseName(phase));
+        return RESULT_CLOSE;
+    }
+    if (checkLogout((char*)buf, buf_len, conn->username)){ return RESULT_CLOSE; }
+
+    switch(phase){
+        case PHASE_LOBBY:
+        case PHASE_ACK:
+            return handleLobby(conn, buf, buf_len);
+        case PHASE_RTT_RECEIVED:
+            return handleReceiver(conn, buf, buf_len);
+        case PHASE_M1:
+        case PHASE_M2:
+        case PHASE_M3:
+        case PHASE_CHAT: {
+            bool relayed;
+            HandlerResult result = handleChat(conn, buf, buf_len, relayed);
+
+            //Only a message that reached the peer is a relay: a dropped one would shorten the statistics
+            if (relayed){
+                int relay_phase = (phase == PHASE_M1) ? LATENCY_M1_RELAY : (phase == PHASE_M2) ? LATENCY_M2_RELAY : (phase == PHASE_M3) ? LATENCY_M3_RELAY : LATENCY_MESSAGE_RELAY;
+                LatencyStats::record(relay_phase, relay_start);
+                const char* relay_name = (phase == PHASE_M1) ? "M1 relay" : (phase == PHASE_M2) ? "M2 relay" : (phase == PHASE_M3) ? "M3 relay" : "message relay";
+                Tracer::record(relay_name, relay_start, conn->id, conn->username, conn->getPeer(), false);
+            }
+            return result;
+        }
+        default:
+            return RESULT_CLOSE;
+    }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function closes a connection. If the user was in the  *|
+|* middle of a RTT or of a chat, the other user is released.  *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void SecureChatServer::closeConnection(Connection* conn){
+    int phase = conn->phase.load();
+    string username = conn->username;
+    if (phase != PHASE_CLOSED){ ProtocolStateMachine::transition(conn, PHASE_CLOSED); }
+
+    bool current = false;
+    if (!username.empty() && (*users).count(username) != 0){
+        pthread_mutex_lock(&(*users).at(username).user_mutex);
+        if ((*users).at(username).connection.get() == conn){
+            current = true;
+            (*users).at(username).status = 0;
+            (*users).at(username).connection.reset();
+        }
+        pthread_mutex_unlock(&(*users).at(username).user_mutex);
+        if (current){ ServerMetrics::userOnline(false); }
+    }
+
+    if (current){
+        string peer = conn->getPeer();
+        shared_ptr<Connection> peer_conn = getConnection(peer);
+        /* ---------------------------------------------------------- *\
+        |* The sender is waiting for the response of this user        *|
+        \* ---------------------------------------------------------- */
+        if (phase == PHASE_RTT_RECEIVED && peer_conn && peer_conn->phase == PHASE_RTT_PENDING && peer_conn->getPeer() == username){
+            if (ProtocolStateMachine::transition(peer_conn.get(), PHASE_LOBBY)){
+                notifyPeer(peer_conn, MSG_RESPONSE, 0);
+            }
+        }
+        /* ---------------------------------------------------------- *\
+        |* The other user of the chat goes back to the lobby          *|
+        \* ---------------------------------------------------------- */
+        if ((phase == PHASE_M1 || phase == PHASE_M2 || phase == PHASE_M3 || phase == PHASE_PEER_WAIT || phase == PHASE_CHAT) && peer_conn && peer_conn->getPeer() == username){
+            char msg[RETURN_TO_LOBBY_SIZE];
+            msg[0] = 12;
+            forward(peer, (unsigned char*)msg, RETURN_TO_LOBBY_SIZE);
+            backToLobby(peer_conn);
+        }
+        Logger::info("Logout completed correctly");
+    }
+
+    conn->reactor.load()->unregisterConnection(conn);
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function handles the first message of a user: S2, or  *|
+|* R2 with a ticket, the only message that is not encrypted   *|
+|* with K. It runs on a crypto worker and leaves the session  *|
+|* state of the connection to startSession.                   *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+HandlerResult SecureChatServer::handleAuthentication(Connection* conn, unsigned char* msg, unsigned int len, LoginResult &login){
+    if (len == 0 || !ProtocolStateMachine::accepts(PHASE_S2, msg[0])){
+        Logger::error("Message type is not corresponding to 'authentication type'.");
+        return RESULT_CLOSE;
+    }
+    if (msg[0] == MSG_RESUME){
+        //One ticket for each connection, so that R2 cannot be sent in a loop, each one opened by the server
+        if (conn->resume_tried){
+            Logger::error("Second R2 on the connection of session ", conn->id);
+            return RESULT_CLOSE;
+        }
+        conn->resume_tried = true;
+        return handleResume(conn, msg, len, login);
+    }
+    return handleLogin(conn, msg, len, login);
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function handles the message S2 and answers with S3.  *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+HandlerResult SecureChatServer::handleLogin(Connection* conn, unsigned char* msg, unsigned int len, LoginResult &login){
+    auto start = chrono::steady_clock::now();
 
     /* ---------------------------------------------------------- *\
     |* Receive authentication from the user (S2)                  *|
     \* ---------------------------------------------------------- */
+    string username;
     unsigned int status;
-    unsigned char* R_user; 
+    unsigned char suite, aead;
+    unsigned char R_user[R_SIZE];
     EVP_PKEY* tpubk;
-    string username = receiveAuthentication(data_socket, status, R_server, R_user, tpubk);
-    cout<<"Thread "<<gettid()<<": Message S2 received"<<endl;
+    unsigned long long phase_start = Instrumentation::now();
+    if (!receiveAuthentication(msg, len, conn->R_server, username, status, suite, aead, R_user, tpubk)){ return RESULT_CLOSE; }
+    LatencyStats::record(LATENCY_S2_VERIFY, phase_start);
+    Tracer::record("S2 verify", phase_start, conn->id, username, "", false);
+    Logger::info("Message S2 received");
 
-    pthread_mutex_destroy(&(*users).at(username).user_mutex);
-    pthread_mutex_init(&(*users).at(username).user_mutex, NULL);
+    unsigned char K[K_SIZE];
+    unsigned char* iv;
+    phase_start = Instrumentation::now();
+    if (suite == SUITE_X25519){
+        /* ---------------------------------------------------------- *\
+        |* Derive K from the X25519 shares                            *|
+        \* ---------------------------------------------------------- */
+        if (!sendS3Share(conn, K, R_user, tpubk, iv)){ return RESULT_CLOSE; }
+    } else {
+        /* ---------------------------------------------------------- *\
+        |* Create K                                                   *|
+        \* ---------------------------------------------------------- */
+        RAND_poll();
+        RAND_bytes(K, K_SIZE);
+        if (!sendS3Message(conn, K, R_user, tpubk, iv)){ return RESULT_CLOSE; }
+    }
+    LatencyStats::record(LATENCY_S3, phase_start);
+    Tracer::record("S3", phase_start, conn->id, username, "", false);
+    SessionTickets::recordLogin(false, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    Logger::info("Message S3 sent");
 
     /* ---------------------------------------------------------- *\
-    |* Change user status to 1 if the user is available to        *|
-    |* receive a message                                          *|
+    |* A full login starts a new chain of tickets                 *|
     \* ---------------------------------------------------------- */
-    changeUserStatus(username, status, data_socket);
+    login.username = username;
+    login.status = status;
+    login.aead = aead;
+    memcpy(login.K, K, K_SIZE);
+    memcpy(login.iv, iv, BLOCK_SIZE);
+    memcpy(login.R_user, R_user, R_SIZE);
+    login.expiry = SessionTickets::now() + TICKET_LIFETIME;
+    OPENSSL_cleanse(K, K_SIZE);
+    free(iv);
+    return RESULT_CONTINUE;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function handles the message R2 of a user with a      *|
+|* ticket and answers with R3. K is derived from the secret   *|
+|* in the ticket: no signature and no key exchange. If the    *|
+|* ticket is not accepted the connection stays in the S2      *|
+|* phase, where only a full login is accepted from then on.   *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+HandlerResult SecureChatServer::handleResume(Connection* conn, unsigned char* msg, unsigned int len, LoginResult &login){
+    auto start = chrono::steady_clock::now();
+    TraceSpan resume_span("R2 resume", conn->id, "", "");
 
     /* ---------------------------------------------------------- *\
-    |* Print user list                                            *|
+    |* Receive the ticket from the user (R2)                      *|
     \* ---------------------------------------------------------- */
-    printUserList();
+    string username;
+    unsigned int status;
+    unsigned char aead;
+    unsigned char R_user[R_SIZE];
+    unsigned long long expiry;
+    unsigned char secret[RESUMPTION_SECRET_SIZE];
+    if (!receiveResumption(msg, len, conn->R_server, username, status, aead, R_user, expiry, secret)){
+        /* ---------------------------------------------------------- *\
+        |* A rejected ticket is not an error: the connection stays in *|
+        |* S2, with no user in login, and the client falls back to a  *|
+        |* full login on it. It is closed only if the reject cannot   *|
+        |* be sent, or on a second R2                                 *|
+        \* ---------------------------------------------------------- */
+        SessionTickets::recordRejected();
+        unsigned char reject = MSG_RESUME_REJECTED;
+        return conn->write(&reject, 1) ? RESULT_CONTINUE : RESULT_CLOSE;
+    }
+    Logger::info("Message R2 received");
+    resume_span.setUsers(username, "");
 
     /* ---------------------------------------------------------- *\
-    |* Create K                                                   *|
+    |* Derive K and the counter, salted with R_server and R_user  *|
     \* ---------------------------------------------------------- */
-    RAND_poll();
-    unsigned char K[K_SIZE];
-    RAND_bytes(K, K_SIZE);
-
-    unsigned char* iv;
-    sendS3Message(data_socket, K, R_user, tpubk, iv);
-
-    storeK(username, K);
-    setCounters(iv, username);
-
-    cout<<"Thread "<<gettid()<<": Message S3 sent"<<endl;
+    unsigned char salt[2*R_SIZE];
+    memcpy(salt, conn->R_server, R_SIZE);
+    memcpy(salt+R_SIZE, R_user, R_SIZE);
+    unsigned char key_material[DERIVED_KEY_SIZE];
+    bool ok = Utility::expandKey(secret, RESUMPTION_SECRET_SIZE, salt, 2*R_SIZE, "resume", key_material, DERIVED_KEY_SIZE);
 
     /* ---------------------------------------------------------- *\
-    |* Sender case                                                *|
+    |* R3: R_user and the proof that the server opened the ticket *|
     \* ---------------------------------------------------------- */
-    if(status == 0){
-        while(1){
-            /* ---------------------------------------------------------- *\
-            |* Send the list of users that are available to receive       *|
-            \* ---------------------------------------------------------- */
-            cout<<"Trying to send the available users"<<endl;
-            sendAvailableUsers(data_socket, username);
-            cout<<"Thread "<<gettid()<<": Available users sent to "<<username<<endl;
-
-            /* ---------------------------------------------------------- *\
-            |* Server's thread receive the RTT message                    *|
-            \* ---------------------------------------------------------- */
-            string receiver_username = receiveRTT(data_socket, username);
-            if(receiver_username.compare("") == 0) { continue; }
-            cout<<"Thread "<<gettid()<<": RTT received from "<<username<<endl;
-
-            if((*users).at(receiver_username).status == 0){
-                sendBadResponse(data_socket, username);
-                waitForAck(data_socket, username);
-                continue;
-            }
-            /* ---------------------------------------------------------- *\
-            |* Server forwards the RTT to the final receiver              *|
-            \* ---------------------------------------------------------- */
-            changeUserStatus(receiver_username, 0, 0);
-            cout<<"Thread "<<gettid()<<": Changed status of user "<<receiver_username<<endl;
-            forwardRTT(receiver_username, username);
-            cout<<"Thread "<<gettid()<<": RTT forwarded to "<<receiver_username<<endl;
-            
-            /* ---------------------------------------------------------- *\
-            |* Wait on the condition variable of the receiver             *|
-            \* ---------------------------------------------------------- */
-            wait(receiver_username);
-            /* ---------------------------------------------------------- *\
-            |* Check if the request has been accepted                     *|
-            \* ---------------------------------------------------------- */
-            pthread_mutex_lock(&(*users).at(username).user_mutex);
-            if((*users).at(receiver_username).responses.at(username) != 1) { pthread_mutex_unlock(&(*users).at(username).user_mutex); continue; }
-            pthread_mutex_unlock(&(*users).at(username).user_mutex);
-
-            /* ---------------------------------------------------------- *\
-            |* Starts a new thread to handle the chat                     *|
-            \* ---------------------------------------------------------- */
-            int receiver_socket = (*users).at(receiver_username).socket;
-            thread handler (&SecureChatServer::handleChat, this, data_socket, receiver_socket, username, receiver_username);
-
-            handler.join();
-            notify(username);
-            cout<<"Returning to lobby.."<<endl;
-        }
-    }
+    unsigned char buf[1 + 2*R_SIZE];
+    buf[0] = MSG_RESUME;
+    memcpy(buf+1, R_user, R_SIZE);
+    memcpy(buf+1+R_SIZE, conn->R_server, R_SIZE);
+    unsigned char mac[MAC_SIZE];
+    ok = ok && Utility::computeMAC(secret, RESUMPTION_SECRET_SIZE, buf, 1+2*R_SIZE, mac);
+    OPENSSL_cleanse(secret, RESUMPTION_SECRET_SIZE);
+
     /* ---------------------------------------------------------- *\
-    |* Receiver case                                              *|
+    |* R_server is not sent back, only covered by the MAC         *|
     \* ---------------------------------------------------------- */
-    if (status == 1){ //user wants to receive a message
-        while(1){
-            /* ---------------------------------------------------------- *\
-            |* Server waits for the response (accept or refuse)           *|
-            |* from the final receiver                                    *|
-            \* ---------------------------------------------------------- */
-            unsigned int response;
-            string sender_username = receiveResponse(data_socket, username, response);
-            cout<<"Thread "<<gettid()<<": Response received from "<<username<<endl;
-
-            /* ---------------------------------------------------------- *\
-            |* Server forwards the response to the sender                 *|
-            \* ---------------------------------------------------------- */
-            forwardResponse(sender_username, username, response);
-            cout<<"Thread "<<gettid()<<": Response forwarded to "<<sender_username<<endl;
-
-            if (response == 0){
-                changeUserStatus(username, 1, 0);
-            }
-            /* ---------------------------------------------------------- *\
-            |* Frees the other thread that is handling the sender         *|
-            \* ---------------------------------------------------------- */
-            notify(username);
-            if (response == 0){
-                continue;
-            }
-            wait(sender_username);
-        }
+    struct iovec parts[2];
+    parts[0].iov_base = buf;
+    parts[0].iov_len = 1 + R_SIZE;
+    parts[1].iov_base = mac;
+    parts[1].iov_len = MAC_SIZE;
+    if (!ok || !conn->writev(parts, 2)){
+        Logger::error("Error in the sendto of the message R3");
+        OPENSSL_cleanse(key_material, DERIVED_KEY_SIZE);
+        return RESULT_CLOSE;
     }
+    SessionTickets::recordLogin(true, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    Logger::info("Message R3 sent");
 
-    pthread_exit(NULL);
+    /* ---------------------------------------------------------- *\
+    |* The new ticket keeps the expiry of the chain               *|
+    \* ---------------------------------------------------------- */
+    login.username = username;
+    login.status = status;
+    login.aead = aead;
+    memcpy(login.K, key_material, K_SIZE);
+    memcpy(login.iv, key_material + K_SIZE, BLOCK_SIZE);
+    memcpy(login.R_user, R_user, R_SIZE);
+    login.expiry = expiry;
+    OPENSSL_cleanse(key_material, DERIVED_KEY_SIZE);
+    return RESULT_CONTINUE;
 }
 
 /* ---------------------------------------------------------- *\
 |*                                                            *|
-|* This function handles a chat betweem two clients.          *|
+|* This function starts the session of a logged user, after   *|
+|* S3 or R3: the user gets a new ticket and, if it is a       *|
+|* sender, the list of the available users.                   *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatServer::handleChat(int sender_socket, int receiver_socket, string sender, string receiver){
-     /* ----------------------------------------------------------*\
-    |* Server sends receiver public key to the sender user        *|
+bool SecureChatServer::startSession(Connection* conn, LoginResult &login){
+    string username = login.username;
+    unsigned int status = login.status;
+    conn->username = username;
+    conn->role = status;
+    TraceSpan session_span("ticket and user list", conn->id, username, "");
+    if (!storeK(username, login.K, login.aead)){
+        OPENSSL_cleanse(login.K, K_SIZE);
+        OPENSSL_cleanse(login.iv, BLOCK_SIZE);
+        return false;
+    }
+    setCounters(login.iv, username);
+    Logger::info("Records of ", username, " protected with ", SessionCipher::suiteName(login.aead));
+
+    /* ---------------------------------------------------------- *\
+    |* Resumption secret of the next ticket                       *|
     \* ---------------------------------------------------------- */
-    sendUserPubKey(receiver, sender_socket, sender);
-    sendUserPubKey(sender, receiver_socket, receiver);
-    cout<<"Thread "<<gettid()<<": Public key sent "<<endl;
+    unsigned char salt[2*R_SIZE];
+    memcpy(salt, conn->R_server, R_SIZE);
+    memcpy(salt+R_SIZE, login.R_user, R_SIZE);
+    unsigned char secret[RESUMPTION_SECRET_SIZE];
+    bool derived = Utility::expandKey(login.K, K_SIZE, salt, 2*R_SIZE, "resumption", secret, RESUMPTION_SECRET_SIZE);
+    OPENSSL_cleanse(login.K, K_SIZE);
+    OPENSSL_cleanse(login.iv, BLOCK_SIZE);
 
     /* ---------------------------------------------------------- *\
-    |* *************************   M1   ************************* *|
+    |* Publish the connection. The status is changed to 1 if the  *|
+    |* user is available to receive a message                     *|
     \* ---------------------------------------------------------- */
+    if (!derived || !ProtocolStateMachine::transition(conn, (status == 0) ? PHASE_LOBBY : PHASE_IDLE)){ OPENSSL_cleanse(secret, RESUMPTION_SECRET_SIZE); return false; }
+    pthread_mutex_lock(&(*users).at(username).user_mutex);
+    bool replaced = (bool)(*users).at(username).connection;
+    (*users).at(username).connection = conn->shared_from_this();
+    pthread_mutex_unlock(&(*users).at(username).user_mutex);
+    if (!replaced){ ServerMetrics::userOnline(true); }
+    changeUserStatus(username, status, conn->socket);
 
+    /* ---------------------------------------------------------- *\
+    |* Print user list                                            *|
+    \* ---------------------------------------------------------- */
+    printUserList();
 
     /* ---------------------------------------------------------- *\
-    |* Server receives the message M1 from the sender user        *|
+    |* Send the ticket for the next login                         *|
     \* ---------------------------------------------------------- */
-    unsigned char* m1;
-    unsigned int len;
-    receive(sender_socket, sender, len, m1, M1_SIZE);
-    cout<<"Thread "<<gettid()<<": M1 received from "<<sender<<endl;
+    bool sent = sendTicket(username, secret, login.expiry);
+    OPENSSL_cleanse(secret, RESUMPTION_SECRET_SIZE);
+    if (!sent){ return false; }
 
     /* ---------------------------------------------------------- *\
-    |* Server forwards the message M1 to the receiver user        *|
+    |* Send the list of users that are available to receive       *|
     \* ---------------------------------------------------------- */
-    forward(receiver, m1, len);
-    cout<<"Thread "<<gettid()<<": M1 message forwarded from "<<sender<<" to "<<receiver<<endl;
+    if (status == 0){
+        if (!sendAvailableUsers(username)){ return false; }
+        Logger::info("Available users sent to ", username);
+    }
+    return true;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function sends a ticket to a user, with the seconds   *|
+|* left before it expires.                                    *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool SecureChatServer::sendTicket(string username, unsigned char* secret, unsigned long long expiry){
+    unsigned char msg[TICKET_MSG_SIZE];
+    msg[0] = MSG_TICKET;
+    unsigned long long now = SessionTickets::now();
+    unsigned int lifetime = (expiry > now) ? expiry - now : 0;
+    memcpy(msg+1, &lifetime, sizeof(unsigned int));
+    if (!SessionTickets::issue(username, expiry, secret, msg+1+sizeof(unsigned int))){ Logger::error("Error while sealing the ticket"); return false; }
 
     /* ---------------------------------------------------------- *\
-    |* *************************   M2   ************************* *|
+    |* Encrypt and send the message.                              *|
     \* ---------------------------------------------------------- */
+    bool sent = forward(username, msg, TICKET_MSG_SIZE);
+    OPENSSL_cleanse(msg, TICKET_MSG_SIZE);
+    return sent;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function handles the messages of a sender that is in  *|
+|* the lobby: RTT, refresh and the ACK of a bad response.     *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+HandlerResult SecureChatServer::handleLobby(Connection* conn, unsigned char* buf, unsigned int buf_len){
+    string username = conn->username;
 
     /* ---------------------------------------------------------- *\
-    |* Server receives the message M2 from the receiver user      *|
+    |* ACK of a bad response: send the list again                 *|
     \* ---------------------------------------------------------- */
-    unsigned char* m2;
-    receive(receiver_socket, receiver, len, m2, M2_SIZE);
-    cout<<"Thread "<<gettid()<<": M2 received from "<<receiver<<endl;
+    if (conn->phase == PHASE_ACK){
+        if (!checkAck((char*)buf, buf_len)){
+            Logger::error("Message type not corresponding to 'ACK' type");
+            return RESULT_CLOSE;
+        }
+        if (!ProtocolStateMachine::transition(conn, PHASE_LOBBY)){ return RESULT_CLOSE; }
+        return sendAvailableUsers(username) ? RESULT_CONTINUE : RESULT_CLOSE;
+    }
+
+    if (checkRefresh((char*)buf, buf_len, username)){ return sendAvailableUsers(username) ? RESULT_CONTINUE : RESULT_CLOSE; }
 
     /* ---------------------------------------------------------- *\
-    |* Server forwards the message M2 to the sender user          *|
+    |* Server's thread receive the RTT message                    *|
     \* ---------------------------------------------------------- */
-    forward(sender, m2, len);
-    cout<<"Thread "<<gettid()<<": M2 message forwarded from "<<receiver<<" to "<<sender<<endl;
+    unsigned long long rtt_start = Instrumentation::now();
+    string receiver_username;
+    if (!receiveRTT(buf, buf_len, receiver_username)){ return RESULT_CLOSE; }
+    Logger::info("RTT received from ", username);
 
     /* ---------------------------------------------------------- *\
-    |* *************************   M3   ************************* *|
+    |* The receiver is not available anymore                      *|
     \* ---------------------------------------------------------- */
+    shared_ptr<Connection> receiver_conn = getConnection(receiver_username);
+    if (!receiver_conn || !reserveUser(receiver_username)){
+        if (!ProtocolStateMachine::transition(conn, PHASE_ACK)){ return RESULT_CLOSE; }
+        return sendBadResponse(username) ? RESULT_CONTINUE : RESULT_CLOSE;
+    }
+    Logger::info("Changed status of user ", receiver_username);
 
+    /* ---------------------------------------------------------- *\
+    |* Server forwards the RTT to the final receiver. The session *|
+    |* of the sender is suspended until the response.             *|
+    \* ---------------------------------------------------------- */
+    conn->setPeer(receiver_username);
+    receiver_conn->setPeer(username);
+    bool forwarded = ProtocolStateMachine::transition(conn, PHASE_RTT_PENDING) &&
+                     ProtocolStateMachine::transition(receiver_conn.get(), PHASE_RTT_RECEIVED) &&
+                     forwardRTT(receiver_username, username);
+    if (!forwarded){
+        if (!ProtocolStateMachine::transition(conn, PHASE_LOBBY)){ return RESULT_CLOSE; }
+        forwardResponse(username, receiver_username, 0);
+        return sendAvailableUsers(username) ? RESULT_CONTINUE : RESULT_CLOSE;
+    }
+    LatencyStats::record(LATENCY_RTT_FORWARD, rtt_start);
+    Tracer::record("RTT forward", rtt_start, conn->id, username, receiver_username, false);
+    Logger::info("RTT forwarded to ", receiver_username);
+    return RESULT_WAIT_PEER;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function handles the response of a receiver to a RTT. *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+HandlerResult SecureChatServer::handleReceiver(Connection* conn, unsigned char* buf, unsigned int buf_len){
+    string username = conn->username;
+    TraceSpan response_span("RTT response", conn->id, username, conn->getPeer());
 
     /* ---------------------------------------------------------- *\
-    |* Server receives the message M3 from the sender user        *|
+    |* Server receives the response (accept or refuse)            *|
+    |* from the final receiver                                    *|
     \* ---------------------------------------------------------- */
-    unsigned char *m3;
-    receive(sender_socket, sender, len, m3, M3_SIZE);
-    cout<<"Thread "<<gettid()<<": M3 received from "<<sender<<endl;
+    unsigned int response;
+    string sender_username;
+    if (!receiveResponse(buf, buf_len, sender_username, response)){ return RESULT_CLOSE; }
+    Logger::info("Response received from ", username);
+
+    if (sender_username.compare(conn->getPeer()) != 0){
+        Logger::error("Response to a RTT that has not been forwarded");
+        return RESULT_CLOSE;
+    }
 
     /* ---------------------------------------------------------- *\
-    |* Server forwards the message M3 to the receiver user        *|
+    |* The sender may have left in the meantime                   *|
     \* ---------------------------------------------------------- */
-    forward(receiver, m3, len);
-    cout<<"Thread "<<gettid()<<": M3 message forwarded from "<<sender<<" to "<<receiver<<endl;
+    shared_ptr<Connection> sender_conn = getConnection(sender_username);
+    if (!sender_conn || sender_conn->getPeer().compare(username) != 0 || !ProtocolStateMachine::transition(sender_conn.get(), (response == 1) ? PHASE_M1 : PHASE_LOBBY)){
+        if (!ProtocolStateMachine::transition(conn, PHASE_IDLE)){ return RESULT_CLOSE; }
+        changeUserStatus(username, 1, 0);
+        return RESULT_CONTINUE;
+    }
+
+    if (response != 1){
+        if (!ProtocolStateMachine::transition(conn, PHASE_IDLE)){ return RESULT_CLOSE; }
+        changeUserStatus(username, 1, 0);
+    }
+    else {
+        if (!ProtocolStateMachine::transition(conn, PHASE_PEER_WAIT)){ return RESULT_CLOSE; }
+        /* ---------------------------------------------------------- *\
+        |* The two users of a chat are served by the same shard: the  *|
+        |* receiver joins the sender's one                            *|
+        \* ---------------------------------------------------------- */
+        Reactor* target = sender_conn->reactor.load();
+        if (conn->reactor.load() != target && conn->reactor.load()->migrateConnection(conn, target)){
+            Logger::info("Connection of ", username, " moved to the shard of ", sender_username);
+        }
+    }
 
     /* ---------------------------------------------------------- *\
-    |* Select used to listen simultaneously to  stdin and  socket *|
+    |* Wake up the sender, that forwards the response itself      *|
     \* ---------------------------------------------------------- */
-    fd_set master, copy;
-    FD_ZERO(&master);
+    notifyPeer(sender_conn, MSG_RESPONSE, response);
+    return RESULT_CONTINUE;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function forwards the response of the receiver to a   *|
+|* sender, already moved to M1 or back to the lobby by the    *|
+|* receiver.                                                  *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool SecureChatServer::handleResponse(Connection* conn, unsigned int response){
+    string username = conn->username;
+    string receiver_username = conn->getPeer();
+
+    if (!forwardResponse(username, receiver_username, response)){ return false; }
+    Logger::info("Response forwarded to ", username);
+    if (response != 1){ return sendAvailableUsers(username); }
 
-    FD_SET(sender_socket, &master);
-    FD_SET(receiver_socket, &master);
+    //If the receiver left in the meantime its connection brings this user back to the lobby
+    shared_ptr<Connection> receiver_conn = getConnection(receiver_username);
+    if (receiver_conn){ startChat(conn->shared_from_this(), receiver_conn); }
+    return true;
+}
 
-    while(true){
-        copy = master;
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function queues an event for the session of another   *|
+|* user, that is resumed by the reactor owning it.            *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void SecureChatServer::notifyPeer(shared_ptr<Connection> conn, unsigned int message_type, unsigned int value){
+    ConnectionEvent event;
+    event.type = EVENT_PEER;
+    event.message_type = message_type;
+    event.value = value;
+    conn->postEvent(move(event));
+}
 
-        int socket_count = select(FD_SETSIZE, &copy, NULL, NULL, NULL);
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function sends the public keys to the two users,      *|
+|* already moved to the key establishment.                    *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void SecureChatServer::startChat(shared_ptr<Connection> sender_conn, shared_ptr<Connection> receiver_conn){
+    string sender = sender_conn->username;
+    string receiver = receiver_conn->username;
 
-		if (FD_ISSET(sender_socket, &copy)){
-            unsigned char* msg;
-            unsigned int len;
-            receive(sender_socket, sender, len, msg, GENERAL_MSG_SIZE);
-            checkLobby((char*)msg, len, receiver, receiver_socket, "");
-            forward(receiver, msg, len);
-        }
-        if (FD_ISSET(receiver_socket, &copy)){
-            unsigned char* msg;
-            unsigned int len;
-            receive(receiver_socket, receiver, len, msg, GENERAL_MSG_SIZE);
-            checkLobby((char*)msg, len, sender, sender_socket, receiver);
-            forward(sender, msg, len);
-        }
+    /* ---------------------------------------------------------- *\
+    |* Server sends the sender public key to the receiver user    *|
+    |* first: once the sender gets the other key it may send M1,  *|
+    |* that another reactor forwards to the receiver at once      *|
+    \* ---------------------------------------------------------- */
+    sendUserPubKey(sender, receiver);
+    sendUserPubKey(receiver, sender);
+    Logger::info("Public key sent ");
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function handles a chat betweem two clients: the      *|
+|* messages M1, M2 and M3 are relayed in order, then every    *|
+|* message is forwarded to the other user. A message dropped  *|
+|* or not forwarded leaves relayed false.                     *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+HandlerResult SecureChatServer::handleChat(Connection* conn, unsigned char* buf, unsigned int buf_len, bool &relayed){
+    string username = conn->username;
+    string peer = conn->getPeer();
+    relayed = false;
+
+    //If the peer is leaving the message is dropped, its connection will bring this user back to the lobby
+    shared_ptr<Connection> peer_conn = getConnection(peer);
+    if (!peer_conn){ return RESULT_CONTINUE; }
+
+    switch(conn->phase.load()){
+        /* ---------------------------------------------------------- *\
+        |* Server forwards the message M1 to the receiver user        *|
+        \* ---------------------------------------------------------- */
+        case PHASE_M1:
+            if (!ProtocolStateMachine::transition(peer_conn.get(), PHASE_M2)){ return RESULT_CONTINUE; }
+            if (!ProtocolStateMachine::transition(conn, PHASE_PEER_WAIT)){ return RESULT_CLOSE; }
+            relayed = forward(peer, buf, buf_len);
+            Logger::info("M1 message forwarded from ", username, " to ", peer);
+            return RESULT_CONTINUE;
+        /* ---------------------------------------------------------- *\
+        |* Server forwards the message M2 to the sender user          *|
+        \* ---------------------------------------------------------- */
+        case PHASE_M2:
+            if (!ProtocolStateMachine::transition(peer_conn.get(), PHASE_M3)){ return RESULT_CONTINUE; }
+            if (!ProtocolStateMachine::transition(conn, PHASE_PEER_WAIT)){ return RESULT_CLOSE; }
+            relayed = forward(peer, buf, buf_len);
+            Logger::info("M2 message forwarded from ", username, " to ", peer);
+            return RESULT_CONTINUE;
+        /* ---------------------------------------------------------- *\
+        |* Server forwards the message M3 to the receiver user        *|
+        \* ---------------------------------------------------------- */
+        case PHASE_M3:
+            if (!ProtocolStateMachine::transition(peer_conn.get(), PHASE_CHAT)){ return RESULT_CONTINUE; }
+            if (!ProtocolStateMachine::transition(conn, PHASE_CHAT)){ return RESULT_CLOSE; }
+            relayed = forward(peer, buf, buf_len);
+            Logger::info("M3 message forwarded from ", username, " to ", peer);
+            return RESULT_CONTINUE;
+        case PHASE_CHAT:
+            if (checkLobby((char*)buf, buf_len)){
+                char lobby_msg[RETURN_TO_LOBBY_SIZE];
+                lobby_msg[0] = 12;
+                forward(peer, (unsigned char*)lobby_msg, RETURN_TO_LOBBY_SIZE);
+                backToLobby(conn->shared_from_this());
+                backToLobby(peer_conn);
+                Logger::info("Return to lobby completed correctly");
+                return RESULT_CONTINUE;
+            }
+            relayed = forward(peer, buf, buf_len);
+            if (relayed){ ServerMetrics::recordRelay(buf_len); }
+            return RESULT_CONTINUE;
+        default:
+            return RESULT_CONTINUE;
     }
 }
 
@@ -411,29 +1086,29 @@ void SecureChatServer::handleChat(int sender_socket, int receiver_socket, string
 |* This function sends the certificate to a user.             *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatServer::sendCertificate(int data_socket, unsigned char* R_server){
-    char* buf = (char*)malloc(S1_SIZE);
-    memcpy(buf, R_server, R_SIZE);
+bool SecureChatServer::sendCertificate(Connection* conn){
     /* ---------------------------------------------------------- *\
-    |* Serialize the certificate                                  *|
+    |* Pin the current identity: S3 is signed with its key even   *|
+    |* if the certificate is reloaded in the meantime             *|
     \* ---------------------------------------------------------- */
-    BIO* mbio = BIO_new(BIO_s_mem());
-    PEM_write_bio_X509(mbio, server_certificate);
-    char* certificate_buf = NULL;
-    long certificate_size = BIO_get_mem_data(mbio, &certificate_buf);
+    conn->identity = identity.load();
+    const string &certificate = conn->identity->certificate_pem;
+    if (certificate.size() > S1_SIZE - R_SIZE){ Logger::error("The certificate is too big"); return false; }
 
-    Utility::secure_thread_memcpy((unsigned char*)buf, R_SIZE, S1_SIZE, (unsigned char*)certificate_buf, 0, certificate_size, certificate_size); 
     /* ---------------------------------------------------------- *\
-    |* Send the certificate                                       *|
+    |* Send the nonce and the serialized certificate, gathered    *|
+    |* without copies                                             *|
     \* ---------------------------------------------------------- */
-    if (R_SIZE + certificate_size < R_SIZE) { cerr<<"Wrap around"<<endl; pthread_exit(NULL); }
-	if (send(data_socket, buf, R_SIZE + certificate_size, 0) < 0){
-		cerr<<"Error in the sendto of the message containing the certificate."<<endl;
-		pthread_exit(NULL);
+    struct iovec parts[2];
+    parts[0].iov_base = conn->R_server;
+    parts[0].iov_len = R_SIZE;
+    parts[1].iov_base = (void*)certificate.data();
+    parts[1].iov_len = certificate.size();
+	if (!conn->writev(parts, 2)){
+		Logger::error("Error in the sendto of the message containing the certificate.");
+		return false;
 	}
-
-    BIO_free(mbio);
-	return;
+    return true;
 }
 
 /* ---------------------------------------------------------- *\
@@ -441,10 +1116,10 @@ void SecureChatServer::sendCertificate(int data_socket, unsigned char* R_server)
 |* This function sends the message S3 to a user.              *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatServer::sendS3Message(int data_socket, unsigned char* K, unsigned char* R_user, EVP_PKEY* tpubk, unsigned char* &iv){
-    char* buf = (char*)malloc(S3_SIZE);
+bool SecureChatServer::sendS3Message(Connection* conn, unsigned char* K, unsigned char* R_user, EVP_PKEY* tpubk, unsigned char* &iv){
+    unsigned char buf[S3_SIZE];
     buf[0] = 1;
-    Utility::secure_thread_memcpy((unsigned char*)buf, 1, S3_SIZE, R_user, 0, R_SIZE, R_SIZE);
+    memcpy(buf+1, R_user, R_SIZE);
 
     /* ---------------------------------------------------------- *\
     |* Encrypt K using TpubK                                      *|
@@ -454,39 +1129,95 @@ void SecureChatServer::sendS3Message(int data_socket, unsigned char* K, unsigned
     unsigned char* encrypted_key, *ciphertext;
     unsigned int cipherlen;
     int outlen, encrypted_key_len;
-    Utility::secure_thread_memcpy(plaintext, 0, K_SIZE, K, 0, K_SIZE, K_SIZE);
+    memcpy(plaintext, K, K_SIZE);
 
-    if (!Utility::encryptMessage(K_SIZE, tpubk, plaintext, ciphertext, encrypted_key, iv, encrypted_key_len, outlen, cipherlen)){ cerr<<"ERR: Error while encrypting"<<endl; pthread_exit(NULL); }
-    Utility::secure_thread_memcpy((unsigned char*)buf, len, S3_SIZE, ciphertext, 0, K_SIZE+16, cipherlen);
+    bool ok = Utility::encryptMessage(K_SIZE, tpubk, plaintext, ciphertext, encrypted_key, iv, encrypted_key_len, outlen, cipherlen);
+    if (!ok){ Logger::error("Error while encrypting"); }
+    ok = ok && Utility::secure_thread_memcpy(buf, len, S3_SIZE, ciphertext, 0, K_SIZE+16, cipherlen);
     len += cipherlen;
-    Utility::secure_thread_memcpy((unsigned char*)buf, len, S3_SIZE, iv, 0, BLOCK_SIZE, BLOCK_SIZE);
+    ok = ok && Utility::secure_thread_memcpy(buf, len, S3_SIZE, iv, 0, BLOCK_SIZE, BLOCK_SIZE);
     len += BLOCK_SIZE;
-    Utility::secure_thread_memcpy((unsigned char*)buf, len, S3_SIZE, encrypted_key, 0, EVP_PKEY_size(tpubk), encrypted_key_len);
+    ok = ok && Utility::secure_thread_memcpy(buf, len, S3_SIZE, encrypted_key, 0, EVP_PKEY_size(tpubk), encrypted_key_len);
     len += encrypted_key_len;
 
+    /* ---------------------------------------------------------- *\
+    |* Delete TpubK                                               *|
+    \* ---------------------------------------------------------- */
+    EVP_PKEY_free(tpubk);
+    if (!ok){ return false; }
+
     /* ---------------------------------------------------------- *\
     |* Sign the R_user                                            *|
     \* ---------------------------------------------------------- */
     unsigned char* signature;
     unsigned int signature_len;
-    Utility::signMessage(server_prvkey, (char*)buf, len, &signature, &signature_len);
-    Utility::secure_thread_memcpy((unsigned char*)buf, len, S3_SIZE, signature, 0, SIGNATURE_SIZE, signature_len);
-    len += SIGNATURE_SIZE;
-
+    Utility::signMessage(conn->identity->prvkey, (char*)buf, len, &signature, &signature_len);
+    bool copied = Utility::secure_thread_memcpy(buf, len, S3_SIZE, signature, 0, SIGNATURE_SIZE, signature_len);
+    free(signature);
+    if (!copied){ return false; }
+    len += signature_len;
 
     /* ---------------------------------------------------------- *\
     |* Send the S3 message                                        *|
     \* ---------------------------------------------------------- */
-    if (send(data_socket, buf, len, 0) < 0) { 
-        cerr<<"ERR: Error in the sendto of the message S3"<<endl; 
-        exit(1); 
+    if (!conn->write(buf, len)) {
+        Logger::error("Error in the sendto of the message S3");
+        return false;
     }
+	return true;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function sends the message S3 of the X25519 suite:    *|
+|* the server share signed with R_user. K and the counter are *|
+|* derived from the shares, salted with R_server and R_user.  *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool SecureChatServer::sendS3Share(Connection* conn, unsigned char* K, unsigned char* R_user, EVP_PKEY* tpubk, unsigned char* &iv){
+    unsigned char buf[S3_X25519_SIZE];
+    buf[0] = 1;
+    memcpy(buf+1, R_user, R_SIZE);
+    unsigned int len = 1+R_SIZE;
 
     /* ---------------------------------------------------------- *\
-    |* Delete TpubK                                               *|
+    |* Generate the server share and derive K                     *|
+    \* ---------------------------------------------------------- */
+    unsigned char salt[2*R_SIZE];
+    memcpy(salt, conn->R_server, R_SIZE);
+    memcpy(salt+R_SIZE, R_user, R_SIZE);
+    iv = (unsigned char*)malloc(BLOCK_SIZE);
+    EVP_PKEY* tsharek = KeyPool::pop(SUITE_X25519);
+    bool ok = iv && Utility::writeShare(tsharek, buf+len) && Utility::deriveK(tsharek, tpubk, salt, 2*R_SIZE, "login", K, iv);
+    len += X25519_SHARE_SIZE;
+
+    /* ---------------------------------------------------------- *\
+    |* Delete the shares                                          *|
     \* ---------------------------------------------------------- */
+    EVP_PKEY_free(tsharek);
     EVP_PKEY_free(tpubk);
-	return;
+    if (!ok){ Logger::error("Error while deriving K"); free(iv); return false; }
+
+    /* ---------------------------------------------------------- *\
+    |* Sign the R_user and the server share                       *|
+    \* ---------------------------------------------------------- */
+    unsigned char* signature;
+    unsigned int signature_len;
+    Utility::signMessage(conn->identity->prvkey, (char*)buf, len, &signature, &signature_len);
+    bool copied = Utility::secure_thread_memcpy(buf, len, S3_X25519_SIZE, signature, 0, SIGNATURE_SIZE, signature_len);
+    free(signature);
+    if (!copied){ free(iv); return false; }
+    len += signature_len;
+
+    /* ---------------------------------------------------------- *\
+    |* Send the S3 message                                        *|
+    \* ---------------------------------------------------------- */
+    if (!conn->write(buf, len)) {
+        Logger::error("Error in the sendto of the message S3");
+        free(iv);
+        return false;
+    }
+	return true;
 }
 
 /* ---------------------------------------------------------- *\
@@ -495,45 +1226,25 @@ void SecureChatServer::sendS3Message(int data_socket, unsigned char* K, unsigned
 |* another user.                                              *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatServer::sendUserPubKey(string username, int data_socket, string key_receiver){
+bool SecureChatServer::sendUserPubKey(string username, string key_receiver){
 
-    char buf[PUBKEY_MSG_SIZE];
-    char* pubkey_buf = NULL;
+    unsigned char buf[PUBKEY_MSG_SIZE];
     buf[0] = 5;
 
-    EVP_PKEY* pubkey = getUserKey(username);
-
     /* ---------------------------------------------------------- *\
-    |* Serialize the public key                                   *|
+    |* The key is serialized once, when it enters the cache       *|
     \* ---------------------------------------------------------- */
-    BIO* mbio = BIO_new(BIO_s_mem());
-    PEM_write_bio_PUBKEY(mbio, pubkey);
-
-    long pubkey_size = BIO_get_mem_data(mbio, &pubkey_buf);
-    if (1 + pubkey_size < 1){ cerr<<"Wrap around"<<endl; pthread_exit(NULL); }
+    shared_ptr<UserKey> user_key = getUserKey(username);
+    if (!user_key){ return false; }
+    unsigned int pubkey_size = user_key->pem.size();
+    if (1 + pubkey_size < 1){ Logger::error("Wrap around"); return false; }
     unsigned int len = 1 + pubkey_size;
-    Utility::secure_thread_memcpy((unsigned char*)buf, 1, PUBKEY_MSG_SIZE, (unsigned char*)pubkey_buf, 0, pubkey_size, pubkey_size);
-    BIO_free(mbio);
+    if (!Utility::secure_thread_memcpy(buf, 1, PUBKEY_MSG_SIZE, (unsigned char*)user_key->pem.data(), 0, pubkey_size, pubkey_size)){ return false; }
 
     /* ---------------------------------------------------------- *\
     |* Encrypt and send the message.                              *|
     \* ---------------------------------------------------------- */
-    incrementCounter(0, key_receiver);
-    unsigned char* ciphertext, *tag, *enc_buf;
-    int outlen;
-    unsigned int cipherlen;
-    unsigned int enc_buf_max_len = PUBKEY_MSG_SIZE + ENC_FIELDS;
-    unsigned int enc_buf_len;
-    enc_buf = (unsigned char*)malloc(enc_buf_max_len);
-    if (Utility::encryptSessionMessage(len, (*users).at(key_receiver).K, (unsigned char*)buf, ciphertext, outlen, cipherlen, (*users).at(key_receiver).server_counter, tag, enc_buf, enc_buf_max_len, 0, enc_buf_len) == false){
-        cerr<<"Thread "<<gettid()<<"Error in the encryption"<<endl;
-        pthread_exit(NULL);
-    };
-    if (send(data_socket, enc_buf, enc_buf_len, 0) < 0){
-		cerr<<"Thread "<<gettid()<<"Error in the sendto of the user pubkey"<<endl;
-		pthread_exit(NULL);
-	}
-	return;
+    return forward(key_receiver, buf, len);
 }
 
 /* ---------------------------------------------------------- *\
@@ -542,93 +1253,139 @@ void SecureChatServer::sendUserPubKey(string username, int data_socket, string k
 |* from the client and verifies it.                           *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-string SecureChatServer::receiveAuthentication(int data_socket, unsigned int &status, unsigned char* R_server, unsigned char* &R_user, EVP_PKEY* &tpubk){
-    /* ---------------------------------------------------------- *\
-    |* Receive the authentication message                         *|
-    \* ---------------------------------------------------------- */
-    char* buf = (char*)malloc(S2_SIZE);
-    if (!buf){
-        cerr<<"There is not more space in memory to allocate a new buffer"<<endl;
-        exit(1);
-    }
-
-    unsigned int len = recv(data_socket, (void*)buf, S2_SIZE, 0);
-    if (len < 0){
-        cerr<<"Thread "<<gettid()<<": Error in receiving the authentication message"<<endl;
-        exit(1);
-    }
-
-    cout<<"Thread "<<gettid()<<": Authentication message received"<<endl;
+bool SecureChatServer::receiveAuthentication(unsigned char* buf, unsigned int len, unsigned char* R_server, string &username, unsigned int &status, unsigned char &suite, unsigned char &aead, unsigned char* R_user, EVP_PKEY* &tpubk){
+    Logger::info("Authentication message received");
     /* ---------------------------------------------------------- *\
     |* Extract the fields from the message                        *|
     \* ---------------------------------------------------------- */
-    unsigned int tpubk_len_index = 1 + R_SIZE;
+    if (len < 2 + R_SIZE){ Logger::error("Access out-of-bound"); return false; }
+    suite = buf[1] & 0x0F;
+    aead = buf[1] >> 4;
+    if (suite != SUITE_RSA && suite != SUITE_X25519){ Logger::error("Key exchange suite ", (unsigned int)suite, " is not supported."); return false; }
+    if (len > ((suite == SUITE_X25519) ? S2_X25519_SIZE : S2_SIZE)){ Logger::error("Authentication message too long for its suite"); return false; }
+    if (!SessionCipher::cipher(aead)){ Logger::error("AEAD suite ", (unsigned int)aead, " is not supported."); return false; }
+    unsigned int tpubk_len_index = 2 + R_SIZE;
     long tpubk_len;
-    Utility::secure_thread_memcpy((unsigned char*)&tpubk_len, 0, sizeof(long), (unsigned char*)buf, tpubk_len_index, S2_SIZE, sizeof(long));
-    unsigned int username_index = 1 + 2*R_SIZE + sizeof(long) + tpubk_len;
-    unsigned int signed_msg_len = 1 + R_SIZE + sizeof(long) + tpubk_len;
+    if (!Utility::secure_thread_memcpy((unsigned char*)&tpubk_len, 0, sizeof(long), buf, tpubk_len_index, len, sizeof(long))){ return false; }
+    if (tpubk_len <= 0 || tpubk_len > PUBKEY_SIZE){ Logger::error("TpubK length is over the upper bound."); return false; }
+    unsigned int username_index = 2 + 2*R_SIZE + sizeof(long) + tpubk_len;
+    unsigned int signed_msg_len = 2 + R_SIZE + sizeof(long) + tpubk_len;
+    if (username_index >= len){ Logger::error("Access out-of-bound"); return false; }
     unsigned int username_len = buf[username_index];
-    if (1 + username_index < 1){ cerr<<"Wrap around"<<endl; pthread_exit(NULL); }
     username_index++;
     if (username_len > USERNAME_MAX_SIZE){
-        cerr<<"Thread "<<gettid()<<": Username length is over the upper bound."<<endl;
+        Logger::error("Username length is over the upper bound.");
+        return false;
+    }
+    if (username_index + username_len > len){ Logger::error("Access out-of-bound"); return false; }
+    username.assign((char*)buf+username_index, username_len);
+
+    if ((*users).count(username) == 0){
+        Logger::error("User ", username, " is not registered");
+        return false;
     }
-    string username;
-    if (username_index + (unsigned long)buf < username_index){ cerr<<"Wrap around"<<endl; pthread_exit(NULL); }
-    username.append(buf+username_index, username_len);
-
-    if(len < SIGNATURE_SIZE) { cerr<<"Wrap around"<<endl; pthread_exit(NULL); }
-    unsigned int clear_message_len = len - SIGNATURE_SIZE;
-    if(clear_message_len < 2) { cerr<<"Wrap around"<<endl; pthread_exit(NULL); }
-    clear_message_len -= 2; 
-    if(clear_message_len < username_len) { cerr<<"Wrap around"<<endl; pthread_exit(NULL); }
-    clear_message_len -= username_len;
-    if(clear_message_len < R_SIZE) { cerr<<"Wrap around"<<endl; pthread_exit(NULL); }
-    clear_message_len -= R_SIZE;
 
     /* ---------------------------------------------------------- *\
     |* Verify the authenticity of the message                     *|
     \* ---------------------------------------------------------- */
-    if ((unsigned long)buf + signed_msg_len < signed_msg_len){ cerr<<"Wrap around"<<endl; pthread_exit(NULL); }
-    if (len < SIGNATURE_SIZE){ cerr<<"Access out-of-bound"<<endl; pthread_exit(NULL); }
-    if(Utility::verifyMessage(getUserKey(username), buf, signed_msg_len, (unsigned char*)((unsigned long)buf+len-SIGNATURE_SIZE), SIGNATURE_SIZE) != 1) { 
-        cerr<<"Thread "<<gettid()<<": Authentication error while receiving the authentication"<<endl;
-        pthread_exit(NULL);
+    shared_ptr<UserKey> user_key = getUserKey(username);
+    if (!user_key){ return false; }
+    unsigned int signature_len = EVP_PKEY_get_size(user_key->pubkey);
+    if (username_index + username_len + signature_len > len){ Logger::error("Access out-of-bound"); return false; }
+    int verified = Utility::verifyMessage(user_key->pubkey, (char*)buf, signed_msg_len, buf+len-signature_len, signature_len);
+    if (verified != 1) {
+        Logger::error("Authentication error while receiving the authentication");
+        return false;
     }
 
-    unsigned char* R_server_received = (unsigned char*)malloc(R_SIZE);
-    R_user = (unsigned char*)malloc(R_SIZE);
-
-    Utility::secure_thread_memcpy(R_server_received, 0, R_SIZE, (unsigned char*)buf, 1, len, R_SIZE);
+    unsigned char R_server_received[R_SIZE];
+    if (!Utility::secure_thread_memcpy(R_server_received, 0, R_SIZE, buf, 2, len, R_SIZE)){ return false; }
     if(Utility::compareR(R_server, R_server_received) == false) {
-        cerr<<"Thread "<<gettid()<<": R_server not corrisponding"<<endl;
-        pthread_exit(NULL);
+        Logger::error("R_server not corrisponding");
+        return false;
     }
-    
+
     /* ---------------------------------------------------------- *\
     |* Analyze the content of the plaintext                       *|
     \* ---------------------------------------------------------- */
+    if (!Utility::secure_thread_memcpy(R_user, 0, R_SIZE, buf, 2+R_SIZE+sizeof(long)+tpubk_len, len, R_SIZE)){ return false; }
+
+    status = buf[0];
+    if (status != 0 && status != 1){
+        Logger::error("Message type is not corresponding to 'authentication type'.");
+        return false;
+    }
 
-    Utility::secure_thread_memcpy(R_user, 0, R_SIZE, (unsigned char*)buf, 1+R_SIZE+sizeof(long)+tpubk_len, len, R_SIZE);
     /* ---------------------------------------------------------- *\
-    |* Read the TpubK                                             *|
+    |* Read the TpubK: a PEM public key with SUITE_RSA, the raw   *|
+    |* X25519 share with SUITE_X25519                             *|
     \* ---------------------------------------------------------- */
-    unsigned int tpubk_index = 1 + R_SIZE + sizeof(long); 
-    BIO* mbio = BIO_new(BIO_s_mem());
-    if(tpubk_index + (unsigned long)buf < tpubk_index ) { cerr<<"Wrap around"<<endl; pthread_exit(NULL); }
-    BIO_write(mbio, buf + tpubk_index, tpubk_len);
-    tpubk = PEM_read_bio_PUBKEY(mbio, NULL, NULL, NULL);
-    BIO_free(mbio);
+    unsigned int tpubk_index = 2 + R_SIZE + sizeof(long);
+    if (suite == SUITE_X25519){
+        tpubk = Utility::readShare(buf + tpubk_index, tpubk_len);
+    } else {
+        BIO* mbio = BIO_new(BIO_s_mem());
+        BIO_write(mbio, buf + tpubk_index, tpubk_len);
+        tpubk = PEM_read_bio_PUBKEY(mbio, NULL, NULL, NULL);
+        BIO_free(mbio);
+    }
+    if (!tpubk){ Logger::error("Error while reading the TpubK"); return false; }
 
-    status = buf[0];
+    return true;
+}
+
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function receives the resumption message R2: choice,  *|
+|* suite, R_server, R_user, ticket and the MAC of all of them *|
+|* with the resumption secret in the ticket.                  *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool SecureChatServer::receiveResumption(unsigned char* buf, unsigned int len, unsigned char* R_server, string &username, unsigned int &status, unsigned char &aead, unsigned char* R_user, unsigned long long &expiry, unsigned char* secret){
+    Logger::info("Resumption message received");
+    if (len != R2_SIZE){ Logger::error("Resumption message of the wrong size"); return false; }
+
+    status = buf[1];
     if (status != 0 && status != 1){
-        cerr<<"Thread "<<gettid()<<": Message type is not corresponding to 'authentication type'."<<endl;
-        exit(1);
+        Logger::error("Message type is not corresponding to 'authentication type'.");
+        return false;
     }
+    aead = buf[2] >> 4;
+    if (!SessionCipher::cipher(aead)){ Logger::error("AEAD suite ", (unsigned int)aead, " is not supported."); return false; }
+    if (Utility::compareR(R_server, buf+3) == false){
+        Logger::error("R_server not corrisponding");
+        return false;
+    }
+    memcpy(R_user, buf+3+R_SIZE, R_SIZE);
 
-    return username;
-}
+    /* ---------------------------------------------------------- *\
+    |* Open the ticket                                            *|
+    \* ---------------------------------------------------------- */
+    unsigned int ticket_index = 3 + 2*R_SIZE;
+    if (!SessionTickets::open(buf+ticket_index, username, expiry, secret)){ return false; }
 
+    /* ---------------------------------------------------------- *\
+    |* The user must still be registered, with its key            *|
+    \* ---------------------------------------------------------- */
+    if ((*users).count(username) == 0 || !UserKeyCache::get(username)){
+        Logger::error("User ", username, " of the ticket is not registered");
+        OPENSSL_cleanse(secret, RESUMPTION_SECRET_SIZE);
+        return false;
+    }
+
+    /* ---------------------------------------------------------- *\
+    |* Verify that the user knows the secret of the ticket        *|
+    \* ---------------------------------------------------------- */
+    unsigned char mac[MAC_SIZE];
+    unsigned int mac_index = ticket_index + TICKET_SIZE;
+    if (!Utility::computeMAC(secret, RESUMPTION_SECRET_SIZE, buf, mac_index, mac) || CRYPTO_memcmp(mac, buf+mac_index, MAC_SIZE) != 0){
+        Logger::error("Authentication error while receiving the resumption of ", username);
+        OPENSSL_cleanse(secret, RESUMPTION_SECRET_SIZE);
+        return false;
+    }
+    return true;
+}
 
 /* ---------------------------------------------------------- *\
 |*                                                            *|
@@ -643,6 +1400,44 @@ void SecureChatServer::changeUserStatus(string username, unsigned int status, in
     pthread_mutex_unlock(&(*users).at(username).user_mutex);
 }
 
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function changes the status of a user from 1 to 0.    *|
+|* It fails if the user was not available.                    *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool SecureChatServer::reserveUser(string username){
+    if ((*users).count(username) == 0){ return false; }
+    bool reserved = false;
+    pthread_mutex_lock(&(*users).at(username).user_mutex);
+    if ((*users).at(username).status == 1){
+        (*users).at(username).status = 0;
+        reserved = true;
+    }
+    pthread_mutex_unlock(&(*users).at(username).user_mutex);
+    return reserved;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function gets the connection of a logged user.        *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+shared_ptr<Connection> SecureChatServer::getConnection(string username){
+    if ((*users).count(username) == 0){ return NULL; }
+    pthread_mutex_lock(&(*users).at(username).user_mutex);
+    shared_ptr<Connection> conn = (*users).at(username).connection;
+    pthread_mutex_unlock(&(*users).at(username).user_mutex);
+    return conn;
+}
+
+shared_ptr<SessionCipher> SecureChatServer::getCipher(string username){
+    pthread_mutex_lock(&(*users).at(username).user_mutex);
+    shared_ptr<SessionCipher> cipher = (*users).at(username).cipher;
+    pthread_mutex_unlock(&(*users).at(username).user_mutex);
+    return cipher;
+}
+
 /* ---------------------------------------------------------- *\
 |*                                                            *|
 |* This function sets the initial values of the counters.     *|
@@ -650,9 +1445,9 @@ void SecureChatServer::changeUserStatus(string username, unsigned int status, in
 \* ---------------------------------------------------------- */
 void SecureChatServer::setCounters(unsigned char* iv, string username){
     pthread_mutex_lock(&(*users).at(username).user_mutex);
-    Utility::secure_thread_memcpy((unsigned char*)&(*users).at(username).server_counter, 0, sizeof(__uint128_t), iv, 0, EVP_CIPHER_iv_length(EVP_aes_256_cbc()), sizeof(__uint128_t));
-    Utility::secure_thread_memcpy((unsigned char*)&(*users).at(username).user_counter, 0, sizeof(__uint128_t), iv, 0, EVP_CIPHER_iv_length(EVP_aes_256_cbc()), sizeof(__uint128_t));
-    Utility::secure_thread_memcpy((unsigned char*)&(*users).at(username).base_counter, 0, sizeof(__uint128_t), iv, 0, EVP_CIPHER_iv_length(EVP_aes_256_cbc()), sizeof(__uint128_t));
+    memcpy((unsigned char*)&(*users).at(username).server_counter, iv, sizeof(__uint128_t));
+    memcpy((unsigned char*)&(*users).at(username).user_counter, iv, sizeof(__uint128_t));
+    memcpy((unsigned char*)&(*users).at(username).base_counter, iv, sizeof(__uint128_t));
     memset((unsigned char*)(&(*users).at(username).server_counter)+12, 0, 4);
     memset((unsigned char*)(&(*users).at(username).user_counter)+12, 0, 4);
     memset((unsigned char*)(&(*users).at(username).base_counter)+12, 0, 4);
@@ -680,8 +1475,7 @@ void SecureChatServer::incrementCounter(int counter, string username){
         pthread_mutex_unlock(&(*users).at(username).user_mutex);
         return;
     }
-    cerr<<"Bad call of the function increment counter"<<endl;
-    pthread_exit(NULL);
+    Logger::error("Bad call of the function increment counter");
 }
 
 /* ---------------------------------------------------------- *\
@@ -689,30 +1483,29 @@ void SecureChatServer::incrementCounter(int counter, string username){
 |* This function checks if the received counter is correct.   *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatServer::checkCounter(int counter, string username, unsigned char* received_counter_msg){
+bool SecureChatServer::checkCounter(int counter, string username, unsigned char* received_counter_msg){
     //counter = 0 -> server, counter = 1 -> user
-    __uint128_t received_counter;
-    Utility::secure_thread_memcpy((unsigned char*)&received_counter, 0, sizeof(__uint128_t), received_counter_msg, 0, 12, 12);
-    memset((unsigned char*)(&received_counter)+12, 0, 4);
+    __uint128_t received_counter = 0;
+    memcpy((unsigned char*)&received_counter, received_counter_msg, 12);
     if (counter == 0){
         pthread_mutex_lock(&(*users).at(username).user_mutex);
         __uint128_t server_counter_12 = (*users).at(username).server_counter;
         memset((unsigned char*)(&server_counter_12)+12, 0, 4);
-        if (server_counter_12 != received_counter || received_counter == (*users).at(username).base_counter){ pthread_mutex_unlock(&(*users).at(username).user_mutex); cerr<<"Bad received server counter"<<endl; pthread_exit(NULL); }
+        if (server_counter_12 != received_counter || received_counter == (*users).at(username).base_counter){ pthread_mutex_unlock(&(*users).at(username).user_mutex); Logger::error("Bad received server counter of ", username); return false; }
         pthread_mutex_unlock(&(*users).at(username).user_mutex);
-        return;
+        return true;
     }
     if (counter == 1){
         pthread_mutex_lock(&(*users).at(username).user_mutex);
         __uint128_t user_counter_12 = (*users).at(username).user_counter;
         memset((unsigned char*)(&user_counter_12)+12, 0, 4);
-        if (user_counter_12 != received_counter || received_counter == (*users).at(username).base_counter){ pthread_mutex_unlock(&(*users).at(username).user_mutex); cerr<<"Bad received user counter"<<endl; pthread_exit(NULL); }
+        if (user_counter_12 != received_counter || received_counter == (*users).at(username).base_counter){ pthread_mutex_unlock(&(*users).at(username).user_mutex); Logger::error("Bad received user counter of ", username); return false; }
         pthread_mutex_unlock(&(*users).at(username).user_mutex);
-        return;
+        return true;
     }
-    
-    cerr<<"Bad call of the function check counter"<<endl;
-    pthread_exit(NULL);
+
+    Logger::error("Bad call of the function check counter");
+    return false;
 }
 
 /* ---------------------------------------------------------- *\
@@ -721,9 +1514,9 @@ void SecureChatServer::checkCounter(int counter, string username, unsigned char*
 |*                                                            *|
 \* ---------------------------------------------------------- */
 void SecureChatServer::printUserList(){
-    cout<<"Thread "<<gettid()<<": User List"<<endl;
+    Logger::debug("User List");
     for (map<string,User>::iterator it=(*users).begin(); it!=(*users).end(); ++it){
-        it->second.printUser();
+        Logger::debug("     Username: ", it->second.username, ", status: ", it->second.status);
     }
 }
 
@@ -747,81 +1540,55 @@ vector<User> SecureChatServer::getOnlineUsers(){
 |* This function sends the list of available users.           *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatServer::sendAvailableUsers(int data_socket, string username){
+bool SecureChatServer::sendAvailableUsers(string username){
+    unsigned long long list_start = Instrumentation::now();
+
     /* ---------------------------------------------------------- *\
     |* Retrive the list of online users.                          *|
     \* ---------------------------------------------------------- */
     vector<User> available = getOnlineUsers();
-    char* buf = (char*)malloc(2 + available.size()*(USERNAME_MAX_SIZE+1) + SIGNATURE_SIZE);
+    unsigned char buf[AVAILABLE_USER_MAX_SIZE];
     buf[0] = 2;
-    if (available.size() > MAX_AVAILABLE_USER_MESSAGE){ buf[1] = MAX_AVAILABLE_USER_MESSAGE; }
-    else{ buf[1] = available.size(); }
     unsigned int len = 2;
-    
-    for (unsigned int i = 0; i < available.size(); i++){
+    unsigned int user_number = 0;
+
+    for (unsigned int i = 0; i < available.size() && user_number < MAX_AVAILABLE_USER_MESSAGE; i++){
         if (available[i].username.compare(username) != 0){
-            if (len >= AVAILABLE_USER_MAX_SIZE){ cerr<<"Access out-of-bound"<<endl; pthread_exit(NULL); }
+            if (len >= AVAILABLE_USER_MAX_SIZE){ Logger::error("Access out-of-bound"); return false; }
             buf[len] = available[i].username.length();
-            if (len + 1 == 0){ cerr<<"Wrap around"<<endl; pthread_exit(NULL); }
             len++;
-            Utility::secure_thread_memcpy((unsigned char*)buf, len, 2 + available.size()*(USERNAME_MAX_SIZE+1) + SIGNATURE_SIZE, (unsigned char*)available[i].username.c_str(), 0, available[i].username.length(), available[i].username.length());
+            if (!Utility::secure_thread_memcpy(buf, len, AVAILABLE_USER_MAX_SIZE, (unsigned char*)available[i].username.c_str(), 0, available[i].username.length(), available[i].username.length())){ return false; }
             len += available[i].username.length();
+            user_number++;
         }
     }
+    buf[1] = user_number;
 
     /* ---------------------------------------------------------- *\
     |* Encrypt and send the message.                              *|
     \* ---------------------------------------------------------- */
-    incrementCounter(0, username);
-    unsigned char* ciphertext, *tag, *enc_buf;
-    int outlen;
-    unsigned int cipherlen;
-    unsigned int enc_buf_max_len = 2 + available.size()*(USERNAME_MAX_SIZE+1) + ENC_FIELDS;
-    unsigned int enc_buf_len;
-    enc_buf = (unsigned char*)malloc(enc_buf_max_len);
-    if (Utility::encryptSessionMessage(len, (*users).at(username).K, (unsigned char*)buf, ciphertext, outlen, cipherlen, (*users).at(username).server_counter, tag, enc_buf, enc_buf_max_len, 0, enc_buf_len) == false){
-        cerr<<"Thread "<<gettid()<<"Error in the encryption"<<endl;
-        pthread_exit(NULL);
-    };
-    if (send(data_socket, enc_buf, enc_buf_len, 0) < 0){
-		cerr<<"Thread "<<gettid()<<"Error in the sendto of the available user list"<<endl;
-		pthread_exit(NULL);
+    if (!forward(username, buf, len)){
+		Logger::error("Error in the sendto of the available user list");
+		return false;
 	}
+    LatencyStats::record(LATENCY_USER_LIST, list_start);
+    return true;
 }
 
 /* ---------------------------------------------------------- *\
 |*                                                            *|
-|* This function receives the Request to Talk from the user.  *|
+|* This function parses the Request to Talk of a user.        *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-string SecureChatServer::receiveRTT(int data_socket, string username){
-    char* enc_buf = (char*)malloc(RTT_MAX_SIZE+ENC_FIELDS);
-    if (!enc_buf){ cerr<<"Thread "<<gettid()<<"There is not more space in memory to allocate a new buffer"<<endl; pthread_exit(NULL); }
-    unsigned int len = recv(data_socket, (void*)enc_buf, AVAILABLE_USER_MAX_SIZE+ENC_FIELDS, 0);
-    if (len < 0){ cerr<<"Thread "<<gettid()<<": Error in receiving the RTT message"<<endl; pthread_exit(NULL); }
-
-    unsigned char* buf = (unsigned char*)malloc(RTT_MAX_SIZE);
-    if (!buf){ cerr<<"Thread "<<gettid()<<"There is not more space in memory to allocate a new buffer"<<endl; pthread_exit(NULL); }
-    unsigned int buf_len;
-    incrementCounter(1, username);
-    checkCounter(1, username, (unsigned char*)enc_buf);
-    if (Utility::decryptSessionMessage(buf, (unsigned char*)enc_buf, len, (*users).at(username).K, buf_len, 0) == false){
-        cerr<<"ERR: Error while decrypting"<<endl;
-        pthread_exit(NULL);
-    };
-
-    checkLogout(data_socket, 0, (char*)buf, buf_len, username, "");
-    if(checkRefresh((char*)buf, buf_len, username) == true){ return ""; }
-
+bool SecureChatServer::receiveRTT(unsigned char* buf, unsigned int buf_len, string &receiver_username){
+    if (buf_len < 2){ Logger::error("RTT message too short."); return false; }
     unsigned int message_type = buf[0];
-    if (message_type != 3){ cerr<<"Thread "<<gettid()<<": Message type is not corresponding to 'RTT type'."<<endl; pthread_exit(NULL); }
+    if (message_type != 3){ Logger::error("Message type is not corresponding to 'RTT type'."); return false; }
     unsigned int receiver_username_len = buf[1];
-    if (receiver_username_len > USERNAME_MAX_SIZE){ cerr<<"Thread "<<gettid()<<": Receiver Username length is over the upper bound."<<endl; }
-    string receiver_username;
-    if ((unsigned long)buf + 2 < 2){ cerr<<"Wrap around"<<endl; pthread_exit(NULL); }
-    receiver_username.append((char*)buf+2, receiver_username_len);
+    if (receiver_username_len > USERNAME_MAX_SIZE || 2 + receiver_username_len > buf_len){ Logger::error("Receiver Username length is over the upper bound."); return false; }
+    receiver_username.assign((char*)buf+2, receiver_username_len);
 
-    return receiver_username;
+    return true;
 }
 
 /* ---------------------------------------------------------- *\
@@ -829,78 +1596,43 @@ string SecureChatServer::receiveRTT(int data_socket, string username){
 |* This function forwards an RTT to the receiver user.        *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatServer::forwardRTT(string receiver_username, string sender_username){
-    int data_socket = (*users).at(receiver_username).socket;
-
-    char msg[RTT_MAX_SIZE];
-    msg[0] = 3; 
-    unsigned int sender_username_len = sender_username.length(); 
+bool SecureChatServer::forwardRTT(string receiver_username, string sender_username){
+    unsigned char msg[RTT_MAX_SIZE];
+    msg[0] = 3;
+    unsigned int sender_username_len = sender_username.length();
     msg[1] = sender_username_len;
-    if (sender_username_len + 2 < sender_username_len){ cerr<<"Wrap around"<<endl; exit(1); }
     unsigned int len = sender_username_len + 2;
-    Utility::secure_thread_memcpy((unsigned char*)msg, 2, RTT_MAX_SIZE, (unsigned char*)sender_username.c_str(), 0, sender_username_len, sender_username_len);
+    if (!Utility::secure_thread_memcpy(msg, 2, RTT_MAX_SIZE, (unsigned char*)sender_username.c_str(), 0, sender_username_len, sender_username_len)){ return false; }
 
     /* ---------------------------------------------------------- *\
     |* Encrypt and send the message.                              *|
     \* ---------------------------------------------------------- */
-    incrementCounter(0, receiver_username);
-    unsigned char* ciphertext, *tag, *enc_buf;
-    int outlen;
-    unsigned int cipherlen;
-    unsigned int enc_buf_max_len = 2 + sender_username_len + ENC_FIELDS;
-    unsigned int enc_buf_len;
-    enc_buf = (unsigned char*)malloc(enc_buf_max_len);
-    if (Utility::encryptSessionMessage(len, (*users).at(receiver_username).K, (unsigned char*)msg, ciphertext, outlen, cipherlen, (*users).at(receiver_username).server_counter, tag, enc_buf, enc_buf_max_len, 0, enc_buf_len) == false){
-        cerr<<"Thread "<<gettid()<<"Error in the encryption"<<endl;
-        pthread_exit(NULL);
-    };
-    if (send(data_socket, enc_buf, enc_buf_len, 0) < 0){
-		cerr<<"Thread "<<gettid()<<"Error in the sendto of the RTT forwarded"<<endl;
-		pthread_exit(NULL);
+    if (!forward(receiver_username, msg, len)){
+		Logger::error("Error in the sendto of the RTT forwarded");
+		return false;
 	}
-    
-    cout<<"Thread "<<gettid()<<": RTT message sent from "<<sender_username<<" to "<<receiver_username<<endl;
+
+    Logger::info("RTT message sent from ", sender_username, " to ", receiver_username);
+    return true;
 }
 
 /* ---------------------------------------------------------- *\
 |*                                                            *|
-|* This function receives a response to RTT from a receiver.  *|
+|* This function parses a response to RTT from a receiver.    *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-string SecureChatServer::receiveResponse(int data_socket, string receiver_username, unsigned int &response){
-    char* enc_buf = (char*)malloc(RESPONSE_MAX_SIZE+ENC_FIELDS);
-    if (!enc_buf){ cerr<<"Thread "<<gettid()<<"There is not more space in memory to allocate a new buffer"<<endl; pthread_exit(NULL); }
-    unsigned int len = recv(data_socket, (void*)enc_buf, AVAILABLE_USER_MAX_SIZE+ENC_FIELDS, 0);
-    if (len < 0){ cerr<<"Thread "<<gettid()<<": Error in receiving the RTT message"<<endl; pthread_exit(NULL); }
-
-    unsigned char* buf = (unsigned char*)malloc(RESPONSE_MAX_SIZE);
-    if (!buf){ cerr<<"Thread "<<gettid()<<"There is not more space in memory to allocate a new buffer"<<endl; pthread_exit(NULL); }
-    unsigned int buf_len;
-    incrementCounter(1, receiver_username);
-    checkCounter(1, receiver_username, (unsigned char*)enc_buf);
-    if (Utility::decryptSessionMessage(buf, (unsigned char*)enc_buf, len, (*users).at(receiver_username).K, buf_len, 0) == false){
-        cerr<<"ERR: Error while decrypting"<<endl;
-        pthread_exit(NULL);
-    };
-
-    checkLogout(data_socket, 0, (char*)buf, buf_len, receiver_username, "");
+bool SecureChatServer::receiveResponse(unsigned char* buf, unsigned int buf_len, string &sender_username, unsigned int &response){
+    if (buf_len < 3){ Logger::error("Response message too short."); return false; }
     unsigned int message_type = buf[0];
-    if (message_type != 4){ cerr<<"Thread "<<gettid()<<": Message type is not corresponding to 'Response to RTT type'."<<endl; pthread_exit(NULL);}
+    if (message_type != 4){ Logger::error("Message type is not corresponding to 'Response to RTT type'."); return false; }
 
     response = buf[1];
 
     unsigned int username_len = buf[2];
+    if (username_len > USERNAME_MAX_SIZE || 3 + username_len > buf_len){ Logger::error("Sender Username length is over the upper bound."); return false; }
+    sender_username.assign((char*)buf+3, username_len);
 
-    if (3 + (unsigned long)buf < 3){ cerr<<"Thread "<<gettid()<<":Wrap around"<<endl; pthread_exit(NULL); }
-    string sender_username;
-    sender_username.append((char*)buf+3, username_len);
-
-    if ((*users).at(receiver_username).responses.count(sender_username)!=0)
-        (*users).at(receiver_username).responses.at(sender_username) = response;
-    else
-        (*users).at(receiver_username).responses.insert(pair<string, unsigned int>(sender_username, response));
-
-    return sender_username;
+    return true;
 }
 
 /* ---------------------------------------------------------- *\
@@ -908,40 +1640,27 @@ string SecureChatServer::receiveResponse(int data_socket, string receiver_userna
 |* This function forwards an response to RTT to the sender.   *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatServer::forwardResponse(string sender_username, string username, unsigned int response){
-    int data_socket = (*users).at(sender_username).socket;
-
-    char msg[RESPONSE_MAX_SIZE];
+bool SecureChatServer::forwardResponse(string sender_username, string username, unsigned int response){
+    unsigned char msg[RESPONSE_MAX_SIZE];
     msg[0] = 4;
     msg[1] = response;
 
     unsigned int username_len = sender_username.length();
     msg[2] = username_len;
 
-    if (3 + username_len < 3){ cerr<<"Thread "<<gettid()<<":Wrap around"<<endl; exit(1); }
     unsigned int len = 3 + username_len;
 
-    Utility::secure_thread_memcpy((unsigned char*)msg, 3, RESPONSE_MAX_SIZE, (unsigned char*)sender_username.c_str(), 0, username_len, username_len);
+    if (!Utility::secure_thread_memcpy(msg, 3, RESPONSE_MAX_SIZE, (unsigned char*)sender_username.c_str(), 0, username_len, username_len)){ return false; }
     /* ---------------------------------------------------------- *\
     |* Encrypt and send the message.                              *|
     \* ---------------------------------------------------------- */
-    incrementCounter(0, sender_username);
-    unsigned char* ciphertext, *tag, *enc_buf;
-    int outlen;
-    unsigned int cipherlen;
-    unsigned int enc_buf_max_len = 2 + username_len + ENC_FIELDS;
-    unsigned int enc_buf_len;
-    enc_buf = (unsigned char*)malloc(enc_buf_max_len);
-    if (Utility::encryptSessionMessage(len, (*users).at(sender_username).K, (unsigned char*)msg, ciphertext, outlen, cipherlen, (*users).at(sender_username).server_counter, tag, enc_buf, enc_buf_max_len, 0, enc_buf_len) == false){
-        cerr<<"Thread "<<gettid()<<"Error in the encryption"<<endl;
-        pthread_exit(NULL);
-    };
-    if (send(data_socket, enc_buf, enc_buf_len, 0) < 0){
-		cerr<<"Thread "<<gettid()<<"Error in the sendto of the Response forwarded"<<endl;
-		pthread_exit(NULL);
+    if (!forward(sender_username, msg, len)){
+		Logger::error("Error in the sendto of the Response forwarded");
+		return false;
 	}
 
-    cout<<"Thread "<<gettid()<<": Response to RTT sent from "<<username<<" to "<<sender_username<<" with value equal to "<<response<<endl;
+    Logger::info("Response to RTT sent from ", username, " to ", sender_username, " with value equal to ", response);
+    return true;
 }
 
 
@@ -950,7 +1669,7 @@ void SecureChatServer::forwardResponse(string sender_username, string username,
 |* This function checks if the message received is a refresh. *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-bool SecureChatServer::checkRefresh(char* msg, unsigned int buffer_len,string username){
+bool SecureChatServer::checkRefresh(char* msg, unsigned int buffer_len,string){
     if(msg[0] != 10 || buffer_len != 1)
         return false;
     return true;
@@ -961,28 +1680,17 @@ bool SecureChatServer::checkRefresh(char* msg, unsigned int buffer_len,string us
 |* This function sends a bad response message to the user.    *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatServer::sendBadResponse(int data_socket, string username){
-    char msg[LOGOUT_MAX_SIZE];
+bool SecureChatServer::sendBadResponse(string username){
+    unsigned char msg[BAD_RESPONSE_SIZE];
     msg[0] = 7;
     /* ---------------------------------------------------------- *\
     |* Encrypt and send the message.                              *|
     \* ---------------------------------------------------------- */
-    incrementCounter(0, username);
-    unsigned char* ciphertext, *tag, *enc_buf;
-    int outlen;
-    unsigned int cipherlen;
-    unsigned int enc_buf_max_len = LOGOUT_MAX_SIZE + ENC_FIELDS;
-    unsigned int enc_buf_len;
-    enc_buf = (unsigned char*)malloc(enc_buf_max_len);
-    if (Utility::encryptSessionMessage(LOGOUT_MAX_SIZE, (*users).at(username).K, (unsigned char*)msg, ciphertext, outlen, cipherlen, (*users).at(username).server_counter, tag, enc_buf, enc_buf_max_len, 0, enc_buf_len) == false){
-        cerr<<"Thread "<<gettid()<<"Error in the encryption"<<endl;
-        pthread_exit(NULL);
-    };
-
-    if (send(data_socket, enc_buf, enc_buf_len, 0) < 0){
-		cerr<<"Thread "<<gettid()<<"Error in the send of the bad response message"<<endl;
-		pthread_exit(NULL);
+    if (!forward(username, msg, BAD_RESPONSE_SIZE)){
+		Logger::error("Error in the send of the bad response message");
+		return false;
 	}
+    return true;
 }
 
 /* ---------------------------------------------------------- *\
@@ -990,19 +1698,23 @@ void SecureChatServer::sendBadResponse(int data_socket, string username){
 |* This function checks if the message received is a logout.  *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatServer::checkLogout(int data_socket, int other_socket, char* msg, unsigned int buffer_len, string username, string other_username){
+bool SecureChatServer::checkLogout(char* msg, unsigned int buffer_len, string username){
     if(msg[0] != 8 || buffer_len != 1)
-        return;
-    
-    changeUserStatus(username, 0, 0);
-    
-    close(data_socket);
-    if (other_socket != 0){
-        close(other_socket);
-        cout<<"Thread "<<gettid()<<": Communication between "<<username<<" and "<<other_username<<" correctly closed"<<endl;
-    }
-    else{ cout<<"Thread "<<gettid()<<": Logout completed correctly"<<endl;}
-    pthread_exit(NULL);
+        return false;
+
+    Logger::info("Logout requested by ", username);
+    return true;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function checks if the message received is an ACK.    *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool SecureChatServer::checkAck(char* msg, unsigned int buffer_len){
+    if(msg[0] != 11 || buffer_len != ACK_SIZE)
+        return false;
+    return true;
 }
 
 /* ---------------------------------------------------------- *\
@@ -1011,157 +1723,121 @@ void SecureChatServer::checkLogout(int data_socket, int other_socket, char* msg,
 |* lobby.                                                     *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatServer::checkLobby(char* buf, unsigned int buffer_len, string username, int data_socket, string other_username){
-    if(buf[0] != 12 || buffer_len != 1)
-        return;
-    
-    else{ cout<<"Thread "<<gettid()<<": Return to lobby completed correctly"<<endl;}
-
-    char msg[RETURN_TO_LOBBY_SIZE];
-    msg[0] = 12;
-    /* ---------------------------------------------------------- *\
-    |* Encrypt and send the message.                              *|
-    \* ---------------------------------------------------------- */
-    incrementCounter(0, username);
-    unsigned char* ciphertext, *tag, *enc_buf;
-    int outlen;
-    unsigned int cipherlen;
-    unsigned int enc_buf_max_len = LOGOUT_MAX_SIZE + ENC_FIELDS;
-    unsigned int enc_buf_len;
-    enc_buf = (unsigned char*)malloc(enc_buf_max_len);
-    if (Utility::encryptSessionMessage(LOGOUT_MAX_SIZE, (*users).at(username).K, (unsigned char*)msg, ciphertext, outlen, cipherlen, (*users).at(username).server_counter, tag, enc_buf, enc_buf_max_len, 0, enc_buf_len) == false){
-        cerr<<"Thread "<<gettid()<<"Error in the encryption"<<endl;
-        pthread_exit(NULL);
-    };
-
-    if (send(data_socket, enc_buf, enc_buf_len, 0) < 0){
-		cerr<<"Thread "<<gettid()<<"Error in the send of the bad response message"<<endl;
-		pthread_exit(NULL);
-	}
-
-    if(other_username.compare("") == 0){
-        changeUserStatus(username, 1, 0);
-    } else { 
-        changeUserStatus(other_username, 1, 0);
-    }
-
-    pthread_exit(NULL);
+bool SecureChatServer::checkLobby(char* buf, unsigned int buffer_len){
+    if(buf[0] != 12 || buffer_len != RETURN_TO_LOBBY_SIZE)
+        return false;
+    return true;
 }
 
 /* ---------------------------------------------------------- *\
 |*                                                            *|
-|* This function receives and decrypts a message.             *|
+|* This function brings a user back to the lobby at the end   *|
+|* of a chat: the receiver is available again, the sender     *|
+|* gets the list of available users.                          *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatServer::receive(int data_socket, string username, unsigned int &len, unsigned char* &buf, const unsigned int max_size){
-    char* enc_buf = (char*)malloc(max_size+ENC_FIELDS);
-    if (!enc_buf){ cerr<<"Thread "<<gettid()<<"There is not more space in memory to allocate a new buffer"<<endl; pthread_exit(NULL); }
-    len = recv(data_socket, (void*)enc_buf, max_size+ENC_FIELDS, 0);
-    if (len < 0){ cerr<<"Thread "<<gettid()<<": Error in receiving a message"<<endl; pthread_exit(NULL); }
-    if (len == 0){
-        close(data_socket);
-        cout<<"Thread "<<gettid()<<": Logout completed correctly"<<endl;
-        pthread_exit(NULL);
+void SecureChatServer::backToLobby(shared_ptr<Connection> conn){
+    if (conn->role == 1){
+        if (ProtocolStateMachine::transition(conn.get(), PHASE_IDLE)){
+            changeUserStatus(conn->username, 1, 0);
+        }
+        return;
     }
+    if (ProtocolStateMachine::transition(conn.get(), PHASE_LOBBY)){
+        sendAvailableUsers(conn->username);
+    }
+}
 
-    buf = (unsigned char*)malloc(max_size);
-    if (!buf){ cerr<<"Thread "<<gettid()<<"There is not more space in memory to allocate a new buffer"<<endl; pthread_exit(NULL); }
-    unsigned int buf_len;
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function decrypts a message received from a user, in  *|
+|* the record itself.                                         *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool SecureChatServer::receive(string username, unsigned char* record, unsigned int record_len, unsigned char* &plaintext, unsigned int &len){
+    if (record_len < GCM_IV_SIZE + TAG_SIZE){ Logger::error("Message too short"); return false; }
     incrementCounter(1, username);
-    checkCounter(1, username, (unsigned char*)enc_buf);
+    if (!checkCounter(1, username, record)){ ServerMetrics::recordCounterFailure(); return false; }
 
-    if (Utility::decryptSessionMessage(buf, (unsigned char*)enc_buf, len, (*users).at(username).K, buf_len, 0) == false){
-        cerr<<"ERR: Error while decrypting"<<endl;
-        pthread_exit(NULL);
+    if (getCipher(username)->open(record, record_len, len) == false){
+        Logger::error("Error while decrypting");
+        ServerMetrics::recordDecryptFailure();
+        return false;
     };
-    len = buf_len;
+    plaintext = record + GCM_IV_SIZE;
+    return true;
 }
 
 /* ---------------------------------------------------------- *\
 |*                                                            *|
-|* This function encrypts and forward a message.              *|
+|* This function encrypts and forward a message. The counter  *|
+|* is incremented under the output lock of the connection so  *|
+|* that messages from different reactors stay in order.       *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatServer::forward(string username, unsigned char* msg, unsigned int len){    
-    int data_socket = (*users).at(username).socket;
+bool SecureChatServer::forward(string username, unsigned char* msg, unsigned int len){
+    shared_ptr<Connection> conn = getConnection(username);
+    if (!conn){ return false; }
+    if (len > MAX_RECORD_SIZE - GCM_IV_SIZE - TAG_SIZE){ Logger::error("Message too long to be forwarded"); return false; }
+
+    //The record is built on the stack, the frame is copied only if the socket cannot take it
+    unsigned char record[MAX_RECORD_SIZE];
+    unsigned int record_len;
+    memcpy(record + GCM_IV_SIZE, msg, len);
+
+    lock_guard<mutex> lck(conn->out_mutex);
+    shared_ptr<SessionCipher> cipher = getCipher(username);
+    if (cipher->encryptExpired() && !sendRekey(conn.get(), username)){ return false; }
     incrementCounter(0, username);
-    unsigned char* ciphertext, *tag, *enc_buf;
-    int outlen;
-    unsigned int cipherlen;
-    unsigned int enc_buf_max_len = len + ENC_FIELDS;
-    unsigned int enc_buf_len;
-    enc_buf = (unsigned char*)malloc(enc_buf_max_len);
-    if (Utility::encryptSessionMessage(len, (*users).at(username).K, (unsigned char*)msg, ciphertext, outlen, cipherlen, (*users).at(username).server_counter, tag, enc_buf, enc_buf_max_len, 0, enc_buf_len) == false){
-        cerr<<"Thread "<<gettid()<<"Error in the encryption"<<endl;
-        pthread_exit(NULL);
+    if (cipher->seal((*users).at(username).server_counter, record, len, MAX_RECORD_SIZE, record_len) == false){
+        Logger::error("Error in the encryption");
+        return false;
     };
-    if (send(data_socket, enc_buf, enc_buf_len, 0) < 0){
-		cerr<<"Thread "<<gettid()<<"Error in the forward"<<endl;
-		pthread_exit(NULL);
+    if (!conn->writeLocked(record, record_len)){
+		Logger::error("Error in the forward");
+		return false;
 	}
-
+    return true;
 }
 
 /* ---------------------------------------------------------- *\
-|* to wait the Response message of the receiver before        *|
-|* checking the response value in the thread of the sender    *|
+|*                                                            *|
+|* This function sends a rekey message, sealed with the old   *|
+|* key, and moves to the next key. It is sent just before the *|
+|* record that would go over the limit of the old key, with   *|
+|* the output lock held.                                      *|
+|*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatServer::wait(string username){
-    unique_lock<mutex> lck((*users).at(username).mtx);
-    while(!(*users).at(username).ready)
-            (*users).at(username).cv.wait(lck);
-    pthread_mutex_lock(&(*users).at(username).user_mutex);
-    (*users).at(username).ready = 0;
-    pthread_mutex_unlock(&(*users).at(username).user_mutex);
-}
-
-/* ------------------------------------------------------------- *\
-|* to notify that the Response message has been received         *|
-|* before checking the response value in the thread of the sender*|
-\* ------------------------------------------------------------- */
-void SecureChatServer::notify(string username){
-    pthread_mutex_lock(&(*users).at(username).user_mutex);
-    (*users).at(username).ready = 1;
-    pthread_mutex_unlock(&(*users).at(username).user_mutex);
-    (*users).at(username).cv.notify_all();
-}
-
-/* ------------------------------------------------------------- *\
-|* to save the session key K used to communicate with a client.  *|
-\* ------------------------------------------------------------- */
-void SecureChatServer::storeK(string username, unsigned char* K){
-    (*users).at(username).K = (unsigned char*)malloc(K_SIZE);
-    Utility::secure_thread_memcpy((*users).at(username).K, 0, K_SIZE, K, 0, K_SIZE, K_SIZE);
+bool SecureChatServer::sendRekey(Connection* conn, string username){
+    unsigned char record[GCM_IV_SIZE + REKEY_SIZE + TAG_SIZE];
+    unsigned int record_len;
+    record[GCM_IV_SIZE] = MSG_REKEY;
+    incrementCounter(0, username);
+    shared_ptr<SessionCipher> cipher = getCipher(username);
+    if (!cipher->seal((*users).at(username).server_counter, record, REKEY_SIZE, sizeof(record), record_len) || !conn->writeLocked(record, record_len)){
+        Logger::error("Error in the rekey of ", username);
+        return false;
+    }
+    if (!cipher->rekeyEncrypt()){ return false; }
+    Logger::info("Key of the records to ", username, " ratcheted");
+    return true;
 }
 
 /* ---------------------------------------------------------- *\
 |*                                                            *|
-|* This function receives and decrypts an ACK.                *|
+|* This function keys the cipher of a new session with K. The *|
+|* contexts are kept from a session to the next, unless the   *|
+|* session being replaced still holds them: it may be sealing *|
+|* or opening a record on another reactor, so the new session *|
+|* gets its own. K itself is not kept.                        *|
 |*                                                            *|
 \* ---------------------------------------------------------- */
-void SecureChatServer::waitForAck(int data_socket, string username){
-    char* enc_buf = (char*)malloc(ACK_SIZE+ENC_FIELDS);
-    if (!enc_buf){ cerr<<"Thread "<<gettid()<<"There is not more space in memory to allocate a new buffer"<<endl; pthread_exit(NULL); }
-    unsigned int len = recv(data_socket, (void*)enc_buf, ACK_SIZE+ENC_FIELDS, 0);
-    if (len < 0){ cerr<<"Thread "<<gettid()<<": Error in receiving an ACK message"<<endl; pthread_exit(NULL); }
-    if (len == 0){
-        close(data_socket);
-        cout<<"Thread "<<gettid()<<": Logout completed correctly"<<endl;
-        pthread_exit(NULL);
-    }
-
-    unsigned char* buf = (unsigned char*)malloc(ACK_SIZE);
-    if (!buf){ cerr<<"Thread "<<gettid()<<"There is not more space in memory to allocate a new buffer"<<endl; pthread_exit(NULL); }
-    unsigned int buf_len;
-    incrementCounter(1, username);
-    checkCounter(1, username, (unsigned char*)enc_buf);
-    if (Utility::decryptSessionMessage(buf, (unsigned char*)enc_buf, len, (*users).at(username).K, buf_len, 0) == false){
-        cerr<<"ERR: Error while decrypting"<<endl;
-        pthread_exit(NULL);
-    };
-
-    if (buf[0]!=11){
-        cerr<<"Thread "<<gettid()<<": Message type not corresponding to 'ACK' type"<<endl;
-        pthread_exit(NULL);
-    }
-}
\ No newline at end of file
+bool SecureChatServer::storeK(string username, unsigned char* K, unsigned char aead){
+    pthread_mutex_lock(&(*users).at(username).user_mutex);
+    shared_ptr<SessionCipher> &cipher = (*users).at(username).cipher;
+    if (!cipher || cipher.use_count() > 1){ cipher = make_shared<SessionCipher>(); }
+    bool keyed = cipher->setKey(aead, K, KEY_LABEL_SERVER, KEY_LABEL_USER);
+    pthread_mutex_unlock(&(*users).at(username).user_mutex);
+    if (!keyed){ Logger::error("Error in setting the session key of ", username); }
+    return keyed;
+}
@@ -9,111 +9,223 @@
 #include <cstring>
 #include <openssl/evp.h>
 #include <vector>
+#include <atomic>
 #include <thread>
 #include "User.h"
+#include "Reactor.h"
+#include "Coroutine.h"
+#include "KeyPool.h"
+#include "UserKeyCache.h"
+#include "ServerIdentity.h"
+#include "SessionTickets.h"
+#include "CryptoPool.h"
+#include "LatencyStats.h"
+#include "ServerMetrics.h"
+#include "Logger.h"
+#include "Tracer.h"
+
+//Result of the handler of a message
+enum HandlerResult {
+    RESULT_CLOSE,       //protocol error or logout: the connection has to be closed
+    RESULT_CONTINUE,    //wait for the next message of the client
+    RESULT_WAIT_PEER    //RTT forwarded: wait for the response of the receiver
+};
+
+//Keys of a user authenticated by S2 or R2, handed from the crypto worker to the reactor
+struct LoginResult {
+    string username;    //empty if a ticket was rejected
+    unsigned int status;
+    unsigned char aead;     //AEAD suite of the records
+    unsigned char K[K_SIZE];
+    unsigned char iv[BLOCK_SIZE];
+    unsigned char R_user[R_SIZE];
+    unsigned long long expiry;
+};
 
 class SecureChatServer{
     private:
-        //Server private key
-        static EVP_PKEY* server_prvkey;
-
-        //Server certificate
-        static X509* server_certificate;
+        //Server private key and certificate, replaced as a whole by a reload
+        static atomic<shared_ptr<const ServerIdentity>> identity;
 
         //Port and listening IP address, in dotted notation (e.g. 192.168.1.1)
-        int listening_socket;
         char address[MAX_ADDRESS_SIZE];
         unsigned short int port;
         struct sockaddr_in server_addr;
 
-        //Get the server private key
-        static EVP_PKEY* getPrvKey();
+        //Shards of the server: each reactor accepts and drives its own connections in its own thread
+        vector<Reactor*> reactors;
+
+        //Read the server private key and certificate
+        static shared_ptr<const ServerIdentity> getIdentity();
+
+        //Reload the server private key and certificate on every SIGHUP
+        static void reloadIdentity();
+
+        //Print the statistics and stop the server on SIGINT
+        static void shutdownOnSignal();
 
-        //Get the specified user private key
-        static EVP_PKEY* getUserKey(string username);
+        //Get the public key of the specified user, from the key cache
+        static shared_ptr<UserKey> getUserKey(string username);
 
-        //Get the server certificate
-        static X509* getCertificate();
+        //Setup a listening socket bound with SO_REUSEPORT
+        int setupSocket();
 
-        //Setup the socket
-        void setupSocket();
+        //Start the shards
+        void setupReactors(unsigned int reactor_threads, IoBackend backend);
 
-        //Let the main process listen to client requests
+        //Let the main process wait for the shards
         void listenRequests();
 
+        //Accept the requests waiting on the listening socket of a shard
+        void acceptConnections(Reactor* reactor);
+
+        //Read the bytes available on a connection and give its frames to its session (called by its reactor, epoll)
+        void handleConnection(Connection* conn);
+
+        //Take the bytes received on a connection, or its end if len <= 0 (called by its reactor, io_uring)
+        void handleData(Connection* conn, unsigned char* buf, int len);
+
+        //Give the frames buffered on a connection to its session, false if it has been closed or handed off
+        bool deliverFrames(Connection* conn);
+
+        //Give a received frame, or the end of the connection, to its session
+        void handleRecord(Connection* conn, unsigned char* buf, int len);
+
+        //Protocol run on a connection, from S2 to the logout. It is suspended while waiting for a message
+        Task<bool> session(shared_ptr<Connection> conn);
+
+        //Suspend a sender until the receiver answers to its RTT
+        Task<bool> waitResponse(shared_ptr<Connection> conn);
+
+        //Check a message against the state machine of the connection and handle it
+        HandlerResult handleMessage(Connection* conn, unsigned char* msg, unsigned int len);
+
+        //Close a connection, releasing the peer if needed
+        void closeConnection(Connection* conn);
+
         //Send the certificate to a client
-        void sendCertificate(int process_socket, unsigned char* R_server);
+        bool sendCertificate(Connection* conn);
 
         //Receive authentication from user
-        string receiveAuthentication(int process_socket, unsigned int &status, unsigned char* R_server, unsigned char* &R_user, EVP_PKEY* &tpubk);
+        bool receiveAuthentication(unsigned char* buf, unsigned int len, unsigned char* R_server, string &username, unsigned int &status, unsigned char &suite, unsigned char &aead, unsigned char* R_user, EVP_PKEY* &tpubk);
+
+        //Receive a resumption request from a user with a ticket
+        bool receiveResumption(unsigned char* buf, unsigned int len, unsigned char* R_server, string &username, unsigned int &status, unsigned char &aead, unsigned char* R_user, unsigned long long &expiry, unsigned char* secret);
 
-        void handleConnection(int data_socket, sockaddr_in client_address);
+        //Check the type of the message S2 or R2 and give it to its handler
+        HandlerResult handleAuthentication(Connection* conn, unsigned char* msg, unsigned int len, LoginResult &login);
+
+        //Handle the message S2 and answer with S3
+        HandlerResult handleLogin(Connection* conn, unsigned char* msg, unsigned int len, LoginResult &login);
+
+        //Handle the message R2 and answer with R3, or reject the ticket
+        HandlerResult handleResume(Connection* conn, unsigned char* msg, unsigned int len, LoginResult &login);
+
+        //Publish a logged user, send its next ticket and the user list
+        bool startSession(Connection* conn, LoginResult &login);
+
+        //Send a ticket sealing the resumption secret of the session
+        bool sendTicket(string username, unsigned char* secret, unsigned long long expiry);
+
+        //Handle a decrypted message of a sender in the lobby
+        HandlerResult handleLobby(Connection* conn, unsigned char* buf, unsigned int buf_len);
+
+        //Handle the decrypted response of a receiver
+        HandlerResult handleReceiver(Connection* conn, unsigned char* buf, unsigned int buf_len);
+
+        //Forward to a sender the response of the receiver
+        bool handleResponse(Connection* conn, unsigned int response);
+
+        //Queue an event for the session of another connection
+        void notifyPeer(shared_ptr<Connection> conn, unsigned int message_type, unsigned int value);
+
+        //Handle a decrypted message of the key establishment or of the chat; relayed tells if it reached the peer
+        HandlerResult handleChat(Connection* conn, unsigned char* buf, unsigned int buf_len, bool &relayed);
 
         //Change user status
         void changeUserStatus(string username, unsigned int status, int socket);
 
+        //Atomically change the status of an available user to 0
+        bool reserveUser(string username);
+
+        //Get the connection of a logged user
+        shared_ptr<Connection> getConnection(string username);
+
+        //Get the cipher of the current session of a user
+        shared_ptr<SessionCipher> getCipher(string username);
+
         void printUserList();
 
         //Send the list of available users
-        void sendAvailableUsers(int data_socket, string username);
+        bool sendAvailableUsers(string username);
 
         vector<User> getOnlineUsers();
 
         //Receive Request To Talk
-        string receiveRTT(int data_socket, string username);
+        bool receiveRTT(unsigned char* buf, unsigned int len, string &receiver_username);
 
         //Forward a RTT to the final receiver
-        void forwardRTT(string receiver_username, string sender_username);
+        bool forwardRTT(string receiver_username, string sender_username);
 
         //Receive response to RTT
-        string receiveResponse(int data_socket, string receiver_username, unsigned int &response);
+        bool receiveResponse(unsigned char* buf, unsigned int len, string &sender_username, unsigned int &response);
 
         //Forward response to RTT
-        void forwardResponse(string sender_username, string username, unsigned int response);
+        bool forwardResponse(string sender_username, string username, unsigned int response);
+
+        //Send the public keys to start the key establishment between two users
+        void startChat(shared_ptr<Connection> sender_conn, shared_ptr<Connection> receiver_conn);
 
         //Send user public key to the users that want to communicate
-        void sendUserPubKey(string username, int data_socket, string key_receiver);
+        bool sendUserPubKey(string username, string key_receiver);
 
         //Receive a refresh message
         bool checkRefresh(char* msg, unsigned int buffer_len, string username);
 
         //Send a message to the user to return him to lobby
-        void sendBadResponse(int data_socket, string username);
+        bool sendBadResponse(string username);
 
         //Receive a logout message
-        void checkLogout(int data_socket, int other_socket, char* msg, unsigned int buffer_len, string username, string other_username);
+        bool checkLogout(char* msg, unsigned int buffer_len, string username);
 
-        void receive(int data_socket, string username, unsigned int &len, unsigned char* &msg, const unsigned int max_size);
+        //Receive an ACK message
+        bool checkAck(char* msg, unsigned int buffer_len);
 
-        void forward(string username, unsigned char* msg, unsigned int len);
+        //Decrypt in place a message received from a user, plaintext points inside the record
+        bool receive(string username, unsigned char* record, unsigned int record_len, unsigned char* &plaintext, unsigned int &len);
 
-        void wait(string username);
+        //Encrypt a message and queue it on the connection of a user
+        bool forward(string username, unsigned char* msg, unsigned int len);
 
-        void notify(string username);
+        //Bring a user back to the lobby at the end of a chat
+        void backToLobby(shared_ptr<Connection> conn);
 
-        void handleChat(int sender_socket, int receiver_socket, string sender, string receiver);
+        bool sendS3Message(Connection* conn, unsigned char* K, unsigned char* R_user, EVP_PKEY* tpubk, unsigned char* &iv);
 
-        void sendS3Message(int data_socket, unsigned char* K, unsigned char* R_user, EVP_PKEY* tpubk, unsigned char* &iv);
+        //Answer to an S2 of the X25519 suite with the server share, deriving K and the counter
+        bool sendS3Share(Connection* conn, unsigned char* K, unsigned char* R_user, EVP_PKEY* tpubk, unsigned char* &iv);
 
         void setCounters(unsigned char* iv, string username);
 
         void incrementCounter(int counter, string username);
 
-        void checkCounter(int counter, string username, unsigned char* received_counter);
+        bool checkCounter(int counter, string username, unsigned char* received_counter);
 
-        void storeK(string username, unsigned char* K);
+        //Send a rekey message and move the records to the user to the next key, with out_mutex held
+        bool sendRekey(Connection* conn, string username);
 
-        void waitForAck(int data_socket, string username);
+        //Key the cipher of a new session of the user with K, false on failure
+        bool storeK(string username, unsigned char* K, unsigned char aead);
 
-        void checkLobby(char* msg, unsigned int buffer_len, string username, int data_socket, string other_username);
+        bool checkLobby(char* msg, unsigned int buffer_len);
 
     public:
-        //Constructor that gets as inputs the address, the port and the user filename.
-        SecureChatServer(const char* addr, unsigned short int port, const char *user_filename);
+        //Constructor that gets as inputs the address, the port, the user filename, the number of reactor threads, the I/O backend, the metrics endpoint and the trace file (NULL for none).
+        SecureChatServer(const char* addr, unsigned short int port, const char *user_filename, unsigned int reactor_threads, IoBackend backend, const char* metrics_endpoint, const char* trace_path);
 
-        //Destructor to close the listening socket
+        //Destructor to close the shards
         ~SecureChatServer();
 
         //List of users
         static map<string, User> *users;
-};
\ No newline at end of file
+};
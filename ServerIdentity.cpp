@@ -0,0 +1,60 @@
+#include "ServerIdentity.h"
+#include "Utility.h"
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+ServerIdentity::ServerIdentity(EVP_PKEY* prvkey, X509* certificate){
+    this->prvkey = prvkey;
+    this->certificate = certificate;
+    BIO* mbio = BIO_new(BIO_s_mem());
+    PEM_write_bio_X509(mbio, certificate);
+    char* certificate_buf = NULL;
+    long certificate_size = BIO_get_mem_data(mbio, &certificate_buf);
+    this->certificate_pem.assign(certificate_buf, certificate_size);
+    BIO_free(mbio);
+}
+
+ServerIdentity::~ServerIdentity(){
+    EVP_PKEY_free(this->prvkey);
+    X509_free(this->certificate);
+}
+
+//Open a file of the server, only under Utility::HOME_DIR
+static BIO* openFile(string path){
+    char* canon_path = realpath(path.c_str(), NULL);
+    if (!canon_path){ return NULL; }
+    bool allowed = strncmp(canon_path, Utility::HOME_DIR, strlen(Utility::HOME_DIR)) == 0;
+    free(canon_path);
+    if (!allowed){ return NULL; }
+    return BIO_new_file(path.c_str(), "r");
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function reads the private key and the certificate of *|
+|* the server. Unlike Utility::readPrvKey it does not exit on *|
+|* an error, so that a failed reload keeps the old identity.  *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+shared_ptr<const ServerIdentity> ServerIdentity::load(string prvkey_path, string certificate_path){
+    BIO* prvkey_file = openFile(prvkey_path);
+    if (!prvkey_file){ cerr<<"Thread "<<gettid()<<": Cannot open "<<prvkey_path<<endl; return NULL; }
+    EVP_PKEY* prvkey = PEM_read_bio_PrivateKey(prvkey_file, NULL, NULL, NULL);
+    BIO_free(prvkey_file);
+    if (!prvkey){ cerr<<"Thread "<<gettid()<<": Error in reading the private key from "<<prvkey_path<<endl; return NULL; }
+
+    BIO* certificate_file = openFile(certificate_path);
+    if (!certificate_file){ cerr<<"Thread "<<gettid()<<": Cannot open "<<certificate_path<<endl; EVP_PKEY_free(prvkey); return NULL; }
+    X509* certificate = PEM_read_bio_X509(certificate_file, NULL, NULL, NULL);
+    BIO_free(certificate_file);
+    if (!certificate){ cerr<<"Thread "<<gettid()<<": Error in reading the certificate from "<<certificate_path<<endl; EVP_PKEY_free(prvkey); return NULL; }
+
+    if (X509_check_private_key(certificate, prvkey) != 1){
+        cerr<<"Thread "<<gettid()<<": The private key does not match the certificate"<<endl;
+        EVP_PKEY_free(prvkey);
+        X509_free(certificate);
+        return NULL;
+    }
+    return make_shared<const ServerIdentity>(prvkey, certificate);
+}
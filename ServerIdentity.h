@@ -0,0 +1,33 @@
+#include <memory>
+#include <string>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#ifndef CYBERSECURITYPROJECT_SERVERIDENTITY_H
+#define CYBERSECURITYPROJECT_SERVERIDENTITY_H
+
+using namespace std;
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Private key and certificate of the server, with the PEM of *|
+|* the certificate serialized once for every S1. It is never  *|
+|* modified: a reload builds a new one, and a connection      *|
+|* keeps the one sent in its S1 to sign its S3.               *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+struct ServerIdentity {
+    EVP_PKEY* prvkey;
+    X509* certificate;
+    string certificate_pem;
+
+    ServerIdentity(EVP_PKEY* prvkey, X509* certificate);
+    ServerIdentity(const ServerIdentity&) = delete;
+    ServerIdentity& operator=(const ServerIdentity&) = delete;
+    ~ServerIdentity();
+
+    //Read a private key and its certificate, NULL if they are missing, not valid or do not match
+    static shared_ptr<const ServerIdentity> load(string prvkey_path, string certificate_path);
+};
+
+#endif
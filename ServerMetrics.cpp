@@ -0,0 +1,214 @@
+#include "ServerMetrics.h"
+#include "ProtocolStateMachine.h"
+#include "SessionTickets.h"
+#include "LatencyStats.h"
+#include "Logger.h"
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <malloc.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+atomic<unsigned long long> ServerMetrics::relayed_messages(0);
+atomic<unsigned long long> ServerMetrics::relayed_bytes(0);
+atomic<unsigned long long> ServerMetrics::decrypt_failures(0);
+atomic<unsigned long long> ServerMetrics::counter_failures(0);
+atomic<long long> ServerMetrics::users_online(0);
+unsigned long long ServerMetrics::start_ns = 0;
+int ServerMetrics::metrics_socket = -1;
+
+void ServerMetrics::recordRelay(unsigned int bytes){
+    relayed_messages.fetch_add(1, memory_order_relaxed);
+    relayed_bytes.fetch_add(bytes, memory_order_relaxed);
+}
+
+void ServerMetrics::recordDecryptFailure(){
+    decrypt_failures.fetch_add(1, memory_order_relaxed);
+}
+
+void ServerMetrics::recordCounterFailure(){
+    counter_failures.fetch_add(1, memory_order_relaxed);
+}
+
+void ServerMetrics::userOnline(bool online){
+    users_online.fetch_add(online ? 1 : -1, memory_order_relaxed);
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function opens the endpoint and starts the thread     *|
+|* serving it. Only local clients can reach it: the port is   *|
+|* bound to the loopback interface.                           *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool ServerMetrics::start(string endpoint){
+    start_ns = Instrumentation::now();
+    if (endpoint.find('/') != string::npos){
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (endpoint.size() >= sizeof(addr.sun_path)){ Logger::error("Path of the metrics socket too long"); return false; }
+        strcpy(addr.sun_path, endpoint.c_str());
+        metrics_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(addr.sun_path);
+        if (metrics_socket < 0 || bind(metrics_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(metrics_socket, 16) < 0){
+            Logger::error("Error in opening the metrics socket ", endpoint);
+            return false;
+        }
+    } else {
+        int port = atoi(endpoint.c_str());
+        if (port <= 0 || port >= 65536){ Logger::error("Metrics port not valid"); return false; }
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        metrics_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int enable = 1;
+        if (metrics_socket < 0 || setsockopt(metrics_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0 ||
+            bind(metrics_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(metrics_socket, 16) < 0){
+            Logger::error("Error in opening the metrics port ", port);
+            return false;
+        }
+    }
+    thread(&ServerMetrics::serve).detach();
+    Logger::info("Metrics served on ", endpoint);
+    return true;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function is the thread of the endpoint: it reads the  *|
+|* HTTP request of a scrape, whatever it asks, and answers    *|
+|* with the metrics before closing the connection.            *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void ServerMetrics::serve(){
+    while (true){
+        int client = accept4(metrics_socket, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0){ continue; }
+
+        //A slow client cannot hold the endpoint for more than a second
+        struct timeval timeout = {1, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        char request[4096];
+        unsigned int received = 0;
+        while (received < sizeof(request) - 1){
+            ssize_t len = recv(client, request + received, sizeof(request) - 1 - received, 0);
+            if (len <= 0){ break; }
+            received += len;
+            request[received] = '\0';
+            if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")){ break; }
+        }
+
+        string body = render();
+        string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        unsigned int sent = 0;
+        while (sent < response.size()){
+            ssize_t len = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (len <= 0){ break; }
+            sent += len;
+        }
+        close(client);
+    }
+}
+
+unsigned long long ServerMetrics::threadCount(){
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)){
+        if (line.compare(0, 8, "Threads:") == 0){ return strtoull(line.c_str() + 8, NULL, 10); }
+    }
+    return 0;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function writes the metrics in the Prometheus text    *|
+|* format. The rates (handshakes, messages and bytes per      *|
+|* second) are left to the scraper, from the counters.        *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+string ServerMetrics::render(){
+    ostringstream out;
+
+    out<<"# HELP securechat_uptime_seconds Seconds since the server started."<<"\n";
+    out<<"# TYPE securechat_uptime_seconds gauge"<<"\n";
+    out<<"securechat_uptime_seconds "<<(Instrumentation::now() - start_ns)/1e9<<"\n";
+
+    out<<"# HELP securechat_connections Open connections by phase of the protocol."<<"\n";
+    out<<"# TYPE securechat_connections gauge"<<"\n";
+    for (int i = 0; i < PHASE_CLOSED; i++){
+        out<<"securechat_connections{state=\""<<ProtocolStateMachine::phaseName(i)<<"\"} "<<ProtocolStateMachine::connections(i)<<"\n";
+    }
+
+    out<<"# HELP securechat_users_online Users logged in."<<"\n";
+    out<<"# TYPE securechat_users_online gauge"<<"\n";
+    out<<"securechat_users_online "<<users_online.load(memory_order_relaxed)<<"\n";
+
+    out<<"# HELP securechat_handshakes_total Logins completed, with S3 (full) or R3 (resumed)."<<"\n";
+    out<<"# TYPE securechat_handshakes_total counter"<<"\n";
+    out<<"securechat_handshakes_total{kind=\"full\"} "<<SessionTickets::loginCount(false)<<"\n";
+    out<<"securechat_handshakes_total{kind=\"resumed\"} "<<SessionTickets::loginCount(true)<<"\n";
+
+    out<<"# HELP securechat_tickets_rejected_total Resumptions refused, followed by a full login."<<"\n";
+    out<<"# TYPE securechat_tickets_rejected_total counter"<<"\n";
+    out<<"securechat_tickets_rejected_total "<<SessionTickets::rejectedCount()<<"\n";
+
+    out<<"# HELP securechat_relayed_messages_total Chat messages forwarded to the peer."<<"\n";
+    out<<"# TYPE securechat_relayed_messages_total counter"<<"\n";
+    out<<"securechat_relayed_messages_total "<<relayed_messages.load(memory_order_relaxed)<<"\n";
+
+    out<<"# HELP securechat_relayed_bytes_total Bytes of the chat messages forwarded to the peer."<<"\n";
+    out<<"# TYPE securechat_relayed_bytes_total counter"<<"\n";
+    out<<"securechat_relayed_bytes_total "<<relayed_bytes.load(memory_order_relaxed)<<"\n";
+
+    out<<"# HELP securechat_decrypt_failures_total Records of the users that could not be decrypted."<<"\n";
+    out<<"# TYPE securechat_decrypt_failures_total counter"<<"\n";
+    out<<"securechat_decrypt_failures_total "<<decrypt_failures.load(memory_order_relaxed)<<"\n";
+
+    out<<"# HELP securechat_counter_failures_total Records of the users with a wrong counter."<<"\n";
+    out<<"# TYPE securechat_counter_failures_total counter"<<"\n";
+    out<<"securechat_counter_failures_total "<<counter_failures.load(memory_order_relaxed)<<"\n";
+
+    out<<"# HELP securechat_log_dropped_total Log entries dropped because the ring of their thread was full."<<"\n";
+    out<<"# TYPE securechat_log_dropped_total counter"<<"\n";
+    out<<"securechat_log_dropped_total "<<Logger::dropped()<<"\n";
+
+    out<<"# HELP securechat_threads Threads of the process."<<"\n";
+    out<<"# TYPE securechat_threads gauge"<<"\n";
+    out<<"securechat_threads "<<threadCount()<<"\n";
+
+    struct mallinfo2 heap = mallinfo2();
+    out<<"# HELP securechat_heap_bytes Heap of the allocator: in use, and taken from the system."<<"\n";
+    out<<"# TYPE securechat_heap_bytes gauge"<<"\n";
+    out<<"securechat_heap_bytes{kind=\"in_use\"} "<<heap.uordblks + heap.hblkhd<<"\n";
+    out<<"securechat_heap_bytes{kind=\"total\"} "<<heap.arena + heap.hblkhd<<"\n";
+
+    /* ---------------------------------------------------------- *\
+    |* Quantiles of the latency histograms, merged on the spot    *|
+    \* ---------------------------------------------------------- */
+    const char* quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+    const double fractions[] = { 0.5, 0.9, 0.99, 0.999 };
+    LatencySnapshot* merged = new LatencySnapshot;
+    out<<"# HELP securechat_latency_seconds Latency of the steps of the login, of the RTT and of the relay."<<"\n";
+    out<<"# TYPE securechat_latency_seconds summary"<<"\n";
+    for (int i = 0; i < LATENCY_PHASES; i++){
+        LatencyStats::snapshot(i, *merged);
+        string phase = LatencyStats::phaseName(i);
+        for (unsigned int j = 0; j < 4; j++){
+            out<<"securechat_latency_seconds{phase=\""<<phase<<"\",quantile=\""<<quantiles[j]<<"\"} "<<LatencyStats::quantile(*merged, fractions[j])/1e9<<"\n";
+        }
+        out<<"securechat_latency_seconds_sum{phase=\""<<phase<<"\"} "<<merged->total_ns/1e9<<"\n";
+        out<<"securechat_latency_seconds_count{phase=\""<<phase<<"\"} "<<merged->count<<"\n";
+    }
+    delete merged;
+    return out.str();
+}
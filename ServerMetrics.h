@@ -0,0 +1,57 @@
+#include <atomic>
+#include <string>
+
+#ifndef CYBERSECURITYPROJECT_SERVERMETRICS_H
+#define CYBERSECURITYPROJECT_SERVERMETRICS_H
+
+using namespace std;
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Counters of the server and the endpoint that exposes them  *|
+|* in the Prometheus text format. The endpoint is a local TCP *|
+|* port or a Unix socket served by its own thread, one scrape *|
+|* at a time. A scrape reads only atomics: the counters here, *|
+|* the phases of the connections, the logins of the tickets   *|
+|* and the latency histograms; it never takes the locks of    *|
+|* the users.                                                 *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class ServerMetrics {
+    private:
+        static atomic<unsigned long long> relayed_messages;
+        static atomic<unsigned long long> relayed_bytes;
+        static atomic<unsigned long long> decrypt_failures;
+        static atomic<unsigned long long> counter_failures;
+        static atomic<long long> users_online;
+
+        //Steady clock at the start, for the uptime
+        static unsigned long long start_ns;
+
+        //Listening socket of the endpoint
+        static int metrics_socket;
+
+        //Answer the scrapes
+        static void serve();
+
+        //Threads of the process, from /proc
+        static unsigned long long threadCount();
+
+    public:
+        //Open the endpoint: a port on the loopback interface, or the path of a Unix socket if it contains a '/'
+        static bool start(string endpoint);
+
+        static void recordRelay(unsigned int bytes);
+
+        static void recordDecryptFailure();
+
+        static void recordCounterFailure();
+
+        //A user has logged in or out
+        static void userOnline(bool online);
+
+        //Body of a scrape
+        static string render();
+};
+
+#endif
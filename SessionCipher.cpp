@@ -0,0 +1,183 @@
+#include "SessionCipher.h"
+#include "Utility.h"
+#include <cstring>
+#include <iostream>
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+SessionCipher::SessionCipher(){
+    this->encrypt_ctx = EVP_CIPHER_CTX_new();
+    this->decrypt_ctx = EVP_CIPHER_CTX_new();
+    this->keyed = false;
+    this->aead = AEAD_AES_128_GCM;
+    this->encrypted_records = 0;
+    this->encrypted_bytes = 0;
+}
+
+/* ---------------------------------------------------------- *\
+|* Class Destructor                                           *|
+\* ---------------------------------------------------------- */
+SessionCipher::~SessionCipher(){
+    EVP_CIPHER_CTX_free(this->encrypt_ctx);
+    EVP_CIPHER_CTX_free(this->decrypt_ctx);
+    OPENSSL_cleanse(this->encrypt_secret, K_SIZE);
+    OPENSSL_cleanse(this->decrypt_secret, K_SIZE);
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function keys the two contexts with the first secret  *|
+|* of each direction, expanded from K with its label: the     *|
+|* two ends count their records from the same IV, so the same *|
+|* key in both directions would reuse every nonce. The cipher *|
+|* is the one fetched at startup, so the provider is not      *|
+|* searched again.                                            *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool SessionCipher::setKey(unsigned char aead_suite, const unsigned char* K, const char* encrypt_label, const char* decrypt_label){
+    this->keyed = false;
+    if (!this->encrypt_ctx || !this->decrypt_ctx || !cipher(aead_suite)){ return false; }
+    this->aead = aead_suite;
+    if (!Utility::expandKey(K, K_SIZE, NULL, 0, encrypt_label, this->encrypt_secret, K_SIZE) ||
+        !Utility::expandKey(K, K_SIZE, NULL, 0, decrypt_label, this->decrypt_secret, K_SIZE)){ return false; }
+    this->encrypted_records = 0;
+    this->encrypted_bytes = 0;
+    if (!keyContext(this->encrypt_ctx, true, this->encrypt_secret) || !keyContext(this->decrypt_ctx, false, this->decrypt_secret)){ return false; }
+    this->keyed = true;
+    return true;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function keys a context from a secret. The secret is  *|
+|* the key of AES-128-GCM; the suites with a longer key       *|
+|* expand it with HKDF, labeled with the name of the suite.   *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool SessionCipher::keyContext(EVP_CIPHER_CTX* ctx, bool encrypt, const unsigned char* secret){
+    EVP_CIPHER* aead_cipher = cipher(this->aead);
+    unsigned char key[AEAD_KEY_MAX_SIZE];
+    unsigned int key_len = EVP_CIPHER_get_key_length(aead_cipher);
+    bool ok = key_len <= AEAD_KEY_MAX_SIZE;
+    if (ok && key_len == K_SIZE){
+        memcpy(key, secret, K_SIZE);
+    } else if (ok){
+        ok = Utility::expandKey(secret, K_SIZE, NULL, 0, suiteName(this->aead).c_str(), key, key_len);
+    }
+    if (encrypt){
+        ok = ok && EVP_EncryptInit_ex2(ctx, aead_cipher, key, NULL, NULL) == 1;
+    } else {
+        ok = ok && EVP_DecryptInit_ex2(ctx, aead_cipher, key, NULL, NULL) == 1;
+    }
+    OPENSSL_cleanse(key, AEAD_KEY_MAX_SIZE);
+    return ok;
+}
+
+bool SessionCipher::ratchet(unsigned char* secret){
+    unsigned char next[K_SIZE];
+    bool ok = Utility::expandKey(secret, K_SIZE, NULL, 0, "rekey", next, K_SIZE);
+    if (ok){ memcpy(secret, next, K_SIZE); }
+    OPENSSL_cleanse(next, K_SIZE);
+    return ok;
+}
+
+bool SessionCipher::isKeyed(){
+    return this->keyed;
+}
+
+unsigned char SessionCipher::suite(){
+    return this->aead;
+}
+
+bool SessionCipher::encryptExpired(){
+    return this->encrypted_records >= REKEY_RECORDS || this->encrypted_bytes >= REKEY_BYTES;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* These functions ratchet one direction. The old secret is   *|
+|* overwritten, so a key leaked later does not decrypt the    *|
+|* records sent before the rekey. A context that cannot be    *|
+|* keyed again is left unkeyed and refuses the records.       *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool SessionCipher::rekeyEncrypt(){
+    if (!this->keyed){ return false; }
+    this->encrypted_records = 0;
+    this->encrypted_bytes = 0;
+    if (!ratchet(this->encrypt_secret) || !keyContext(this->encrypt_ctx, true, this->encrypt_secret)){ this->keyed = false; return false; }
+    return true;
+}
+
+bool SessionCipher::rekeyDecrypt(){
+    if (!this->keyed){ return false; }
+    if (!ratchet(this->decrypt_secret) || !keyContext(this->decrypt_ctx, false, this->decrypt_secret)){ this->keyed = false; return false; }
+    return true;
+}
+
+EVP_CIPHER* SessionCipher::cipher(unsigned char aead_suite){
+    switch(aead_suite){
+        case AEAD_AES_128_GCM: return Utility::AES_128_GCM;
+        case AEAD_AES_256_GCM: return Utility::AES_256_GCM;
+        case AEAD_CHACHA20_POLY1305: return Utility::CHACHA20_POLY1305;
+        default: return NULL;
+    }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function chooses the default suite of this machine.   *|
+|* Without AES instructions GCM runs on table lookups, many   *|
+|* times slower than ChaCha20-Poly1305 in plain registers.    *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+unsigned char SessionCipher::probeSuite(){
+#if defined(__x86_64__) || defined(__i386__)
+    bool hardware_aes = __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    bool hardware_aes = (hwcap & HWCAP_AES) && (hwcap & HWCAP_PMULL);
+#else
+    bool hardware_aes = false;
+#endif
+    return hardware_aes ? AEAD_AES_128_GCM : AEAD_CHACHA20_POLY1305;
+}
+
+string SessionCipher::suiteName(unsigned char aead_suite){
+    switch(aead_suite){
+        case AEAD_AES_128_GCM: return "aes-128-gcm";
+        case AEAD_AES_256_GCM: return "aes-256-gcm";
+        case AEAD_CHACHA20_POLY1305: return "chacha20-poly1305";
+        default: return "unknown";
+    }
+}
+
+bool SessionCipher::parseSuite(string name, unsigned char &aead_suite){
+    if (name == "aes128"){ aead_suite = AEAD_AES_128_GCM; return true; }
+    if (name == "aes256"){ aead_suite = AEAD_AES_256_GCM; return true; }
+    if (name == "chacha20"){ aead_suite = AEAD_CHACHA20_POLY1305; return true; }
+    return false;
+}
+
+bool SessionCipher::encrypt(__uint128_t counter, const unsigned char* plaintext, unsigned int plaintext_len, unsigned char* record, unsigned int record_size, unsigned int &record_len){
+    if (!this->keyed){ return false; }
+    this->encrypted_records++;
+    this->encrypted_bytes += plaintext_len;
+    return Utility::encryptRecord(this->encrypt_ctx, counter, plaintext, plaintext_len, record, record_size, record_len);
+}
+
+bool SessionCipher::decrypt(const unsigned char* record, unsigned int record_len, unsigned char* plaintext, unsigned int &plaintext_len){
+    if (!this->keyed){ return false; }
+    return Utility::decryptRecord(this->decrypt_ctx, record, record_len, plaintext, plaintext_len);
+}
+
+bool SessionCipher::seal(__uint128_t counter, unsigned char* record, unsigned int plaintext_len, unsigned int record_size, unsigned int &record_len){
+    if (record_size < GCM_IV_SIZE){ cerr<<"ERR: Access-out-bound."<<endl; return false; }
+    return encrypt(counter, record + GCM_IV_SIZE, plaintext_len, record, record_size, record_len);
+}
+
+bool SessionCipher::open(unsigned char* record, unsigned int record_len, unsigned int &plaintext_len){
+    return decrypt(record, record_len, record + GCM_IV_SIZE, plaintext_len);
+}
@@ -0,0 +1,93 @@
+#include <string>
+#include <openssl/evp.h>
+#include "constants.h"
+
+#ifndef CYBERSECURITYPROJECT_SESSIONCIPHER_H
+#define CYBERSECURITYPROJECT_SESSIONCIPHER_H
+
+using namespace std;
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* AEAD contexts of a session key, with the suite negotiated  *|
+|* at login or at the chat setup. The key schedule is         *|
+|* expanded once, when the key is set, and every record then  *|
+|* only sets its IV. All the suites use the same record       *|
+|* layout, so the callers do not depend on the suite. Each    *|
+|* direction has its own secret, expanded from K with the     *|
+|* label of the direction, and ratchets it on its own rekey.  *|
+|* The encrypt and the decrypt contexts can be used by two    *|
+|* different threads, but each one by a single thread at a    *|
+|* time.                                                      *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class SessionCipher {
+    private:
+        EVP_CIPHER_CTX* encrypt_ctx;
+        EVP_CIPHER_CTX* decrypt_ctx;
+        bool keyed;
+        unsigned char aead;
+
+        //Secrets of the current keys of the two directions
+        unsigned char encrypt_secret[K_SIZE];
+        unsigned char decrypt_secret[K_SIZE];
+
+        //Records and bytes encrypted with the current key
+        unsigned long long encrypted_records;
+        unsigned long long encrypted_bytes;
+
+        //Key a context with the key of the suite expanded from a secret
+        bool keyContext(EVP_CIPHER_CTX* ctx, bool encrypt, const unsigned char* secret);
+
+        //Replace a secret with the next one of its chain
+        static bool ratchet(unsigned char* secret);
+
+    public:
+        SessionCipher();
+
+        ~SessionCipher();
+
+        SessionCipher(const SessionCipher&) = delete;
+        SessionCipher& operator=(const SessionCipher&) = delete;
+
+        //Key both contexts at the start of a session, with the secrets expanded from K with the label of each direction
+        bool setKey(unsigned char aead_suite, const unsigned char* K, const char* encrypt_label, const char* decrypt_label);
+
+        bool isKeyed();
+
+        unsigned char suite();
+
+        //The encrypt key reached REKEY_RECORDS or REKEY_BYTES: the next record has to be a rekey message
+        bool encryptExpired();
+
+        //Move the encrypt key to the next one, after sending the rekey message
+        bool rekeyEncrypt();
+
+        //Move the decrypt key to the next one, after receiving the rekey message
+        bool rekeyDecrypt();
+
+        //Cipher fetched at startup for a suite, NULL if the suite is not known
+        static EVP_CIPHER* cipher(unsigned char aead_suite);
+
+        //Suite of the CPU: AES-128-GCM with AES and carry-less multiply instructions, ChaCha20-Poly1305 without
+        static unsigned char probeSuite();
+
+        static string suiteName(unsigned char aead_suite);
+
+        //Suite of a name given on the command line (aes128, aes256, chacha20)
+        static bool parseSuite(string name, unsigned char &aead_suite);
+
+        //Encrypt a plaintext in a record IV | ciphertext | tag. The plaintext can already be at record + GCM_IV_SIZE
+        bool encrypt(__uint128_t counter, const unsigned char* plaintext, unsigned int plaintext_len, unsigned char* record, unsigned int record_size, unsigned int &record_len);
+
+        //Decrypt and authenticate a record. The plaintext can be written at record + GCM_IV_SIZE
+        bool decrypt(const unsigned char* record, unsigned int record_len, unsigned char* plaintext, unsigned int &plaintext_len);
+
+        //Encrypt in place the plaintext written at record + GCM_IV_SIZE
+        bool seal(__uint128_t counter, unsigned char* record, unsigned int plaintext_len, unsigned int record_size, unsigned int &record_len);
+
+        //Decrypt in place a record, the plaintext is left at record + GCM_IV_SIZE
+        bool open(unsigned char* record, unsigned int record_len, unsigned int &plaintext_len);
+};
+
+#endif
@@ -0,0 +1,113 @@
+#include "SessionTickets.h"
+#include "Utility.h"
+#include "Logger.h"
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <unistd.h>
+
+unsigned char SessionTickets::ticket_key[K_SIZE];
+
+atomic<unsigned long long> SessionTickets::issued(0);
+
+LoginStats SessionTickets::full_logins;
+LoginStats SessionTickets::resumed_logins;
+atomic<unsigned long long> SessionTickets::rejected(0);
+
+void SessionTickets::start(){
+    RAND_poll();
+    RAND_bytes(ticket_key, K_SIZE);
+}
+
+unsigned long long SessionTickets::now(){
+    return chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function seals a ticket: username length, username   *|
+|* padded to USERNAME_MAX_SIZE, expiry and resumption secret, *|
+|* encrypted and authenticated with the ticket key.           *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool SessionTickets::issue(string username, unsigned long long expiry, const unsigned char* secret, unsigned char* ticket){
+    if (username.length() > USERNAME_MAX_SIZE){ return false; }
+    unsigned char* plaintext = ticket + GCM_IV_SIZE;
+    memset(plaintext, 0, TICKET_PLAINTEXT_SIZE);
+    plaintext[0] = username.length();
+    memcpy(plaintext + 1, username.c_str(), username.length());
+    memcpy(plaintext + 1 + USERNAME_MAX_SIZE, &expiry, sizeof(expiry));
+    memcpy(plaintext + 1 + USERNAME_MAX_SIZE + sizeof(expiry), secret, RESUMPTION_SECRET_SIZE);
+
+    unsigned int ticket_len;
+    bool ok = Utility::sealRecord(ticket_key, ++issued, ticket, TICKET_PLAINTEXT_SIZE, TICKET_SIZE, ticket_len) && ticket_len == TICKET_SIZE;
+    if (!ok){ OPENSSL_cleanse(ticket, TICKET_SIZE); }
+    return ok;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function opens a ticket received in R2. The ticket is *|
+|* decrypted in a copy, the received one is left untouched.   *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool SessionTickets::open(const unsigned char* ticket, string &username, unsigned long long &expiry, unsigned char* secret){
+    unsigned char record[TICKET_SIZE];
+    memcpy(record, ticket, TICKET_SIZE);
+    unsigned int plaintext_len;
+    if (!Utility::openRecord(ticket_key, record, TICKET_SIZE, plaintext_len) || plaintext_len != TICKET_PLAINTEXT_SIZE){
+        Logger::warn("Ticket not issued with the current key");
+        return false;
+    }
+
+    unsigned char* plaintext = record + GCM_IV_SIZE;
+    unsigned int username_len = plaintext[0];
+    bool ok = username_len > 0 && username_len <= USERNAME_MAX_SIZE;
+    if (ok){
+        username.assign((char*)plaintext + 1, username_len);
+        memcpy(&expiry, plaintext + 1 + USERNAME_MAX_SIZE, sizeof(expiry));
+        memcpy(secret, plaintext + 1 + USERNAME_MAX_SIZE + sizeof(expiry), RESUMPTION_SECRET_SIZE);
+        if (expiry <= now()){ Logger::warn("Ticket of ", username, " expired"); ok = false; }
+    }
+    OPENSSL_cleanse(record, TICKET_SIZE);
+    if (!ok){ OPENSSL_cleanse(secret, RESUMPTION_SECRET_SIZE); }
+    return ok;
+}
+
+void SessionTickets::recordLogin(bool resumed, unsigned long long ns){
+    LoginStats &stats = resumed ? resumed_logins : full_logins;
+    stats.count++;
+    stats.total_ns += ns;
+}
+
+void SessionTickets::recordRejected(){
+    rejected++;
+}
+
+unsigned long long SessionTickets::loginCount(bool resumed){
+    return (resumed ? resumed_logins : full_logins).count.load();
+}
+
+unsigned long long SessionTickets::rejectedCount(){
+    return rejected.load();
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function prints the full and the resumed logins, with *|
+|* the server time of each kind as logins per CPU second.     *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void SessionTickets::printTicketStats(){
+    cout<<"Thread "<<gettid()<<": Login statistics"<<endl;
+    const char* names[] = { "full", "resumed" };
+    LoginStats* stats[] = { &full_logins, &resumed_logins };
+    for (unsigned int i = 0; i < 2; i++){
+        unsigned long long count = stats[i]->count.load();
+        unsigned long long total_ns = stats[i]->total_ns.load();
+        double rate = (total_ns > 0) ? count*1e9/total_ns : 0;
+        cout<<"     "<<names[i]<<": "<<count<<" logins, mean "<<((count > 0) ? total_ns/count/1000 : 0)<<" us, "<<fixed<<setprecision(1)<<rate<<" logins/s per thread"<<endl;
+    }
+    cout<<"     "<<rejected.load()<<" tickets rejected"<<endl;
+}
@@ -0,0 +1,64 @@
+#include <atomic>
+#include <string>
+#include <openssl/evp.h>
+#include "constants.h"
+
+#ifndef CYBERSECURITYPROJECT_SESSIONTICKETS_H
+#define CYBERSECURITYPROJECT_SESSIONTICKETS_H
+
+using namespace std;
+
+//Logins of one kind and the server time they took, from S2 or R2 to S3 or R3 sent
+struct LoginStats {
+    atomic<unsigned long long> count;
+    atomic<unsigned long long> total_ns;
+};
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Resumption tickets of the server. A ticket is the username,*|
+|* the expiry and the resumption secret of a session, sealed  *|
+|* with a key that only the server knows, so the server keeps *|
+|* no state per ticket. The key is generated at startup: the  *|
+|* tickets issued before a restart are rejected and the users *|
+|* go through the full login again.                           *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class SessionTickets {
+    private:
+        static unsigned char ticket_key[K_SIZE];
+
+        //Counter used as IV of the tickets, never repeated with the same key
+        static atomic<unsigned long long> issued;
+
+        static LoginStats full_logins;
+        static LoginStats resumed_logins;
+        static atomic<unsigned long long> rejected;
+
+    public:
+        //Generate the ticket key, before the reactors start
+        static void start();
+
+        //Seconds since the epoch
+        static unsigned long long now();
+
+        //Seal a ticket (TICKET_SIZE bytes)
+        static bool issue(string username, unsigned long long expiry, const unsigned char* secret, unsigned char* ticket);
+
+        //Open a ticket, false if it was not issued with the current key or it is expired
+        static bool open(const unsigned char* ticket, string &username, unsigned long long &expiry, unsigned char* secret);
+
+        //Account a login of the server, full or resumed
+        static void recordLogin(bool resumed, unsigned long long ns);
+
+        static void recordRejected();
+
+        //Logins of a kind accounted so far
+        static unsigned long long loginCount(bool resumed);
+
+        static unsigned long long rejectedCount();
+
+        static void printTicketStats();
+};
+
+#endif
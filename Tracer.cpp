@@ -0,0 +1,156 @@
+#include "Tracer.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <signal.h>
+#include <thread>
+
+bool Tracer::enabled = false;
+string Tracer::path;
+string Tracer::process;
+mutex Tracer::write_mutex;
+
+void Tracer::record(const char* name, unsigned long long begin_ns, unsigned long long session, const string &user, const string &peer, bool async){
+    if (!enabled){ return; }
+    Buffer* buffer = PerThread<Buffer>::get();
+    unsigned int count = buffer->count.load(memory_order_relaxed);
+    if (count == TRACE_BUFFER_EVENTS){
+        buffer->dropped.store(buffer->dropped.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        return;
+    }
+    TraceEvent &event = buffer->events[count];
+    event.name = name;
+    event.begin_ns = begin_ns;
+    event.end_ns = Instrumentation::now();
+    event.session = session;
+    event.tid = gettid();
+    event.async = async;
+    strncpy(event.user, user.c_str(), USERNAME_MAX_SIZE);
+    event.user[USERNAME_MAX_SIZE] = '\0';
+    strncpy(event.peer, peer.c_str(), USERNAME_MAX_SIZE);
+    event.peer[USERNAME_MAX_SIZE] = '\0';
+
+    //Publish the span to the writer
+    buffer->count.store(count + 1, memory_order_release);
+}
+
+string Tracer::jsonEscape(const char* text, unsigned int len){
+    string escaped;
+    for (unsigned int i = 0; i < len; i++){
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\'){
+            escaped += '\\';
+            escaped += c;
+        } else if (c < 0x20){
+            char code[7];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function writes the spans published in the buffers.   *|
+|* A span of a thread becomes a complete event ("X") on the   *|
+|* track of the thread; a span that may be suspended becomes  *|
+|* a pair of async events ("b" and "e") on the track of its   *|
+|* session, since it overlaps the spans of the other          *|
+|* connections served meanwhile by the same thread. The file  *|
+|* is replaced only once written.                             *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void Tracer::write(){
+    if (!enabled){ return; }
+    lock_guard<mutex> lck(write_mutex);
+
+    string tmp_path = path + ".tmp";
+    ofstream out(tmp_path);
+    if (!out){
+        cerr<<"Error in opening the trace file "<<tmp_path<<endl;
+        return;
+    }
+    pid_t pid = getpid();
+    out<<fixed<<setprecision(3);
+    out<<"{\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_spans\":"<<dropped()<<"},\"traceEvents\":[\n";
+    out<<"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":"<<pid<<",\"tid\":0,\"args\":{\"name\":\""<<jsonEscape(process.c_str(), process.size())<<"\"}}";
+
+    for (Buffer* buffer = PerThread<Buffer>::first(); buffer != NULL; buffer = buffer->next){
+        unsigned int count = buffer->count.load(memory_order_acquire);
+        for (unsigned int i = 0; i < count; i++){
+            const TraceEvent &event = buffer->events[i];
+            string args = "{\"session\":" + to_string(event.session) + ",\"user\":\"" + jsonEscape(event.user, strlen(event.user)) + "\",\"peer\":\"" + jsonEscape(event.peer, strlen(event.peer)) + "\"}";
+            string name = jsonEscape(event.name, strlen(event.name));
+            if (event.async){
+                out<<",\n{\"name\":\""<<name<<"\",\"cat\":\"session\",\"ph\":\"b\",\"id\":"<<event.session<<",\"pid\":"<<pid<<",\"tid\":"<<event.tid<<",\"ts\":"<<event.begin_ns/1000.0<<",\"args\":"<<args<<"}";
+                out<<",\n{\"name\":\""<<name<<"\",\"cat\":\"session\",\"ph\":\"e\",\"id\":"<<event.session<<",\"pid\":"<<pid<<",\"tid\":"<<event.tid<<",\"ts\":"<<event.end_ns/1000.0<<"}";
+            } else {
+                out<<",\n{\"name\":\""<<name<<"\",\"cat\":\"protocol\",\"ph\":\"X\",\"pid\":"<<pid<<",\"tid\":"<<event.tid<<",\"ts\":"<<event.begin_ns/1000.0<<",\"dur\":"<<(event.end_ns - event.begin_ns)/1000.0<<",\"args\":"<<args<<"}";
+            }
+        }
+    }
+    out<<"\n]}\n";
+    out.close();
+    if (!out || rename(tmp_path.c_str(), path.c_str()) != 0){ cerr<<"Error in writing the trace file "<<path<<endl; }
+}
+
+unsigned long long Tracer::dropped(){
+    unsigned long long total = 0;
+    for (Buffer* buffer = PerThread<Buffer>::first(); buffer != NULL; buffer = buffer->next){
+        total += buffer->dropped.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+void Tracer::dumpLoop(int signum){
+    sigset_t dump_set;
+    sigemptyset(&dump_set);
+    sigaddset(&dump_set, signum);
+    while (true){
+        int received;
+        if (sigwait(&dump_set, &received) != 0){ continue; }
+        write();
+    }
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function enables the trace. It is called before the   *|
+|* threads that record spans are started.                     *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void Tracer::start(string path, string process, int signum){
+    Tracer::path = path;
+    Tracer::process = process;
+    enabled = true;
+    atexit(&Tracer::write);
+    if (signum != 0){ thread(&Tracer::dumpLoop, signum).detach(); }
+}
+
+TraceSpan::TraceSpan(const char* name, unsigned long long session, const string &user, const string &peer, bool async){
+    this->name = name;
+    this->session = session;
+    this->async = async;
+    this->begin_ns = 0;
+    if (!Tracer::active()){ return; }
+    this->user = user;
+    this->peer = peer;
+    this->begin_ns = Instrumentation::now();
+}
+
+TraceSpan::~TraceSpan(){
+    if (!Tracer::active()){ return; }
+    Tracer::record(this->name, this->begin_ns, this->session, this->user, this->peer, this->async);
+}
+
+void TraceSpan::setUsers(const string &user, const string &peer){
+    if (!Tracer::active()){ return; }
+    this->user = user;
+    this->peer = peer;
+}
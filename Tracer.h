@@ -0,0 +1,98 @@
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include "constants.h"
+#include "Instrumentation.h"
+
+#ifndef CYBERSECURITYPROJECT_TRACER_H
+#define CYBERSECURITYPROJECT_TRACER_H
+
+using namespace std;
+
+//Span recorded by a thread, written as a Chrome trace event
+struct TraceEvent {
+    const char* name;       //string literal, never copied
+    unsigned long long begin_ns;
+    unsigned long long end_ns;
+    unsigned long long session;     //0 if the span does not belong to a session
+    pid_t tid;              //thread where the span began
+    bool async;             //the span may be suspended (coroutine): drawn on a track of its session
+    char user[USERNAME_MAX_SIZE + 1];
+    char peer[USERNAME_MAX_SIZE + 1];
+};
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Opt-in timeline of the protocol, written as the JSON of    *|
+|* the Chrome trace format (chrome://tracing, Perfetto). Each *|
+|* thread appends its spans to a buffer of its own, bounded   *|
+|* to TRACE_BUFFER_EVENTS: once full, the spans are dropped   *|
+|* and counted. The buffers are allocated only if the trace   *|
+|* is enabled, and written at the exit of the process or on   *|
+|* a signal. Times come from the steady clock, shared by the  *|
+|* processes of a host, so the trace of the server and the    *|
+|* ones of its clients can be merged.                         *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class Tracer {
+    public:
+        //Spans of a thread; count is moved only by the thread
+        struct Buffer {
+            TraceEvent events[TRACE_BUFFER_EVENTS];
+            atomic<unsigned int> count;
+            atomic<unsigned long long> dropped;
+            Buffer* next;
+        };
+
+    private:
+        static bool enabled;
+        static string path;
+        static string process;
+
+        //Held while the trace is written: at the exit or on the signal
+        static mutex write_mutex;
+
+        //Write the trace every time the signal is received
+        static void dumpLoop(int signum);
+
+    public:
+        //Enable the trace, written to path under the given process name; signum (0 for none) must be blocked in all the threads
+        static void start(string path, string process, int signum);
+
+        static bool active(){ return enabled; }
+
+        //Record a span begun at a value of Instrumentation::now()
+        static void record(const char* name, unsigned long long begin_ns, unsigned long long session, const string &user, const string &peer, bool async);
+
+        //Write all the spans recorded up to now, replacing the file
+        static void write();
+
+        //Spans dropped because a buffer was full
+        static unsigned long long dropped();
+
+        //Text as a JSON string, without the quotes
+        static string jsonEscape(const char* text, unsigned int len);
+};
+
+//Span from its construction to its destruction, recorded only if the trace is enabled
+class TraceSpan {
+    private:
+        const char* name;
+        unsigned long long begin_ns;
+        unsigned long long session;
+        string user;
+        string peer;
+        bool async;
+
+    public:
+        TraceSpan(const char* name, unsigned long long session, const string &user, const string &peer, bool async = false);
+
+        ~TraceSpan();
+
+        //Name the users once they are known, e.g. after S2
+        void setUsers(const string &user, const string &peer);
+};
+
+#endif
@@ -64,6 +64,8 @@ User::User(const User &user){
     this->socket = user.socket;
     this->status = user.status;
     this->username = user.username;
+    this->connection = user.connection;
+    this->cipher = user.cipher;
 
     if (pthread_mutex_init(&this->user_mutex, NULL) != 0){
         cerr<<"Error in initializing the mutex"<<endl;
@@ -6,8 +6,9 @@
 #include <arpa/inet.h>
 #include <cstring>
 #include <mutex>
-#include <condition_variable>
-#include "Utility.h"
+#include <memory>
+#include "Connection.h"
+#include "SessionCipher.h"
 #include <openssl/evp.h>
 
 using namespace std;
@@ -17,7 +18,9 @@ struct User {
     __uint128_t user_counter;
     __uint128_t base_counter;
 
-    unsigned char* K;
+    //Contexts keyed with K at S3, used for every record of the session. Taken under user_mutex: a replaced
+    //session may still be using the previous ones on another reactor
+    shared_ptr<SessionCipher> cipher;
 
     //Username of the user
     string username;
@@ -39,11 +42,8 @@ struct User {
     //Mutex used to avoid multiple simultaneous accesses
     pthread_mutex_t user_mutex;
 
-    //This variable is used to communicate between the thread of the sender and the thread of the receiver during the protocol
-    condition_variable cv;
-    bool ready; //to wait the Response message of the receiver before checking the response value in the thread of the sender
-    mutex mtx;
-    map<string, int> responses;
+    //Connection of the logged user, used by the other reactors to reach him/her
+    shared_ptr<Connection> connection;
 
     User(const User &user);
 
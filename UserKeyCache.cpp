@@ -0,0 +1,140 @@
+#include "UserKeyCache.h"
+#include "User.h"
+#include "Utility.h"
+#include "Logger.h"
+#include <iostream>
+#include <limits.h>
+#include <mutex>
+#include <sys/inotify.h>
+#include <thread>
+#include <unistd.h>
+
+UserKeyTable* UserKeyCache::table = NULL;
+
+atomic<unsigned long long> UserKeyCache::hits(0);
+atomic<unsigned long long> UserKeyCache::loads(0);
+atomic<unsigned long long> UserKeyCache::reloads(0);
+
+static const string KEY_FILE_SUFFIX = "_pubkey.pem";
+
+UserKey::UserKey(EVP_PKEY* pubkey){
+    this->pubkey = pubkey;
+    BIO* mbio = BIO_new(BIO_s_mem());
+    PEM_write_bio_PUBKEY(mbio, pubkey);
+    char* pem_buf = NULL;
+    long pem_size = BIO_get_mem_data(mbio, &pem_buf);
+    this->pem.assign(pem_buf, pem_size);
+    BIO_free(mbio);
+}
+
+UserKey::~UserKey(){
+    EVP_PKEY_free(this->pubkey);
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function reads the key file of a user. Unlike         *|
+|* Utility::readPubKey it does not exit on a file that is not *|
+|* valid: the file may be in the middle of a replacement.     *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+shared_ptr<UserKey> UserKeyCache::load(string username){
+    string path = table->directory + username + KEY_FILE_SUFFIX;
+    char* canon_path = realpath(path.c_str(), NULL);
+    if (!canon_path){ return NULL; }
+    bool allowed = strncmp(canon_path, Utility::HOME_DIR, strlen(Utility::HOME_DIR)) == 0;
+    free(canon_path);
+    if (!allowed){ return NULL; }
+
+    BIO* file = BIO_new_file(path.c_str(), "r");
+    if (!file){ return NULL; }
+    EVP_PKEY* pubkey = PEM_read_bio_PUBKEY(file, NULL, NULL, NULL);
+    BIO_free(file);
+    if (!pubkey){ Logger::error("The public key of ", username, " is not valid"); return NULL; }
+    return make_shared<UserKey>(pubkey);
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function fills the cache and starts the inotify       *|
+|* thread. It is called once, before the reactors start.      *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool UserKeyCache::start(string directory, map<string, User>* users){
+    if (table){ return true; }
+    table = new UserKeyTable();
+    table->directory = directory;
+
+    for (map<string, User>::iterator it = users->begin(); it != users->end(); ++it){
+        if (!it->second.pubkey){ continue; }
+        EVP_PKEY_up_ref(it->second.pubkey);
+        table->keys[it->first] = make_shared<UserKey>(it->second.pubkey);
+    }
+
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0 || inotify_add_watch(inotify_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0){
+        Logger::error("Error while watching ", directory, ", the keys will not be reloaded");
+        if (inotify_fd >= 0){ close(inotify_fd); }
+        return false;
+    }
+    thread(&UserKeyCache::watch, inotify_fd).detach();
+    return true;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function is the inotify thread: the key of a user is  *|
+|* reloaded when its file is written or moved in the          *|
+|* directory, and dropped when it is removed.                 *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+void UserKeyCache::watch(int inotify_fd){
+    alignas(struct inotify_event) char buf[16*(sizeof(struct inotify_event) + NAME_MAX + 1)];
+    while (true){
+        ssize_t len = read(inotify_fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR){ continue; }
+        if (len <= 0){ Logger::error("Error while reading the inotify events"); close(inotify_fd); return; }
+
+        for (char* p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len){
+            struct inotify_event* event = (struct inotify_event*)p;
+            if (event->len == 0){ continue; }
+            string name(event->name);
+            if (name.length() <= KEY_FILE_SUFFIX.length() || name.compare(name.length() - KEY_FILE_SUFFIX.length(), KEY_FILE_SUFFIX.length(), KEY_FILE_SUFFIX) != 0){ continue; }
+            string username = name.substr(0, name.length() - KEY_FILE_SUFFIX.length());
+
+            shared_ptr<UserKey> key = (event->mask & (IN_DELETE | IN_MOVED_FROM)) ? shared_ptr<UserKey>() : load(username);
+            {
+                unique_lock<shared_mutex> lock(table->keys_mutex);
+                if (key){
+                    table->keys[username] = key;
+                } else {
+                    table->keys.erase(username);
+                }
+            }
+            reloads++;
+            Logger::info("Public key of ", username, (key ? " reloaded" : " dropped"));
+        }
+    }
+}
+
+shared_ptr<UserKey> UserKeyCache::get(string username){
+    {
+        shared_lock<shared_mutex> lock(table->keys_mutex);
+        map<string, shared_ptr<UserKey>>::iterator it = table->keys.find(username);
+        if (it != table->keys.end()){
+            hits++;
+            return it->second;
+        }
+    }
+
+    shared_ptr<UserKey> key = load(username);
+    loads++;
+    if (!key){ return NULL; }
+    unique_lock<shared_mutex> lock(table->keys_mutex);
+    return table->keys.emplace(username, key).first->second;
+}
+
+void UserKeyCache::printCacheStats(){
+    cout<<"Thread "<<gettid()<<": User key cache statistics"<<endl;
+    cout<<"     "<<hits.load()<<" hits, "<<loads.load()<<" loads from disk, "<<reloads.load()<<" reloads"<<endl;
+}
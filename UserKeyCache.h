@@ -0,0 +1,68 @@
+#include <atomic>
+#include <map>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <openssl/evp.h>
+
+#ifndef CYBERSECURITYPROJECT_USERKEYCACHE_H
+#define CYBERSECURITYPROJECT_USERKEYCACHE_H
+
+using namespace std;
+
+struct User;
+
+//Parsed public key of a user and its encoding in the message that sends it to a peer
+struct UserKey {
+    EVP_PKEY* pubkey;
+    string pem;
+
+    UserKey(EVP_PKEY* pubkey);
+    UserKey(const UserKey&) = delete;
+    UserKey& operator=(const UserKey&) = delete;
+    ~UserKey();
+};
+
+//Cached keys and the directory they are read from
+struct UserKeyTable {
+    string directory;
+    map<string, shared_ptr<UserKey>> keys;
+    shared_mutex keys_mutex;
+};
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Public keys of the users, parsed once and shared by the    *|
+|* reactors. A thread watches the key directory with inotify  *|
+|* and reloads the key of a user when its file is written,    *|
+|* so logins and chat setups do not touch the disk. A key is  *|
+|* given out as a shared_ptr: a reload does not free a key    *|
+|* still used by another thread.                              *|
+|* The table is never freed, like the key pools.              *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class UserKeyCache {
+    private:
+        static UserKeyTable* table;
+
+        static atomic<unsigned long long> hits;
+        static atomic<unsigned long long> loads;
+        static atomic<unsigned long long> reloads;
+
+        //Read and parse the key file of a user, NULL if it is missing or not valid
+        static shared_ptr<UserKey> load(string username);
+
+        //Body of the inotify thread
+        static void watch(int inotify_fd);
+
+    public:
+        //Fill the cache with the keys parsed by loadUsers and start watching the directory
+        static bool start(string directory, map<string, User>* users);
+
+        //Key of a user, read from disk only if it is not cached
+        static shared_ptr<UserKey> get(string username);
+
+        static void printCacheStats();
+};
+
+#endif
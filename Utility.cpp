@@ -1,13 +1,22 @@
 #include "Utility.h"
+#include "SessionCipher.h"
+#include <openssl/params.h>
 #include <iostream>
 #include <cstring>
 #include <fstream>
 #include <unistd.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 
 const char* Utility::HOME_DIR = "/home/";
 
+//Fetched once from the default provider, instead of at every use
+EVP_CIPHER* Utility::AES_128_GCM = EVP_CIPHER_fetch(NULL, "AES-128-GCM", NULL);
+EVP_CIPHER* Utility::AES_256_GCM = EVP_CIPHER_fetch(NULL, "AES-256-GCM", NULL);
+EVP_CIPHER* Utility::CHACHA20_POLY1305 = EVP_CIPHER_fetch(NULL, "ChaCha20-Poly1305", NULL);
+EVP_CIPHER* Utility::AES_256_CBC = EVP_CIPHER_fetch(NULL, "AES-256-CBC", NULL);
+EVP_MD* Utility::SHA_256 = EVP_MD_fetch(NULL, "SHA256", NULL);
+EVP_KDF* Utility::HKDF = EVP_KDF_fetch(NULL, "HKDF", NULL);
+
 EVP_PKEY* Utility::readPrvKey(string path, void* password) {
     char* canon_path = realpath(path.c_str(), NULL);
     if(!canon_path) return NULL;
@@ -112,107 +121,160 @@ X509_CRL* Utility::readCRL(string path){
     return crl;
 }
 
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* These functions verify and sign with an identity key.      *|
+|* RSA keys sign the SHA-256 digest of the message, Ed25519   *|
+|* keys the message itself: the signature is as long as       *|
+|* EVP_PKEY_get_size of the key (256 or 64 bytes).            *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
 int Utility::verifyMessage(EVP_PKEY* pubkey, char* clear_message, unsigned int clear_message_len, unsigned char* signature, unsigned int signature_len){
+    const EVP_MD* md = EVP_PKEY_is_a(pubkey, "ED25519") ? NULL : Utility::SHA_256;
     EVP_MD_CTX* ctx = EVP_MD_CTX_new();
-    EVP_VerifyInit(ctx, EVP_sha256());
-    EVP_VerifyUpdate(ctx, clear_message, clear_message_len);
-    int ret = EVP_VerifyFinal(ctx, signature, signature_len, pubkey);
+    int ret = EVP_DigestVerifyInit(ctx, NULL, md, NULL, pubkey);
+    if (ret == 1){ ret = EVP_DigestVerify(ctx, signature, signature_len, (unsigned char*)clear_message, clear_message_len); }
     EVP_MD_CTX_free(ctx);
     return ret;
 }
 
 void Utility::signMessage(EVP_PKEY* privkey, char* msg, unsigned int len, unsigned char** signature, unsigned int* signature_len){
-    //*signature = (unsigned char*)malloc(EVP_PKEY_size(privkey));
-    *signature = (unsigned char*)malloc(SIGNATURE_SIZE);
-    if (!signature){
+    size_t sig_len = EVP_PKEY_get_size(privkey);
+    *signature = (unsigned char*)malloc(sig_len);
+    if (!*signature){
         cout<<"Error in the malloc for the signature"<<endl;
         exit(1);
     }
+    const EVP_MD* md = EVP_PKEY_is_a(privkey, "ED25519") ? NULL : Utility::SHA_256;
     EVP_MD_CTX* ctx = EVP_MD_CTX_new();
-    EVP_SignInit(ctx, EVP_sha256());
-    EVP_SignUpdate(ctx, (unsigned char*)msg, len);
-    EVP_SignFinal(ctx, *signature, &*signature_len, privkey);
+    if (EVP_DigestSignInit(ctx, NULL, md, NULL, privkey) != 1 || EVP_DigestSign(ctx, *signature, &sig_len, (unsigned char*)msg, len) != 1){
+        cerr<<"ERR: Error while signing the message"<<endl;
+        exit(1);
+    }
     EVP_MD_CTX_free(ctx);
+    *signature_len = sig_len;
 }
 
 bool Utility::isNumeric(string str){
    for (unsigned int i = 0; i < str.length(); i++)
       if (isdigit(str[i]) == false)
          return false;
-      return true;
+   return true;
 }
 
-EVP_PKEY* Utility::generateTprivK(string username){
-    pid_t pid;
-    char* argv1[7] = {strdup("genrsa"), strdup("-out"), strdup(""), strdup("3072"), NULL};
-    EVP_PKEY* tprivk;
-    string tprivk_path = "./client/" + username + "/tprivk.pem";
-    argv1[2] = (char*)malloc(tprivk_path.length()+1);
-    if(!argv1[2]){ cerr<<"ERR: Malloc didn't work"<<endl; exit(1); }
-    strncpy(argv1[2], tprivk_path.c_str(), tprivk_path.length());
-    argv1[2][tprivk_path.length()] = '\0';
-    pid = fork();
-    if (pid == 0){ execv("/bin/openssl", argv1); exit(0); }
-    if (pid < 0){ cerr<<"ERR: Error while creating a new process"<<endl; exit(1); }
-    waitpid(pid, NULL, 0);
-    FILE* file = fopen(tprivk_path.c_str(), "r");
-    if(!file){ cerr<<"ERR: Error while reading the fileX"<<endl; exit(1); }
-    tprivk = PEM_read_PrivateKey(file, NULL, NULL, NULL);
-    if(!tprivk) { cerr<<"ERR: Error while reading the private key"<<endl; exit(1); }
-    fclose(file);
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function generates the ephemeral key pair of a login  *|
+|* or of a chat in memory: it is never written on disk.       *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+EVP_PKEY* Utility::generateTprivK(){
+    EVP_PKEY* tprivk = NULL;
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_from_name(NULL, "RSA", NULL);
+    if (!ctx){ cerr<<"ERR: Error while creating the key generation context"<<endl; exit(1); }
+    if (EVP_PKEY_keygen_init(ctx) <= 0 || EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, EPHEMERAL_KEY_BITS) <= 0 || EVP_PKEY_generate(ctx, &tprivk) <= 0){
+        cerr<<"ERR: Error while generating the private key"<<endl;
+        exit(1);
+    }
+    EVP_PKEY_CTX_free(ctx);
     return tprivk;
 }
 
-EVP_PKEY* Utility::generateTpubK(string username){
-    string tprivk_path = "./client/" + username + "/tprivk.pem";
-    pid_t pid;
-    string tpubk_path = "./client/" + username + "/tpubk.pem";
-    char* argv2[9] = {strdup("rsa"), strdup("-pubout"), strdup("-in"), strdup(""), strdup("-out"), strdup(""), NULL};
-    argv2[3] = (char*)malloc(tprivk_path.length()+1);
-    if (!argv2[3]){ cerr<<"ERR: Malloc didn't work"<<endl; exit(1); }
-    strncpy(argv2[3], tprivk_path.c_str(), tprivk_path.length());
-    argv2[3][tprivk_path.length()] = '\0';
-    argv2[5] = (char*)malloc(tpubk_path.length()+1);
-    if (!argv2[5]){ cerr<<"ERR: Malloc didn't work"<<endl; exit(1); }
-    strncpy(argv2[5], tpubk_path.c_str(), tpubk_path.length());
-    argv2[5][tpubk_path.length()] = '\0';
-    pid = fork();
-    if (pid == 0){ execv("/bin/openssl", argv2); exit(0); }
-    if (pid < 0){ cerr<<"ERR: Error while creating a new process"<<endl; exit(1); }
-    waitpid(pid, NULL, 0);
-    EVP_PKEY* tpubk;
-    FILE* file = fopen(tpubk_path.c_str(), "r");
-    if(!file){ cerr<<"ERR: Error while reading the file"<<endl; exit(1); }
-    tpubk = PEM_read_PUBKEY(file, NULL, NULL, NULL);
-    if(!tpubk){ cerr<<"ERR: Error while reading the public key"<<endl; exit(1); }
-    fclose(file);
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function extracts the public key of an ephemeral key  *|
+|* pair, as a key of its own that can be freed separately.    *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+EVP_PKEY* Utility::generateTpubK(EVP_PKEY* tprivk){
+    unsigned char* der = NULL;
+    int der_len = i2d_PUBKEY(tprivk, &der);
+    if (der_len <= 0){ cerr<<"ERR: Error while encoding the public key"<<endl; exit(1); }
+    const unsigned char* p = der;
+    EVP_PKEY* tpubk = d2i_PUBKEY(NULL, &p, der_len);
+    OPENSSL_free(der);
+    if (!tpubk){ cerr<<"ERR: Error while reading the public key"<<endl; exit(1); }
     return tpubk;
 }
 
-void Utility::removeTprivK(string username){
-    string tprivk_path = "./client/" + username + "/tprivk.pem";
-    char* argv4[3] = {strdup("/bin/rm"), strdup(""), NULL};
-    argv4[1] = (char*)malloc(tprivk_path.length());
-    if (!argv4[1]){ cerr<<"ERR: Malloc didn't work"<<endl; exit(1); }
-    strncpy(argv4[1], tprivk_path.c_str(), tprivk_path.length());
-    argv4[1][tprivk_path.length()] = '\0';
-    pid_t pid = fork();
-    if (pid == 0){ execv("/bin/rm", argv4); exit(0); }
-    if (pid < 0){ cerr<<"ERR: Error while creating a new process"<<endl; exit(1); }
-    waitpid(pid, NULL, 0);
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function generates the ephemeral X25519 key pair of   *|
+|* a login or of a chat: only its 32 bytes public share is    *|
+|* sent, instead of the PEM of an RSA public key.             *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+EVP_PKEY* Utility::generateTshareK(){
+    EVP_PKEY* tsharek = NULL;
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_from_name(NULL, "X25519", NULL);
+    if (!ctx){ cerr<<"ERR: Error while creating the key generation context"<<endl; exit(1); }
+    if (EVP_PKEY_keygen_init(ctx) <= 0 || EVP_PKEY_generate(ctx, &tsharek) <= 0){
+        cerr<<"ERR: Error while generating the private key"<<endl;
+        exit(1);
+    }
+    EVP_PKEY_CTX_free(ctx);
+    return tsharek;
+}
+
+bool Utility::writeShare(EVP_PKEY* tsharek, unsigned char* share){
+    size_t share_len = X25519_SHARE_SIZE;
+    if (EVP_PKEY_get_raw_public_key(tsharek, share, &share_len) != 1 || share_len != X25519_SHARE_SIZE){ return false; }
+    return true;
 }
 
-void Utility::removeTpubK(string username){
-    string tpubk_path = "./client/" + username + "/tpubk.pem";
-    char* argv3[3] = {strdup("/bin/rm"), strdup(""), NULL};
-    argv3[1] = (char*)malloc(tpubk_path.length()+1);
-    if (!argv3[1]){ cerr<<"ERR: Malloc didn't work"<<endl; exit(1); }
-    strncpy(argv3[1], tpubk_path.c_str(), tpubk_path.length());
-    argv3[1][tpubk_path.length()] = '\0';
-    pid_t pid = fork();
-    if (pid == 0){ execv("/bin/rm", argv3); exit(0); }
-    if (pid < 0){ cerr<<"ERR: Error while creating a new process"<<endl; exit(1); }
-    waitpid(pid, NULL, 0);
+EVP_PKEY* Utility::readShare(const unsigned char* share, unsigned int share_len){
+    if (share_len != X25519_SHARE_SIZE){ return NULL; }
+    return EVP_PKEY_new_raw_public_key_ex(NULL, "X25519", NULL, share, share_len);
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function derives K and the initial counter of a       *|
+|* session from an X25519 exchange: HKDF-SHA256 of the shared *|
+|* secret, salted with the nonces and bound to the label of   *|
+|* the handshake ("login" or "chat").                         *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool Utility::deriveK(EVP_PKEY* tsharek, EVP_PKEY* peer_share, const unsigned char* salt, unsigned int salt_len, const char* label, unsigned char* K, unsigned char* iv){
+    unsigned char secret[X25519_SHARE_SIZE];
+    size_t secret_len = sizeof(secret);
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_from_pkey(NULL, tsharek, NULL);
+    if (!ctx){ return false; }
+    bool ok = EVP_PKEY_derive_init(ctx) == 1 && EVP_PKEY_derive_set_peer(ctx, peer_share) == 1 && EVP_PKEY_derive(ctx, secret, &secret_len) == 1;
+    EVP_PKEY_CTX_free(ctx);
+    if (!ok){ return false; }
+
+    unsigned char key_material[DERIVED_KEY_SIZE];
+    ok = expandKey(secret, secret_len, salt, salt_len, label, key_material, DERIVED_KEY_SIZE);
+    OPENSSL_cleanse(secret, sizeof(secret));
+    if (ok){
+        memcpy(K, key_material, K_SIZE);
+        memcpy(iv, key_material + K_SIZE, BLOCK_SIZE);
+    }
+    OPENSSL_cleanse(key_material, DERIVED_KEY_SIZE);
+    return ok;
+}
+
+bool Utility::expandKey(const unsigned char* secret, unsigned int secret_len, const unsigned char* salt, unsigned int salt_len, const char* label, unsigned char* out, unsigned int out_len){
+    EVP_KDF_CTX* kctx = EVP_KDF_CTX_new(Utility::HKDF);
+    if (!kctx){ return false; }
+    //Without a salt the parameter is left out, HKDF then uses a string of zeros
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string("digest", (char*)"SHA256", 0),
+        OSSL_PARAM_construct_octet_string("key", (void*)secret, secret_len),
+        OSSL_PARAM_construct_octet_string("info", (void*)label, strlen(label)),
+        OSSL_PARAM_construct_octet_string("salt", (void*)salt, salt_len),
+        OSSL_PARAM_construct_end()
+    };
+    if (salt_len == 0){ params[3] = OSSL_PARAM_construct_end(); }
+    bool ok = EVP_KDF_derive(kctx, out, out_len, params) == 1;
+    EVP_KDF_CTX_free(kctx);
+    return ok;
+}
+
+bool Utility::computeMAC(const unsigned char* key, unsigned int key_len, const unsigned char* msg, unsigned int msg_len, unsigned char* mac){
+    size_t mac_len = 0;
+    return EVP_Q_mac(NULL, "HMAC", NULL, "SHA256", NULL, key, key_len, msg, msg_len, mac, MAC_SIZE, &mac_len) != NULL && mac_len == MAC_SIZE;
 }
 
 /* ---------------------------------------------------------- *\
@@ -227,7 +289,7 @@ void Utility::printPublicKey(EVP_PKEY* key){
 
 bool Utility::compareR(const unsigned char* R1, const unsigned char* R2){
     bool ok = true;
-    for (int i = 0; i < R_SIZE; i++){ 
+    for (unsigned int i = 0; i < R_SIZE; i++){ 
         if(R1[i] != R2[i]) { ok = false; break; }
     }
     if(ok==false) { cerr<<"ERR: Nonce R not correctly exchanged"<<endl; }
@@ -241,9 +303,9 @@ bool Utility::encryptMessage(int plaintext_len, EVP_PKEY* pubkey, unsigned char*
     if (!ciphertext){ return false;}
     EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
     cipherlen = 0;
-    iv = (unsigned char*) malloc(EVP_CIPHER_iv_length(EVP_aes_256_cbc()));
+    iv = (unsigned char*) malloc(EVP_CIPHER_iv_length(Utility::AES_256_CBC));
     if (!iv){ return false;}
-    int ret = EVP_SealInit(ctx, EVP_aes_256_cbc(), &encrypted_key, &encrypted_key_len, iv, &pubkey, 1);
+    int ret = EVP_SealInit(ctx, Utility::AES_256_CBC, &encrypted_key, &encrypted_key_len, iv, &pubkey, 1);
     if(ret == 0) { return false; }
     ret = EVP_SealUpdate(ctx, ciphertext, &outlen, (unsigned char*)plaintext, plaintext_len);
     if(ret == 0) { return false; }
@@ -257,7 +319,7 @@ bool Utility::encryptMessage(int plaintext_len, EVP_PKEY* pubkey, unsigned char*
 }
 
 bool Utility::decryptMessage(unsigned char* &plaintext, unsigned char *ciphertext, unsigned int ciphertext_len, unsigned char* iv, unsigned char* encrypted_key, unsigned int encrypted_key_len, EVP_PKEY* prvkey, unsigned int& plaintext_len){
-    const EVP_CIPHER* cipher = EVP_aes_256_cbc();
+    const EVP_CIPHER* cipher = Utility::AES_256_CBC;
     int outlen;
     EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
     plaintext_len = 0;
@@ -286,99 +348,98 @@ void Utility::printChatMessage(string print_message, char* buf, unsigned int len
     cout<<print_message<<": "<<buf<<endl;
 }
 
-bool Utility::encryptSessionMessage(int plaintext_len, 
-                                    unsigned char* key, unsigned char* plaintext, 
-                                    unsigned char* &ciphertext, int& outlen, 
-                                    unsigned int& ciphertext_len, __uint128_t counter,
-                                    unsigned char* &tag, unsigned char* &buf,
-                                    unsigned int buf_len, unsigned int server_or_user,
-                                    unsigned int &enc_buf_len){
-
-    EVP_CIPHER_CTX *ctx;
-    int len=0;
-    ciphertext_len=0;
-    unsigned char* iv = (unsigned char*)malloc(GCM_IV_SIZE);
-    ciphertext = (unsigned char*)malloc(plaintext_len+BLOCK_SIZE);
-    tag = (unsigned char*)malloc(TAG_SIZE);
-    memcpy(iv, &counter, GCM_IV_SIZE);
-    if(!(ctx = EVP_CIPHER_CTX_new()))
-        return false;
-    if(1 != EVP_EncryptInit(ctx, EVP_aes_128_gcm(), key, iv))
-        return false;
-    if(1 != EVP_EncryptUpdate(ctx, NULL, &len, iv, GCM_IV_SIZE))
-        return false;
-    if(1 != EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, plaintext_len))
-        return false;
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* These functions encrypt and decrypt a session record:      *|
+|* IV | ciphertext | tag, with the IV taken from the counter   *|
+|* and authenticated as AAD. The context already has the key, *|
+|* only the IV is set here. The plaintext and the ciphertext  *|
+|* can be the same memory, as GCM does not change the length. *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool Utility::encryptRecord(EVP_CIPHER_CTX* ctx, __uint128_t counter, const unsigned char* plaintext, unsigned int plaintext_len, unsigned char* record, unsigned int record_size, unsigned int &record_len){
+    if (plaintext_len > record_size || record_size - plaintext_len < GCM_IV_SIZE + TAG_SIZE){ cerr<<"ERR: Access-out-bound."<<endl; return false; }
+    memcpy(record, &counter, GCM_IV_SIZE);
+
+    int len = 0;
+    int ciphertext_len = 0;
+    if (EVP_EncryptInit_ex2(ctx, NULL, NULL, record, NULL) != 1){ return false; }
+    if (EVP_EncryptUpdate(ctx, NULL, &len, record, GCM_IV_SIZE) != 1){ return false; }
+    if (EVP_EncryptUpdate(ctx, record + GCM_IV_SIZE, &len, plaintext, plaintext_len) != 1){ return false; }
     ciphertext_len = len;
-    if(1 != EVP_EncryptFinal(ctx, ciphertext + len, &len))
-        return false;
+    if (EVP_EncryptFinal_ex(ctx, record + GCM_IV_SIZE + ciphertext_len, &len) != 1){ return false; }
     ciphertext_len += len;
-    if(1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, 16, tag))
-        return false;
-    EVP_CIPHER_CTX_free(ctx);
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_SIZE, record + GCM_IV_SIZE + ciphertext_len) != 1){ return false; }
 
-    enc_buf_len = ciphertext_len + GCM_IV_SIZE + TAG_SIZE;
-    if (server_or_user == 0){ //server
-        Utility::secure_thread_memcpy(buf, 0, buf_len, iv, 0, GCM_IV_SIZE, GCM_IV_SIZE);
-        Utility::secure_thread_memcpy(buf, GCM_IV_SIZE, buf_len, ciphertext, 0, plaintext_len + BLOCK_SIZE, ciphertext_len);
-        unsigned int tag_index = ciphertext_len + GCM_IV_SIZE;
-        Utility::secure_thread_memcpy(buf, tag_index, buf_len, tag, 0, TAG_SIZE, TAG_SIZE);
-        return true;
-    }
-    if (server_or_user == 1){ //user
-        Utility::secure_memcpy(buf, 0, buf_len, iv, 0, GCM_IV_SIZE, GCM_IV_SIZE);
-        Utility::secure_memcpy(buf, GCM_IV_SIZE, buf_len, ciphertext, 0, plaintext_len + BLOCK_SIZE, ciphertext_len);
-        unsigned int tag_index = ciphertext_len + GCM_IV_SIZE;
-        Utility::secure_memcpy(buf, tag_index, buf_len, tag, 0, TAG_SIZE, TAG_SIZE);
-        return true;
-    }
-    return false;
+    record_len = GCM_IV_SIZE + ciphertext_len + TAG_SIZE;
+    return true;
 }
 
-bool Utility::decryptSessionMessage(unsigned char* &plaintext, unsigned char *msg, unsigned int msg_len, unsigned char* key, unsigned int& plaintext_len, int server_or_user){
-    const EVP_CIPHER* cipher = EVP_aes_128_gcm();
-    unsigned char* iv = (unsigned char*)malloc(GCM_IV_SIZE);
-    if (!iv){ return false;}
-    unsigned int not_ciphertext_len = GCM_IV_SIZE+TAG_SIZE;
-    if (msg_len < not_ciphertext_len){ return false; }
-    unsigned int ciphertext_len = msg_len - not_ciphertext_len;
-    unsigned char* ciphertext = (unsigned char*)malloc(ciphertext_len);
-    if (!ciphertext){ return false;}
-    unsigned char* tag = (unsigned char*)malloc(TAG_SIZE);
-    if (!tag) {return false;}
-    if (ciphertext_len + GCM_IV_SIZE < ciphertext_len){return false;}
-    unsigned int tag_index = ciphertext_len + GCM_IV_SIZE;
-    if (server_or_user == 0){ //server
-        Utility::secure_thread_memcpy(iv, 0, GCM_IV_SIZE, msg, 0, msg_len, GCM_IV_SIZE);
-        Utility::secure_thread_memcpy(ciphertext, 0, ciphertext_len, msg, GCM_IV_SIZE, msg_len, ciphertext_len);
-        Utility::secure_thread_memcpy(tag, 0, TAG_SIZE, msg, tag_index, msg_len, TAG_SIZE);
-    }
-    if (server_or_user == 1){ //user
-        Utility::secure_memcpy(iv, 0, GCM_IV_SIZE, msg, 0, msg_len, GCM_IV_SIZE);
-        Utility::secure_memcpy(ciphertext, 0, ciphertext_len, msg, GCM_IV_SIZE, msg_len, ciphertext_len);
-        Utility::secure_memcpy(tag, 0, TAG_SIZE, msg, tag_index, msg_len, TAG_SIZE);
-    }
-    
-    EVP_CIPHER_CTX *ctx;
-    int len;
-    int ret;
-    if(!(ctx = EVP_CIPHER_CTX_new()))
-        return false;
-    if(!EVP_DecryptInit(ctx, EVP_aes_128_gcm(), key, iv))
-        return false;
-    if(!EVP_DecryptUpdate(ctx, NULL, &len, iv, GCM_IV_SIZE))
-        return false;
-    if(!EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertext_len))
-        return false;
+bool Utility::decryptRecord(EVP_CIPHER_CTX* ctx, const unsigned char* record, unsigned int record_len, unsigned char* plaintext, unsigned int &plaintext_len){
+    if (record_len < GCM_IV_SIZE + TAG_SIZE){ return false; }
+    unsigned int ciphertext_len = record_len - GCM_IV_SIZE - TAG_SIZE;
+
+    int len = 0;
+    if (EVP_DecryptInit_ex2(ctx, NULL, NULL, record, NULL) != 1){ return false; }
+    if (EVP_DecryptUpdate(ctx, NULL, &len, record, GCM_IV_SIZE) != 1){ return false; }
+    if (EVP_DecryptUpdate(ctx, plaintext, &len, record + GCM_IV_SIZE, ciphertext_len) != 1){ return false; }
     plaintext_len = len;
-    if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, 16, tag))
-        return false;
-    ret = EVP_DecryptFinal(ctx, plaintext + len, &len);
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, TAG_SIZE, (void*)(record + GCM_IV_SIZE + ciphertext_len)) != 1){ return false; }
+
+    //The tag does not match
+    return EVP_DecryptFinal_ex(ctx, plaintext + len, &len) > 0;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Versions with a key used only once: the key is expanded in *|
+|* a temporary context. The sessions use a SessionCipher.     *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool Utility::sealRecord(unsigned char* key, __uint128_t counter, unsigned char* record, unsigned int plaintext_len, unsigned int record_size, unsigned int &record_len){
+    if (record_size < GCM_IV_SIZE){ cerr<<"ERR: Access-out-bound."<<endl; return false; }
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (!ctx){ return false; }
+    bool ok = EVP_EncryptInit_ex2(ctx, Utility::AES_128_GCM, key, NULL, NULL) == 1
+           && encryptRecord(ctx, counter, record + GCM_IV_SIZE, plaintext_len, record, record_size, record_len);
+    EVP_CIPHER_CTX_free(ctx);
+    return ok;
+}
 
-    EVP_CIPHER_CTX_cleanup(ctx);
+bool Utility::openRecord(unsigned char* key, unsigned char* record, unsigned int record_len, unsigned int &plaintext_len){
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (!ctx){ return false; }
+    bool ok = EVP_DecryptInit_ex2(ctx, Utility::AES_128_GCM, key, NULL, NULL) == 1
+           && decryptRecord(ctx, record, record_len, record + GCM_IV_SIZE, plaintext_len);
+    EVP_CIPHER_CTX_free(ctx);
+    return ok;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Copying versions: the plaintext is in its own buffer. The  *|
+|* ciphertext and the tag point inside buf.                   *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+bool Utility::encryptSessionMessage(int plaintext_len, 
+                                    SessionCipher &cipher, unsigned char* plaintext, 
+                                    unsigned char* &ciphertext, int& outlen, 
+                                    unsigned int& ciphertext_len, __uint128_t counter,
+                                    unsigned char* &tag, unsigned char* &buf,
+                                    unsigned int buf_len, unsigned int &enc_buf_len){
+    ciphertext_len = 0;
+    if (plaintext_len < 0 || !cipher.encrypt(counter, plaintext, plaintext_len, buf, buf_len, enc_buf_len)){ return false; }
+    ciphertext_len = enc_buf_len - GCM_IV_SIZE - TAG_SIZE;
+    outlen = ciphertext_len;
+    ciphertext = buf + GCM_IV_SIZE;
+    tag = buf + GCM_IV_SIZE + ciphertext_len;
     return true;
 }
 
+bool Utility::decryptSessionMessage(unsigned char* &plaintext, unsigned char *msg, unsigned int msg_len, SessionCipher &cipher, unsigned int& plaintext_len){
+    return cipher.decrypt(msg, msg_len, plaintext, plaintext_len);
+}
+
 void Utility::secure_memcpy(unsigned char* buf, unsigned int buf_index, unsigned int buf_len, unsigned char* source, unsigned int source_index, unsigned int source_len, unsigned int cpy_size){
     if (buf_index + (unsigned long)buf < buf_index){ cerr<<"ERR: Wrap around."<<endl; exit(1); }
     if (buf_index + cpy_size < buf_index){ cerr<<"ERR: Wrap around."<<endl; exit(1); }
@@ -390,20 +451,21 @@ void Utility::secure_memcpy(unsigned char* buf, unsigned int buf_index, unsigned
     memcpy(buf+buf_index, source+source_index, cpy_size);
 }
 
-void Utility::secure_thread_memcpy(unsigned char* buf, unsigned int buf_index, unsigned int buf_len, unsigned char* source, unsigned int source_index, unsigned int source_len, unsigned int cpy_size){
-    if (buf_index + (unsigned long)buf < buf_index){ cerr<<"ERR: Wrap around."<<endl; pthread_exit(NULL); }
-    if (buf_index + cpy_size < buf_index){ cerr<<"ERR: Wrap around."<<endl; pthread_exit(NULL); }
-    if (buf_index + cpy_size > buf_len){ cerr<<"ERR: Access-out-bound."<<endl; pthread_exit(NULL); }
-    if (source_index + cpy_size < source_index){ cerr<<"ERR: Wrap around."<<endl; pthread_exit(NULL); }
-    if (source_index + cpy_size > source_len){ cerr<<"ERR: Access-out-bound."<<endl; pthread_exit(NULL); }
-    if (source_index + (unsigned long)source < source_index){ cerr<<"ERR: Wrap around."<<endl; pthread_exit(NULL); }
+bool Utility::secure_thread_memcpy(unsigned char* buf, unsigned int buf_index, unsigned int buf_len, unsigned char* source, unsigned int source_index, unsigned int source_len, unsigned int cpy_size){
+    if (buf_index + (unsigned long)buf < buf_index){ cerr<<"ERR: Wrap around."<<endl; return false; }
+    if (buf_index + cpy_size < buf_index){ cerr<<"ERR: Wrap around."<<endl; return false; }
+    if (buf_index + cpy_size > buf_len){ cerr<<"ERR: Access-out-bound."<<endl; return false; }
+    if (source_index + cpy_size < source_index){ cerr<<"ERR: Wrap around."<<endl; return false; }
+    if (source_index + cpy_size > source_len){ cerr<<"ERR: Access-out-bound."<<endl; return false; }
+    if (source_index + (unsigned long)source < source_index){ cerr<<"ERR: Wrap around."<<endl; return false; }
 
     memcpy(buf+buf_index, source+source_index, cpy_size);
+    return true;
 }
 
 bool Utility::compareTag(const unsigned char* tag1, const unsigned char* tag2){
     bool ok = true;
-    for (int i = 0; i < TAG_SIZE; i++){ 
+    for (unsigned int i = 0; i < TAG_SIZE; i++){ 
         if(tag1[i] != tag2[i]) { ok = false; break; }
     }
     if(ok==false) { cerr<<"ERR: Tag not correctly exchanged"<<endl; }
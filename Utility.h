@@ -11,12 +11,22 @@
 
 using namespace std;
 
+class SessionCipher;
+
 class Utility {
     private:
 
     public:
         static const char* HOME_DIR;
 
+        //Algorithms fetched at startup
+        static EVP_CIPHER* AES_128_GCM;
+        static EVP_CIPHER* AES_256_GCM;
+        static EVP_CIPHER* CHACHA20_POLY1305;
+        static EVP_CIPHER* AES_256_CBC;
+        static EVP_MD* SHA_256;
+        static EVP_KDF* HKDF;
+
         static EVP_PKEY* readPrvKey(string path, void* password);
 
         static EVP_PKEY* readPubKey(string path, void* password);
@@ -31,13 +41,29 @@ class Utility {
 
         static bool isNumeric(string str); //check is a string is composed only by digit characters
 
-        static EVP_PKEY* generateTprivK(string username);
+        //Generate in memory the ephemeral key pair of a login or of a chat
+        static EVP_PKEY* generateTprivK();
+
+        //Public part of an ephemeral key pair
+        static EVP_PKEY* generateTpubK(EVP_PKEY* tprivk);
+
+        //Generate the ephemeral X25519 key pair of a login or of a chat
+        static EVP_PKEY* generateTshareK();
+
+        //Write the raw public share (X25519_SHARE_SIZE bytes) of an X25519 key pair
+        static bool writeShare(EVP_PKEY* tsharek, unsigned char* share);
 
-        static EVP_PKEY* generateTpubK(string username);
+        //Read a raw public share received from a peer
+        static EVP_PKEY* readShare(const unsigned char* share, unsigned int share_len);
 
-        static void removeTprivK(string username);
+        //Derive K and the initial counter from the X25519 secret shared with a peer, salted with the nonces of the handshake
+        static bool deriveK(EVP_PKEY* tsharek, EVP_PKEY* peer_share, const unsigned char* salt, unsigned int salt_len, const char* label, unsigned char* K, unsigned char* iv);
 
-        static void removeTpubK(string username);
+        //Derive out_len bytes from a secret with HKDF-SHA256
+        static bool expandKey(const unsigned char* secret, unsigned int secret_len, const unsigned char* salt, unsigned int salt_len, const char* label, unsigned char* out, unsigned int out_len);
+
+        //HMAC-SHA256 of a message (MAC_SIZE bytes)
+        static bool computeMAC(const unsigned char* key, unsigned int key_len, const unsigned char* msg, unsigned int msg_len, unsigned char* mac);
 
         static void printPublicKey(EVP_PKEY* key);
 
@@ -52,18 +78,30 @@ class Utility {
         static void printChatMessage(string print_message, char* buf, unsigned int len);
 
         static bool encryptSessionMessage(int plaintext_len, 
-                                    unsigned char* key, unsigned char* plaintext, 
+                                    SessionCipher &cipher, unsigned char* plaintext, 
                                     unsigned char* &ciphertext, int& outlen, 
                                     unsigned int& cipherlen, __uint128_t counter, 
                                     unsigned char* &tag, unsigned char* &buf,
-                                    unsigned int buf_len, unsigned int server_or_user,
-                                    unsigned int &enc_buf_len);
+                                    unsigned int buf_len, unsigned int &enc_buf_len);
+
+        static bool decryptSessionMessage(unsigned char* &plaintext, unsigned char *msg, unsigned int msg_len, SessionCipher &cipher, unsigned int& plaintext_len);
+
+        //Encrypt a plaintext in a record IV | ciphertext | tag with a keyed context. The plaintext can already be at record + GCM_IV_SIZE
+        static bool encryptRecord(EVP_CIPHER_CTX* ctx, __uint128_t counter, const unsigned char* plaintext, unsigned int plaintext_len, unsigned char* record, unsigned int record_size, unsigned int &record_len);
+
+        //Decrypt and authenticate a record with a keyed context. The plaintext can be written at record + GCM_IV_SIZE
+        static bool decryptRecord(EVP_CIPHER_CTX* ctx, const unsigned char* record, unsigned int record_len, unsigned char* plaintext, unsigned int &plaintext_len);
+
+        //Encrypt in place the plaintext written at record + GCM_IV_SIZE, with a key used only once
+        static bool sealRecord(unsigned char* key, __uint128_t counter, unsigned char* record, unsigned int plaintext_len, unsigned int record_size, unsigned int &record_len);
 
-        static bool decryptSessionMessage(unsigned char* &plaintext, unsigned char *msg, unsigned int msg_len, unsigned char* key, unsigned int& plaintext_len, int server_or_user);
+        //Decrypt in place a record with a key used only once, the plaintext is left at record + GCM_IV_SIZE
+        static bool openRecord(unsigned char* key, unsigned char* record, unsigned int record_len, unsigned int &plaintext_len);
 
         static void secure_memcpy(unsigned char* buf, unsigned int buf_index, unsigned int buf_len, unsigned char* source, unsigned int source_index, unsigned int source_len, unsigned int cpy_size);
 
-        static void secure_thread_memcpy(unsigned char* buf, unsigned int buf_index, unsigned int buf_len, unsigned char* source, unsigned int source_index, unsigned int source_len, unsigned int cpy_size);
+        //Same checks as secure_memcpy, but reports the failure to the caller instead of terminating the process
+        static bool secure_thread_memcpy(unsigned char* buf, unsigned int buf_index, unsigned int buf_len, unsigned char* source, unsigned int source_index, unsigned int source_len, unsigned int cpy_size);
 
         static bool compareTag(const unsigned char* tag1, const unsigned char* tag2);
 };
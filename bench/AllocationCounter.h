@@ -0,0 +1,26 @@
+#include <cstddef>
+
+#ifndef CYBERSECURITYPROJECT_ALLOCATIONCOUNTER_H
+#define CYBERSECURITYPROJECT_ALLOCATIONCOUNTER_H
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Heap allocations of the calling thread, counted by         *|
+|* wrapping the allocator of libc, so the ones made inside    *|
+|* OpenSSL are counted too. Included by one file of a         *|
+|* benchmark only, the one with main.                         *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+static thread_local unsigned long allocations = 0;
+
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void* ptr, size_t size);
+
+    void* malloc(size_t size){ allocations++; return __libc_malloc(size); }
+    void* calloc(size_t count, size_t size){ allocations++; return __libc_calloc(count, size); }
+    void* realloc(void* ptr, size_t size){ if (!ptr){ allocations++; } return __libc_realloc(ptr, size); }
+}
+
+#endif
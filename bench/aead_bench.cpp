@@ -0,0 +1,167 @@
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include "../SessionCipher.h"
+#include "../Utility.h"
+#include "AllocationCounter.h"
+
+using namespace std;
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Benchmark of the session records: every iteration          *|
+|* encrypts and decrypts one message with the copying code    *|
+|* the relay used before the in-place API (kept below as a    *|
+|* reference), with the in-place one keyed at every call      *|
+|* (sealRecord/openRecord) and with the contexts of a         *|
+|* SessionCipher keyed once, for every AEAD suite, with the   *|
+|* heap allocations of each message.                          *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+
+static unsigned char key[K_SIZE];
+static SessionCipher* ciphers[AEAD_SUITES];
+static SessionCipher* cipher;
+
+static void report(string api, unsigned int len, unsigned int iterations, double seconds, unsigned long allocs){
+    double mb_per_sec = (double)len*iterations/seconds/(1024*1024);
+    cout<<fixed<<setprecision(1)<<api<<"\t"<<len<<" B\t"<<mb_per_sec<<" MB/s\t"<<(unsigned long)(iterations/seconds)<<" messages/s\t"<<(double)allocs/iterations<<" allocations/message"<<endl;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Copying encryption and decryption as the relay did them    *|
+|* before the in-place API: IV, ciphertext and tag in buffers *|
+|* of their own, a new context keyed at every call, then      *|
+|* copied into or out of the record. The buffers are freed    *|
+|* here, so that a long run does not grow.                    *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+static bool copyingEncrypt(int plaintext_len, unsigned char* key, unsigned char* plaintext, __uint128_t counter,
+                           unsigned char* buf, unsigned int buf_len, unsigned int &enc_buf_len){
+    int len = 0;
+    unsigned int ciphertext_len = 0;
+    unsigned char* iv = (unsigned char*)malloc(GCM_IV_SIZE);
+    unsigned char* ciphertext = (unsigned char*)malloc(plaintext_len + BLOCK_SIZE);
+    unsigned char* tag = (unsigned char*)malloc(TAG_SIZE);
+    memcpy(iv, &counter, GCM_IV_SIZE);
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    bool ok = ctx && iv && ciphertext && tag
+        && EVP_EncryptInit(ctx, EVP_aes_128_gcm(), key, iv) == 1
+        && EVP_EncryptUpdate(ctx, NULL, &len, iv, GCM_IV_SIZE) == 1
+        && EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, plaintext_len) == 1;
+    ciphertext_len = len;
+    ok = ok && EVP_EncryptFinal(ctx, ciphertext + len, &len) == 1;
+    ciphertext_len += len;
+    ok = ok && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_SIZE, tag) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+
+    enc_buf_len = ciphertext_len + GCM_IV_SIZE + TAG_SIZE;
+    ok = ok && Utility::secure_thread_memcpy(buf, 0, buf_len, iv, 0, GCM_IV_SIZE, GCM_IV_SIZE)
+        && Utility::secure_thread_memcpy(buf, GCM_IV_SIZE, buf_len, ciphertext, 0, plaintext_len + BLOCK_SIZE, ciphertext_len)
+        && Utility::secure_thread_memcpy(buf, GCM_IV_SIZE + ciphertext_len, buf_len, tag, 0, TAG_SIZE, TAG_SIZE);
+    free(iv);
+    free(ciphertext);
+    free(tag);
+    return ok;
+}
+
+static bool copyingDecrypt(unsigned char* plaintext, unsigned char* msg, unsigned int msg_len, unsigned char* key, unsigned int &plaintext_len){
+    if (msg_len < GCM_IV_SIZE + TAG_SIZE){ return false; }
+    unsigned int ciphertext_len = msg_len - GCM_IV_SIZE - TAG_SIZE;
+    unsigned char* iv = (unsigned char*)malloc(GCM_IV_SIZE);
+    unsigned char* ciphertext = (unsigned char*)malloc(ciphertext_len);
+    unsigned char* tag = (unsigned char*)malloc(TAG_SIZE);
+    bool ok = iv && ciphertext && tag
+        && Utility::secure_thread_memcpy(iv, 0, GCM_IV_SIZE, msg, 0, msg_len, GCM_IV_SIZE)
+        && Utility::secure_thread_memcpy(ciphertext, 0, ciphertext_len, msg, GCM_IV_SIZE, msg_len, ciphertext_len)
+        && Utility::secure_thread_memcpy(tag, 0, TAG_SIZE, msg, GCM_IV_SIZE + ciphertext_len, msg_len, TAG_SIZE);
+
+    int len = 0;
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    ok = ok && ctx
+        && EVP_DecryptInit(ctx, EVP_aes_128_gcm(), key, iv) == 1
+        && EVP_DecryptUpdate(ctx, NULL, &len, iv, GCM_IV_SIZE) == 1
+        && EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertext_len) == 1;
+    plaintext_len = len;
+    //The tag does not match
+    ok = ok && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, TAG_SIZE, tag) == 1
+        && EVP_DecryptFinal(ctx, plaintext + len, &len) > 0;
+    EVP_CIPHER_CTX_free(ctx);
+    free(iv);
+    free(ciphertext);
+    free(tag);
+    return ok;
+}
+
+static void benchCopying(unsigned int len, unsigned int iterations){
+    vector<unsigned char> msg(len, 'a');
+    vector<unsigned char> enc_storage(len + ENC_FIELDS);
+    vector<unsigned char> plain_storage(len + BLOCK_SIZE);
+    unsigned char* enc_buf = enc_storage.data();
+    unsigned char* plaintext = plain_storage.data();
+
+    unsigned long start_allocs = allocations;
+    auto start = chrono::steady_clock::now();
+    for (unsigned int i = 0; i < iterations; i++){
+        unsigned int enc_len, plain_len;
+        if (!copyingEncrypt(len, key, msg.data(), i, enc_buf, len + ENC_FIELDS, enc_len)){
+            cerr<<"ERR: Error in the encryption"<<endl;
+            exit(1);
+        }
+        if (!copyingDecrypt(plaintext, enc_buf, enc_len, key, plain_len)){
+            cerr<<"ERR: Error in the decryption"<<endl;
+            exit(1);
+        }
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    report("copying", len, iterations, elapsed.count(), allocations - start_allocs);
+}
+
+static void benchInPlace(unsigned int len, unsigned int iterations, bool keyed_once, SessionCipher* cipher){
+    vector<unsigned char> record(GCM_IV_SIZE + len + TAG_SIZE);
+    memset(record.data() + GCM_IV_SIZE, 'a', len);
+
+    unsigned long start_allocs = allocations;
+    auto start = chrono::steady_clock::now();
+    for (unsigned int i = 0; i < iterations; i++){
+        unsigned int record_len, plain_len;
+        bool sealed = keyed_once ? cipher->seal(i, record.data(), len, record.size(), record_len)
+                                 : Utility::sealRecord(key, i, record.data(), len, record.size(), record_len);
+        if (!sealed){
+            cerr<<"ERR: Error in the encryption"<<endl;
+            exit(1);
+        }
+        bool opened = keyed_once ? cipher->open(record.data(), record_len, plain_len)
+                                 : Utility::openRecord(key, record.data(), record_len, plain_len);
+        if (!opened){
+            cerr<<"ERR: Error in the decryption"<<endl;
+            exit(1);
+        }
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    report(keyed_once ? "session " + SessionCipher::suiteName(cipher->suite()) : string("in-place"), len, iterations, elapsed.count(), allocations - start_allocs);
+}
+
+int main(int argc, char* argv[]){
+    unsigned int iterations = (argc > 1) ? atoi(argv[1]) : 100000;
+    RAND_bytes(key, K_SIZE);
+    for (unsigned char aead = 0; aead < AEAD_SUITES; aead++){
+        ciphers[aead] = new SessionCipher();
+        if (!ciphers[aead]->setKey(aead, key, KEY_LABEL_USER, KEY_LABEL_USER)){ cerr<<"ERR: Error in setting the key of "<<SessionCipher::suiteName(aead)<<endl; exit(1); }
+    }
+    cipher = ciphers[AEAD_AES_128_GCM];
+    cout<<"Default suite of this CPU: "<<SessionCipher::suiteName(SessionCipher::probeSuite())<<endl;
+
+    unsigned int sizes[] = {RETURN_TO_LOBBY_SIZE, RTT_MAX_SIZE, 1024, GENERAL_MSG_SIZE + ENC_FIELDS};
+    for (unsigned int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+        benchCopying(sizes[i], iterations);
+        benchInPlace(sizes[i], iterations, false, cipher);
+        for (unsigned char aead = 0; aead < AEAD_SUITES; aead++){
+            benchInPlace(sizes[i], iterations, true, ciphers[aead]);
+        }
+    }
+    return 0;
+}
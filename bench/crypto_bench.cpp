@@ -0,0 +1,300 @@
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../SessionCipher.h"
+#include "../Utility.h"
+#include "AllocationCounter.h"
+
+using namespace std;
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Microbenchmark of the primitives of Utility, each one in   *|
+|* isolation, over payloads from 1 byte to INPUT_SIZE:        *|
+|* the session records (encryptSessionMessage and             *|
+|* decryptSessionMessage), the RSA envelopes (encryptMessage  *|
+|* and decryptMessage), the signatures (signMessage and       *|
+|* verifyMessage) and secure_memcpy. Every operation runs     *|
+|* for a fixed time in each of the threads, so the slow RSA   *|
+|* operations and the fast copies get the same precision,     *|
+|* and the heap allocations of each thread are counted.       *|
+|*                                                            *|
+|* usage: ./bench/crypto_bench [-t threads] [-d ms] [--json]  *|
+|*            [--baseline file] [--tolerance percent]         *|
+|*                                                            *|
+|* --json prints one object per line: the output of a run is  *|
+|* the baseline of the next ones. With --baseline each result *|
+|* is compared with the one of the same operation, size and   *|
+|* threads, and the exit status is 1 if an operation is       *|
+|* slower than the tolerance (10% by default).                *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+
+typedef chrono::steady_clock Clock;
+
+//Keys shared by the threads, used read-only
+static unsigned char session_key[K_SIZE];
+static EVP_PKEY* identity_key;
+static EVP_PKEY* envelope_prvkey;
+static EVP_PKEY* envelope_pubkey;
+
+//State of a thread: the prepared inputs of the operation and its outputs
+struct Worker {
+    unsigned int size;
+    SessionCipher cipher;
+    __uint128_t counter;
+    vector<unsigned char> payload;
+    vector<unsigned char> record;
+    vector<unsigned char> output;
+    unsigned int record_len;
+
+    unsigned char* signature;
+    unsigned int signature_len;
+
+    unsigned char* ciphertext;
+    unsigned char* encrypted_key;
+    unsigned char* iv;
+    int encrypted_key_len;
+    unsigned int cipherlen;
+};
+
+/* ---------------------------------------------------------- *\
+|* The operations, and what they need ready before the clock  *|
+\* ---------------------------------------------------------- */
+static void sessionEncrypt(Worker &w){
+    unsigned char* ciphertext, *tag, *enc_buf = w.record.data();
+    int outlen;
+    unsigned int cipherlen;
+    if (!Utility::encryptSessionMessage(w.size, w.cipher, w.payload.data(), ciphertext, outlen, cipherlen, ++w.counter, tag, enc_buf, w.record.size(), w.record_len)){
+        cerr<<"ERR: Error in the encryption"<<endl;
+        exit(1);
+    }
+}
+
+static void sessionDecrypt(Worker &w){
+    unsigned char* plaintext = w.output.data();
+    unsigned int plaintext_len;
+    if (!Utility::decryptSessionMessage(plaintext, w.record.data(), w.record_len, w.cipher, plaintext_len)){
+        cerr<<"ERR: Error in the decryption"<<endl;
+        exit(1);
+    }
+}
+
+static void envelopeSeal(Worker &w){
+    int outlen;
+    if (!Utility::encryptMessage(w.size, envelope_pubkey, w.payload.data(), w.ciphertext, w.encrypted_key, w.iv, w.encrypted_key_len, outlen, w.cipherlen)){
+        cerr<<"ERR: Error in the envelope"<<endl;
+        exit(1);
+    }
+}
+
+static void envelopeSealFree(Worker &w){
+    envelopeSeal(w);
+    free(w.ciphertext);
+    free(w.encrypted_key);
+    free(w.iv);
+}
+
+static void envelopeOpen(Worker &w){
+    unsigned char* plaintext = w.output.data();
+    unsigned int plaintext_len;
+    if (!Utility::decryptMessage(plaintext, w.ciphertext, w.cipherlen, w.iv, w.encrypted_key, w.encrypted_key_len, envelope_prvkey, plaintext_len)){
+        cerr<<"ERR: Error in the opening of the envelope"<<endl;
+        exit(1);
+    }
+}
+
+static void sign(Worker &w){
+    Utility::signMessage(identity_key, (char*)w.payload.data(), w.size, &w.signature, &w.signature_len);
+}
+
+static void signFree(Worker &w){
+    sign(w);
+    free(w.signature);
+}
+
+static void verify(Worker &w){
+    if (Utility::verifyMessage(identity_key, (char*)w.payload.data(), w.size, w.signature, w.signature_len) != 1){
+        cerr<<"ERR: Signature not verified"<<endl;
+        exit(1);
+    }
+}
+
+static void copy(Worker &w){
+    Utility::secure_memcpy(w.output.data(), 0, w.output.size(), w.payload.data(), 0, w.size, w.size);
+}
+
+struct Operation {
+    const char* name;
+    void (*prepare)(Worker &w);
+    void (*run)(Worker &w);
+};
+
+static const Operation operations[] = {
+    { "encryptSessionMessage", NULL, sessionEncrypt },
+    { "decryptSessionMessage", sessionEncrypt, sessionDecrypt },
+    { "encryptMessage", NULL, envelopeSealFree },
+    { "decryptMessage", envelopeSeal, envelopeOpen },
+    { "signMessage", NULL, signFree },
+    { "verifyMessage", sign, verify },
+    { "secure_memcpy", NULL, copy }
+};
+
+struct Result {
+    string op;
+    unsigned int size;
+    unsigned int threads;
+    double ops_per_sec;
+    double ns_per_op;
+    double allocs_per_op;
+};
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function runs an operation in a thread until the      *|
+|* deadline. The clock is read every few operations, so that  *|
+|* it does not weigh on the fast ones.                        *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+static void work(const Operation* op, unsigned int size, atomic<bool>* go, chrono::milliseconds duration, unsigned long long* ops, double* seconds, unsigned long* allocs){
+    Worker w;
+    w.size = size;
+    w.counter = 0;
+    w.payload.assign(size, 'a');
+    w.record.resize(size + ENC_FIELDS);
+    w.output.resize(size + ENC_FIELDS);
+    if (!w.cipher.setKey(AEAD_AES_128_GCM, session_key, KEY_LABEL_USER, KEY_LABEL_USER)){ cerr<<"ERR: Error in setting the session key"<<endl; exit(1); }
+    if (op->prepare){ op->prepare(w); }
+
+    while (!go->load()){ this_thread::yield(); }
+    unsigned long start_allocs = allocations;
+    unsigned long long count = 0;
+    auto start = Clock::now();
+    auto deadline = start + duration;
+    auto now = start;
+    while (now < deadline){
+        for (unsigned int i = 0; i < 16; i++){ op->run(w); }
+        count += 16;
+        now = Clock::now();
+    }
+    *ops = count;
+    *seconds = chrono::duration<double>(now - start).count();
+    *allocs = allocations - start_allocs;
+}
+
+static Result measure(const Operation* op, unsigned int size, unsigned int threads, chrono::milliseconds duration){
+    vector<unsigned long long> ops(threads);
+    vector<double> seconds(threads);
+    vector<unsigned long> allocs(threads);
+    vector<thread> pool;
+    atomic<bool> go(false);
+    for (unsigned int i = 0; i < threads; i++){
+        pool.emplace_back(work, op, size, &go, duration, &ops[i], &seconds[i], &allocs[i]);
+    }
+    go = true;
+    for (unsigned int i = 0; i < threads; i++){ pool[i].join(); }
+
+    Result result = { op->name, size, threads, 0, 0, 0 };
+    unsigned long long total_ops = 0;
+    unsigned long total_allocs = 0;
+    for (unsigned int i = 0; i < threads; i++){
+        result.ops_per_sec += ops[i]/seconds[i];
+        result.ns_per_op += seconds[i]*1e9/ops[i]/threads;
+        total_ops += ops[i];
+        total_allocs += allocs[i];
+    }
+    result.allocs_per_op = (double)total_allocs/total_ops;
+    return result;
+}
+
+/* ---------------------------------------------------------- *\
+|* Baseline: the lines printed by --json                      *|
+\* ---------------------------------------------------------- */
+static string key(string op, unsigned int size, unsigned int threads){
+    return op + "/" + to_string(size) + "/" + to_string(threads);
+}
+
+static map<string, double> readBaseline(string path){
+    map<string, double> baseline;
+    ifstream file(path);
+    if (!file){ cerr<<"ERR: Cannot open the baseline "<<path<<endl; exit(1); }
+    string line;
+    while (getline(file, line)){
+        char op[64];
+        unsigned int size, threads;
+        double ops_per_sec;
+        if (sscanf(line.c_str(), "{\"op\": \"%63[^\"]\", \"size\": %u, \"threads\": %u, \"ops_per_sec\": %lf", op, &size, &threads, &ops_per_sec) == 4){
+            baseline[key(op, size, threads)] = ops_per_sec;
+        }
+    }
+    return baseline;
+}
+
+int main(int argc, char* argv[]){
+    unsigned int threads = 1;
+    unsigned int duration_ms = 200;
+    bool json = false;
+    string baseline_path;
+    double tolerance = 10;
+    for (int i = 1; i < argc; i++){
+        string arg = argv[i];
+        if (arg == "-t" && i + 1 < argc){ threads = atoi(argv[++i]); }
+        else if (arg == "-d" && i + 1 < argc){ duration_ms = atoi(argv[++i]); }
+        else if (arg == "--json"){ json = true; }
+        else if (arg == "--baseline" && i + 1 < argc){ baseline_path = argv[++i]; }
+        else if (arg == "--tolerance" && i + 1 < argc){ tolerance = atof(argv[++i]); }
+        else { cerr<<"usage: "<<argv[0]<<" [-t threads] [-d ms] [--json] [--baseline file] [--tolerance percent]"<<endl; return 1; }
+    }
+    if (threads == 0 || duration_ms == 0){ cerr<<"ERR: The threads and the duration must be positive"<<endl; return 1; }
+    map<string, double> baseline;
+    if (!baseline_path.empty()){ baseline = readBaseline(baseline_path); }
+
+    /* ---------------------------------------------------------- *\
+    |* Keys of the same kind as the ones of the protocol          *|
+    \* ---------------------------------------------------------- */
+    RAND_bytes(session_key, K_SIZE);
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_from_name(NULL, "RSA", NULL);
+    if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0 || EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, SIGNATURE_SIZE*8) <= 0 || EVP_PKEY_generate(ctx, &identity_key) <= 0){
+        cerr<<"ERR: Error while generating the identity key"<<endl;
+        return 1;
+    }
+    EVP_PKEY_CTX_free(ctx);
+    envelope_prvkey = Utility::generateTprivK();
+    envelope_pubkey = Utility::generateTpubK(envelope_prvkey);
+    if (!envelope_prvkey || !envelope_pubkey){ cerr<<"ERR: Error while generating the ephemeral key"<<endl; return 1; }
+
+    unsigned int sizes[] = {1, 16, 256, 1024, 4096, INPUT_SIZE};
+    bool regression = false;
+    for (unsigned int o = 0; o < sizeof(operations)/sizeof(operations[0]); o++){
+        for (unsigned int s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++){
+            Result r = measure(&operations[o], sizes[s], threads, chrono::milliseconds(duration_ms));
+
+            //Change of the throughput from the baseline, in percent
+            map<string, double>::iterator base = baseline.find(key(r.op, r.size, r.threads));
+            bool compared = base != baseline.end() && base->second > 0;
+            double change = compared ? (r.ops_per_sec - base->second)*100/base->second : 0;
+            bool slower = compared && change < -tolerance;
+            regression = regression || slower;
+
+            if (json){
+                cout<<fixed<<setprecision(1)<<"{\"op\": \""<<r.op<<"\", \"size\": "<<r.size<<", \"threads\": "<<r.threads<<", \"ops_per_sec\": "<<r.ops_per_sec
+                    <<", \"ns_per_op\": "<<r.ns_per_op<<", \"allocs_per_op\": "<<setprecision(2)<<r.allocs_per_op;
+                if (compared){ cout<<setprecision(1)<<", \"baseline_ops_per_sec\": "<<base->second<<", \"change_percent\": "<<change<<", \"regression\": "<<(slower ? "true" : "false"); }
+                cout<<"}"<<endl;
+            } else {
+                cout<<fixed<<setprecision(1)<<left<<setw(24)<<r.op<<right<<setw(6)<<r.size<<" B\t"<<r.threads<<" threads\t"<<setw(12)<<r.ops_per_sec<<" ops/s\t"<<setw(10)<<r.ns_per_op<<" ns/op\t"
+                    <<setprecision(2)<<r.allocs_per_op<<" allocations/op";
+                if (compared){ cout<<setprecision(1)<<"\t"<<showpos<<change<<noshowpos<<"% from the baseline"<<(slower ? " REGRESSION" : ""); }
+                cout<<endl;
+            }
+        }
+    }
+    return regression ? 1 : 0;
+}
@@ -0,0 +1,221 @@
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include "../Utility.h"
+#include "../SessionTickets.h"
+
+using namespace std;
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Benchmark of the cryptography of the S2/S3 login, run by   *|
+|* the client and the server in the same process, for each    *|
+|* key exchange suite and identity key type:                  *|
+|* "rsa" makes an ephemeral RSA key pair and sends K in an    *|
+|* envelope, "x25519" exchanges two shares and derives K with *|
+|* HKDF, "resumed" sends a ticket of a previous session and   *|
+|* derives K from its secret (R2/R3, no identity key used).   *|
+|* The server column is the CPU time of the server            *|
+|* alone, the bytes are the ones of S2 and S3 on the wire.    *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+
+static EVP_PKEY* generateIdentity(const char* type){
+    EVP_PKEY* key = NULL;
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_from_name(NULL, type, NULL);
+    if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0){ cerr<<"ERR: Error while creating the key generation context"<<endl; exit(1); }
+    if (strcmp(type, "RSA") == 0){ EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, SIGNATURE_SIZE*8); }
+    if (EVP_PKEY_generate(ctx, &key) <= 0){ cerr<<"ERR: Error while generating the identity key"<<endl; exit(1); }
+    EVP_PKEY_CTX_free(ctx);
+    return key;
+}
+
+struct Identities {
+    EVP_PKEY* client;
+    EVP_PKEY* server;
+};
+
+//Length of the fields of S2 that do not depend on the suite: choice, suite, R_server, R_user and a username of 5 bytes
+static const unsigned int S2_FIXED = 2 + 2*R_SIZE + sizeof(long) + 1 + 5;
+
+typedef chrono::steady_clock Clock;
+
+/* ---------------------------------------------------------- *\
+|* One login: returns the bytes of S2 and S3                  *|
+\* ---------------------------------------------------------- */
+static unsigned int rsaLogin(Identities &id, double &server_ms){
+    unsigned char msg[S2_SIZE];
+    unsigned char* signature;
+    unsigned int signature_len;
+
+    //Client: ephemeral key pair and S2
+    EVP_PKEY* tprivk = Utility::generateTprivK();
+    EVP_PKEY* tpubk = Utility::generateTpubK(tprivk);
+    BIO* mbio = BIO_new(BIO_s_mem());
+    PEM_write_bio_PUBKEY(mbio, tpubk);
+    char* pubkey_buf = NULL;
+    long pubkey_size = BIO_get_mem_data(mbio, &pubkey_buf);
+    memcpy(msg, pubkey_buf, pubkey_size);
+    Utility::signMessage(id.client, (char*)msg, pubkey_size, &signature, &signature_len);
+    unsigned int bytes = S2_FIXED + pubkey_size + signature_len;
+
+    //Server: verify S2, send K in the envelope and sign S3
+    auto start = Clock::now();
+    BIO* rbio = BIO_new(BIO_s_mem());
+    BIO_write(rbio, msg, pubkey_size);
+    EVP_PKEY* received = PEM_read_bio_PUBKEY(rbio, NULL, NULL, NULL);
+    BIO_free(rbio);
+    if (Utility::verifyMessage(id.client, (char*)msg, pubkey_size, signature, signature_len) != 1){ cerr<<"ERR: S2 not verified"<<endl; exit(1); }
+    free(signature);
+    unsigned char K[K_SIZE];
+    RAND_bytes(K, K_SIZE);
+    unsigned char* ciphertext, *encrypted_key, *iv;
+    unsigned int cipherlen;
+    int outlen, encrypted_key_len;
+    if (!Utility::encryptMessage(K_SIZE, received, K, ciphertext, encrypted_key, iv, encrypted_key_len, outlen, cipherlen)){ cerr<<"ERR: Error while encrypting"<<endl; exit(1); }
+    unsigned char s3[S3_SIZE];
+    unsigned int len = 1 + R_SIZE;
+    memcpy(s3+len, ciphertext, cipherlen);
+    len += cipherlen;
+    memcpy(s3+len, iv, BLOCK_SIZE);
+    len += BLOCK_SIZE;
+    memcpy(s3+len, encrypted_key, encrypted_key_len);
+    len += encrypted_key_len;
+    Utility::signMessage(id.server, (char*)s3, len, &signature, &signature_len);
+    server_ms += chrono::duration<double, milli>(Clock::now() - start).count();
+    bytes += len + signature_len;
+
+    //Client: verify S3 and open the envelope
+    if (Utility::verifyMessage(id.server, (char*)s3, len, signature, signature_len) != 1){ cerr<<"ERR: S3 not verified"<<endl; exit(1); }
+    unsigned char* plaintext = (unsigned char*)malloc(2*BLOCK_SIZE);
+    unsigned int plaintext_len;
+    if (!Utility::decryptMessage(plaintext, ciphertext, cipherlen, iv, encrypted_key, encrypted_key_len, tprivk, plaintext_len) || memcmp(plaintext, K, K_SIZE) != 0){ cerr<<"ERR: Error while decrypting"<<endl; exit(1); }
+
+    free(plaintext);
+    free(signature);
+    free(ciphertext);
+    free(encrypted_key);
+    free(iv);
+    BIO_free(mbio);
+    EVP_PKEY_free(received);
+    EVP_PKEY_free(tpubk);
+    EVP_PKEY_free(tprivk);
+    return bytes;
+}
+
+static unsigned int x25519Login(Identities &id, double &server_ms){
+    unsigned char msg[X25519_SHARE_SIZE];
+    unsigned char salt[2*R_SIZE];
+    unsigned char* signature;
+    unsigned int signature_len;
+    RAND_bytes(salt, 2*R_SIZE);
+
+    //Client: share and S2
+    EVP_PKEY* tsharek = Utility::generateTshareK();
+    if (!Utility::writeShare(tsharek, msg)){ cerr<<"ERR: Error while writing the share"<<endl; exit(1); }
+    Utility::signMessage(id.client, (char*)msg, X25519_SHARE_SIZE, &signature, &signature_len);
+    unsigned int bytes = S2_FIXED + X25519_SHARE_SIZE + signature_len;
+
+    //Server: verify S2, answer with its share and derive K
+    auto start = Clock::now();
+    EVP_PKEY* received = Utility::readShare(msg, X25519_SHARE_SIZE);
+    if (!received || Utility::verifyMessage(id.client, (char*)msg, X25519_SHARE_SIZE, signature, signature_len) != 1){ cerr<<"ERR: S2 not verified"<<endl; exit(1); }
+    free(signature);
+    EVP_PKEY* server_sharek = Utility::generateTshareK();
+    unsigned char s3[S3_X25519_SIZE];
+    unsigned int len = 1 + R_SIZE;
+    unsigned char server_K[K_SIZE], server_iv[BLOCK_SIZE];
+    if (!Utility::writeShare(server_sharek, s3+len) || !Utility::deriveK(server_sharek, received, salt, 2*R_SIZE, "login", server_K, server_iv)){ cerr<<"ERR: Error while deriving K"<<endl; exit(1); }
+    len += X25519_SHARE_SIZE;
+    Utility::signMessage(id.server, (char*)s3, len, &signature, &signature_len);
+    server_ms += chrono::duration<double, milli>(Clock::now() - start).count();
+    bytes += len + signature_len;
+
+    //Client: verify S3 and derive K
+    if (Utility::verifyMessage(id.server, (char*)s3, len, signature, signature_len) != 1){ cerr<<"ERR: S3 not verified"<<endl; exit(1); }
+    EVP_PKEY* server_share = Utility::readShare(s3+1+R_SIZE, X25519_SHARE_SIZE);
+    unsigned char K[K_SIZE], iv[BLOCK_SIZE];
+    if (!server_share || !Utility::deriveK(tsharek, server_share, salt, 2*R_SIZE, "login", K, iv) || memcmp(K, server_K, K_SIZE) != 0 || memcmp(iv, server_iv, BLOCK_SIZE) != 0){ cerr<<"ERR: Different keys derived"<<endl; exit(1); }
+
+    free(signature);
+    EVP_PKEY_free(server_share);
+    EVP_PKEY_free(server_sharek);
+    EVP_PKEY_free(received);
+    EVP_PKEY_free(tsharek);
+    return bytes;
+}
+
+static unsigned int resumedLogin(Identities &, double &server_ms){
+    unsigned char secret[RESUMPTION_SECRET_SIZE];
+    unsigned char salt[2*R_SIZE];
+    RAND_bytes(secret, RESUMPTION_SECRET_SIZE);
+    RAND_bytes(salt, 2*R_SIZE);
+
+    //Client: R2 with the ticket of the previous session
+    unsigned char r2[R2_SIZE];
+    r2[0] = 14;
+    r2[1] = 0;
+    r2[2] = SUITE_X25519 | (AEAD_AES_128_GCM << 4);
+    memcpy(r2+3, salt, 2*R_SIZE);
+    if (!SessionTickets::issue("alice", SessionTickets::now() + TICKET_LIFETIME, secret, r2+3+2*R_SIZE)){ cerr<<"ERR: Error while sealing the ticket"<<endl; exit(1); }
+    Utility::computeMAC(secret, RESUMPTION_SECRET_SIZE, r2, R2_SIZE-MAC_SIZE, r2+R2_SIZE-MAC_SIZE);
+
+    //Server: open the ticket, verify R2, derive K and answer with R3
+    auto start = Clock::now();
+    string username;
+    unsigned long long expiry;
+    unsigned char server_secret[RESUMPTION_SECRET_SIZE], mac[MAC_SIZE];
+    if (!SessionTickets::open(r2+3+2*R_SIZE, username, expiry, server_secret)){ cerr<<"ERR: Ticket not opened"<<endl; exit(1); }
+    if (!Utility::computeMAC(server_secret, RESUMPTION_SECRET_SIZE, r2, R2_SIZE-MAC_SIZE, mac) || CRYPTO_memcmp(mac, r2+R2_SIZE-MAC_SIZE, MAC_SIZE) != 0){ cerr<<"ERR: R2 not verified"<<endl; exit(1); }
+    unsigned char server_keys[DERIVED_KEY_SIZE];
+    Utility::expandKey(server_secret, RESUMPTION_SECRET_SIZE, salt, 2*R_SIZE, "resume", server_keys, DERIVED_KEY_SIZE);
+    unsigned char r3[1 + 2*R_SIZE];
+    r3[0] = 14;
+    memcpy(r3+1, salt+R_SIZE, R_SIZE);
+    memcpy(r3+1+R_SIZE, salt, R_SIZE);
+    Utility::computeMAC(server_secret, RESUMPTION_SECRET_SIZE, r3, 1+2*R_SIZE, mac);
+    server_ms += chrono::duration<double, milli>(Clock::now() - start).count();
+
+    //Client: verify R3 and derive K
+    unsigned char client_mac[MAC_SIZE], keys[DERIVED_KEY_SIZE];
+    Utility::computeMAC(secret, RESUMPTION_SECRET_SIZE, r3, 1+2*R_SIZE, client_mac);
+    Utility::expandKey(secret, RESUMPTION_SECRET_SIZE, salt, 2*R_SIZE, "resume", keys, DERIVED_KEY_SIZE);
+    if (CRYPTO_memcmp(mac, client_mac, MAC_SIZE) != 0 || memcmp(keys, server_keys, DERIVED_KEY_SIZE) != 0){ cerr<<"ERR: Different keys derived"<<endl; exit(1); }
+    return R2_SIZE + R3_SIZE;
+}
+
+template<typename F>
+static void measure(const char* name, double seconds, Identities &id, F login){
+    unsigned int handshakes = 0;
+    unsigned int bytes = 0;
+    double server_ms = 0;
+    auto start = Clock::now();
+    chrono::duration<double> elapsed;
+    do {
+        bytes = login(id, server_ms);
+        handshakes++;
+        elapsed = Clock::now() - start;
+    } while (elapsed.count() < seconds || handshakes < 3);
+    cout<<fixed<<setprecision(1)<<name<<"\t"<<handshakes/elapsed.count()<<" handshakes/s\tserver "
+        <<setprecision(3)<<server_ms/handshakes<<" ms\tS2+S3 "<<bytes<<" bytes"<<endl;
+}
+
+int main(int argc, char* argv[]){
+    double seconds = (argc > 1) ? atof(argv[1]) : 3;
+    Identities rsa = { generateIdentity("RSA"), generateIdentity("RSA") };
+    Identities ed25519 = { generateIdentity("ED25519"), generateIdentity("ED25519") };
+
+    measure("rsa, rsa identities", seconds, rsa, rsaLogin);
+    measure("x25519, rsa identities", seconds, rsa, x25519Login);
+    measure("x25519, ed25519 identities", seconds, ed25519, x25519Login);
+    SessionTickets::start();
+    measure("resumed, ticket", seconds, rsa, resumedLogin);
+
+    EVP_PKEY_free(rsa.client);
+    EVP_PKEY_free(rsa.server);
+    EVP_PKEY_free(ed25519.client);
+    EVP_PKEY_free(ed25519.server);
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+#include "../Utility.h"
+
+using namespace std;
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Benchmark of the ephemeral key pair made at every login    *|
+|* and chat, the main part of the login latency of a client.  *|
+|* "forked" repeats the old steps: openssl genrsa and rsa     *|
+|* -pubout in two processes, the keys read back from disk and *|
+|* removed with two more processes. "in-memory" is the EVP    *|
+|* keygen used now.                                           *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+
+static void run(vector<string> args){
+    vector<char*> argv;
+    for (unsigned int i = 0; i < args.size(); i++){ argv.push_back((char*)args[i].c_str()); }
+    argv.push_back(NULL);
+    pid_t pid = fork();
+    if (pid == 0){
+        freopen("/dev/null", "w", stderr);
+        execv(argv[0], argv.data());
+        exit(1);
+    }
+    if (pid < 0){ cerr<<"ERR: Error while creating a new process"<<endl; exit(1); }
+    waitpid(pid, NULL, 0);
+}
+
+static void forkedKeygen(string dir){
+    string tprivk_path = dir + "/tprivk.pem";
+    string tpubk_path = dir + "/tpubk.pem";
+    run({"/bin/openssl", "genrsa", "-out", tprivk_path, to_string(EPHEMERAL_KEY_BITS)});
+    run({"/bin/openssl", "rsa", "-pubout", "-in", tprivk_path, "-out", tpubk_path});
+
+    FILE* file = fopen(tprivk_path.c_str(), "r");
+    if (!file){ cerr<<"ERR: Error while reading the private key"<<endl; exit(1); }
+    EVP_PKEY* tprivk = PEM_read_PrivateKey(file, NULL, NULL, NULL);
+    fclose(file);
+    file = fopen(tpubk_path.c_str(), "r");
+    if (!file){ cerr<<"ERR: Error while reading the public key"<<endl; exit(1); }
+    EVP_PKEY* tpubk = PEM_read_PUBKEY(file, NULL, NULL, NULL);
+    fclose(file);
+    if (!tprivk || !tpubk){ cerr<<"ERR: Error while reading the keys"<<endl; exit(1); }
+
+    run({"/bin/rm", tprivk_path});
+    run({"/bin/rm", tpubk_path});
+    EVP_PKEY_free(tprivk);
+    EVP_PKEY_free(tpubk);
+}
+
+static void inMemoryKeygen(){
+    EVP_PKEY* tprivk = Utility::generateTprivK();
+    EVP_PKEY* tpubk = Utility::generateTpubK(tprivk);
+    EVP_PKEY_free(tprivk);
+    EVP_PKEY_free(tpubk);
+}
+
+template<typename F>
+static void measure(const char* name, unsigned int iterations, F keygen){
+    vector<double> ms;
+    for (unsigned int i = 0; i < iterations; i++){
+        auto start = chrono::steady_clock::now();
+        keygen();
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+        ms.push_back(elapsed.count());
+    }
+    sort(ms.begin(), ms.end());
+    double total = 0;
+    for (unsigned int i = 0; i < ms.size(); i++){ total += ms[i]; }
+    cout<<fixed<<setprecision(1)<<name<<"\tmean "<<total/ms.size()<<" ms\tmedian "<<ms[ms.size()/2]<<" ms\tmax "<<ms.back()<<" ms"<<endl;
+}
+
+int main(int argc, char* argv[]){
+    unsigned int iterations = (argc > 1) ? atoi(argv[1]) : 20;
+    char dir[] = "/tmp/keygen_benchXXXXXX";
+    if (!mkdtemp(dir)){ cerr<<"ERR: Error while creating the temporary directory"<<endl; return 1; }
+
+    measure("forked", iterations, [&](){ forkedKeygen(dir); });
+    measure("in-memory", iterations, [](){ inMemoryKeygen(); });
+
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,384 @@
+#include <algorithm>
+#include <climits>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../SecureChatClient.h"
+#include "../Instrumentation.h"
+
+using namespace std;
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Load generator: many clients in one process, each one a    *|
+|* SecureChatClient in its own thread, driven by a script     *|
+|* instead of the terminal. The users come in pairs: the      *|
+|* receiver waits for RTTs, the sender refreshes the lobby,   *|
+|* sends an RTT to its receiver, sets up the chat (M1-M3) and *|
+|* both of them send messages at a fixed rate, each one       *|
+|* carrying the time it was sent. After the chats of a pair   *|
+|* both users logout.                                         *|
+|*                                                            *|
+|* usage: ./bench/loadgen --provision count [-u prefix]       *|
+|*        ./bench/loadgen serverIP serverPort [-n pairs]      *|
+|*            [-u prefix] [-c chats] [-m messages] [-r rate]  *|
+|*            [-s size] [-f refreshes] [-x refuse%]           *|
+|*            [-l logins/s] [-k x25519|rsa]                   *|
+|*            [-a aes128|aes256|chacha20] [--full]            *|
+|*                                                            *|
+|* --provision creates the users prefix0..prefixN-1: their    *|
+|* keys and CA files under ./client, their public keys under  *|
+|* ./server and the list prefix_user_list, to give to         *|
+|* server_main. The private keys have no password; for users  *|
+|* with one, it is taken from SECURECHAT_KEY_PASSWORD.        *|
+|* --full removes the tickets of the users before the login,  *|
+|* so that no session is resumed.                             *|
+|*                                                            *|
+|* As in the interactive client, a protocol error in any      *|
+|* session ends the whole run.                                *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+
+//Stack of a client thread: the largest buffers of a client are a few frames
+static const size_t CLIENT_STACK_SIZE = 512*1024;
+
+struct LoadConfig {
+    string address;
+    unsigned short int port;
+    string prefix;
+    unsigned int pairs;
+    unsigned int chats;         //chats of each pair
+    unsigned int messages;      //messages sent by each user in a chat
+    double rate;                //messages per second sent by each user, 0 for no pause
+    unsigned int size;          //bytes of a message
+    unsigned int refreshes;     //lobby refreshes before each RTT
+    unsigned int refuse;        //percent of the RTTs refused by the receivers
+    double login_rate;          //clients started per second, 0 for all at once
+    unsigned char suite;
+    unsigned char aead;
+    bool full;
+};
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* Driver of a simulated user: the scenario of a ScriptDriver *|
+|* built from the configuration, with generated messages      *|
+|* carrying their send time, refusals drawn at random and a   *|
+|* growing pause before a new RTT. It records the times of    *|
+|* its steps; the samples of all the users are merged at the  *|
+|* end of the run.                                            *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+class LoadDriver : public ScriptDriver {
+    public:
+        const LoadConfig* config;
+        string username;
+        unsigned int seed;
+
+        unsigned long long started_ns;
+        unsigned long long s1_ns;               //certificate of the server received
+        unsigned long long login_done_ns;
+        bool resumed;
+        vector<unsigned long long> rtt_ns;      //RTT sent to chat started, on the sender
+        vector<unsigned long long> relay_ns;    //message sent to message received
+        unsigned int refused;
+
+        unsigned int backoff_ms;
+        unsigned long long rtt_sent_ns;
+
+        using ScriptDriver::role;
+        using ScriptDriver::chats_done;
+
+        LoadDriver(const LoadConfig* config, string username, string peer, unsigned int role) : ScriptDriver(NULL){
+            this->config = config;
+            this->username = username;
+            this->seed = hash<string>()(username);
+            this->started_ns = 0;
+            this->s1_ns = 0;
+            this->login_done_ns = 0;
+            this->resumed = false;
+            this->refused = 0;
+            this->backoff_ms = 10;
+            this->rtt_sent_ns = 0;
+
+            //Both users send config->messages and wait for as many; only the sender leaves the chat
+            this->role = role;
+            this->peer = peer;
+            this->refreshes = config->refreshes;
+            this->interval_ns = (config->rate > 0) ? (unsigned long long)(1e9/config->rate) : 0;
+            this->expect = config->messages;
+            this->chats = config->chats;
+            this->attempts = UINT_MAX;
+            valid();
+        }
+
+        unsigned int answerRTT(string){
+            return ((unsigned int)rand_r(&this->seed) % 100 < config->refuse) ? 0 : 1;
+        }
+
+        void event(ClientEvent event, string peer, const char* msg, unsigned int msg_len){
+            unsigned long long t = Instrumentation::now();
+            switch (event){
+                case EVENT_S1_RECEIVED:
+                    this->s1_ns = t;
+                    break;
+                case EVENT_S3_RECEIVED:
+                case EVENT_R3_RECEIVED:
+                    this->login_done_ns = t;
+                    this->resumed = (event == EVENT_R3_RECEIVED);
+                    break;
+                case EVENT_RTT_SENT:
+                    this->rtt_sent_ns = t;
+                    break;
+                case EVENT_RTT_ACCEPTED:
+                    this->backoff_ms = 10;
+                    break;
+                case EVENT_RTT_REFUSED:
+                    this->refused++;
+                    break;
+                case EVENT_CHAT_STARTED:
+                    if (this->role == 0){ this->rtt_ns.push_back(t - this->rtt_sent_ns); }
+                    break;
+                case EVENT_MESSAGE_RECEIVED:
+                    this->relay_ns.push_back(t - strtoull(msg, NULL, 10));
+                    break;
+                default:
+                    break;
+            }
+            ScriptDriver::event(event, peer, msg, msg_len);
+        }
+
+    protected:
+        unsigned int messageCount(){
+            return config->messages;
+        }
+
+        //The send time, padded to the size of the messages
+        void composeMessage(unsigned int, char* buf, unsigned int size){
+            unsigned int len = snprintf(buf, size, "%llu ", Instrumentation::now());
+            unsigned int msg_size = min(max(config->size, len), size - 1);
+            memset(buf + len, 'x', msg_size - len);
+            buf[msg_size] = '\0';
+        }
+
+        //The receiver was busy, refused or not logged in yet: try again later and later, up to a second
+        unsigned int retryDelay(){
+            unsigned int delay = this->backoff_ms;
+            this->backoff_ms = min(2*this->backoff_ms, 1000u);
+            return delay;
+        }
+};
+
+static void* runClient(void* arg){
+    LoadDriver* driver = (LoadDriver*)arg;
+    const LoadConfig* config = driver->config;
+    if (config->full){ unlink(("./client/" + driver->username + "/session_ticket").c_str()); }
+    driver->started_ns = Instrumentation::now();
+    SecureChatClient client(driver->username, config->address.c_str(), config->port, config->suite, config->aead, driver);
+    return NULL;
+}
+
+/* ---------------------------------------------------------- *\
+|*                                                            *|
+|* This function creates the users of the load: a key pair    *|
+|* for each one, written for the client and for the server,   *|
+|* and a copy of the CA files of the server. The keys are     *|
+|* generated by one thread per core.                          *|
+|*                                                            *|
+\* ---------------------------------------------------------- */
+static bool copyFile(string from, string to){
+    ifstream in(from, ios::binary);
+    ofstream out(to, ios::binary | ios::trunc);
+    if (!in || !out){ return false; }
+    out<<in.rdbuf();
+    return (bool)out;
+}
+
+static void provisionUser(string username){
+    string dir = "./client/" + username;
+    mkdir(dir.c_str(), 0700);
+    if (!copyFile("./server/ca_cert.pem", dir + "/ca_cert.pem") || !copyFile("./server/ca_crl.pem", dir + "/ca_crl.pem")){
+        cerr<<"ERR: Error while copying the CA files for "<<username<<endl;
+        exit(1);
+    }
+
+    EVP_PKEY* key = EVP_RSA_gen(SIGNATURE_SIZE*8);
+    if (!key){ cerr<<"ERR: Error while generating the key of "<<username<<endl; exit(1); }
+    FILE* prvkey_file = fopen((dir + "/" + username + "_key_password.pem").c_str(), "w");
+    FILE* pubkey_file = fopen(("./server/" + username + "_pubkey.pem").c_str(), "w");
+    if (!prvkey_file || !pubkey_file || !PEM_write_PrivateKey(prvkey_file, key, NULL, NULL, 0, NULL, NULL) || !PEM_write_PUBKEY(pubkey_file, key)){
+        cerr<<"ERR: Error while writing the keys of "<<username<<endl;
+        exit(1);
+    }
+    fclose(prvkey_file);
+    fclose(pubkey_file);
+    EVP_PKEY_free(key);
+}
+
+static int provision(string prefix, unsigned int count){
+    if (prefix.length() + to_string(count).length() >= USERNAME_MAX_SIZE){ cerr<<"ERR: The usernames would be too long"<<endl; return 1; }
+    atomic<unsigned int> next(0);
+    vector<thread> workers;
+    unsigned int threads = max(1u, thread::hardware_concurrency());
+    for (unsigned int i = 0; i < threads; i++){
+        workers.emplace_back([&](){
+            for (unsigned int u = next++; u < count; u = next++){ provisionUser(prefix + to_string(u)); }
+        });
+    }
+    for (unsigned int i = 0; i < workers.size(); i++){ workers[i].join(); }
+
+    string list_path = prefix + "_user_list";
+    ofstream list(list_path, ios::trunc);
+    for (unsigned int u = 0; u < count; u++){ list<<prefix<<u<<endl; }
+    if (!list){ cerr<<"ERR: Error while writing "<<list_path<<endl; return 1; }
+    cout<<"LOG: "<<count<<" users created, start the server with "<<list_path<<endl;
+    return 0;
+}
+
+/* ---------------------------------------------------------- *\
+|* Report                                                     *|
+\* ---------------------------------------------------------- */
+static void printLatency(string name, vector<unsigned long long> &samples){
+    cout<<"     "<<left<<setw(16)<<name<<right;
+    if (samples.empty()){ cout<<"no samples"<<endl; return; }
+    sort(samples.begin(), samples.end());
+    double percentiles[] = { 50, 90, 99, 99.9 };
+    const char* names[] = { "p50", "p90", "p99", "p99.9" };
+    cout<<fixed<<setprecision(3);
+    for (unsigned int i = 0; i < sizeof(percentiles)/sizeof(percentiles[0]); i++){
+        unsigned long long index = min((unsigned long long)(samples.size()*percentiles[i]/100), (unsigned long long)samples.size() - 1);
+        cout<<names[i]<<" "<<samples[index]/1e6<<" ms  ";
+    }
+    cout<<"max "<<samples.back()/1e6<<" ms ("<<samples.size()<<" samples)"<<endl;
+}
+
+static void usage(){
+    cout<<"usage: ./bench/loadgen --provision count [-u prefix]"<<endl;
+    cout<<"       ./bench/loadgen serverIP serverPort [-n pairs] [-u prefix] [-c chats] [-m messages] [-r rate] [-s size]"<<endl;
+    cout<<"                      [-f refreshes] [-x refuse%] [-l logins/s] [-k x25519|rsa] [-a aes128|aes256|chacha20] [--full]"<<endl;
+}
+
+int main(int argc, char** argv){
+    LoadConfig config = { "", 0, "load", 1, 1, 10, 10, 64, 1, 0, 0, SUITE_X25519, SessionCipher::probeSuite(), false };
+    int provision_count = -1;
+    vector<string> positional;
+    for (int i = 1; i < argc; i++){
+        string arg = argv[i];
+        bool value = i + 1 < argc;
+        if (arg == "--provision" && value){ provision_count = atoi(argv[++i]); }
+        else if (arg == "-u" && value){ config.prefix = argv[++i]; }
+        else if (arg == "-n" && value){ config.pairs = atoi(argv[++i]); }
+        else if (arg == "-c" && value){ config.chats = atoi(argv[++i]); }
+        else if (arg == "-m" && value){ config.messages = atoi(argv[++i]); }
+        else if (arg == "-r" && value){ config.rate = atof(argv[++i]); }
+        else if (arg == "-s" && value){ config.size = atoi(argv[++i]); }
+        else if (arg == "-f" && value){ config.refreshes = atoi(argv[++i]); }
+        else if (arg == "-x" && value){ config.refuse = atoi(argv[++i]); }
+        else if (arg == "-l" && value){ config.login_rate = atof(argv[++i]); }
+        else if (arg == "-k" && value){
+            string suite = argv[++i];
+            if (suite == "rsa"){ config.suite = SUITE_RSA; }
+            else if (suite != "x25519"){ cout<<"The key exchange suite must be x25519 or rsa"<<endl; return 1; }
+        }
+        else if (arg == "-a" && value){
+            if (!SessionCipher::parseSuite(argv[++i], config.aead)){ cout<<"The AEAD suite must be aes128, aes256 or chacha20"<<endl; return 1; }
+        }
+        else if (arg == "--full"){ config.full = true; }
+        else if (arg[0] != '-'){ positional.push_back(arg); }
+        else { usage(); return 1; }
+    }
+    if (provision_count > 0){ return provision(config.prefix, provision_count); }
+    if (positional.size() != 2 || config.pairs == 0 || config.chats == 0 || config.refuse >= 100 || config.size >= INPUT_SIZE){ usage(); return 1; }
+    config.address = positional[0];
+    config.port = atoi(positional[1].c_str());
+
+    //One socket per client
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max){
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    /* ---------------------------------------------------------- *\
+    |* The key pool is shared by all the clients: started here,   *|
+    |* before the threads, with room for a burst of logins        *|
+    \* ---------------------------------------------------------- */
+    KeyPool::start(config.suite, min(2*config.pairs, 256u));
+
+    vector<LoadDriver*> drivers;
+    for (unsigned int i = 0; i < config.pairs; i++){
+        string sender = config.prefix + to_string(2*i);
+        string receiver = config.prefix + to_string(2*i + 1);
+        drivers.push_back(new LoadDriver(&config, receiver, sender, 1));
+        drivers.push_back(new LoadDriver(&config, sender, receiver, 0));
+    }
+
+    cout<<"LOG: "<<drivers.size()<<" clients, "<<config.chats<<" chats per pair, "<<config.messages<<" messages of "<<config.size<<" B per user and chat"<<endl;
+
+    //The logs of the clients are silenced, the errors still go to cerr
+    cout.setstate(ios::failbit);
+
+    /* ---------------------------------------------------------- *\
+    |* The receivers log in first, so that the first RTTs find    *|
+    |* them online                                                *|
+    \* ---------------------------------------------------------- */
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CLIENT_STACK_SIZE);
+    vector<pthread_t> threads(drivers.size());
+    unsigned long long start_ns = Instrumentation::now();
+    for (unsigned int pass = 0; pass < 2; pass++){
+        for (unsigned int i = pass; i < drivers.size(); i += 2){
+            if (pthread_create(&threads[i], &attr, runClient, drivers[i]) != 0){ cerr<<"ERR: Error while creating the thread of "<<drivers[i]->username<<endl; exit(1); }
+            if (config.login_rate > 0){ this_thread::sleep_for(chrono::nanoseconds((long long)(1e9/config.login_rate))); }
+        }
+    }
+    for (unsigned int i = 0; i < threads.size(); i++){ pthread_join(threads[i], NULL); }
+    unsigned long long end_ns = Instrumentation::now();
+    cout.clear();
+
+    /* ---------------------------------------------------------- *\
+    |* Merge the samples of the users                             *|
+    \* ---------------------------------------------------------- */
+    vector<unsigned long long> login_ns, handshake_ns, rtt_ns, relay_ns;
+    unsigned long long last_login_ns = start_ns;
+    unsigned int resumed = 0, refused = 0, chats = 0;
+    for (unsigned int i = 0; i < drivers.size(); i++){
+        LoadDriver* d = drivers[i];
+        login_ns.push_back(d->login_done_ns - d->started_ns);
+        //S1 to S3: the ephemeral key or share of the client, S2 and the checks of the server, without the connect
+        if (!d->resumed){ handshake_ns.push_back(d->login_done_ns - d->s1_ns); }
+        last_login_ns = max(last_login_ns, d->login_done_ns);
+        resumed += d->resumed;
+        if (d->role == 0){
+            refused += d->refused;
+            chats += d->chats_done;
+        }
+        rtt_ns.insert(rtt_ns.end(), d->rtt_ns.begin(), d->rtt_ns.end());
+        relay_ns.insert(relay_ns.end(), d->relay_ns.begin(), d->relay_ns.end());
+    }
+    double login_s = (last_login_ns - start_ns)/1e9;
+    double run_s = (end_ns - start_ns)/1e9;
+
+    cout<<fixed<<setprecision(1);
+    cout<<"LOG: Run of "<<run_s<<" s, suites "<<KeyPool::suiteName(config.suite)<<" and "<<SessionCipher::suiteName(config.aead)<<endl;
+    cout<<"     "<<login_ns.size()<<" logins ("<<resumed<<" resumed) in "<<login_s<<" s: "<<login_ns.size()/login_s<<" handshakes/s"<<endl;
+    cout<<"     "<<chats<<" chats, "<<refused<<" RTTs refused or to a busy user"<<endl;
+    cout<<"     "<<relay_ns.size()<<" messages relayed: "<<relay_ns.size()/run_s<<" messages/s"<<endl;
+    printLatency("login", login_ns);
+    printLatency("S1 to S3", handshake_ns);
+    printLatency("RTT to chat", rtt_ns);
+    printLatency("relay", relay_ns);
+    return 0;
+}
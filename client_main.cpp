@@ -11,8 +11,46 @@ bool isValidIpAddress(char *ipAddress){
 
 int main( int argc, char** argv) {
 
+    /* ---------------------------------------------------------- *\
+    |* The options of a headless session may follow the usual     *|
+    |* arguments: a script and/or the options of the scenario     *|
+    \* ---------------------------------------------------------- */
+    vector<char*> args;
+    vector<pair<string, string>> options;
+    string script_path;
+    string events_path;
+    string trace_path;
+    string password;
+    bool verbose = false;
+    for (int i = 0; i < argc; i++){
+        if (strncmp(argv[i], "--", 2) != 0){
+            args.push_back(argv[i]);
+            continue;
+        }
+        string key = argv[i] + 2;
+        if (key == "verbose"){
+            verbose = true;
+            continue;
+        }
+        if (i + 1 >= argc){
+            cout<<"The option --"<<key<<" needs a value"<<endl;
+            return 0;
+        }
+        if (key == "script"){ script_path = argv[++i]; }
+        else if (key == "events"){ events_path = argv[++i]; }
+        else if (key == "trace"){ trace_path = argv[++i]; }
+        else if (key == "password"){ password = argv[++i]; }
+        else { options.push_back(make_pair(key, string(argv[++i]))); }
+    }
+    bool headless = script_path.size() > 0 || options.size() > 0;
+    argc = args.size();
+    argv = args.data();
+
     if (argc < 4) {
-        cout << "usage: ./client username serverIP serverPort"<< endl;
+        cout << "usage: ./client username serverIP serverPort [x25519|rsa] [aes128|aes256|chacha20]"<< endl;
+        cout << "       [--script file] [--role send|receive] [--peer user] [--accept all|none|user] [--message text]..."<< endl;
+        cout << "       [--interval ms] [--expect n] [--leave yes|no] [--refresh n] [--chats n] [--attempts n] [--retry ms]"<< endl;
+        cout << "       [--events file] [--verbose] [--trace file] [--password pass, or "<<KEY_PASSWORD_ENV<<" in the environment]"<< endl;
         return 0;
     }
     if(!isValidIpAddress(argv[2])){
@@ -30,7 +68,55 @@ int main( int argc, char** argv) {
         cout<<"The server port must be positive and between 0 and 65536"<<endl;
         return 0;
     }
-    SecureChatClient client(argv[1],argv[2],stoi(argv[3]));
+    unsigned char suite = SUITE_X25519;
+    if (argc > 4){
+        if (strcmp(argv[4], "rsa") == 0){
+            suite = SUITE_RSA;
+        } else if (strcmp(argv[4], "x25519") != 0){
+            cout<<"The key exchange suite must be x25519 or rsa"<<endl;
+            return 0;
+        }
+    }
+    //Without a choice, the AEAD suite that is fast on this CPU
+    unsigned char aead = SessionCipher::probeSuite();
+    if (argc > 5 && !SessionCipher::parseSuite(argv[5], aead)){
+        cout<<"The AEAD suite must be aes128, aes256 or chacha20"<<endl;
+        return 0;
+    }
+
+    //Password of the private key: without one, the environment or a prompt
+    const char* key_password = password.size() > 0 ? password.c_str() : NULL;
+
+    //Chrome trace of the session, written at the exit
+    if (trace_path.size() > 0){ Tracer::start(trace_path, string("client ") + argv[1], 0); }
+
+    if (!headless){
+        TerminalDriver driver;
+        SecureChatClient client(argv[1],argv[2],stoi(argv[3]),suite,aead,&driver,key_password);
+        return 0;
+    }
+
+    /* ---------------------------------------------------------- *\
+    |* Headless session: the script first, then the options, and  *|
+    |* the steps on stdout instead of the log unless asked to     *|
+    \* ---------------------------------------------------------- */
+    FILE* events = stdout;
+    if (events_path.size() > 0 && (events = fopen(events_path.c_str(), "w")) == NULL){
+        cout<<"Cannot open the events file "<<events_path<<endl;
+        return 0;
+    }
+    ScriptDriver driver(events);
+    if (script_path.size() > 0 && !driver.load(script_path)){ return 1; }
+    for (unsigned int i = 0; i < options.size(); i++){
+        if (!driver.set(options[i].first, options[i].second)){
+            cout<<"The option --"<<options[i].first<<" "<<options[i].second<<" is not valid"<<endl;
+            return 0;
+        }
+    }
+    if (!driver.valid()){ return 1; }
+    if (events == stdout && !verbose){ cout.setstate(ios::failbit); }
+    SecureChatClient client(argv[1],argv[2],stoi(argv[3]),suite,aead,&driver,key_password);
+    if (events != stdout){ fclose(events); }
 
     return 0;
 }
\ No newline at end of file
@@ -1,5 +1,8 @@
 #include <string>
 
+#ifndef CYBERSECURITYPROJECT_CONSTANTS_H
+#define CYBERSECURITYPROJECT_CONSTANTS_H
+
 //Fields
 const unsigned int USERNAME_MAX_SIZE = 16;
 const unsigned int MAX_ADDRESS_SIZE = 16;
@@ -13,27 +16,114 @@ const unsigned int DIGEST_SIZE = EVP_MD_size(EVP_sha256());
 const unsigned int SIGNATURE_SIZE = 256;
 const unsigned int BLOCK_SIZE = 16;
 const unsigned int ENCRYPTED_KEY_SIZE = 384;
+const unsigned int EPHEMERAL_KEY_BITS = 3072; //RSA key pair generated at each login and chat, ENCRYPTED_KEY_SIZE bytes
+const unsigned int X25519_SHARE_SIZE = 32;
+const unsigned int DERIVED_KEY_SIZE = K_SIZE + BLOCK_SIZE; //K and the initial counter derived from an X25519 exchange
+const unsigned int MAC_SIZE = 32;                   //HMAC-SHA256
+const unsigned int RESUMPTION_SECRET_SIZE = 32;     //derived from K at each login, kept by the client with its ticket
 const unsigned int NONCE_SIZE = 16;
 const unsigned int MAX_AVAILABLE_USER_MESSAGE = 255;
 const unsigned int PUBKEY_SIZE = 1024;
 const unsigned int ENC_FIELDS = TAG_SIZE + BLOCK_SIZE + GCM_IV_SIZE;
 
+//Key exchange suites, offered by the client in S2 and by the sender in M1
+const unsigned char SUITE_RSA = 0;      //ephemeral RSA key pair, K sent in an envelope (encryptMessage)
+const unsigned char SUITE_X25519 = 1;   //ephemeral X25519 shares, K and the counter derived with HKDF
+const unsigned int KEY_SUITES = 2;
+
+//AEAD suites of the records, offered with the key exchange suite: the suite byte of S2, R2 and M1 is key exchange suite | AEAD suite << 4
+const unsigned char AEAD_AES_128_GCM = 0;           //K used as it is, the suite of the clients that offer none
+const unsigned char AEAD_AES_256_GCM = 1;           //key expanded from K with HKDF
+const unsigned char AEAD_CHACHA20_POLY1305 = 2;     //key expanded from K with HKDF, for CPUs without AES instructions
+const unsigned int AEAD_SUITES = 3;
+const unsigned int AEAD_KEY_MAX_SIZE = 32;
+
+//Rekeying: a direction of a session ratchets its key with HKDF after this many records or bytes, announced by a rekey message.
+//Lowered at build time to exercise it, e.g. -DREKEY_AFTER_RECORDS=16 for the client and the server
+#ifndef REKEY_AFTER_RECORDS
+#define REKEY_AFTER_RECORDS (1ULL << 20)
+#endif
+#ifndef REKEY_AFTER_BYTES
+#define REKEY_AFTER_BYTES (1ULL << 30)
+#endif
+const unsigned long long REKEY_RECORDS = REKEY_AFTER_RECORDS;
+const unsigned long long REKEY_BYTES = REKEY_AFTER_BYTES;
+
+//Labels of the first secrets of the two directions of a session, expanded from K: the directions never share a key
+const char* const KEY_LABEL_SERVER = "server";          //records from the server to a user
+const char* const KEY_LABEL_USER = "user";              //records from a user to the server
+const char* const KEY_LABEL_SENDER = "sender";          //chat records of the user that sent the RTT
+const char* const KEY_LABEL_RECEIVER = "receiver";      //chat records of the user that accepted it
+
+//Client: environment variable with the password of the private key of the user, if not given with --password
+const char* const KEY_PASSWORD_ENV = "SECURECHAT_KEY_PASSWORD";
+
+//Ephemeral key pools
+const unsigned int CLIENT_KEY_POOL_SIZE = 2;    //key pairs of its suite kept ready by a client: one login and one chat
+const unsigned int SERVER_KEY_POOL_SIZE = 256;  //X25519 key pairs kept ready by the server for a burst of logins
+
+//Session tickets
+const unsigned int TICKET_LIFETIME = 86400;     //seconds a ticket can be used after the full login that started the chain
+const unsigned int TICKET_PLAINTEXT_SIZE = 1 + USERNAME_MAX_SIZE + sizeof(unsigned long long) + RESUMPTION_SECRET_SIZE;
+const unsigned int TICKET_SIZE = GCM_IV_SIZE + TICKET_PLAINTEXT_SIZE + TAG_SIZE;
+
 //Messages
 const unsigned int AVAILABLE_USER_MAX_SIZE = 2 + MAX_AVAILABLE_USER_MESSAGE*(USERNAME_MAX_SIZE+2);
 const unsigned int RTT_MAX_SIZE = 3 + USERNAME_MAX_SIZE;
 const unsigned int RESPONSE_MAX_SIZE = SIGNATURE_SIZE + USERNAME_MAX_SIZE + 3;
 const unsigned int LOGOUT_MAX_SIZE = 1;
 const unsigned int PUBKEY_MSG_SIZE = 1 + PUBKEY_SIZE + SIGNATURE_SIZE; //TOOD: ricontrollare
-const unsigned int M1_SIZE = 1 + R_SIZE;
+const unsigned int M1_SIZE = 2 + R_SIZE;
 const unsigned int INPUT_SIZE = 10000;
 const unsigned int GENERAL_MSG_SIZE = 1 + INPUT_SIZE;
 const unsigned int M2_SIZE = 1 + 2*R_SIZE + sizeof(long) + PUBKEY_SIZE + SIGNATURE_SIZE;
 const unsigned int M3_SIZE = 1 + R_SIZE + 3*BLOCK_SIZE + ENCRYPTED_KEY_SIZE + SIGNATURE_SIZE; //one block for K (16), one block for IV (16), the encrypted key and the signature
+const unsigned int M2_X25519_SIZE = 1 + 2*R_SIZE + sizeof(long) + X25519_SHARE_SIZE + SIGNATURE_SIZE;
+const unsigned int M3_X25519_SIZE = 1 + R_SIZE + X25519_SHARE_SIZE + SIGNATURE_SIZE;
 const unsigned int LOGOUT_NONCE_MSG_SIZE = 3*BLOCK_SIZE + ENCRYPTED_KEY_SIZE + SIGNATURE_SIZE+1000;
 const unsigned int S1_SIZE = CERTIFICATE_MAX_SIZE + R_SIZE;
-const unsigned int S2_SIZE = 1 + 2*R_SIZE + sizeof(long) + PUBKEY_SIZE + 1 + USERNAME_MAX_SIZE + SIGNATURE_SIZE;
+const unsigned int S2_SIZE = 2 + 2*R_SIZE + sizeof(long) + PUBKEY_SIZE + 1 + USERNAME_MAX_SIZE + SIGNATURE_SIZE;
 const unsigned int S3_SIZE = 1 + R_SIZE + 3*BLOCK_SIZE + ENCRYPTED_KEY_SIZE + SIGNATURE_SIZE;
+const unsigned int S2_X25519_SIZE = 2 + 2*R_SIZE + sizeof(long) + X25519_SHARE_SIZE + 1 + USERNAME_MAX_SIZE + SIGNATURE_SIZE;
+const unsigned int S3_X25519_SIZE = 1 + R_SIZE + X25519_SHARE_SIZE + SIGNATURE_SIZE;
+const unsigned int TICKET_MSG_SIZE = 1 + sizeof(unsigned int) + TICKET_SIZE;
+const unsigned int R2_SIZE = 3 + 2*R_SIZE + TICKET_SIZE + MAC_SIZE;    //resumption request, sent instead of S2
+const unsigned int R3_SIZE = 1 + R_SIZE + MAC_SIZE;                     //resumption accepted, sent instead of S3
 const unsigned int ACK_SIZE = 1;
 const unsigned int REFRESH_SIZE = 1;
 const unsigned int BAD_RESPONSE_SIZE = 1;
-const unsigned int RETURN_TO_LOBBY_SIZE = 1;
\ No newline at end of file
+const unsigned int RETURN_TO_LOBBY_SIZE = 1;
+const unsigned int REKEY_SIZE = 1;
+
+//Framing
+const unsigned int FRAME_HEADER_SIZE = 4;      //length of the payload, big endian
+const unsigned int MAX_FRAME_SIZE = GENERAL_MSG_SIZE + 2*ENC_FIELDS; //largest payload accepted by a reader (chat messages are encrypted twice)
+const unsigned int FRAME_BUFFER_SIZE = 2*(FRAME_HEADER_SIZE + MAX_FRAME_SIZE); //one full frame always fits next to a partial one
+
+//Buffer pools
+const unsigned int POOL_CACHED_BUFFERS = 64;    //free buffers of each size class kept by a thread
+
+//Server
+const unsigned int MAX_RECORD_SIZE = GENERAL_MSG_SIZE + 2*ENC_FIELDS; //largest encrypted message relayed by the server (chat messages are encrypted twice)
+const unsigned int MAX_EPOLL_EVENTS = 64;
+const unsigned int MAX_WRITE_PARTS = 4;         //parts of a message gathered by Connection::writev
+const unsigned int MAX_CONNECTION_EVENTS = 256; //events queued for a session before the connection is closed
+const unsigned int CRYPTO_OFFLOAD_SIZE = 4096;  //chat records at least this long are decrypted and encrypted again by a crypto worker
+const unsigned int RING_ENTRIES = 1024;         //submission entries of the io_uring of a reactor
+const unsigned int RING_FILES = 16384;          //fixed file slots of the io_uring of a reactor
+const unsigned int RING_RECV_BUFFERS = 256;     //buffers given to the kernel for the receives of a reactor
+const unsigned int RING_SEND_BUFFERS = 64;      //registered buffers for the sends of a reactor
+
+//Latency histograms: exact up to 2^LATENCY_SUB_BITS ns, then 2^LATENCY_SUB_BITS buckets for each power of two (about 6% wide)
+const unsigned int LATENCY_SUB_BITS = 4;
+const unsigned int LATENCY_SUB_BUCKETS = 1 << LATENCY_SUB_BITS;
+const unsigned int LATENCY_BUCKETS = (64 - LATENCY_SUB_BITS + 1)*LATENCY_SUB_BUCKETS;
+
+//Asynchronous logger
+const unsigned int LOG_RING_SIZE = 1 << 16;     //bytes of the ring of each thread that logs, a power of two
+const unsigned int LOG_ENTRY_MAX_SIZE = 4096;   //largest entry, header and arguments; longer ones are dropped
+
+//Trace of the protocol
+const unsigned int TRACE_BUFFER_EVENTS = 1 << 14;   //spans kept for each thread, the next ones are dropped
+
+#endif
\ No newline at end of file
@@ -15,7 +15,7 @@ bool isValidIpAddress(char *ipAddress){
 int main( int argc, char** argv) {
 
     if (argc < 4) {
-        cout << "usage: ./server $ip_address $port $userFile" << endl;
+        cout << "usage: ./server $ip_address $port $userFile [$reactorThreads] [epoll|io_uring] [$metricsPort|$metricsSocketPath|-] [$traceFile]" << endl;
         return 0;
     }
 
@@ -43,6 +43,34 @@ int main( int argc, char** argv) {
         exit(1);
     }*/
 
-    SecureChatServer server(argv[1], port, argv[3]);
+    unsigned int reactor_threads = thread::hardware_concurrency();
+    if (argc > 4) {
+        try {
+            reactor_threads = stoi(argv[4]);
+        } catch (exception &err){
+            cout<<"please insert a valid number of reactor threads"<<endl;
+            exit(1);
+        }
+    }
+    if (reactor_threads == 0) { reactor_threads = 1; }
+
+    IoBackend backend = IO_EPOLL;
+    if (argc > 5) {
+        string backend_name = argv[5];
+        if (backend_name == "io_uring") {
+            backend = IO_URING;
+        } else if (backend_name != "epoll") {
+            cout<<"please choose epoll or io_uring as I/O backend"<<endl;
+            exit(1);
+        }
+    }
+
+    //Metrics on a local port, or on a Unix socket if a path is given ("-" for none)
+    const char* metrics_endpoint = (argc > 6 && strcmp(argv[6], "-") != 0) ? argv[6] : NULL;
+
+    //Chrome trace of the protocol, opt-in
+    const char* trace_path = (argc > 7) ? argv[7] : NULL;
+
+    SecureChatServer server(argv[1], port, argv[3], reactor_threads, backend, metrics_endpoint, trace_path);
     return 0;
 }
\ No newline at end of file